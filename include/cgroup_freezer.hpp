@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <string>
+
+namespace RECK {
+
+// Stops every thread of a process at once with the cgroup v2 freezer. Only a process alone in its cgroup is frozen,
+// freezing a shared cgroup would stop the others too. The process is never moved to a cgroup of its own: if the
+// dumper died before moving it back, nothing but the dumper would thaw it. ptracer stops a process that shares its
+// cgroup thread by thread instead. Needs cgroup v2 mounted and write access to the cgroup of the process
+class cgroup_freezer {
+   public:
+    explicit cgroup_freezer(pid_t pid);
+    // Thaws the process
+    ~cgroup_freezer();
+
+    cgroup_freezer(const cgroup_freezer&) = delete;
+    cgroup_freezer& operator=(const cgroup_freezer&) = delete;
+
+    // Returns once every thread is frozen, -1 if cgroup v2 is not usable, the process is not alone in its cgroup or
+    // the timeout expires. Threads created while freezing are frozen too, the task list of a frozen process does not
+    // change
+    int freeze(std::chrono::milliseconds timeout = std::chrono::milliseconds{1000});
+    int thaw();
+    bool frozen() const { return m_frozen; }
+
+    // Mount point of the cgroup v2 hierarchy, empty if it is not mounted
+    static std::string mount_point();
+    // Path of the cgroup of pid relative to the mount point, empty if it has none in cgroup v2
+    static std::string cgroup_of(pid_t pid);
+
+   private:
+    int wait_frozen(std::chrono::milliseconds timeout);
+
+    pid_t m_pid;
+    bool m_frozen = false;
+    // Directory of the frozen cgroup
+    std::string m_cgroup;
+};
+
+}  // namespace RECK
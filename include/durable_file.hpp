@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "qos.hpp"
+
+namespace RECK {
+
+// What making an image durable cost
+struct commit_stats {
+    // Size of the image and what was reserved for it up front
+    size_t bytes = 0;
+    size_t preallocated = 0;
+    // Windows handed to the writeback while the image was written
+    size_t windows = 0;
+    // Waiting for earlier windows to reach the disk during the dump
+    std::chrono::microseconds writeback{0};
+    // fdatasync of the image and its stripes at the end
+    std::chrono::microseconds sync{0};
+    // rename and fsync of the directory
+    std::chrono::microseconds publish{0};
+    // Staged bytes written to the file during the dump once the staging budget was reached
+    size_t spilled = 0;
+};
+
+// Image file written with a commit protocol. The data goes to <path>.tmp, preallocated with fallocate, and is
+// written back in windows of window bytes with sync_file_range while the dump goes on, so the disk works in
+// parallel and the dirty pages never pile up. commit does one fdatasync, which finds little left to write, and
+// renames the file to path: a crash leaves either the previous image or the new one, never half of it. Files
+// written next to the image, like its stripes, are synced with their directories before that rename. They have to
+// get names of their own, the previous image keeps its files until the new one replaces it.
+//
+// Without durable the file is opened in place with O_TRUNC and commit does nothing, like before
+//
+// A staged file is written to a memfd first and commit copies it to the file before anything else. The copy runs on
+// threads of their own that have the QoS policy applied and goes through a qos_throttle of it, so a dump that
+// stages its image while the tracee is stopped is only throttled once the tracee runs again. It needs memory for
+// the whole image, unless qos_policy::stage_budget bounds it: paced spills the staged data to the file once it
+// takes more and the rest of the image goes straight to the file, at the same fd. With a budget the files written
+// next to the image are not staged
+class durable_file {
+   public:
+    durable_file(std::string path, bool durable, size_t window);
+    // Closes the file, the temporary file is removed if it was not committed
+    ~durable_file();
+
+    durable_file(const durable_file&) = delete;
+    durable_file& operator=(const durable_file&) = delete;
+
+    // Before open, commit copies the staged data with policy
+    void stage(const qos_policy& policy);
+    bool staged() const { return m_staged; }
+    // A file written next to the image, created at path. Returns the fd to write, owned by the caller, a memfd when
+    // the image is staged. commit copies a staged one to the file and syncs the file and its directory
+    int open_extra(const std::string& path);
+    // A file of the previous image, removed once the new one is committed
+    void remove_on_commit(std::string path);
+
+    // The fd to write, a memfd when staged
+    int open();
+    int fd() const { return m_staged ? m_stage_fd : m_fd; }
+    // Reserves len bytes past the end without changing the size, the rest is released on commit
+    void preallocate(size_t len);
+    // Starts the writeback of the windows filled up to the current offset and waits for the one before each. Spills
+    // a staged image past its budget first
+    int paced();
+    int commit();
+    const commit_stats& stats() const { return m_stats; }
+
+   private:
+    int spill();
+
+    std::string m_path;
+    std::string m_tmp_path;
+    bool m_durable;
+    size_t m_window;
+    int m_fd = -1;
+    bool m_staged = false;
+    qos_policy m_policy;
+    int m_stage_fd = -1;
+    // Files written next to the image, their memfd when staged
+    struct extra {
+        std::string path;
+        int fd;
+        int staged;
+    };
+    std::vector<extra> m_extras;
+    std::vector<std::string> m_removed;
+    bool m_committed = false;
+    // Start of the first window not handed to the writeback yet
+    off_t m_queued = 0;
+    commit_stats m_stats;
+};
+
+}  // namespace RECK
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "maps_parser.hpp"
+#include "serializer.hpp"
+
+namespace RECK {
+
+struct region_estimate {
+    memory_map map;
+    // From /proc/<pid>/smaps
+    size_t resident = 0;
+    size_t dirty = 0;
+    size_t swapped = 0;
+    // Resident pages of a file mapping, they could be read back from the file
+    size_t file_backed = 0;
+    // Pages of an anonymous region neither present nor swapped in /proc/<pid>/pagemap, they are saved as zeros
+    size_t zero = 0;
+    size_t excluded = 0;
+    // Bytes added to the image, or to the stripes, for this region
+    size_t image_bytes = 0;
+};
+
+struct checkpoint_estimate {
+    std::vector<region_estimate> regions;
+    size_t threads = 0;
+    size_t resident = 0;
+    size_t dirty = 0;
+    size_t swapped = 0;
+    size_t file_backed = 0;
+    size_t zero = 0;
+    size_t excluded = 0;
+    size_t image_size = 0;
+
+    // Bytes per second. write_bandwidth is 0 when it is not known, see estimator::estimate
+    double copy_bandwidth = 0;
+    double write_bandwidth = 0;
+    // The tracee is stopped while its memory is copied and written, only while it is copied when the write
+    // bandwidth is not known
+    std::chrono::microseconds pause{0};
+
+    friend std::ostream &operator<<(std::ostream &os, const checkpoint_estimate &estimate);
+};
+
+// Dry run of a checkpoint: what dump_serialized_file would write and how long the tracee would be stopped.
+// Only /proc files and the exclusion table are read, the tracee is never stopped and nothing is written unless
+// probe_write is set
+class estimator {
+   public:
+    // The write bandwidth of a directory is the one given to set_write_bandwidth or the one measured by an earlier
+    // probe of this process. With probe_write a directory without one is measured with write_bandwidth
+    static checkpoint_estimate estimate(pid_t pid, const std::string_view &directory,
+                                        const dump_options &options = {}, bool probe_write = false);
+
+    // Sequential write bandwidth of the device of a directory including the flush. Measuring writes and syncs a
+    // 32 MiB temporary file in the directory, it is done once per directory and process and the result is kept
+    static double write_bandwidth(const std::string_view &directory);
+    // Known write bandwidth of a directory, like one measured by an earlier run, used instead of a probe
+    static void set_write_bandwidth(const std::string_view &directory, double bandwidth);
+    // Bandwidth of process_vm_readv, measured once
+    static double copy_bandwidth();
+
+   private:
+    // Bandwidth kept for the directory, 0 if there is none and probe is not set
+    static double known_write_bandwidth(const std::string_view &directory, bool probe);
+    static int read_smaps(pid_t pid, std::vector<region_estimate> &v_regions);
+    static int read_pagemap(pid_t pid, std::vector<region_estimate> &v_regions);
+};
+
+}  // namespace RECK
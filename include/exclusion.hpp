@@ -0,0 +1,53 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "maps_parser.hpp"
+
+namespace RECK {
+
+// Memory the application can rebuild after a restart. The ranges are not saved in the checkpoint and they are
+// restored as zero filled pages. Only whole pages inside the range are skipped.
+int exclude(const void *ptr, size_t len);
+// Same as exclude for transient buffers (I/O staging, scratch space), kept apart to tell them apart in the images
+int mark_scratch(const void *ptr, size_t len);
+// Remove a range registered with exclude or mark_scratch
+int unexclude(const void *ptr);
+
+// Table shared with the dumper, it lives in its own mapping of the tracee and is read with process_vm_readv
+struct exclusion_table {
+    enum kind : uint32_t {
+        EXCLUDE,
+        SCRATCH,
+        // Found by the dumper to hold no live data, see liveness.hpp. Never stored in the table
+        DEAD,
+    };
+
+    struct entry {
+        unsigned long start_address;
+        unsigned long end_address;
+        kind type;
+    };
+
+    static constexpr size_t table_size = 4 * 4096;
+    static constexpr size_t capacity = (table_size - 16) / sizeof(entry);
+
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    entry entries[capacity];
+
+    static constexpr char default_magic[8] = {'R', 'E', 'C', 'K', 'E', 'X', 'C', 'L'};
+    static constexpr const char *mapping_name = "reck_exclusions";
+
+    // Page aligned ranges registered in the tracee, sorted by start address
+    static std::vector<entry> read_remote(pid_t pid, const std::vector<memory_map> &maps);
+};
+
+static_assert(sizeof(exclusion_table) <= exclusion_table::table_size, "exclusion table does not fit in its mapping");
+
+}  // namespace RECK
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RECK {
+
+// Open files of a process, saved with the checkpoint and opened again at the same numbers on restore.
+//
+// Files with a path are reopened with their flags and offset, memfds are created again with their contents and
+// pipes with both ends in the process get a new pipe with the data that was buffered in it. Descriptors that
+// shared an open file description share it again. Sockets, anonymous inodes (eventfd, epoll...), named FIFOs,
+// deleted files and pipes to other processes are left out: the restored process keeps whatever the restoring
+// one has at their numbers
+class fd_table {
+   public:
+    enum kind : uint32_t {
+        FD_FILE,
+        FD_MEMFD,
+        FD_PIPE,
+    };
+
+    // Stored as is in a FILE_DESC entry, followed by the path and the data
+    struct entry {
+        int32_t fd;
+        // As in /proc/<pid>/fdinfo, O_CLOEXEC included
+        int32_t flags;
+        uint64_t pos;
+        kind type;
+        // Lower fd with the same open file description, -1 if none
+        int32_t dup_of;
+        // Tells apart the memfds and the pipes
+        uint64_t inode;
+        uint32_t path_size;
+        uint32_t reserved;
+        // Contents of a memfd or data buffered in a pipe, only with the first entry of the inode
+        uint64_t data_size;
+    };
+
+    struct file {
+        entry e;
+        std::string path;
+        std::vector<char> data;
+    };
+
+    // Sorted by fd. pid has to be stopped for the offsets and the pipe data to be consistent. -1 when a file that
+    // is saved cannot be read, the table would miss it
+    static int read_remote(pid_t pid, std::vector<file>& v_files);
+    // Opens the files at their numbers in the calling process, threads at once, 0 uses every core
+    static int restore(const std::vector<file>& v_files, unsigned threads = 0);
+};
+
+}  // namespace RECK
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <sys/sendfile.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <cerrno>
+
 #include <debug.hpp>
 
 namespace RECK {
@@ -37,6 +40,34 @@ class filesystem {
         return ret;
     }
 
+    static ssize_t pwrite(int fd, const void* data, size_t len, off_t offset) {
+        ssize_t r = 0;
+        size_t l = len;
+        ssize_t ret = 0;
+        const char* buffer = static_cast<const char*>(data);
+        debug_msg(">> Begin pwrite(" << fd << ", " << data << ", " << len << ", " << offset << ")");
+
+        do {
+            r = ::pwrite(fd, buffer, l, offset + ret);
+            if (r < 0) {         // fail once
+                if (ret == 0) {
+                    return r;    // return error if is the first
+                } else {
+                    return ret;  // return the size of already write
+                }
+            }
+            if (r == 0) break;   // end of file
+
+            l = l - r;
+            buffer = buffer + r;
+            ret = ret + r;
+
+        } while ((l > 0) && (r > 0));
+
+        debug_msg(">> End pwrite(" << fd << ", " << data << ", " << len << ", " << offset << ")= " << ret);
+        return ret;
+    }
+
     static ssize_t remote_write(pid_t pid, const void* remote_data, const void* local_data, size_t len) {
         ssize_t r = 0;
         ssize_t ret = 0;
@@ -134,5 +165,41 @@ class filesystem {
                                         << ")= " << ret);
         return ret;
     }
+
+    // Copy inside the kernel from the current offsets of both files
+    static ssize_t copy(int fd_in, int fd_out, size_t len) {
+        ssize_t r = 0;
+        size_t l = len;
+        ssize_t ret = 0;
+        bool use_sendfile = false;
+        debug_msg(">> Begin copy(" << fd_in << ", " << fd_out << ", " << len << ")");
+
+        do {
+            if (!use_sendfile) {
+                r = ::copy_file_range(fd_in, nullptr, fd_out, nullptr, l, 0);
+                if (r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                    use_sendfile = true;  // not supported between these files
+                    continue;
+                }
+            } else {
+                r = ::sendfile(fd_out, fd_in, nullptr, l);
+            }
+            if (r < 0) {         // fail once
+                if (ret == 0) {
+                    return r;    // return error if is the first
+                } else {
+                    return ret;  // return the size of already copied
+                }
+            }
+            if (r == 0) break;   // end of file
+
+            l = l - r;
+            ret = ret + r;
+
+        } while (l > 0);
+
+        debug_msg(">> End copy(" << fd_in << ", " << fd_out << ", " << len << ")= " << ret);
+        return ret;
+    }
 };
 }  // namespace RECK
\ No newline at end of file
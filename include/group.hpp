@@ -0,0 +1,95 @@
+#pragma once
+
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "serializer.hpp"
+
+namespace RECK {
+
+// One SOCK_SEQPACKET packet between a member of a group checkpoint and the coordinator
+struct group_message {
+    enum type : uint32_t {
+        // Member: bytes is the estimated size of the image and path its name
+        JOIN,
+        // Coordinator, the whole group joined: path is the directory of the image
+        GO,
+        // Member: the tracee is stopped
+        STOPPED,
+        // Coordinator, every tracee of the group is stopped
+        DUMP,
+        // Member: the last grant is used up, bytes more are needed
+        REQUEST,
+        // Coordinator: bytes may be written
+        GRANT,
+        // Member: the image is safe and the tracee runs again
+        DONE,
+        // Coordinator, a member failed before the dump: the tracee is released without one
+        ABORT,
+    };
+
+    type kind;
+    uint32_t reserved;
+    uint64_t bytes;
+    char path[PATH_MAX];
+};
+
+// Node level I/O scheduler of group checkpoints, run by the reck-group daemon.
+//
+// The members of a group are held at two barriers, every member joined and then every tracee stopped, so the
+// images are a consistent cut of the group. The directories are shared out so every device gets about the same
+// bytes, largest images first. Each device writes for one member at a time and the member with the fewest bytes
+// left gets its next grant: the device streams one image after another, the small images finish first and their
+// processes run again at once. The aggregate pause stays close to the total bytes over the device bandwidth
+class group_coordinator {
+   public:
+    struct member_stats {
+        std::string name;
+        uint64_t bytes;
+        // From the stop of the group to the release of the member
+        std::chrono::milliseconds pause;
+    };
+
+    group_coordinator(std::string socket_path, std::vector<std::string> directories);
+    ~group_coordinator();
+
+    group_coordinator(const group_coordinator&) = delete;
+    group_coordinator& operator=(const group_coordinator&) = delete;
+
+    int listen();
+    // Runs one group of members to its end. -1 when a member failed, the group is aborted if it was not dumping
+    int serve(size_t members);
+    // Members of the last group in the order they were released
+    const std::vector<member_stats>& stats() const { return m_stats; }
+
+   private:
+    std::string m_socket_path;
+    std::vector<std::string> m_directories;
+    // Device of every directory, as an index
+    std::vector<size_t> m_devices;
+    size_t m_device_count = 0;
+    int m_fd = -1;
+    std::vector<member_stats> m_stats;
+};
+
+// Member side of a group checkpoint
+class group_checkpoint {
+   public:
+    // Writes granted at once, a member asks the coordinator again after this many bytes
+    static constexpr size_t quantum = 8 * 1024 * 1024;
+
+    // Dumps pid to name in the directory the coordinator at socket_path assigns, once the whole group is stopped.
+    // The writes go through the coordinator and pid runs again as soon as its image is complete
+    static ssize_t dump_serialized_file(pid_t pid, const std::string& socket_path, const std::string& name,
+                                        const dump_options& options = {});
+    // Like serializer::make_checkpoint, the dumper is a child of the caller
+    static ssize_t make_checkpoint(const std::string& socket_path, const std::string& name,
+                                   const dump_options& options = {});
+};
+
+}  // namespace RECK
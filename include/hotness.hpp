@@ -0,0 +1,60 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "maps_parser.hpp"
+
+namespace RECK {
+
+// Pages of a running process touched during a window before the checkpoint. Sampling leaves the soft-dirty bits of
+// the process alone, they belong to the snapshots and to the users of dump_options::clear_soft_dirty
+class hotness {
+   public:
+    enum method {
+        NONE,
+        // Accessed pages with /sys/kernel/mm/page_idle, needs CONFIG_IDLE_PAGE_TRACKING and root
+        PAGE_IDLE,
+        // Written pages comparing a hash of every page at both ends of the window, works everywhere
+        CONTENT,
+    };
+
+    // The process keeps running during the window. Returns the sorted page addresses
+    static std::vector<unsigned long> sample(pid_t pid, std::chrono::milliseconds window, method m = NONE);
+    // Best method supported by the running kernel
+    static method best_method();
+    // Written pages are reported by the soft-dirty bit of /proc/<pid>/pagemap, checked once
+    static bool soft_dirty_supported();
+    // Starts a new soft-dirty window of pid, every page reads as clean until it is written
+    static int clear_soft_dirty(pid_t pid);
+
+    // Calls fn(address, len, is_hot) for the consecutive hot and cold runs of the pages in [start, start + len)
+    template <typename F>
+    static void split_runs(const unsigned long* hot, size_t n_hot, unsigned long start, size_t len, size_t page,
+                           F&& fn) {
+        auto it = std::lower_bound(hot, hot + n_hot, start);
+        unsigned long end = start + len;
+        unsigned long run_start = start;
+        bool run_hot = it != hot + n_hot && *it == start;
+        for (unsigned long address = start; address < end; address += page) {
+            while (it != hot + n_hot && *it < address) it++;
+            bool is_hot = it != hot + n_hot && *it == address;
+            if (is_hot != run_hot) {
+                fn(run_start, address - run_start, run_hot);
+                run_start = address;
+                run_hot = is_hot;
+            }
+        }
+        if (run_start < end) fn(run_start, end - run_start, run_hot);
+    }
+
+   private:
+    static std::vector<memory_map> sampled_maps(pid_t pid, bool only_writable);
+    static std::vector<unsigned long> sample_page_idle(pid_t pid, std::chrono::milliseconds window);
+    static std::vector<unsigned long> sample_content(pid_t pid, std::chrono::milliseconds window);
+};
+
+}  // namespace RECK
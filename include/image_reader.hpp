@@ -0,0 +1,140 @@
+#pragma once
+
+#include <sys/user.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "maps_parser.hpp"
+#include "serializer.hpp"
+
+namespace RECK {
+
+template <typename T>
+class span {
+   public:
+    span() = default;
+    span(const T *data, size_t size) : m_data(data), m_size(size) {}
+
+    const T *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const T *begin() const { return m_data; }
+    const T *end() const { return m_data + m_size; }
+    const T &operator[](size_t i) const { return m_data[i]; }
+
+   private:
+    const T *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+// Read only view of a checkpoint image mapped in memory, nothing is copied out of the file.
+// Entries are packed back to back in the image so the returned structs can be unaligned (fine on x86_64).
+class image_reader {
+   public:
+    struct region {
+        const memory_map *map;
+        // Saved pages, all the pages of the region unless it is sparse
+        span<char> data;
+        // One bit per saved page of a SPARSE_MAP or DELTA_MAP, nullptr when every page is saved
+        const uint64_t *bitmap = nullptr;
+        // Saved pages before each word of the bitmap
+        std::vector<uint32_t> rank;
+        // Pages without their bit are in the parent image instead of zero filled
+        bool delta = false;
+        // After a PADDING entry, the saved pages are page aligned in the file and can be mapped from it
+        bool aligned = false;
+        // Offset in data of every saved page of an XOR_MAP and the end of the last one, empty when every saved
+        // page takes a whole page
+        std::vector<size_t> offsets;
+
+        unsigned long start() const { return map->start_address; }
+        unsigned long end() const { return map->end_address; }
+        // Index of the page inside data or -1 if it is a zero filled page
+        ssize_t saved_index(size_t page) const;
+    };
+
+    image_reader() = default;
+    ~image_reader();
+
+    image_reader(const image_reader &) = delete;
+    image_reader &operator=(const image_reader &) = delete;
+
+    int open(const std::string_view &file_path);
+    void close();
+
+    const std::vector<serializer::mdata> &mdata() const { return m_mdata; }
+    const std::vector<const user_regs_struct *> &regs() const { return m_regs; }
+    const std::vector<const user_fpregs_struct *> &fpregs() const { return m_fpregs; }
+    // Sorted by start address
+    const std::vector<region> &regions() const { return m_regions; }
+    // Sorted addresses of the hot pages, empty when the image has none
+    span<unsigned long> hot_pages() const { return m_hot_pages; }
+    // Path of the parent image as stored in a delta, empty for a full image
+    std::string_view parent() const { return m_parent; }
+    bool is_delta() const { return !m_parent.empty(); }
+    // The region data is in stripe files, regions() is empty
+    bool is_striped() const { return m_striped; }
+
+    // Raw payload of an entry
+    span<char> payload(const serializer::mdata &md) const;
+
+    // Region that contains the address or nullptr
+    const region *find(unsigned long address) const;
+    // Pointer to the saved byte of the address, nullptr if it is not saved, it is in a zero filled page or its
+    // page is an XOR delta
+    const char *at(unsigned long address) const;
+    // Stored bytes of the page of the address, a whole page or a page_codec delta. Empty if it is not saved
+    span<char> stored(unsigned long address) const;
+
+    // Offset in the image file of a pointer returned by the reader
+    size_t file_offset(const char *ptr) const { return ptr - m_image; }
+    size_t page_size() const { return m_page_size; }
+
+   private:
+    const char *m_image = nullptr;
+    size_t m_size = 0;
+    size_t m_page_size = 0;
+
+    std::vector<serializer::mdata> m_mdata;
+    std::vector<const user_regs_struct *> m_regs;
+    std::vector<const user_fpregs_struct *> m_fpregs;
+    std::vector<region> m_regions;
+    span<unsigned long> m_hot_pages;
+    std::string_view m_parent;
+    bool m_striped = false;
+};
+
+// Images stacked from a full base to the newest delta
+class image_chain {
+   public:
+    // Opens the image and its parents
+    int open(const std::string_view &file_path);
+    // Opens the given images, oldest first, the newer ones are laid over the older ones
+    int open(const std::vector<std::string> &v_paths);
+
+    size_t size() const { return m_images.size(); }
+    const image_reader &newest() const { return *m_images.back(); }
+    const image_reader &operator[](size_t i) const { return *m_images[i]; }
+
+    // Saved page of the address resolved through the chain, nullptr if it is a zero filled page. XOR deltas are
+    // decoded on top of their base page in buffer, a page of the caller, and buffer is returned
+    const char *page(unsigned long address, char *buffer) const;
+    // The address resolves to a saved page, page() would not return nullptr
+    bool saved(unsigned long address) const;
+
+    // Paths of the chain of an image, oldest first, empty on error
+    static std::vector<std::string> resolve(const std::string_view &file_path);
+
+   private:
+    // Resolves the address from the image at level down to the oldest one
+    const char *page(size_t level, unsigned long address, char *buffer) const;
+
+    std::vector<std::unique_ptr<image_reader>> m_images;
+};
+
+}  // namespace RECK
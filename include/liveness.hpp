@@ -0,0 +1,33 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <vector>
+
+#include "exclusion.hpp"
+#include "maps_parser.hpp"
+
+namespace RECK {
+
+// Ranges of a stopped tracee that hold no live data. They are skipped by the dumper and restored as zero pages,
+// the same as the ranges in the exclusion table
+class liveness {
+   public:
+    // Leaf functions use this much below the stack pointer without moving it (x86_64 System V ABI)
+    static constexpr unsigned long red_zone = 128;
+
+    // Part of each thread stack below its stack pointer and red zone. Only [stack] and anonymous mappings right
+    // above a PROT_NONE guard, like the pthread ones, are trimmed: a stack pointer in any other mapping can be a
+    // sigaltstack or a coroutine stack inside memory that is live below it
+    static std::vector<exclusion_table::entry> dead_stacks(const std::vector<memory_map>& maps,
+                                                           const std::vector<user_regs_struct>& v_regs);
+
+    // Free chunks and the top chunk of the main glibc malloc arena in [heap]. The chunk headers are walked from
+    // the start of the heap and nothing is returned unless the walk ends exactly at its end, so another allocator
+    // or a heap in the middle of an update is left alone. Small chunks in the tcache and fast bins look in use
+    // and are kept
+    static std::vector<exclusion_table::entry> free_chunks(pid_t pid, const std::vector<memory_map>& maps);
+};
+
+}  // namespace RECK
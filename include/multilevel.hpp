@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace RECK {
+
+struct storage_tier {
+    std::string directory;
+    // Number of images of a checkpoint series kept in the tier directory, 0 keeps all of them. The series of a
+    // name are the valid images whose names only differ in the digits before the extension, like app.0001.reck
+    // and app.0002.reck. Other files are never removed
+    size_t retention = 1;
+};
+
+// Checkpoints written first to the fastest tier and drained in background to the rest.
+// Tiers are ordered from the fastest (a tmpfs like /dev/shm) to the most durable one.
+class multilevel {
+   public:
+    static ssize_t make_checkpoint(const std::vector<storage_tier>& tiers, const std::string_view& name);
+
+    // This need to be called in another process diferent to pid.
+    // The process is resumed as soon as the image is in the first tier, then it is copied to the others.
+    static ssize_t dump_serialized_file(pid_t pid, const std::vector<storage_tier>& tiers,
+                                        const std::string_view& name);
+
+    // Path of the image in the fastest tier with a valid copy, empty if there is none
+    static std::string find_checkpoint(const std::vector<storage_tier>& tiers, const std::string_view& name);
+    static ssize_t restore_serialized_file(const std::vector<storage_tier>& tiers, const std::string_view& name);
+
+   private:
+    static int drain(const std::string& src_path, const std::string& dst_path);
+    static int apply_retention(const storage_tier& tier, const std::string_view& keep);
+};
+
+}  // namespace RECK
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+
+struct uffd_msg;
+
+namespace RECK {
+
+// Cold memory of a running process moved out to a fresh image of it, a swap tier of one process. The pages of the
+// private anonymous regions that are not hot and still read the same as in the image are dropped from the process
+// and served again from the image when the process touches them.
+//
+// The tracee is stopped while every cold page is compared with the image and dropped with a madvise run by the
+// tracee, see ptracer::remote_syscall. The tracee also creates a userfaultfd, taken over with pidfd_getfd, and
+// the dropped regions are registered with it before the tracee runs again. A fault on a dropped page is served
+// with UFFDIO_COPY from the image mapped by the reader, any other missing page is zero filled like it would be.
+// Forks, mremap, munmap and MADV_DONTNEED of the process are followed, a child gets the same pages from the image
+// and a page the process drops itself reads as zero again.
+//
+// The dropped pages only exist in the image: the image must not change and the process serving the faults must
+// outlive the offload. Once no process holds the userfaultfd the kernel unregisters it, and a page still dropped
+// silently reads as zero, so drop refuses to run without a guardian unless the caller accepts that. guard forks a
+// guardian that recalls the pages when this process dies first, SIGKILL included. It follows the events this
+// process read through a journal written right after every read, a kill between the read and the journal loses the
+// changes of that read: a page the process dropped itself may come back from the image, and the pages of a fork
+// or of an mremap in it read as zero. recall, also run by the destructor, puts every page still dropped back into
+// the process
+class cold_offload {
+   public:
+    struct stats {
+        // Pages of the private anonymous regions that were not hot
+        size_t cold = 0;
+        // Cold pages dropped, the others changed since the image was taken
+        size_t dropped = 0;
+        size_t changed = 0;
+        // Faults served from the image and zero filled
+        size_t faults = 0;
+        size_t zero_fills = 0;
+        // Dropped pages put back by recall without a fault
+        size_t recalled = 0;
+    };
+
+    explicit cold_offload(pid_t pid);
+    ~cold_offload();
+
+    cold_offload(const cold_offload&) = delete;
+    cold_offload& operator=(const cold_offload&) = delete;
+
+    // image_path is a full image of pid, the process keeps running between the dump and the drop. hot has the
+    // sorted addresses of the pages to keep, the hot pages saved in the image when it is empty. Fails without a
+    // guardian unless accept_loss, the pages read as zero if this process dies before recall
+    int drop(const std::string& image_path, const std::vector<unsigned long>& hot = {}, bool accept_loss = false);
+    // Forks a guardian before drop. It holds a copy of every userfaultfd, of the image mapped by drop and of the
+    // dropped pages, and recalls them if this process dies without recall. It does not recall from an image that
+    // was written again since the drop. A dying guardian only warns
+    int guard();
+    // Serves the faults of the process and of its children for up to timeout, a negative timeout waits until
+    // the process exits. Returns the faults served, -1 on error
+    ssize_t serve(std::chrono::milliseconds timeout);
+    // Copies every page still dropped back into the processes and unregisters them, the offload is over
+    int recall();
+    bool exited() const { return m_exited; }
+    const stats& get_stats() const { return m_stats; }
+
+   private:
+    // Dropped pages at start, still in the image at image
+    struct extent {
+        size_t len;
+        unsigned long image;
+    };
+    // A userfaultfd for the process or a child of it, with the dropped pages it has not faulted in yet. Closed
+    // once none is left, the kernel unregisters its regions then
+    struct backing {
+        int fd;
+        // Names the backing for the guardian
+        uint64_t id;
+        std::map<unsigned long, extent> extents;
+    };
+    // Mapped shared with the guardian, see offload.cpp
+    struct guard_state;
+
+    // Reads and handles every message queued on b. Returns the faults served, -1 on error
+    ssize_t handle(backing& b);
+    // Maps the missing pages of [address, address + len) in the process of b, the dropped ones from the image and
+    // the others zero filled. 1 when the process is changing its mappings and the fill has to be tried again
+    int fill(backing& b, unsigned long address, size_t len);
+    // The pages of [start, start + len) are not in the image anymore, they are unmapped or were dropped again
+    static std::vector<std::pair<unsigned long, extent>> erase(backing& b, unsigned long start, size_t len);
+    // Follows a REMAP, REMOVE or UNMAP event of the process of b
+    static void follow(backing& b, const uffd_msg& msg);
+    void close_empty();
+    void close_backing(const backing& b);
+
+    // Sends the fd of a backing to the guardian, a negative fd tells it the backing is closed
+    void tell_guardian(uint64_t id, int fd);
+    // Copies the dropped pages of every backing to the state of the guardian
+    void publish();
+    // Events read from b for the guardian, with the ids of the backings their forks get
+    void journal(const backing& b, const uffd_msg* msgs, size_t count, uint64_t* child_ids);
+    // Stops the guardian once nothing is dropped anymore
+    void disarm();
+    // The guardian itself, waits until disarm or until this process is gone
+    [[noreturn]] void run_guardian(int sock);
+
+    pid_t m_pid;
+    int m_pidfd = -1;
+    bool m_exited = false;
+    image_reader m_reader;
+    // A list, a fork adds a backing while the others are handled
+    std::list<backing> m_backings;
+    stats m_stats;
+    // Dropped pages put back by fill
+    size_t m_filled = 0;
+    uint64_t m_next_id = 0;
+    pid_t m_guardian = -1;
+    int m_guard_fd = -1;
+    guard_state* m_state = nullptr;
+};
+
+}  // namespace RECK
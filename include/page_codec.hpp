@@ -0,0 +1,30 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace RECK {
+
+// Delta of a page against its previous version: the XOR of both as runs of {skip zero bytes, literal bytes}.
+// Pages where a few values changed, or drifted in their low bytes, shrink to a few records
+class page_codec {
+   public:
+    struct run {
+        uint16_t skip;
+        uint16_t len;
+    };
+    static_assert(sizeof(run) == 4, "runs are written as is to the image");
+
+    // Larger pages are always stored whole
+    static constexpr size_t max_page_size = 16384;
+
+    // Encodes data against base, nullptr for a zero page, into out of page bytes. Returns the encoded size or -1
+    // when it is not smaller than the page
+    static ssize_t encode(const char* data, const char* base, size_t page, char* out);
+    // XORs the encoded runs into page_data, which holds the base page. False if the delta is corrupted
+    static bool decode(const char* in, size_t len, char* page_data, size_t page);
+};
+
+}  // namespace RECK
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "filesystem.hpp"
+#include "qos.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+// Data of the tracee on its way to the image, data can be changed in place by the stages
+struct chunk {
+    unsigned long address;
+    char* data;
+    size_t len;
+};
+
+// Stages combined at compile time: pipeline<A, B, Sink> runs a(chunk, next) where next is pipeline<B, Sink>, every
+// call is known to the compiler and nothing is dispatched at run time. A stage is any callable
+// ssize_t(const chunk&, Next&) that pushes what it produces to next and returns c.len, or -1 on error. The last
+// one is a sink, ssize_t(const chunk&). A stage or sink with ssize_t flush(Next&) or ssize_t flush() gets it at
+// the end, for those that keep data between chunks
+template <class Stage, class... Rest>
+class pipeline {
+   public:
+    explicit pipeline(Stage stage, Rest... rest) : m_stage(std::move(stage)), m_next(std::move(rest)...) {}
+
+    ssize_t operator()(const chunk& c) { return m_stage(c, m_next); }
+
+    ssize_t flush() {
+        if constexpr (has_flush<Stage, pipeline<Rest...>>::value) {
+            if (m_stage.flush(m_next) < 0) return -1;
+        }
+        return m_next.flush();
+    }
+
+    // Stage I from the front, for the results of a stage after the run
+    template <size_t I>
+    auto& get() {
+        if constexpr (I == 0) {
+            return m_stage;
+        } else {
+            return m_next.template get<I - 1>();
+        }
+    }
+
+   private:
+    template <class S, class N, class = void>
+    struct has_flush : std::false_type {};
+    template <class S, class N>
+    struct has_flush<S, N, std::void_t<decltype(std::declval<S&>().flush(std::declval<N&>()))>> : std::true_type {};
+
+    Stage m_stage;
+    pipeline<Rest...> m_next;
+};
+
+template <class Sink>
+class pipeline<Sink> {
+   public:
+    explicit pipeline(Sink sink) : m_sink(std::move(sink)) {}
+
+    ssize_t operator()(const chunk& c) { return m_sink(c); }
+
+    ssize_t flush() {
+        if constexpr (has_flush<Sink>::value) {
+            return m_sink.flush();
+        } else {
+            return 0;
+        }
+    }
+
+    template <size_t I>
+    auto& get() {
+        static_assert(I == 0, "pipeline has less stages");
+        return m_sink;
+    }
+
+   private:
+    template <class S, class = void>
+    struct has_flush : std::false_type {};
+    template <class S>
+    struct has_flush<S, std::void_t<decltype(std::declval<S&>().flush())>> : std::true_type {};
+
+    Sink m_sink;
+};
+
+template <class... Stages>
+pipeline<Stages...> make_pipeline(Stages... stages) {
+    return pipeline<Stages...>(std::move(stages)...);
+}
+
+// Sources push [address, address + len) through a pipeline in chunks of their buffer and flush it. They return
+// len, or -1 when the source or a stage fails
+
+// Memory of another process read with process_vm_readv
+class remote_source {
+   public:
+    static constexpr size_t default_chunk = 4 * 1024 * 1024;
+
+    remote_source(pid_t pid, std::vector<char>& buffer, size_t chunk_size = default_chunk)
+        : m_pid(pid), m_buffer(buffer), m_chunk(chunk_size) {}
+
+    template <class Pipeline>
+    ssize_t pump(unsigned long address, size_t len, Pipeline& p) {
+        m_buffer.resize(std::min(len, m_chunk));
+        for (size_t done = 0; done < len;) {
+            size_t n = std::min(len - done, m_chunk);
+            {
+                trace_scope(REMOTE_READ, address + done, n);
+                auto ret = filesystem::remote_read(m_pid, reinterpret_cast<void*>(address + done), m_buffer.data(), n);
+                if (ret != static_cast<ssize_t>(n)) {
+                    std::cerr << "Error reading remote data " << ret << " " << strerror(errno) << std::endl;
+                    return -1;
+                }
+            }
+            if (p(chunk{address + done, m_buffer.data(), n}) < 0) return -1;
+            done += n;
+        }
+        if (p.flush() < 0) return -1;
+        return len;
+    }
+
+   private:
+    pid_t m_pid;
+    std::vector<char>& m_buffer;
+    size_t m_chunk;
+};
+
+// Zeros, for the memory that cannot be read
+class zero_source {
+   public:
+    zero_source(std::vector<char>& buffer, size_t chunk_size = remote_source::default_chunk)
+        : m_buffer(buffer), m_chunk(chunk_size) {}
+
+    template <class Pipeline>
+    ssize_t pump(unsigned long address, size_t len, Pipeline& p) {
+        for (size_t done = 0; done < len;) {
+            size_t n = std::min(len - done, m_chunk);
+            // Stages can change the data, it is cleared for every chunk
+            m_buffer.assign(n, 0);
+            if (p(chunk{address + done, m_buffer.data(), n}) < 0) return -1;
+            done += n;
+        }
+        if (p.flush() < 0) return -1;
+        return len;
+    }
+
+   private:
+    std::vector<char>& m_buffer;
+    size_t m_chunk;
+};
+
+// Memory of the current process at data, pushed at once
+class local_source {
+   public:
+    explicit local_source(char* data) : m_data(data) {}
+
+    template <class Pipeline>
+    ssize_t pump(unsigned long address, size_t len, Pipeline& p) {
+        if (p(chunk{address, m_data, len}) < 0 || p.flush() < 0) return -1;
+        return len;
+    }
+
+   private:
+    char* m_data;
+};
+
+// Calls f(chunk&) before passing the chunk on, to change the data in place
+template <class F>
+class transform_stage {
+   public:
+    explicit transform_stage(F f) : m_f(std::move(f)) {}
+
+    template <class Next>
+    ssize_t operator()(const chunk& c, Next& next) {
+        chunk out = c;
+        m_f(out);
+        return next(out) < 0 ? -1 : c.len;
+    }
+
+   private:
+    F m_f;
+};
+
+// Calls f(chunk) once the rest of the pipeline took the chunk, a negative result fails it
+template <class F>
+class after_stage {
+   public:
+    explicit after_stage(F f) : m_f(std::move(f)) {}
+
+    template <class Next>
+    ssize_t operator()(const chunk& c, Next& next) {
+        if (next(c) < 0 || m_f(c) < 0) return -1;
+        return c.len;
+    }
+
+   private:
+    F m_f;
+};
+
+// Only the pages for which keep(address, page) is true go on, as runs of consecutive pages. The chunks have to
+// start and end at page boundaries
+template <class Pred>
+class page_filter_stage {
+   public:
+    page_filter_stage(size_t page_size, Pred keep) : m_page(page_size), m_keep(std::move(keep)) {}
+
+    template <class Next>
+    ssize_t operator()(const chunk& c, Next& next) {
+        size_t run = 0;
+        for (size_t offset = 0; offset <= c.len; offset += m_page) {
+            if (offset < c.len && m_keep(c.address + offset, c.data + offset)) continue;
+            if (offset > run && next(chunk{c.address + run, c.data + run, offset - run}) < 0) return -1;
+            m_dropped += offset < c.len ? m_page : 0;
+            run = offset + m_page;
+        }
+        return c.len;
+    }
+
+    size_t dropped() const { return m_dropped; }
+
+   private:
+    size_t m_page;
+    Pred m_keep;
+    size_t m_dropped = 0;
+};
+
+// 64 bit hash of everything that goes through, a word at a time. Equal data in equal chunk boundaries gives an
+// equal value, it is meant to check an image against the tracee and not as a cryptographic hash
+class checksum_stage {
+   public:
+    static constexpr uint64_t seed = 0xcbf29ce484222325UL;
+    static constexpr uint64_t prime = 0x100000001b3UL;
+
+    template <class Next>
+    ssize_t operator()(const chunk& c, Next& next) {
+        m_value = hash(c.data, c.len, m_value);
+        m_bytes += c.len;
+        return next(c) < 0 ? -1 : c.len;
+    }
+
+    static uint64_t hash(const char* data, size_t len, uint64_t value = seed) {
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            value = (value ^ word) * prime;
+            value ^= value >> 29;
+        }
+        for (; i < len; i++) value = (value ^ static_cast<unsigned char>(data[i])) * prime;
+        return value;
+    }
+
+    uint64_t value() const { return m_value; }
+    size_t bytes() const { return m_bytes; }
+
+   private:
+    uint64_t m_value = seed;
+    size_t m_bytes = 0;
+};
+
+// filesystem::write to the current offset of fd
+class fd_sink {
+   public:
+    explicit fd_sink(int fd) : m_fd(fd) {}
+
+    ssize_t operator()(const chunk& c) {
+        trace_scope(WRITE, m_fd, c.len);
+        if (filesystem::write(m_fd, c.data, c.len) != static_cast<ssize_t>(c.len)) {
+            std::cerr << "Error writing remote data " << strerror(errno) << std::endl;
+            return -1;
+        }
+        return c.len;
+    }
+
+   private:
+    int m_fd;
+};
+
+// Same as fd_sink paced by the QoS policy of the dump
+class throttled_sink {
+   public:
+    throttled_sink(int fd, qos_throttle& throttle) : m_fd(fd), m_throttle(throttle) {}
+
+    ssize_t operator()(const chunk& c) {
+        trace_scope(WRITE, m_fd, c.len);
+        if (m_throttle.write(m_fd, c.data, c.len) != static_cast<ssize_t>(c.len)) {
+            std::cerr << "Error writing remote data " << strerror(errno) << std::endl;
+            return -1;
+        }
+        return c.len;
+    }
+
+   private:
+    int m_fd;
+    qos_throttle& m_throttle;
+};
+
+// Same as throttled_sink with pwrite, a chunk goes to offset + (c.address - address) of fd
+class throttled_pwrite_sink {
+   public:
+    throttled_pwrite_sink(int fd, unsigned long address, off_t offset, qos_throttle& throttle)
+        : m_fd(fd), m_address(address), m_offset(offset), m_throttle(throttle) {}
+
+    ssize_t operator()(const chunk& c) {
+        trace_scope(WRITE, m_fd, c.len);
+        if (m_throttle.pwrite(m_fd, c.data, c.len, m_offset + (c.address - m_address)) !=
+            static_cast<ssize_t>(c.len)) {
+            std::cerr << "Error writing remote data " << strerror(errno) << std::endl;
+            return -1;
+        }
+        return c.len;
+    }
+
+   private:
+    int m_fd;
+    unsigned long m_address;
+    off_t m_offset;
+    qos_throttle& m_throttle;
+};
+
+// Appends to a vector
+class buffer_sink {
+   public:
+    explicit buffer_sink(std::vector<char>& out) : m_out(out) {}
+
+    ssize_t operator()(const chunk& c) {
+        m_out.insert(m_out.end(), c.data, c.data + c.len);
+        return c.len;
+    }
+
+   private:
+    std::vector<char>& m_out;
+};
+
+// Drops everything, for stages that only observe
+class null_sink {
+   public:
+    ssize_t operator()(const chunk& c) { return c.len; }
+};
+
+}  // namespace RECK
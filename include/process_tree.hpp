@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "serializer.hpp"
+
+namespace RECK {
+
+// A process and all its descendants checkpointed together, like a pre-fork server and its workers.
+//
+// The tree image at file_path lists the processes and keeps every shared segment once: MAP_SHARED mappings,
+// SysV shm and memfds mapped by any process of the tree, as far as some process maps them. Every process has its
+// own image at process_path(file_path, pid), where its shared maps only name their segment. On restore every
+// segment is created once as a memfd and mapped shared again by the processes that had it. A MAP_SHARED file is
+// restored as a shared copy of its contents, not as the file.
+//
+// A durable dump names the process images after a generation recorded in the tree image. They are committed
+// before the tree image under names of their own, so a crash leaves the previous tree with its own process images
+// or the new one with its own. Those of earlier trees are removed once the new tree image is committed.
+class process_tree {
+   public:
+    struct process {
+        int32_t pid;
+        int32_t ppid;
+    };
+
+    struct segment {
+        uint64_t id;
+        // Highest offset mapped by a process of the tree
+        uint64_t size;
+    };
+
+    // pid and its descendants, parents before their children. The calling process and its descendants are left
+    // out, so a tree can be dumped from a child of its root
+    static std::vector<process> collect(pid_t pid);
+    // Every process of the tree stays stopped until all of them are dumped. options apply to every image but
+    // hot_window, parent and stripe_dirs are ignored. Returns the number of processes
+    static ssize_t dump(pid_t pid, const std::string_view& file_path, const dump_options& options = {});
+    // The caller becomes the root of the tree and the other processes are restored as new descendants of it,
+    // with new pids. Only returns on error
+    static ssize_t restore(const std::string_view& file_path);
+    // Image of pid in the tree image file_path, generation 0 for a tree that was not dumped durable
+    static std::string process_path(const std::string_view& file_path, pid_t pid, uint64_t generation = 0);
+
+   private:
+    // Forks the children of v_procs[i], each one restores its own subtree, and restores v_procs[i] last
+    static ssize_t restore_subtree(const std::string_view& file_path, uint64_t generation,
+                                   const std::vector<process>& v_procs, size_t i,
+                                   const std::map<uint64_t, int>& segments);
+};
+
+}  // namespace RECK
@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <linux/prctl.h>
 #include <sys/ptrace.h>
+#include <sys/types.h>
 #include <sys/user.h>
 
 #include <vector>
@@ -11,7 +12,15 @@ namespace RECK {
 
 class ptracer {
    public:
-    ptracer(pid_t pid);
+    enum stop_method {
+        // PTRACE_ATTACH of every thread, the task list is scanned again until no new thread shows up
+        STOP_PTRACE,
+        // The cgroup v2 freezer stops all the threads at once, then every thread is seized. Falls back to
+        // STOP_PTRACE when the cgroup cannot be frozen or is shared with other processes, see cgroup_freezer.hpp
+        STOP_FREEZE,
+    };
+
+    ptracer(pid_t pid, stop_method method = STOP_PTRACE);
     ~ptracer();
 
     int init();
@@ -21,15 +30,43 @@ class ptracer {
     int set_fpregs(const std::vector<user_fpregs_struct>& v_fpregs);
     int detach();
 
+    // Parasite mode: the stopped main thread runs syscalls injected by the tracer, cure puts everything back.
+    // Without drain only remote_syscall works, the address space of the tracee is left as it is
+    int infect(bool with_drain = true);
+    int cure();
+    bool infected() const { return m_infected; }
+    // How init stopped the tracee, STOP_PTRACE after a fallback
+    stop_method method() const { return m_method; }
+    long remote_syscall(long nr, long a1 = 0, long a2 = 0, long a3 = 0, long a4 = 0, long a5 = 0, long a6 = 0);
+    // The tracee vmsplices len bytes at address into a pipe that is spliced to the current offset of fd, so the
+    // data is never copied to the tracer. Returns the bytes moved, less than len if a range cannot be spliced
+    ssize_t drain(unsigned long address, size_t len, int fd);
+    // Puts the original code back in data read from [address, address + len) of an infected tracee
+    void hide_parasite(unsigned long address, char* data, size_t len) const;
+
     static int allow_pid(pid_t pid = static_cast<pid_t>(PR_SET_PTRACER_ANY));
 
    private:
     int attach(pid_t pid);
+    int seize_frozen();
     std::vector<pid_t> get_tasks();
 
     pid_t m_pid;
+    stop_method m_method;
     std::vector<pid_t> m_tasks;
     bool m_init = false;
+
+    // Parasite state, valid while infected
+    bool m_infected = false;
+    user_regs_struct m_saved_regs;
+    unsigned long m_syscall_ip = 0;
+    long m_saved_code = 0;
+    unsigned long m_remote_page = 0;
+    int m_remote_pipe = -1;
+    int m_pipe[2] = {-1, -1};
+    size_t m_pipe_size = 0;
+    // Signals that arrived while running injected syscalls, sent again on cure
+    std::vector<int> m_pending_signals;
 };
 
 }  // namespace RECK
\ No newline at end of file
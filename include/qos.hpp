@@ -0,0 +1,81 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace RECK {
+
+// Limits on what a dumper takes from the neighbours of the checkpointed process
+struct qos_policy {
+    enum io_class {
+        // Keep the class inherited from the caller
+        IO_NONE,
+        IO_REALTIME,
+        IO_BEST_EFFORT,
+        // Only gets the disk when nobody else uses it
+        IO_IDLE,
+    };
+
+    // Bytes per second written by the dumper, 0 does not limit it
+    double bandwidth = 0;
+    // Bytes that can be written at once after an idle period
+    size_t burst = 4 * 1024 * 1024;
+    io_class io = IO_NONE;
+    // 0 (highest) to 7 (lowest) inside the class
+    int io_level = 4;
+    // CPUs of the dumper threads, empty keeps the inherited affinity
+    std::vector<int> cpus;
+    // Nice value of the dumper threads, 0 keeps the inherited one
+    int nice = 0;
+    // Latency of a write the pacing aims for, 0 disables it. A slower write halves the rate and a faster one
+    // adds bandwidth / 16 back, the rate stays between bandwidth / 64 and bandwidth
+    std::chrono::microseconds target_latency{0};
+    // Called with the size of every write before it is done, it blocks until the write may go. A group checkpoint
+    // routes the writes of its members through the coordinator with it, see group.hpp
+    std::function<void(size_t len)> admit;
+    // Memory a staged image may take, 0 does not bound it and the staging takes as much memory as the image and its
+    // stripes. It is checked between the writes of the dump, past it the image is written to its file during the
+    // stop, without the limits. The stripes are never staged under a budget
+    size_t stage_budget = 0;
+
+    // Anything besides admit, a dump with limits stages its image, see durable_file::stage
+    bool limits() const { return bandwidth > 0 || io != IO_NONE || !cpus.empty() || nice != 0; }
+};
+
+// Token bucket shared by every thread that writes data of one dump
+class qos_throttle {
+   public:
+    explicit qos_throttle(const qos_policy& policy);
+
+    // ioprio, affinity and nice of the calling thread, the threads it creates later inherit them. Only meant for a
+    // thread that does nothing but write, they are never put back
+    static int apply(const qos_policy& policy);
+
+    bool enabled() const { return m_policy.bandwidth > 0; }
+    // Largest write done at once, the whole length when disabled
+    size_t chunk(size_t len) const;
+    // Waits until len bytes fit in the current rate
+    void acquire(size_t len);
+    // Feeds the duration of a write of len bytes to the pacing
+    void completed(size_t len, std::chrono::nanoseconds elapsed);
+    // Bytes per second allowed now
+    double rate() const;
+
+    // filesystem::write and pwrite in chunks that go through acquire and completed
+    ssize_t write(int fd, const void* data, size_t len);
+    ssize_t pwrite(int fd, const void* data, size_t len, off_t offset);
+
+   private:
+    qos_policy m_policy;
+    mutable std::mutex m_mutex;
+    double m_rate;
+    // Negative while writers are waiting for their share
+    double m_tokens;
+    std::chrono::steady_clock::time_point m_last;
+};
+
+}  // namespace RECK
@@ -1,18 +1,111 @@
 #pragma once
 
 #include <sys/user.h>
+
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "durable_file.hpp"
 #include "maps_parser.hpp"
 #include "ptracer.hpp"
+#include "qos.hpp"
 
 namespace RECK {
+
+struct dump_options {
+    // The tracee keeps running this long while its hot pages are sampled before the checkpoint, 0 disables it
+    std::chrono::milliseconds hot_window{0};
+    // Previous image of the same process, only the pages that differ from it are saved. Empty for a full image
+    std::string parent;
+    // Changed pages of a delta are stored as their XOR with the parent page when that is smaller, see
+    // page_codec.hpp
+    bool xor_pages = false;
+    // Memory goes from the tracee to the image through a pipe with vmsplice and splice instead of being copied
+    // to the dumper, see ptracer::drain
+    bool parasite = false;
+    // Region data is striped round robin over one file per directory and the image only keeps the layout. The
+    // stripes of a durable dump get names of their own, those of the image it replaces are removed once it is
+    // committed
+    std::vector<std::string> stripe_dirs;
+    size_t stripe_unit = 1024 * 1024;
+    // Skip the stacks below the stack pointer of every thread and the free chunks of the glibc heap, see
+    // liveness.hpp. They are restored as zero pages
+    bool trim_stacks = false;
+    bool trim_free = false;
+    // Power of two, 0 packs the entries. The data of every full or sparse region starts at a file offset
+    // congruent to its address modulo align, at least the page size, so the restore maps it from the image
+    // instead of reading it. 2 MB lets the page cache use huge pages. Deltas and stripes ignore it. The restored
+    // process keeps the image mapped, it must not be truncated or rewritten in place while the process runs
+    size_t align = 0;
+    // How the threads of the tracee are stopped. STOP_FREEZE stops thousands of threads in about the time of one
+    // and no thread can be created meanwhile
+    ptracer::stop_method stop = ptracer::STOP_PTRACE;
+    // The soft-dirty bits of the tracee are cleared before it runs again, so the pages written after the checkpoint
+    // can be found in /proc/<pid>/pagemap. Ignored without CONFIG_MEM_SOFT_DIRTY
+    bool clear_soft_dirty = false;
+    // The open files of the tracee are saved and opened again at the same numbers on restore, see fd_table.hpp
+    bool files = false;
+    // Bandwidth, I/O priority and CPU limits of the dumper. With any of them the image is staged in memory while the
+    // tracee is stopped and copied to the file under the limits once it runs, see durable_file::stage. The pause
+    // stays short, but the staging takes as much memory as the image and its stripes unless qos.stage_budget bounds
+    // it
+    qos_policy qos;
+    // The image is written to <path>.tmp and renamed once it is on the disk, see durable_file.hpp. The writeback
+    // goes on in windows of writeback_window bytes during the dump, 0 leaves it all to the final fdatasync
+    bool durable = false;
+    size_t writeback_window = 8 * 1024 * 1024;
+    // Filled with the cost of the commit when not null
+    commit_stats* stats = nullptr;
+};
+
 class serializer {
    public:
     enum mdata_type {
         REGS,
         FPREGS,
         MEMORY_MAP,
+        // memory_map, a bitmap with one bit per page in 64 bit words and then only the pages with the bit set,
+        // the rest are zero filled on restore
+        SPARSE_MAP,
+        // Sorted addresses of the pages touched before the checkpoint, they are restored first
+        HOT_PAGES,
+        // Path of the image a delta is based on, relative paths start at the directory of the delta
+        PARENT,
+        // Same layout as SPARSE_MAP but the pages without their bit are taken from the parent image
+        DELTA_MAP,
+        // stripe_set followed by the path of every stripe file
+        STRIPE_SET,
+        // memory_map, the offset of its data in the stripes and a bitmap like SPARSE_MAP. The data is not in the
+        // image, unit k of the stripes is at offset (k / count) * unit of the file k % count
+        STRIPED_MAP,
+        // Filler before a region entry of an image dumped with dump_options::align, its payload is a hole in the
+        // file. The region after it is mapped from the image on restore
+        PADDING,
+        // Same layout as DELTA_MAP with the stored size of every saved page before the data. A page smaller than
+        // the page size is a page_codec delta against the page of the parent image
+        XOR_MAP,
+        // fd_table::entry followed by the path and the data of an open file, see fd_table.hpp
+        FILE_DESC,
+        // memory_map and the id of its segment in the tree image, the data is in the segment. The offset of the map
+        // is its offset in the segment, see process_tree.hpp
+        SHARED_MAP,
+        // Tree image only. process_tree::segment, a bitmap like SPARSE_MAP and the pages mapped by some process
+        SHARED_SEGMENT,
+        // Tree image only. process_tree::process, parents before their children
+        TREE_PROCESS,
+        // Tree image only. uint64_t generation of a durable tree, its process images are named after it
+        TREE_GENERATION,
+    };
+
+    struct stripe_set {
+        uint64_t unit;
+        uint64_t count;
     };
 
     struct header {
@@ -40,13 +133,79 @@ class serializer {
         friend std::ostream& operator<<(std::ostream& os, const mdata& md);
     };
 
+    static size_t page_bitmap_words(size_t pages) { return (pages + 63) / 64; }
+
+    // b starts where a ends and the restore maps both with one mmap. Only regions with the same protection, flags
+    // and name share one, so the restored process keeps its own VMA boundaries. The stack keeps its own mapping
+    static bool can_coalesce(const memory_map& a, const memory_map& b) {
+        return a.end_address == b.start_address && a.prot == b.prot && a.flags == b.flags &&
+               !std::strcmp(a.pathname, b.pathname) && !std::strstr(a.pathname, "[stack]");
+    }
+
+    // Kernel provided mappings are not saved, the kernel maps them again for the restored process
+    static bool is_saved(const memory_map& map) {
+        return !std::strstr(map.pathname, "[vdso]") && !std::strstr(map.pathname, "[vvar") &&
+               !std::strstr(map.pathname, "[vsyscall]");
+    }
+
+    // Calls fn(first_page, n_pages) for every run of consecutive pages with their bit set
+    template <typename F>
+    static void for_each_page_run(const uint64_t* bitmap, size_t pages, F&& fn) {
+        size_t page = 0;
+        while (page < pages) {
+            if (!(bitmap[page / 64] & (1UL << (page % 64)))) {
+                page++;
+                continue;
+            }
+            size_t first = page;
+            while (page < pages && (bitmap[page / 64] & (1UL << (page % 64)))) page++;
+            fn(first, page - first);
+        }
+    }
+
    public:
-    static ssize_t restore_serialized_file(const std::string_view& file_path);
+    // Patches a clone restored by spawn_clones before it runs, index from 0. A negative return kills the clone
+    using clone_fixup = std::function<int(pid_t pid, size_t index)>;
+
+    // fixup runs in the helper that sets the registers, with this process restored and stopped
+    static ssize_t restore_serialized_file(const std::string_view& file_path,
+                                           const std::function<int(pid_t pid)>& fixup = {});
     static std::vector<mdata> read_serialized_mdata(const std::string_view& file_path);
-    static ssize_t make_checkpoint(const std::string_view& file_path);
+    static ssize_t make_checkpoint(const std::string_view& file_path, const dump_options& options = {});
 
     // This need to be called in another process diferent to pid
-    static ssize_t dump_serialized_file(pid_t pid, const std::string_view& file_path);
+    static ssize_t dump_serialized_file(pid_t pid, const std::string_view& file_path,
+                                        const dump_options& options = {});
+
+    // Restores the image into n new children of the caller at once. The clones of an image dumped with
+    // dump_options::align share its unmodified pages through the page cache. Returns the pids of the clones once
+    // all of them run, empty if any of them fails, then the others are killed
+    static std::vector<pid_t> spawn_clones(const std::string_view& file_path, size_t n,
+                                           const clone_fixup& fixup = {});
+
+    // Merge a chain of images, oldest first, into one full image where the newest version of every page wins.
+    // Meant to run offline, threads = 0 uses every core
+    static ssize_t compact_images(const std::vector<std::string>& chain, const std::string_view& file_path,
+                                  unsigned threads = 0);
+
+   private:
+    friend class process_tree;
+    friend class group_checkpoint;
+
+    // Id of the segment of a map in a tree image, negative when the map is saved in the image of the process
+    using shared_segment_fn = std::function<long(const memory_map& map)>;
+
+    // dump_serialized_file of a tracee already stopped by stopped when it is not null, it stays stopped. A staged
+    // image, see dump_options::qos, is then moved to *staged when it is not null instead of committed, the caller
+    // commits it once the tracee runs again
+    static ssize_t dump_process(pid_t pid, const std::string_view& file_path, const dump_options& options,
+                                ptracer* stopped, const shared_segment_fn& shared_segment,
+                                std::unique_ptr<durable_file>* staged = nullptr);
+    // restore_serialized_file with a memfd for every segment id of the SHARED_MAP entries, closed once mapped.
+    // *helper_fd is only for the fixup: it is moved above the restored files, the new number is stored back, and
+    // it is closed in the restored process before the fixup runs
+    static ssize_t restore_process(const std::string_view& file_path, const std::function<int(pid_t pid)>& fixup,
+                                   const std::map<uint64_t, int>& segments, int* helper_fd = nullptr);
 };
 
 }  // namespace RECK
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+
+#include "serializer.hpp"
+
+namespace RECK {
+
+// Snapshots of the calling process kept in memory, to roll it back in milliseconds without going to disk. Every
+// snapshot is a regular image in a memfd, see image_reader.hpp, and the ring keeps the last capacity of them.
+// A rollback only writes back the pages that changed since the snapshot. They are found with the soft-dirty bits
+// when these were last cleared at that snapshot, by the capture or by a rollback to it, and by comparing with the
+// snapshot otherwise. Regions mapped after the snapshot are unmapped, unmapped ones are mapped again and the heap
+// gets its old brk.
+//
+// The state of the ring lives in a shared mapping excluded from the snapshots, so a rollback does not take it
+// back in time. Memory excluded with exclude or mark_scratch is not rolled back either, it is the place for
+// what has to survive a rollback. File descriptors and everything else outside the memory and the registers keep
+// their current state. The threads have to be the same as when the snapshot was taken.
+class snapshot_ring {
+   public:
+    // Images are written with options, without parent and stripes
+    explicit snapshot_ring(size_t capacity = 4, const dump_options& options = {});
+    ~snapshot_ring();
+
+    snapshot_ring(const snapshot_ring&) = delete;
+    snapshot_ring& operator=(const snapshot_ring&) = delete;
+
+    // Like setjmp: the sequence number of the new snapshot, from 1, once it is taken and 0 when the process comes
+    // back to it with rollback. The oldest snapshot is dropped when the ring is full. -1 on error
+    long capture();
+    // Takes the process back to the snapshot seq, capture returns 0 there. Only returns on error, before the
+    // process is changed. An error after that kills the process, it would be half rolled back
+    int rollback(long seq);
+    // Snapshot the process was last rolled back to, 0 if none
+    long restored() const;
+    // Most recent snapshot, 0 if none
+    long latest() const;
+    // Snapshots in the ring
+    size_t size() const;
+    size_t capacity() const;
+
+   private:
+    struct slot {
+        long seq;
+        int fd;
+    };
+    struct control {
+        size_t capacity;
+        long next_seq;
+        long restored;
+        // Helper of the last rollback, reaped when capture returns in the rolled back process
+        pid_t helper;
+        // Snapshot the soft-dirty bits were last cleared at, 0 when unknown. They only tell what changed since it
+        long soft_dirty_base;
+        slot slots[];
+    };
+
+    slot* find(long seq) const;
+    // use_soft_dirty when the bits were last cleared at this snapshot, the pages are compared otherwise
+    static int restore_snapshot(pid_t pid, int fd, const dump_options& options, bool use_soft_dirty);
+
+    control* m_control = nullptr;
+    dump_options m_options;
+};
+
+}  // namespace RECK
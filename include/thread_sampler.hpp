@@ -0,0 +1,121 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace RECK {
+
+// Thread states of a running process sampled at hundreds of Hz, for off-CPU and wall-clock profiles. A sample
+// holds the registers and the top stack_window bytes of the stack of every thread, no memory regions.
+//
+// The threads are seized once and never attached again: a sample interrupts them all with PTRACE_INTERRUPT, then
+// waits for their stops, reads them and lets them go, so the process is stopped for tens of microseconds per
+// sample. A thread that does not stop within stop_timeout, one in an uninterruptible sleep, is recorded with its
+// state and without registers nor stack, it stops later and is let go then. The scheduler state of every thread
+// is read just before the stop, R for a thread on a CPU and S or D for one waiting, and orig_rax tells the syscall
+// a waiting thread is in. The signals of the process stop its threads while they are seized, run forwards them
+// between samples.
+//
+// The samples are streamed to a file: a file_header, then every sample as a sample_header and its records, each
+// record followed by stack_size bytes of stack from regs.rsp up. tools/reck_sample records and decodes it.
+class thread_sampler {
+   public:
+    static constexpr char file_magic[8] = {'R', 'E', 'C', 'K', 'S', 'M', 'P', '\0'};
+    // Version 1 files have no record flags, their records all have registers
+    static constexpr uint32_t file_version = 2;
+    // record::flags of a thread that did not stop in time, its regs are zero and it has no stack
+    static constexpr uint8_t record_no_regs = 1;
+
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        pid_t pid;
+        uint32_t stack_window;
+        uint32_t reserved;
+        // CLOCK_MONOTONIC of the first sample
+        uint64_t ns_start;
+    };
+
+    struct sample_header {
+        // CLOCK_MONOTONIC when the process was stopped and the time it stayed stopped
+        uint64_t ns;
+        uint32_t stop_ns;
+        uint32_t n_records;
+    };
+
+    struct record {
+        pid_t tid;
+        // Scheduler state letter of /proc/<pid>/task/<tid>/stat before the stop
+        char state;
+        uint8_t flags;
+        uint8_t reserved[2];
+        uint32_t stack_size;
+        uint32_t reserved2;
+        user_regs_struct regs;
+    };
+
+    struct thread_sample {
+        record r;
+        std::vector<char> stack;
+    };
+
+    struct sample {
+        sample_header h;
+        std::vector<thread_sample> v_threads;
+    };
+
+    thread_sampler(pid_t pid, size_t stack_window = 4096,
+                   std::chrono::microseconds stop_timeout = std::chrono::milliseconds{10});
+    ~thread_sampler();
+
+    thread_sampler(const thread_sampler&) = delete;
+    thread_sampler& operator=(const thread_sampler&) = delete;
+
+    // Seizes every thread, the process keeps running. Writes the file header to fd
+    int init(int fd);
+    // Stops the process, writes one sample and lets it run. Threads created since the last sample are seized
+    // first and the ones that exited are dropped. Returns the threads sampled, 0 once the process is gone
+    ssize_t take_sample();
+    // A seized thread that gets a signal stops until its tracer lets it go on with it. Lets every thread stopped
+    // that way go, the ones that exited are dropped
+    void forward_signals();
+    // Samples at hz for duration, or until the process exits, and forwards the signals as soon as they stop a
+    // thread in between. SIGCHLD is blocked in the calling thread meanwhile. Returns the samples written
+    ssize_t run(unsigned hz, std::chrono::milliseconds duration);
+    // Longest time the process was stopped by a sample
+    std::chrono::nanoseconds max_stop() const { return m_max_stop; }
+
+    // Samples pid into file_path
+    static ssize_t record_file(pid_t pid, const std::string& file_path, unsigned hz,
+                               std::chrono::milliseconds duration, size_t stack_window = 4096);
+    // Reads back a sample file. -1 when it is not one, a sample cut by the end of the file is left out
+    static int read_file(const std::string& file_path, file_header& h, std::vector<sample>& v_samples);
+
+   private:
+    struct thread {
+        pid_t tid;
+        // /proc/<pid>/task/<tid>/stat kept open, it is read again with pread
+        int stat_fd;
+    };
+
+    int seize_new_threads();
+    void drop_thread(size_t i);
+    // Interrupts every thread, then waits up to m_stop_timeout for them to stop. v_stop is 1 for a thread stopped
+    // with v_status, 0 for one not stopped yet and -1 for one that is gone
+    void stop_threads(std::vector<int>& v_status, std::vector<int>& v_stop);
+
+    pid_t m_pid;
+    size_t m_stack_window;
+    std::chrono::microseconds m_stop_timeout;
+    int m_fd = -1;
+    std::vector<thread> m_threads;
+    std::vector<char> m_buffer;
+    std::chrono::nanoseconds m_max_stop{0};
+};
+
+}  // namespace RECK
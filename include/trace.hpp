@@ -0,0 +1,143 @@
+#pragma once
+
+#include <sys/types.h>
+#include <x86intrin.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace RECK {
+
+// Always on binary trace of the checkpoint and restore internals. Every thread writes to its own ring with no
+// locks, so recording is cheap and async-signal-safe once the ring of the thread exists. With RECK_TRACE=<prefix>
+// the rings are written to <prefix>.<pid> at exit, tools/reck_trace decodes them.
+class trace {
+   public:
+    enum event : uint16_t {
+        DUMP,
+        ATTACH,
+        DUMP_REGS,
+        DUMP_MAP,
+        REMOTE_READ,
+        WRITE,
+        DRAIN,
+        REMOTE_SYSCALL,
+        HOT_SAMPLE,
+        RESTORE,
+        RESTORE_MAP,
+        RESTORE_LOAD,
+        RESTORE_PROTECT,
+        COMPACT,
+        TIER_DRAIN,
+        WRITEBACK,
+        COMMIT,
+        SAMPLE,
+        OFFLOAD,
+        FAULT,
+        EVENT_COUNT,
+    };
+
+    enum kind : uint8_t {
+        BEGIN,
+        END,
+        MARK,
+    };
+
+    struct entry {
+        uint64_t tsc;
+        uint16_t event;
+        uint8_t kind;
+        uint8_t reserved[5];
+        uint64_t arg0;
+        uint64_t arg1;
+    };
+    static_assert(sizeof(entry) == 32, "trace entries are written as is to the trace file");
+
+    // Power of two, the oldest entries are overwritten
+    static constexpr uint64_t ring_entries = 8192;
+
+    // A ring outlives its thread, the next thread to record anything takes it over. Their number stays the
+    // number of threads alive at once
+    struct ring {
+        // Last thread that owned the ring
+        pid_t tid;
+        std::atomic<bool> in_use;
+        std::atomic<uint64_t> head;
+        ring* next;
+        entry entries[ring_entries];
+    };
+
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t n_rings;
+        pid_t pid;
+        uint32_t reserved;
+        // Two points to convert the TSC to nanoseconds
+        uint64_t tsc_start;
+        uint64_t ns_start;
+        uint64_t tsc_end;
+        uint64_t ns_end;
+    };
+
+    struct file_ring {
+        pid_t tid;
+        uint32_t reserved;
+        // Entries ever written to the ring, the file has the last min(head, ring_entries)
+        uint64_t head;
+    };
+
+    static constexpr char file_magic[8] = {'R', 'E', 'C', 'K', 'T', 'R', 'C', '\0'};
+    static constexpr uint32_t file_version = 1;
+
+    static void emit(event e, kind k, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+        ring* r = t_ring ? t_ring : create_ring();
+        if (!r) return;
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        entry& en = r->entries[head & (ring_entries - 1)];
+        en.tsc = __rdtsc();
+        en.event = e;
+        en.kind = k;
+        en.arg0 = arg0;
+        en.arg1 = arg1;
+        r->head.store(head + 1, std::memory_order_release);
+    }
+
+    // Records BEGIN on construction and END with the same arguments on destruction
+    class scope {
+       public:
+        scope(event e, uint64_t arg0 = 0, uint64_t arg1 = 0) : m_event(e), m_arg0(arg0), m_arg1(arg1) {
+            emit(m_event, BEGIN, m_arg0, m_arg1);
+        }
+        ~scope() { emit(m_event, END, m_arg0, m_arg1); }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+       private:
+        event m_event;
+        uint64_t m_arg0;
+        uint64_t m_arg1;
+    };
+
+    // Writes every ring to path with raw syscalls, safe to call from a signal handler
+    static int dump(const char* path);
+    // dump to <prefix>.<pid> when RECK_TRACE is set, for processes that never reach exit
+    static int flush();
+    static const char* event_name(uint16_t e);
+    // Destructor of the ring of an exiting thread, gives it back
+    static void release_ring(void* r);
+
+   private:
+    static ring* create_ring();
+
+    static thread_local ring* t_ring __attribute__((tls_model("initial-exec")));
+};
+
+#define RECK_TRACE_JOIN_(x, y) x##y
+#define RECK_TRACE_JOIN(x, y)  RECK_TRACE_JOIN_(x, y)
+#define trace_scope(event, ...) \
+    ::RECK::trace::scope RECK_TRACE_JOIN(trace_scope_object, __LINE__)(::RECK::trace::event, ##__VA_ARGS__)
+#define trace_mark(event, ...) ::RECK::trace::emit(::RECK::trace::event, ::RECK::trace::MARK, ##__VA_ARGS__)
+
+}  // namespace RECK
@@ -0,0 +1,152 @@
+// #define DEBUG
+
+#include "cgroup_freezer.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
+
+namespace RECK {
+
+namespace {
+
+int write_file(const std::string &path, const std::string &value) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(fd); });
+    if (filesystem::write(fd, value.data(), value.size()) != static_cast<ssize_t>(value.size())) {
+        std::cerr << "Error writing " << value << " to file " << path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+// A cgroup path is inside another one when it is the same or a descendant
+bool inside(const std::string &path, const std::string &cgroup) {
+    if (cgroup == "/") return true;
+    return path.compare(0, cgroup.size(), cgroup) == 0 && (path.size() == cgroup.size() || path[cgroup.size()] == '/');
+}
+
+}  // namespace
+
+cgroup_freezer::cgroup_freezer(pid_t pid) : m_pid(pid) {}
+
+cgroup_freezer::~cgroup_freezer() { thaw(); }
+
+std::string cgroup_freezer::mount_point() {
+    std::ifstream mounts("/proc/self/mounts");
+    std::string line;
+    while (std::getline(mounts, line)) {
+        std::istringstream iss(line);
+        std::string device, path, type;
+        iss >> device >> path >> type;
+        if (type == "cgroup2") return path;
+    }
+    return {};
+}
+
+std::string cgroup_freezer::cgroup_of(pid_t pid) {
+    std::ifstream cgroup("/proc/" + std::to_string(pid) + "/cgroup");
+    std::string line;
+    while (std::getline(cgroup, line)) {
+        // The cgroup v2 entry has hierarchy 0 and no controllers
+        if (line.compare(0, 3, "0::") == 0) return line.substr(3);
+    }
+    return {};
+}
+
+int cgroup_freezer::freeze(std::chrono::milliseconds timeout) {
+    debug_msg("Begin (" << m_pid << ")");
+    if (m_frozen) return 0;
+
+    auto mount = mount_point();
+    auto cgroup = cgroup_of(m_pid);
+    if (mount.empty() || cgroup.empty()) {
+        std::cerr << "Error cgroup v2 is not available for pid " << m_pid << std::endl;
+        return -1;
+    }
+    std::string dir = mount + (cgroup == "/" ? "" : cgroup);
+
+    // Freezing a cgroup shared with others would stop them too, and the root cgroup cannot be frozen
+    bool alone = false;
+    if (cgroup != "/" && !inside(cgroup_of(getpid()), cgroup)) {
+        std::ifstream procs(dir + "/cgroup.procs");
+        pid_t p;
+        size_t count = 0;
+        while (procs >> p) count++;
+        alone = count == 1;
+    }
+    if (!alone) {
+        std::cerr << "Error pid " << m_pid << " is not alone in cgroup " << cgroup << std::endl;
+        return -1;
+    }
+    m_cgroup = dir;
+
+    m_frozen = true;
+    if (write_file(m_cgroup + "/cgroup.freeze", "1") < 0 || wait_frozen(timeout) < 0) {
+        thaw();
+        return -1;
+    }
+
+    debug_msg("End (" << m_pid << ") " << m_cgroup);
+    return 0;
+}
+
+int cgroup_freezer::wait_frozen(std::chrono::milliseconds timeout) {
+    std::string path = m_cgroup + "/cgroup.events";
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(fd); });
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    char buffer[256];
+    while (true) {
+        auto n = ::pread(fd, buffer, sizeof(buffer) - 1, 0);
+        if (n < 0) {
+            std::cerr << "Error reading file " << path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        buffer[n] = '\0';
+        if (std::strstr(buffer, "frozen 1")) return 0;
+
+        // The kernel notifies a change of cgroup.events with POLLPRI
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            std::cerr << "Error cgroup " << m_cgroup << " not frozen after " << timeout.count() << " ms" << std::endl;
+            return -1;
+        }
+        pollfd pfd = {fd, POLLPRI, 0};
+        if (::poll(&pfd, 1, left.count()) < 0 && errno != EINTR) {
+            std::cerr << "Error poll " << path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+}
+
+int cgroup_freezer::thaw() {
+    int ret = 0;
+    debug_msg("Begin (" << m_pid << ")");
+
+    if (m_frozen && write_file(m_cgroup + "/cgroup.freeze", "0") < 0) ret = -1;
+    m_frozen = false;
+    m_cgroup.clear();
+
+    debug_msg("End (" << m_pid << ")");
+    return ret;
+}
+
+}  // namespace RECK
@@ -0,0 +1,292 @@
+// #define DEBUG
+
+#include "durable_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+static void since(std::chrono::steady_clock::time_point start, std::chrono::microseconds& total) {
+    total += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+
+durable_file::durable_file(std::string path, bool durable, size_t window)
+    : m_path(std::move(path)), m_tmp_path(m_path + ".tmp"), m_durable(durable), m_window(window) {}
+
+// Copies the memfd from to the same offsets of to. The holes stay holes, like the padding of an aligned image
+static int copy_staged(int from, int to, qos_throttle& throttle, durable_file* paced) {
+    off_t len = ::lseek(from, 0, SEEK_END);
+    if (len <= 0) return len < 0 ? -1 : 0;
+    void* addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, from, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mmap of staged data " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::munmap(addr, len); });
+    // The writeback goes on between the chunks, the staged data already has its final layout
+    constexpr off_t copy_chunk = 1024 * 1024;
+    auto data = static_cast<const char*>(addr);
+    for (off_t offset = ::lseek(from, 0, SEEK_DATA); offset >= 0 && offset < len;) {
+        off_t end = std::min(::lseek(from, offset, SEEK_HOLE), len);
+        if (end < 0 || ::lseek(to, offset, SEEK_SET) < 0) return -1;
+        while (offset < end) {
+            size_t n = std::min(copy_chunk, end - offset);
+            trace_scope(WRITE, to, n);
+            if (throttle.write(to, data + offset, n) != static_cast<ssize_t>(n)) {
+                std::cerr << "Error writing staged data " << strerror(errno) << std::endl;
+                return -1;
+            }
+            offset += n;
+            if (paced && paced->paced() < 0) return -1;
+        }
+        offset = ::lseek(from, end, SEEK_DATA);
+    }
+    if (::ftruncate(to, len) < 0 || ::lseek(to, len, SEEK_SET) < 0) {
+        std::cerr << "Error resizing the copy of staged data " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+durable_file::~durable_file() {
+    if (m_fd >= 0) ::close(m_fd);
+    if (m_fd >= 0 && m_durable && !m_committed) ::unlink(m_tmp_path.c_str());
+    if (m_stage_fd >= 0) ::close(m_stage_fd);
+    for (auto& e : m_extras) {
+        if (e.staged >= 0) ::close(e.staged);
+        ::close(e.fd);
+        if (m_durable && !m_committed) ::unlink(e.path.c_str());
+    }
+}
+
+// fsync of the directory of path, for the names created or renamed in it
+static int sync_dir(const std::string& path) {
+    auto slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        std::cerr << "Error opening directory " << dir << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(dir_fd); });
+    if (::fsync(dir_fd) < 0) {
+        std::cerr << "Error fsync " << dir << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+void durable_file::stage(const qos_policy& policy) {
+    m_staged = true;
+    m_policy = policy;
+}
+
+int durable_file::open_extra(const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        std::cerr << "Error opening " << path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // Under a budget only the image is staged, it is the one that can be spilled
+    bool stage = m_staged && m_policy.stage_budget == 0;
+    int staged = stage ? ::memfd_create("reck-stage", MFD_CLOEXEC) : -1;
+    if (stage && staged < 0) {
+        std::cerr << "Error memfd_create " << strerror(errno) << std::endl;
+        ::close(fd);
+        return -1;
+    }
+    // The caller gets the fd it writes, the copy is kept for commit
+    int out = ::fcntl(stage ? staged : fd, F_DUPFD_CLOEXEC, 0);
+    if (out < 0) {
+        std::cerr << "Error duplicating fd of " << path << " " << strerror(errno) << std::endl;
+        ::close(fd);
+        if (staged >= 0) ::close(staged);
+        return -1;
+    }
+    m_extras.push_back({path, fd, staged});
+    return out;
+}
+
+void durable_file::remove_on_commit(std::string path) { m_removed.push_back(std::move(path)); }
+
+int durable_file::open() {
+    debug_msg("Begin");
+    if (m_staged) {
+        m_stage_fd = ::memfd_create("reck-stage", MFD_CLOEXEC);
+        if (m_stage_fd < 0) {
+            std::cerr << "Error memfd_create " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    const auto& path = m_durable ? m_tmp_path : m_path;
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (m_durable ? O_CLOEXEC : 0), S_IRUSR | S_IWUSR);
+    if (m_fd < 0) {
+        std::cerr << "Error opening file " << path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    debug_msg("End");
+    return fd();
+}
+
+void durable_file::preallocate(size_t len) {
+    if (!m_durable || len == 0) return;
+    off_t offset = ::lseek(m_fd, 0, SEEK_CUR);
+    // Not every file system has it, the image is written anyway
+    if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+        debug_msg("fallocate " << len << " " << strerror(errno));
+        return;
+    }
+    m_stats.preallocated += len;
+}
+
+int durable_file::spill() {
+    struct stat st;
+    if (::fstat(m_stage_fd, &st) < 0) {
+        std::cerr << "Error fstat of staged data " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (static_cast<size_t>(st.st_blocks) * 512 <= m_policy.stage_budget) return 0;
+    debug_msg("Begin " << st.st_size << " bytes");
+    // The tracee is still stopped, the spill is not throttled
+    qos_throttle unlimited{qos_policy{}};
+    off_t offset = ::lseek(m_stage_fd, 0, SEEK_CUR);
+    if (offset < 0 || copy_staged(m_stage_fd, m_fd, unlimited, nullptr) < 0 || ::lseek(m_fd, offset, SEEK_SET) < 0) {
+        std::cerr << "Error spilling the staged data of " << m_path << std::endl;
+        return -1;
+    }
+    // The writer keeps its fd, it is the file from now on
+    if (::dup3(m_fd, m_stage_fd, O_CLOEXEC) < 0) {
+        std::cerr << "Error dup3 " << strerror(errno) << std::endl;
+        return -1;
+    }
+    ::close(m_fd);
+    m_fd = m_stage_fd;
+    m_stage_fd = -1;
+    m_staged = false;
+    m_stats.spilled = st.st_size;
+    debug_msg("End");
+    return 0;
+}
+
+int durable_file::paced() {
+    if (m_staged && m_policy.stage_budget > 0 && spill() < 0) return -1;
+    if (!m_durable || m_window == 0) return 0;
+    off_t window = m_window;
+    off_t offset = ::lseek(m_fd, 0, SEEK_CUR);
+    while (offset - m_queued >= window) {
+        if (::sync_file_range(m_fd, m_queued, window, SYNC_FILE_RANGE_WRITE) < 0) {
+            std::cerr << "Error sync_file_range " << m_tmp_path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        // One window in flight at a time, the dump only waits when the disk is slower than it
+        if (m_queued >= window) {
+            trace_scope(WRITEBACK, m_queued - window, window);
+            auto start = std::chrono::steady_clock::now();
+            int ret = ::sync_file_range(m_fd, m_queued - window, window,
+                                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                            SYNC_FILE_RANGE_WAIT_AFTER);
+            since(start, m_stats.writeback);
+            if (ret < 0) {
+                std::cerr << "Error sync_file_range " << m_tmp_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
+        m_queued += window;
+        m_stats.windows++;
+    }
+    return 0;
+}
+
+int durable_file::commit() {
+    debug_msg("Begin");
+    // One writer per file like the stripes of a dump, they share the throttle
+    if (m_staged) {
+        qos_throttle throttle{m_policy};
+        std::atomic<bool> failed = false;
+        std::vector<std::thread> v_threads;
+        auto writer = [&](int from, int to, durable_file* paced) {
+            return [&, from, to, paced]() {
+                if (qos_throttle::apply(m_policy) < 0) {
+                    std::cerr << "Warning: QoS policy not fully applied to the copy of " << m_path << std::endl;
+                }
+                if (copy_staged(from, to, throttle, paced) < 0) failed = true;
+            };
+        };
+        v_threads.emplace_back(writer(m_stage_fd, m_fd, this));
+        for (auto& e : m_extras) {
+            if (e.staged >= 0) v_threads.emplace_back(writer(e.staged, e.fd, nullptr));
+        }
+        for (auto& t : v_threads) t.join();
+        if (failed) {
+            std::cerr << "Error copying the staged data of " << m_path << std::endl;
+            return -1;
+        }
+        ::close(m_stage_fd);
+        m_stage_fd = -1;
+        m_staged = false;
+    }
+
+    off_t size = ::lseek(m_fd, 0, SEEK_CUR);
+    m_stats.bytes = size;
+    if (!m_durable) {
+        m_committed = true;
+        return 0;
+    }
+    trace_scope(COMMIT, size);
+
+    // Gives back what the estimate reserved in excess
+    if (m_stats.preallocated > 0 && ::ftruncate(m_fd, size) < 0) {
+        std::cerr << "Error ftruncate " << m_tmp_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    // The image only names files that are on the disk
+    for (auto& e : m_extras) {
+        if (::fdatasync(e.fd) < 0) {
+            std::cerr << "Error fdatasync " << e.path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if (sync_dir(e.path) < 0) return -1;
+    }
+    if (::fdatasync(m_fd) < 0) {
+        std::cerr << "Error fdatasync " << m_tmp_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    since(start, m_stats.sync);
+
+    start = std::chrono::steady_clock::now();
+    if (::rename(m_tmp_path.c_str(), m_path.c_str()) < 0) {
+        std::cerr << "Error renaming " << m_tmp_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    m_committed = true;
+
+    // The rename itself is only durable once the directory is
+    if (sync_dir(m_path) < 0) return -1;
+    since(start, m_stats.publish);
+
+    // Nothing names them anymore
+    for (auto& path : m_removed) {
+        if (::unlink(path.c_str()) < 0 && errno != ENOENT) {
+            std::cerr << "Warning: could not remove " << path << " " << strerror(errno) << std::endl;
+        }
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+}  // namespace RECK
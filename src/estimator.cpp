@@ -0,0 +1,298 @@
+// #define DEBUG
+
+#include "estimator.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "exclusion.hpp"
+#include "filesystem.hpp"
+#include "liveness.hpp"
+
+namespace RECK {
+
+constexpr size_t bandwidth_sample_size = 32 * 1024 * 1024;
+constexpr size_t bandwidth_chunk_size = 1024 * 1024;
+constexpr uint64_t pagemap_present = 1UL << 63;
+constexpr uint64_t pagemap_swapped = 1UL << 62;
+constexpr size_t pagemap_batch = 64 * 1024;
+
+std::ostream &operator<<(std::ostream &os, const checkpoint_estimate &estimate) {
+    auto mib = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+    os << std::dec << std::fixed << std::setprecision(1);
+    os << estimate.regions.size() << " regions, " << estimate.threads << " threads" << std::endl;
+    os << "resident " << mib(estimate.resident) << " MiB, dirty " << mib(estimate.dirty) << " MiB, swapped "
+       << mib(estimate.swapped) << " MiB, file backed " << mib(estimate.file_backed) << " MiB, zero "
+       << mib(estimate.zero) << " MiB, excluded " << mib(estimate.excluded) << " MiB" << std::endl;
+    os << "image " << mib(estimate.image_size) << " MiB, copy " << mib(estimate.copy_bandwidth) << " MiB/s, write "
+       << mib(estimate.write_bandwidth) << " MiB/s, pause " << estimate.pause.count() / 1000.0 << " ms";
+    os.unsetf(std::ios_base::floatfield);
+    return os;
+}
+
+checkpoint_estimate estimator::estimate(pid_t pid, const std::string_view &directory, const dump_options &options,
+                                        bool probe_write) {
+    debug_msg("Begin");
+    checkpoint_estimate estimate;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    auto v_maps = maps_parser::get_maps(pid);
+    for (auto &map : v_maps) {
+        if (serializer::is_saved(map)) estimate.regions.push_back({map});
+    }
+    if (read_smaps(pid, estimate.regions) < 0 || read_pagemap(pid, estimate.regions) < 0) {
+        return {};
+    }
+
+    std::error_code ec;
+    std::string task_path = "/proc/" + std::to_string(pid) + "/task";
+    for ([[maybe_unused]] auto &task : std::filesystem::directory_iterator(task_path, ec)) estimate.threads++;
+
+    // Same layout as dump_serialized_file, deltas are estimated as full images
+    size_t md = sizeof(serializer::mdata);
+    size_t image_size = sizeof(serializer::header);
+    image_size += estimate.threads * (2 * md + sizeof(user_regs_struct) + sizeof(user_fpregs_struct));
+    if (!options.parent.empty()) image_size += md + options.parent.size();
+    bool striped = !options.stripe_dirs.empty();
+    size_t align = options.align ? std::max<size_t>(options.align, page) : 0;
+    if (striped) image_size += md + sizeof(serializer::stripe_set) + options.stripe_dirs.size() * PATH_MAX;
+
+    auto v_exclusions = exclusion_table::read_remote(pid, v_maps);
+    // The stack pointers need the tracee stopped, only the heap can be walked while it runs
+    if (options.trim_free) {
+        auto v_free = liveness::free_chunks(pid, v_maps);
+        v_exclusions.insert(v_exclusions.end(), v_free.begin(), v_free.end());
+    }
+    size_t data_size = 0;
+    for (auto &r : estimate.regions) {
+        size_t pages = r.map.size() / page;
+        std::vector<bool> excluded(pages, false);
+        for (auto &excl : v_exclusions) {
+            if (excl.end_address <= r.map.start_address || excl.start_address >= r.map.end_address) continue;
+            size_t first = (std::max(excl.start_address, r.map.start_address) - r.map.start_address) / page;
+            size_t last = (std::min(excl.end_address, r.map.end_address) - r.map.start_address) / page;
+            std::fill(excluded.begin() + first, excluded.begin() + last, true);
+        }
+        r.excluded = std::count(excluded.begin(), excluded.end(), true) * page;
+
+        size_t words = serializer::page_bitmap_words(pages);
+        size_t entry = md + sizeof(memory_map);
+        if (striped) {
+            entry += sizeof(uint64_t) + words * sizeof(uint64_t);
+        } else if (r.excluded) {
+            entry += words * sizeof(uint64_t);
+        }
+        // Upper bound of the padding, a hole that takes no space on disk
+        if (align && !striped && options.parent.empty()) entry += md + align - 1;
+        r.image_bytes = entry + r.map.size() - r.excluded;
+        image_size += r.image_bytes;
+        data_size += r.map.size() - r.excluded;
+
+        estimate.resident += r.resident;
+        estimate.dirty += r.dirty;
+        estimate.swapped += r.swapped;
+        estimate.file_backed += r.file_backed;
+        estimate.zero += r.zero;
+        estimate.excluded += r.excluded;
+    }
+    // Upper bound, every dirty page could be hot
+    if (options.hot_window.count() > 0) image_size += md + estimate.dirty / page * sizeof(unsigned long);
+    estimate.image_size = image_size;
+
+    // Stripes are read and written by one thread per directory
+    estimate.copy_bandwidth = copy_bandwidth();
+    if (striped) {
+        for (auto &dir : options.stripe_dirs) estimate.write_bandwidth += known_write_bandwidth(dir, probe_write);
+        size_t parallel = std::min<size_t>(options.stripe_dirs.size(), std::thread::hardware_concurrency());
+        estimate.copy_bandwidth *= std::max<size_t>(parallel, 1);
+    } else {
+        estimate.write_bandwidth = known_write_bandwidth(directory, probe_write);
+    }
+    if (options.qos.bandwidth > 0) estimate.write_bandwidth = std::min(estimate.write_bandwidth, options.qos.bandwidth);
+
+    // The parasite splices the pages without the copy to the dumper. With QoS limits the image is staged in
+    // memory during the pause and written after it
+    double seconds = 0;
+    if (options.qos.limits()) {
+        if (estimate.copy_bandwidth > 0) seconds += data_size / estimate.copy_bandwidth;
+    } else if (estimate.write_bandwidth > 0) {
+        seconds += data_size / estimate.write_bandwidth;
+    }
+    if (estimate.copy_bandwidth > 0 && !(options.parasite && !striped && options.parent.empty())) {
+        seconds += data_size / estimate.copy_bandwidth;
+    }
+    estimate.pause = std::chrono::microseconds(static_cast<long>(seconds * 1e6));
+
+    debug_msg("End " << estimate);
+    return estimate;
+}
+
+int estimator::read_smaps(pid_t pid, std::vector<region_estimate> &v_regions) {
+    debug_msg("Begin");
+    std::string smaps_path = "/proc/" + std::to_string(pid) + "/smaps";
+    std::ifstream smaps(smaps_path);
+    if (!smaps.is_open()) {
+        std::cerr << "Error opening file " << smaps_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // Both list the mappings in address order, the regions are walked along with the file
+    region_estimate *current = nullptr;
+    size_t next = 0;
+    size_t anonymous = 0;
+    std::string line;
+    while (std::getline(smaps, line)) {
+        auto colon = line.find(':');
+        auto space = line.find(' ');
+        // Header lines of a mapping start with its address range, they have no colon in the first field
+        if (colon == std::string::npos || space < colon) {
+            if (current && current->map.inode != 0) current->file_backed = current->resident - anonymous;
+            anonymous = 0;
+            auto start = maps_parser::parse_ulong(std::string_view{line}.substr(0, line.find('-')), 16);
+            current = nullptr;
+            if (!start.has_value()) continue;
+            while (next < v_regions.size() && v_regions[next].map.start_address < start.value()) next++;
+            if (next < v_regions.size() && v_regions[next].map.start_address == start.value()) {
+                current = &v_regions[next++];
+            }
+            continue;
+        }
+        if (!current) continue;
+
+        std::istringstream iss(line.substr(colon + 1));
+        size_t kb = 0;
+        iss >> kb;
+        std::string_view key{line.data(), colon};
+        if (key == "Rss") {
+            current->resident = kb * 1024;
+        } else if (key == "Private_Dirty" || key == "Shared_Dirty") {
+            current->dirty += kb * 1024;
+        } else if (key == "Swap") {
+            current->swapped = kb * 1024;
+        } else if (key == "Anonymous") {
+            anonymous = kb * 1024;
+        }
+    }
+    if (current && current->map.inode != 0) current->file_backed = current->resident - anonymous;
+
+    debug_msg("End");
+    return 0;
+}
+
+int estimator::read_pagemap(pid_t pid, std::vector<region_estimate> &v_regions) {
+    debug_msg("Begin");
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    std::string pagemap_path = "/proc/" + std::to_string(pid) + "/pagemap";
+    int fd = ::open(pagemap_path.c_str(), O_RDONLY);
+    defer({
+        if (fd >= 0) ::close(fd);
+    });
+    if (fd < 0) {
+        std::cerr << "Error opening file " << pagemap_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    std::vector<uint64_t> entries(pagemap_batch);
+    for (auto &r : v_regions) {
+        // A page of a file mapping that is not present is read back from the file, not as zeros
+        if (r.map.inode != 0) continue;
+        size_t pages = r.map.size() / page;
+        for (size_t done = 0; done < pages;) {
+            size_t n = std::min(pages - done, pagemap_batch);
+            off_t offset = (r.map.start_address / page + done) * sizeof(uint64_t);
+            auto ret = ::pread(fd, entries.data(), n * sizeof(uint64_t), offset);
+            if (ret != static_cast<ssize_t>(n * sizeof(uint64_t))) {
+                std::cerr << "Error reading pagemap of " << r.map << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (!(entries[i] & (pagemap_present | pagemap_swapped))) r.zero += page;
+            }
+            done += n;
+        }
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+namespace {
+
+std::mutex g_bandwidth_mutex;
+std::map<std::string, double, std::less<>> g_write_bandwidths;
+
+}  // namespace
+
+void estimator::set_write_bandwidth(const std::string_view &directory, double bandwidth) {
+    std::unique_lock lock(g_bandwidth_mutex);
+    g_write_bandwidths.insert_or_assign(std::string{directory}, bandwidth);
+}
+
+double estimator::known_write_bandwidth(const std::string_view &directory, bool probe) {
+    if (probe) return write_bandwidth(directory);
+    std::unique_lock lock(g_bandwidth_mutex);
+    auto it = g_write_bandwidths.find(directory);
+    return it != g_write_bandwidths.end() ? it->second : 0;
+}
+
+double estimator::write_bandwidth(const std::string_view &directory) {
+    std::unique_lock lock(g_bandwidth_mutex);
+    if (auto it = g_write_bandwidths.find(directory); it != g_write_bandwidths.end()) return it->second;
+
+    debug_msg("Begin " << directory);
+    std::string path = std::string{directory} + "/.reck_bandwidth.XXXXXX";
+    int fd = ::mkstemp(path.data());
+    if (fd < 0) {
+        std::cerr << "Error creating file " << path << " " << strerror(errno) << std::endl;
+        return 0;
+    }
+    ::unlink(path.c_str());
+    defer({ ::close(fd); });
+
+    std::vector<char> buffer(bandwidth_chunk_size);
+    for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<char>(i * 31 + 7);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t written = 0; written < bandwidth_sample_size; written += buffer.size()) {
+        if (filesystem::write(fd, buffer.data(), buffer.size()) != static_cast<ssize_t>(buffer.size())) {
+            std::cerr << "Error writing file " << path << " " << strerror(errno) << std::endl;
+            return 0;
+        }
+    }
+    ::fdatasync(fd);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double bandwidth = bandwidth_sample_size / std::max(elapsed.count(), 1e-6);
+    g_write_bandwidths.emplace(directory, bandwidth);
+    debug_msg("End " << bandwidth << " bytes/s");
+    return bandwidth;
+}
+
+double estimator::copy_bandwidth() {
+    static double bandwidth = [] {
+        std::vector<char> src(bandwidth_sample_size, 1), dst(bandwidth_sample_size);
+        auto start = std::chrono::steady_clock::now();
+        auto ret = filesystem::remote_read(getpid(), src.data(), dst.data(), src.size());
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (ret != static_cast<ssize_t>(src.size())) return 0.0;
+        return bandwidth_sample_size / std::max(elapsed.count(), 1e-6);
+    }();
+    return bandwidth;
+}
+
+}  // namespace RECK
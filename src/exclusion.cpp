@@ -0,0 +1,135 @@
+// #define DEBUG
+
+#include "exclusion.hpp"
+
+#include <linux/prctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+#include "debug.hpp"
+#include "filesystem.hpp"
+
+namespace RECK {
+
+// Read by the dumper in the tracee, a forked dumper finds it at the same address
+static exclusion_table *volatile g_exclusion_table = nullptr;
+
+static std::mutex &exclusion_lock() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static exclusion_table *get_table() {
+    if (g_exclusion_table) return g_exclusion_table;
+
+    void *addr = ::mmap(nullptr, exclusion_table::table_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mapping exclusion table " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    // Lets any dumper find the table in /proc/<pid>/maps, needs CONFIG_ANON_VMA_NAME
+    ::prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, addr, exclusion_table::table_size, exclusion_table::mapping_name);
+
+    auto table = static_cast<exclusion_table *>(addr);
+    std::memcpy(table->magic, exclusion_table::default_magic, sizeof(table->magic));
+    g_exclusion_table = table;
+    return table;
+}
+
+static int add_range(const void *ptr, size_t len, exclusion_table::kind type) {
+    debug_msg("Begin " << ptr << " " << len);
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = (reinterpret_cast<unsigned long>(ptr) + page - 1) & ~(page - 1);
+    unsigned long end = (reinterpret_cast<unsigned long>(ptr) + len) & ~(page - 1);
+    if (end <= start) {
+        debug_msg("End range without whole pages");
+        return 0;
+    }
+
+    std::unique_lock lock(exclusion_lock());
+    auto table = get_table();
+    if (!table) return -1;
+    if (table->count >= exclusion_table::capacity) {
+        std::cerr << "Error exclusion table is full (" << exclusion_table::capacity << " entries)" << std::endl;
+        return -1;
+    }
+    // The dumper only looks up to count, so the entry is written before it is published
+    table->entries[table->count] = {start, end, type};
+    __atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+
+    debug_msg("End");
+    return 0;
+}
+
+int exclude(const void *ptr, size_t len) { return add_range(ptr, len, exclusion_table::EXCLUDE); }
+
+int mark_scratch(const void *ptr, size_t len) { return add_range(ptr, len, exclusion_table::SCRATCH); }
+
+int unexclude(const void *ptr) {
+    debug_msg("Begin " << ptr);
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = (reinterpret_cast<unsigned long>(ptr) + page - 1) & ~(page - 1);
+
+    std::unique_lock lock(exclusion_lock());
+    auto table = g_exclusion_table;
+    if (!table) return -1;
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].start_address != start) continue;
+        // A dumper stopping us in between sees the last entry twice, which is harmless
+        uint32_t last = table->count - 1;
+        table->entries[i] = table->entries[last];
+        __atomic_store_n(&table->count, last, __ATOMIC_RELEASE);
+        debug_msg("End");
+        return 0;
+    }
+    debug_msg("End not found");
+    return -1;
+}
+
+std::vector<exclusion_table::entry> exclusion_table::read_remote(pid_t pid, const std::vector<memory_map> &maps) {
+    debug_msg("Begin");
+    std::vector<entry> v_entries;
+
+    const void *remote_table = nullptr;
+    std::string name = std::string{"[anon:"} + mapping_name + "]";
+    for (auto &map : maps) {
+        if (name == map.pathname) {
+            remote_table = reinterpret_cast<const void *>(map.start_address);
+            break;
+        }
+    }
+    if (!remote_table) {
+        // Without named mappings use the address of this process, valid when the dumper was forked by the tracee
+        exclusion_table *ptr = nullptr;
+        auto ret = filesystem::remote_read(pid, const_cast<exclusion_table **>(&g_exclusion_table), &ptr, sizeof(ptr));
+        if (ret != sizeof(ptr) || ptr == nullptr) {
+            debug_msg("End no table");
+            return v_entries;
+        }
+        remote_table = ptr;
+    }
+
+    auto table = std::make_unique<exclusion_table>();
+    auto ret = filesystem::remote_read(pid, remote_table, table.get(), sizeof(exclusion_table));
+    if (ret != sizeof(exclusion_table) || std::memcmp(table->magic, default_magic, sizeof(default_magic)) != 0) {
+        debug_msg("End invalid table");
+        return v_entries;
+    }
+
+    uint32_t count = std::min<uint32_t>(table->count, capacity);
+    v_entries.assign(table->entries, table->entries + count);
+    std::sort(v_entries.begin(), v_entries.end(),
+              [](const entry &a, const entry &b) { return a.start_address < b.start_address; });
+
+    debug_msg("End " << v_entries.size() << " entries");
+    return v_entries;
+}
+
+}  // namespace RECK
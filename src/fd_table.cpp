@@ -0,0 +1,304 @@
+// #define DEBUG
+
+#include "fd_table.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/kcmp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
+
+namespace RECK {
+
+constexpr char memfd_prefix[] = "/memfd:";
+constexpr char deleted_suffix[] = " (deleted)";
+constexpr char pipe_prefix[] = "pipe:[";
+
+static bool starts_with(const std::string& s, const char* prefix) { return s.rfind(prefix, 0) == 0; }
+
+static bool ends_with(const std::string& s, const char* suffix) {
+    size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static int read_fdinfo(pid_t pid, int fd, fd_table::entry& e) {
+    std::ifstream fdinfo("/proc/" + std::to_string(pid) + "/fdinfo/" + std::to_string(fd));
+    if (!fdinfo) return -1;
+    std::string line;
+    while (std::getline(fdinfo, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "pos:") {
+            fields >> e.pos;
+        } else if (key == "flags:") {
+            fields >> std::oct >> e.flags;
+        }
+    }
+    return 0;
+}
+
+// Data queued in the pipe, copied with tee so the process still reads it
+static int pipe_data(const std::string& link, std::vector<char>& data) {
+    int src = ::open(link.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (src < 0) {
+        std::cerr << "Error opening pipe " << link << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(src); });
+    int p[2];
+    if (::pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) {
+        std::cerr << "Error pipe2 " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({
+        ::close(p[0]);
+        ::close(p[1]);
+    });
+    int size = ::fcntl(src, F_GETPIPE_SZ);
+    if (size > 0) ::fcntl(p[1], F_SETPIPE_SZ, size);
+    ssize_t n = ::tee(src, p[1], INT_MAX, SPLICE_F_NONBLOCK);
+    // An empty pipe has nothing to tee
+    if (n < 0 && errno == EAGAIN) return 0;
+    if (n < 0) {
+        std::cerr << "Error tee of pipe " << link << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    data.resize(n);
+    if (filesystem::read(p[0], data.data(), n) != n) {
+        std::cerr << "Error reading pipe data of " << link << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int fd_table::read_remote(pid_t pid, std::vector<file>& v_files) {
+    debug_msg("Begin");
+    v_files.clear();
+    std::string dir = "/proc/" + std::to_string(pid) + "/fd";
+    DIR* d = ::opendir(dir.c_str());
+    if (!d) {
+        std::cerr << "Error opening " << dir << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    std::vector<int> v_fds;
+    while (auto de = ::readdir(d)) {
+        if (de->d_name[0] != '.') v_fds.push_back(std::atoi(de->d_name));
+    }
+    ::closedir(d);
+    std::sort(v_fds.begin(), v_fds.end());
+
+    std::vector<dev_t> v_devs;
+    for (auto fd : v_fds) {
+        std::string link = dir + "/" + std::to_string(fd);
+        char path[PATH_MAX];
+        ssize_t n = ::readlink(link.c_str(), path, sizeof(path) - 1);
+        struct stat st;
+        if (n < 0 || ::stat(link.c_str(), &st) < 0) continue;
+        path[n] = '\0';
+
+        file f = {};
+        f.e.fd = fd;
+        f.e.dup_of = -1;
+        f.e.inode = st.st_ino;
+        f.path = path;
+        if (S_ISFIFO(st.st_mode) && starts_with(f.path, pipe_prefix)) {
+            f.e.type = FD_PIPE;
+        } else if (starts_with(f.path, memfd_prefix)) {
+            f.e.type = FD_MEMFD;
+        } else if (f.path[0] == '/' && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode) &&
+                   !ends_with(f.path, deleted_suffix)) {
+            f.e.type = FD_FILE;
+        } else {
+            debug_msg("Skipping fd " << fd << " " << f.path);
+            continue;
+        }
+        if (read_fdinfo(pid, fd, f.e) < 0) continue;
+        f.e.path_size = f.path.size();
+
+        // Same file, kcmp tells whether it is also the same open file description
+        for (size_t i = 0; i < v_files.size(); i++) {
+            if (v_devs[i] != st.st_dev || v_files[i].e.inode != f.e.inode) continue;
+            if (::syscall(SYS_kcmp, pid, pid, KCMP_FILE, v_files[i].e.fd, fd) == 0) {
+                f.e.dup_of = v_files[i].e.dup_of >= 0 ? v_files[i].e.dup_of : v_files[i].e.fd;
+                break;
+            }
+        }
+        v_files.push_back(std::move(f));
+        v_devs.push_back(st.st_dev);
+    }
+
+    // A pipe with one end outside the process cannot be connected again
+    std::map<uint64_t, int> pipe_ends;
+    for (auto& f : v_files) {
+        if (f.e.type == FD_PIPE) pipe_ends[f.e.inode] |= (f.e.flags & O_ACCMODE) == O_WRONLY ? 2 : 1;
+    }
+    v_files.erase(std::remove_if(v_files.begin(), v_files.end(),
+                                 [&](const file& f) { return f.e.type == FD_PIPE && pipe_ends[f.e.inode] != 3; }),
+                  v_files.end());
+
+    // The contents once per memfd or pipe
+    std::map<uint64_t, bool> saved;
+    for (auto& f : v_files) {
+        if (f.e.type == FD_FILE || saved[f.e.inode]) continue;
+        saved[f.e.inode] = true;
+        std::string link = dir + "/" + std::to_string(f.e.fd);
+        if (f.e.type == FD_PIPE) {
+            if (pipe_data(link, f.data) < 0) return -1;
+        } else {
+            int fd = ::open(link.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd < 0 || ::fstat(fd, &st) < 0) {
+                std::cerr << "Error opening memfd " << link << " " << strerror(errno) << std::endl;
+                if (fd >= 0) ::close(fd);
+                return -1;
+            }
+            defer({ ::close(fd); });
+            f.data.resize(st.st_size);
+            if (filesystem::read(fd, f.data.data(), f.data.size()) != static_cast<ssize_t>(f.data.size())) {
+                std::cerr << "Error reading memfd " << link << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
+        f.e.data_size = f.data.size();
+    }
+
+    debug_msg("End " << v_files.size() << " files");
+    return 0;
+}
+
+// Descriptor for the open file description of f, opened with O_CLOEXEC at the lowest free number
+static int open_file(const fd_table::file& f) {
+    int fd = -1;
+    if (f.e.type == fd_table::FD_FILE) {
+        int flags = (f.e.flags & ~(O_CREAT | O_EXCL | O_TRUNC | O_NOCTTY)) | O_CLOEXEC;
+        fd = ::open(f.path.c_str(), flags);
+    } else {
+        std::string name = f.path.substr(sizeof(memfd_prefix) - 1);
+        if (ends_with(name, deleted_suffix)) name.resize(name.size() - (sizeof(deleted_suffix) - 1));
+        fd = ::memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd >= 0 && filesystem::write(fd, f.data.data(), f.data.size()) != static_cast<ssize_t>(f.data.size())) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        std::cerr << "Error opening " << f.path << " for fd " << f.e.fd << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // Character devices like a tty have no offset
+    ::lseek(fd, f.e.pos, SEEK_SET);
+    return fd;
+}
+
+int fd_table::restore(const std::vector<file>& v_files, unsigned threads) {
+    debug_msg("Begin");
+    if (v_files.empty()) return 0;
+    int high = 0;
+    for (auto& f : v_files) high = std::max(high, f.e.fd + 1);
+
+    // Everything is opened above the restored numbers first, nothing opened here can take one of them
+    std::vector<int> v_src(v_files.size(), -1);
+    std::map<uint64_t, std::pair<int, int>> v_pipes;
+    std::map<uint64_t, size_t> first_memfd;
+    defer({
+        for (auto fd : v_src) {
+            if (fd >= 0) ::close(fd);
+        }
+        for (auto& [inode, ends] : v_pipes) {
+            if (ends.first >= 0) ::close(ends.first);
+            if (ends.second >= 0) ::close(ends.second);
+        }
+    });
+    auto move_high = [high](int fd) {
+        if (fd < 0) return fd;
+        int moved = ::fcntl(fd, F_DUPFD_CLOEXEC, high);
+        ::close(fd);
+        return moved;
+    };
+
+    std::vector<size_t> v_work;
+    for (size_t i = 0; i < v_files.size(); i++) {
+        auto& e = v_files[i].e;
+        if (e.dup_of >= 0) continue;
+        if (e.type == FD_FILE || (e.type == FD_MEMFD && first_memfd.emplace(e.inode, i).second)) {
+            v_work.push_back(i);
+        } else if (e.type == FD_PIPE && !v_pipes.count(e.inode)) {
+            int p[2];
+            if (::pipe2(p, O_CLOEXEC) < 0) {
+                std::cerr << "Error pipe " << strerror(errno) << std::endl;
+                return -1;
+            }
+            auto& ends = v_pipes[e.inode] = {move_high(p[0]), move_high(p[1])};
+            auto& data = v_files[i].data;
+            if (data.size() > 65536) ::fcntl(ends.second, F_SETPIPE_SZ, data.size());
+            if (ends.first < 0 || ends.second < 0 ||
+                filesystem::write(ends.second, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+                std::cerr << "Error refilling pipe of fd " << e.fd << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    // Opening can wait on slow file systems, the files are opened in parallel
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, v_work.size());
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> failed = false;
+    auto worker = [&]() {
+        for (size_t i = next++; i < v_work.size() && !failed; i = next++) {
+            v_src[v_work[i]] = move_high(open_file(v_files[v_work[i]]));
+            if (v_src[v_work[i]] < 0) failed = true;
+        }
+    };
+    std::vector<std::thread> v_threads;
+    for (unsigned i = 1; i < threads; i++) v_threads.emplace_back(worker);
+    worker();
+    for (auto& t : v_threads) t.join();
+    if (failed) {
+        return -1;
+    }
+
+    // In fd order, the description a dup shares is already in place
+    for (size_t i = 0; i < v_files.size(); i++) {
+        auto& e = v_files[i].e;
+        int src = v_src[i];
+        if (e.dup_of >= 0) {
+            src = e.dup_of;
+        } else if (e.type == FD_PIPE) {
+            auto& ends = v_pipes[e.inode];
+            src = (e.flags & O_ACCMODE) == O_WRONLY ? ends.second : ends.first;
+        } else if (e.type == FD_MEMFD && src < 0) {
+            // Another description of a memfd already created
+            std::string link = "/proc/self/fd/" + std::to_string(v_src[first_memfd[e.inode]]);
+            src = v_src[i] = move_high(::open(link.c_str(), (e.flags & O_ACCMODE) | O_CLOEXEC));
+            if (src >= 0) ::lseek(src, e.pos, SEEK_SET);
+        }
+        if (src < 0 || ::dup3(src, e.fd, (e.flags & O_CLOEXEC) ? O_CLOEXEC : 0) < 0) {
+            std::cerr << "Error restoring fd " << e.fd << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if (e.type == FD_PIPE && e.dup_of < 0) ::fcntl(e.fd, F_SETFL, e.flags & O_NONBLOCK);
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+}  // namespace RECK
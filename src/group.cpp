@@ -0,0 +1,333 @@
+// #define DEBUG
+
+#include "group.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <utility>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "maps_parser.hpp"
+#include "ptracer.hpp"
+
+namespace RECK {
+
+static int send_message(int fd, group_message::type kind, uint64_t bytes = 0, const std::string& path = {}) {
+    group_message msg = {};
+    msg.kind = kind;
+    msg.bytes = bytes;
+    path.copy(msg.path, sizeof(msg.path) - 1);
+    return ::send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+}
+
+static int receive_message(int fd, group_message& msg) {
+    ssize_t ret;
+    do {
+        ret = ::recv(fd, &msg, sizeof(msg), 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != sizeof(msg)) return -1;
+    msg.path[sizeof(msg.path) - 1] = '\0';
+    return 0;
+}
+
+static sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+group_coordinator::group_coordinator(std::string socket_path, std::vector<std::string> directories)
+    : m_socket_path(std::move(socket_path)), m_directories(std::move(directories)) {}
+
+group_coordinator::~group_coordinator() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        ::unlink(m_socket_path.c_str());
+    }
+}
+
+int group_coordinator::listen() {
+    debug_msg("Begin");
+    if (m_directories.empty() || m_socket_path.size() >= sizeof(sockaddr_un::sun_path)) {
+        std::cerr << "Error group coordinator needs a directory and a socket path shorter than "
+                  << sizeof(sockaddr_un::sun_path) << std::endl;
+        return -1;
+    }
+    // Directories on the same device share its queue
+    std::vector<dev_t> v_devs;
+    for (auto& dir : m_directories) {
+        struct stat st;
+        if (::stat(dir.c_str(), &st) < 0) {
+            std::cerr << "Error stat " << dir << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        auto it = std::find(v_devs.begin(), v_devs.end(), st.st_dev);
+        m_devices.push_back(it - v_devs.begin());
+        if (it == v_devs.end()) v_devs.push_back(st.st_dev);
+    }
+    m_device_count = v_devs.size();
+
+    m_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+        std::cerr << "Error socket " << strerror(errno) << std::endl;
+        return -1;
+    }
+    auto addr = socket_address(m_socket_path);
+    ::unlink(m_socket_path.c_str());
+    if (::bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(m_fd, SOMAXCONN) < 0) {
+        std::cerr << "Error listening on " << m_socket_path << " " << strerror(errno) << std::endl;
+        ::close(m_fd);
+        m_fd = -1;
+        return -1;
+    }
+    debug_msg("End");
+    return 0;
+}
+
+int group_coordinator::serve(size_t members) {
+    debug_msg("Begin " << members << " members");
+    struct member {
+        int fd;
+        std::string name;
+        uint64_t expected = 0;
+        size_t device = 0;
+        uint64_t granted = 0;
+        // Bytes asked for and not granted yet
+        uint64_t waiting = 0;
+        bool joined = false;
+        bool stopped = false;
+        bool done = false;
+    };
+    std::vector<member> v_members;
+    defer({
+        for (auto& m : v_members) ::close(m.fd);
+    });
+    // Member writing to every device, -1 when it is idle
+    std::vector<long> holders(m_device_count, -1);
+    enum { JOINING, STOPPING, DUMPING } phase = JOINING;
+    std::chrono::steady_clock::time_point stop_start;
+    m_stats.clear();
+
+    auto count = [&](bool member::*flag) {
+        return static_cast<size_t>(
+            std::count_if(v_members.begin(), v_members.end(), [flag](const member& m) { return m.*flag; }));
+    };
+    // The waiting member of the device with the fewest bytes left
+    auto schedule = [&](size_t device) {
+        if (holders[device] >= 0) return 0;
+        long next = -1;
+        for (size_t i = 0; i < v_members.size(); i++) {
+            auto& m = v_members[i];
+            if (m.device != device || m.waiting == 0) continue;
+            uint64_t left = m.expected > m.granted ? m.expected - m.granted : 0;
+            auto& best = v_members[next < 0 ? i : next];
+            if (next < 0 || left < (best.expected > best.granted ? best.expected - best.granted : 0)) next = i;
+        }
+        if (next < 0) return 0;
+        auto& m = v_members[next];
+        holders[device] = next;
+        m.granted += m.waiting;
+        if (send_message(m.fd, group_message::GRANT, std::exchange(m.waiting, 0)) < 0) return -1;
+        return 0;
+    };
+    auto abort = [&]() {
+        if (phase != DUMPING) {
+            for (auto& m : v_members) send_message(m.fd, group_message::ABORT);
+        }
+        std::cerr << "Error group of " << members << " members failed" << std::endl;
+        return -1;
+    };
+
+    while (count(&member::done) < members) {
+        std::vector<pollfd> v_pfds;
+        // A member that is done hangs up, it is not polled anymore
+        for (auto& m : v_members) v_pfds.push_back({m.done ? -1 : m.fd, POLLIN, 0});
+        if (v_members.size() < members) v_pfds.push_back({m_fd, POLLIN, 0});
+        if (::poll(v_pfds.data(), v_pfds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error poll " << strerror(errno) << std::endl;
+            return abort();
+        }
+        // Only the members polled, a member accepted now has nothing to read yet
+        size_t polled = v_members.size();
+        if (polled < members && (v_pfds.back().revents & POLLIN)) {
+            int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) v_members.push_back({fd, {}});
+        }
+
+        for (size_t i = 0; i < polled; i++) {
+            if (!v_pfds[i].revents) continue;
+            auto& m = v_members[i];
+            group_message msg;
+            if (receive_message(m.fd, msg) < 0) {
+                std::cerr << "Error member " << m.name << " of the group left" << std::endl;
+                return abort();
+            }
+            if (msg.kind == group_message::JOIN) {
+                m.name = msg.path;
+                m.expected = msg.bytes;
+                m.joined = true;
+            } else if (msg.kind == group_message::STOPPED) {
+                m.stopped = true;
+            } else if (msg.kind == group_message::REQUEST && phase == DUMPING) {
+                m.waiting = std::max<uint64_t>(msg.bytes, 1);
+                if (holders[m.device] == static_cast<long>(i)) holders[m.device] = -1;
+                if (schedule(m.device) < 0) return abort();
+            } else if (msg.kind == group_message::DONE && phase == DUMPING) {
+                m.done = true;
+                auto pause = std::chrono::steady_clock::now() - stop_start;
+                m_stats.push_back(
+                    {m.name, msg.bytes, std::chrono::duration_cast<std::chrono::milliseconds>(pause)});
+                if (holders[m.device] == static_cast<long>(i)) holders[m.device] = -1;
+                if (schedule(m.device) < 0) return abort();
+            } else {
+                std::cerr << "Error unexpected message " << msg.kind << " from member " << m.name << std::endl;
+                return abort();
+            }
+        }
+
+        if (phase == JOINING && count(&member::joined) == members) {
+            // Largest images first, each to the device with the fewest bytes so far
+            std::vector<size_t> order(v_members.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(),
+                      [&](size_t a, size_t b) { return v_members[a].expected > v_members[b].expected; });
+            std::vector<uint64_t> load(m_device_count, 0);
+            for (auto i : order) {
+                size_t dir = 0;
+                for (size_t d = 1; d < m_directories.size(); d++) {
+                    if (load[m_devices[d]] < load[m_devices[dir]]) dir = d;
+                }
+                v_members[i].device = m_devices[dir];
+                load[m_devices[dir]] += v_members[i].expected;
+                if (send_message(v_members[i].fd, group_message::GO, 0, m_directories[dir]) < 0) return abort();
+            }
+            phase = STOPPING;
+            stop_start = std::chrono::steady_clock::now();
+        }
+        if (phase == STOPPING && count(&member::stopped) == members) {
+            for (auto& m : v_members) {
+                if (send_message(m.fd, group_message::DUMP) < 0) return abort();
+            }
+            phase = DUMPING;
+        }
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+ssize_t group_checkpoint::dump_serialized_file(pid_t pid, const std::string& socket_path, const std::string& name,
+                                               const dump_options& options) {
+    debug_msg("Begin");
+    int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error socket " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(fd); });
+    auto addr = socket_address(socket_path);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "Error connecting to group coordinator " << socket_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    uint64_t expected = 0;
+    for (auto& map : maps_parser::get_maps(pid)) {
+        if (serializer::is_saved(map)) expected += map.size();
+    }
+    group_message msg;
+    if (send_message(fd, group_message::JOIN, expected, name) < 0 || receive_message(fd, msg) < 0 ||
+        msg.kind != group_message::GO) {
+        std::cerr << "Error joining the group of " << socket_path << std::endl;
+        return -1;
+    }
+    std::string file_path = std::string{msg.path} + "/" + name;
+
+    ptracer p{pid, options.stop};
+    if (p.init() < 0) {
+        std::cerr << "Error initiating ptracer for pid " << pid << std::endl;
+        return -1;
+    }
+    if (send_message(fd, group_message::STOPPED) < 0 || receive_message(fd, msg) < 0 ||
+        msg.kind != group_message::DUMP) {
+        std::cerr << "Error group of " << socket_path << " aborted" << std::endl;
+        return -1;
+    }
+
+    // Every write waits for its share of the device, granted a quantum at a time
+    std::mutex mutex;
+    uint64_t granted = 0;
+    bool lost = false;
+    dump_options member_options = options;
+    member_options.qos.admit = [&](size_t len) {
+        std::unique_lock lock(mutex);
+        if (lost || granted >= len) {
+            granted -= lost ? 0 : len;
+            return;
+        }
+        group_message grant;
+        if (send_message(fd, group_message::REQUEST, std::max(len, quantum)) < 0 || receive_message(fd, grant) < 0 ||
+            grant.kind != group_message::GRANT) {
+            std::cerr << "Warning: group coordinator lost, writing without it" << std::endl;
+            lost = true;
+            return;
+        }
+        granted += grant.bytes - len;
+    };
+    std::unique_ptr<durable_file> staged;
+    ssize_t ret = serializer::dump_process(pid, file_path, member_options, &p, {}, &staged);
+    if (ret < 0) {
+        std::cerr << "Error dumping pid " << pid << " to file " << file_path << std::endl;
+        return -1;
+    }
+    p.detach();
+    // A staged image is copied under the QoS limits once the member runs, its writes still go through admit
+    if (staged) {
+        if (staged->commit() < 0) {
+            std::cerr << "Error committing file " << file_path << std::endl;
+            return -1;
+        }
+        if (options.stats) *options.stats = staged->stats();
+    }
+
+    struct stat st;
+    uint64_t size = ::stat(file_path.c_str(), &st) == 0 ? st.st_size : 0;
+    if (send_message(fd, group_message::DONE, size, name) < 0) {
+        std::cerr << "Warning: group coordinator lost before the end of " << file_path << std::endl;
+    }
+    debug_msg("End");
+    return ret;
+}
+
+ssize_t group_checkpoint::make_checkpoint(const std::string& socket_path, const std::string& name,
+                                          const dump_options& options) {
+    debug_msg("Begin");
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Error fork " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (pid) {
+        ptracer::allow_pid();
+    } else {
+        int ret = dump_serialized_file(getppid(), socket_path, name, options);
+        exit(ret < 0 ? 1 : 0);
+    }
+    debug_msg("End");
+    return pid;
+}
+
+}  // namespace RECK
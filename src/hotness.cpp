@@ -0,0 +1,210 @@
+// #define DEBUG
+
+#include "hotness.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+constexpr const char* page_idle_path = "/sys/kernel/mm/page_idle/bitmap";
+constexpr uint64_t pagemap_present = 1UL << 63;
+constexpr uint64_t pagemap_soft_dirty = 1UL << 55;
+constexpr uint64_t pagemap_pfn_mask = (1UL << 55) - 1;
+constexpr size_t content_chunk = 1024 * 1024;
+
+static std::vector<uint64_t> read_pagemap(int fd, const memory_map& map, size_t page) {
+    std::vector<uint64_t> entries(map.size() / page);
+    off_t offset = (map.start_address / page) * sizeof(uint64_t);
+    auto ret = ::pread(fd, entries.data(), entries.size() * sizeof(uint64_t), offset);
+    if (ret != static_cast<ssize_t>(entries.size() * sizeof(uint64_t))) {
+        return {};
+    }
+    return entries;
+}
+
+static int write_clear_refs(pid_t pid, const char* value) {
+    std::string path = "/proc/" + std::to_string(pid) + "/clear_refs";
+    int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0) return -1;
+    auto ret = ::write(fd, value, std::strlen(value));
+    ::close(fd);
+    return ret < 0 ? -1 : 0;
+}
+
+bool hotness::soft_dirty_supported() {
+    static int supported = -1;
+    if (supported >= 0) return supported;
+
+    // A page of a new mapping is soft-dirty when the kernel tracks the bit at all, the bits of this process are
+    // left alone
+    supported = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+    void* addr = ::mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return supported;
+    defer({ ::munmap(addr, page); });
+    *static_cast<volatile char*>(addr) = 1;
+
+    int fd = ::open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) return supported;
+    uint64_t entry = 0;
+    if (::pread(fd, &entry, sizeof(entry), (reinterpret_cast<unsigned long>(addr) / page) * sizeof(entry)) ==
+        sizeof(entry)) {
+        supported = (entry & pagemap_soft_dirty) != 0;
+    }
+    ::close(fd);
+    return supported;
+}
+
+int hotness::clear_soft_dirty(pid_t pid) { return write_clear_refs(pid, "4"); }
+
+static uint64_t hash_page(const char* data, size_t len) {
+    // FNV-1a over 64 bit words
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+hotness::method hotness::best_method() {
+    if (::access(page_idle_path, R_OK | W_OK) == 0) return PAGE_IDLE;
+    return CONTENT;
+}
+
+std::vector<memory_map> hotness::sampled_maps(pid_t pid, bool only_writable) {
+    std::vector<memory_map> v_maps;
+    for (auto& map : maps_parser::get_maps(pid)) {
+        if (!(map.prot & PROT_READ)) continue;
+        if (only_writable && !(map.prot & PROT_WRITE)) continue;
+        if (map.pathname[0] == '[' && !std::strstr(map.pathname, "[heap]") && !std::strstr(map.pathname, "[stack]") &&
+            !std::strstr(map.pathname, "[anon"))
+            continue;
+        v_maps.push_back(map);
+    }
+    return v_maps;
+}
+
+std::vector<unsigned long> hotness::sample(pid_t pid, std::chrono::milliseconds window, method m) {
+    debug_msg("Begin");
+    trace_scope(HOT_SAMPLE, pid, window.count());
+    if (m == NONE) m = best_method();
+
+    std::vector<unsigned long> v_hot;
+    switch (m) {
+        case PAGE_IDLE:
+            v_hot = sample_page_idle(pid, window);
+            break;
+        case CONTENT:
+            v_hot = sample_content(pid, window);
+            break;
+        default:
+            break;
+    }
+    std::sort(v_hot.begin(), v_hot.end());
+
+    debug_msg("End " << v_hot.size() << " hot pages");
+    return v_hot;
+}
+
+std::vector<unsigned long> hotness::sample_page_idle(pid_t pid, std::chrono::milliseconds window) {
+    debug_msg("Begin");
+    std::vector<unsigned long> v_hot;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    std::string pagemap_path = "/proc/" + std::to_string(pid) + "/pagemap";
+    int pagemap_fd = ::open(pagemap_path.c_str(), O_RDONLY);
+    defer({
+        if (pagemap_fd >= 0) ::close(pagemap_fd);
+    });
+    int idle_fd = ::open(page_idle_path, O_RDWR);
+    defer({
+        if (idle_fd >= 0) ::close(idle_fd);
+    });
+    if (pagemap_fd < 0 || idle_fd < 0) {
+        std::cerr << "Error opening pagemap or page_idle " << strerror(errno) << std::endl;
+        return v_hot;
+    }
+
+    // Address of every resident page by pfn, and the idle bits to set grouped by bitmap word
+    std::vector<std::pair<uint64_t, unsigned long>> v_pages;
+    std::map<uint64_t, uint64_t> idle_words;
+    for (auto& map : sampled_maps(pid, false)) {
+        auto entries = read_pagemap(pagemap_fd, map, page);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!(entries[i] & pagemap_present)) continue;
+            uint64_t pfn = entries[i] & pagemap_pfn_mask;
+            if (pfn == 0) continue;
+            v_pages.emplace_back(pfn, map.start_address + i * page);
+            idle_words[pfn / 64] |= 1UL << (pfn % 64);
+        }
+    }
+    for (auto& [word, bits] : idle_words) {
+        ::pwrite(idle_fd, &bits, sizeof(bits), word * sizeof(bits));
+    }
+
+    std::this_thread::sleep_for(window);
+
+    // Accessed pages lose the idle bit
+    for (auto& [word, bits] : idle_words) {
+        if (::pread(idle_fd, &bits, sizeof(bits), word * sizeof(bits)) != sizeof(bits)) bits = ~0UL;
+    }
+    for (auto& [pfn, address] : v_pages) {
+        if (!(idle_words[pfn / 64] & (1UL << (pfn % 64)))) v_hot.push_back(address);
+    }
+
+    debug_msg("End");
+    return v_hot;
+}
+
+std::vector<unsigned long> hotness::sample_content(pid_t pid, std::chrono::milliseconds window) {
+    debug_msg("Begin");
+    std::vector<unsigned long> v_hot;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    auto v_maps = sampled_maps(pid, true);
+    std::vector<char> buffer(content_chunk);
+    auto hash_maps = [&](std::vector<uint64_t>& hashes) {
+        hashes.clear();
+        for (auto& map : v_maps) {
+            for (unsigned long address = map.start_address; address < map.end_address; address += content_chunk) {
+                size_t len = std::min<size_t>(content_chunk, map.end_address - address);
+                auto ret = filesystem::remote_read(pid, reinterpret_cast<void*>(address), buffer.data(), len);
+                for (size_t i = 0; i < len; i += page) {
+                    // Unreadable pages hash to 0 at both ends and are never hot
+                    hashes.push_back(ret == static_cast<ssize_t>(len) ? hash_page(buffer.data() + i, page) : 0);
+                }
+            }
+        }
+    };
+
+    std::vector<uint64_t> before, after;
+    hash_maps(before);
+    std::this_thread::sleep_for(window);
+    hash_maps(after);
+
+    size_t index = 0;
+    for (auto& map : v_maps) {
+        for (unsigned long address = map.start_address; address < map.end_address; address += page, index++) {
+            if (before[index] != after[index]) v_hot.push_back(address);
+        }
+    }
+
+    debug_msg("End");
+    return v_hot;
+}
+
+}  // namespace RECK
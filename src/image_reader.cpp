@@ -0,0 +1,333 @@
+// #define DEBUG
+
+#include "image_reader.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "page_codec.hpp"
+
+namespace RECK {
+
+image_reader::~image_reader() { close(); }
+
+int image_reader::open(const std::string_view &file_path) {
+    debug_msg("Begin");
+    close();
+
+    std::string file_path_str{file_path};
+
+    int fd = ::open(file_path_str.c_str(), O_RDONLY);
+    defer({
+        if (fd >= 0) ::close(fd);
+    });
+
+    if (fd < 0) {
+        std::cerr << "Error opening file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        std::cerr << "Error stat file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(serializer::header)) {
+        std::cerr << "Error file " << file_path << " is too small to be an image" << std::endl;
+        return -1;
+    }
+
+    void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mapping file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    m_image = static_cast<const char *>(addr);
+    m_size = st.st_size;
+    m_page_size = sysconf(_SC_PAGESIZE);
+
+    serializer::header h;
+    std::memcpy(&h, m_image, sizeof(h));
+    if (h.m_num != serializer::header::get_default_magic_num()) {
+        std::cerr << "Error magic number difers in header of file " << file_path << std::endl;
+        close();
+        return -1;
+    }
+
+    size_t offset = sizeof(h);
+    bool padded = false;
+    while (offset + sizeof(serializer::mdata) <= m_size) {
+        serializer::mdata md;
+        std::memcpy(&md, m_image + offset, sizeof(md));
+        if (md.offset != offset + sizeof(md) || md.size > m_size - md.offset) {
+            std::cerr << "Error corrupted entry " << md << " in file " << file_path << std::endl;
+            close();
+            return -1;
+        }
+        debug_msg(md);
+        bool aligned = std::exchange(padded, md.type == serializer::mdata_type::PADDING);
+
+        if (md.type == serializer::mdata_type::REGS && md.size == sizeof(user_regs_struct)) {
+            m_regs.emplace_back(reinterpret_cast<const user_regs_struct *>(m_image + md.offset));
+        } else if (md.type == serializer::mdata_type::FPREGS && md.size == sizeof(user_fpregs_struct)) {
+            m_fpregs.emplace_back(reinterpret_cast<const user_fpregs_struct *>(m_image + md.offset));
+        } else if (md.type == serializer::mdata_type::MEMORY_MAP && md.size >= sizeof(memory_map)) {
+            auto map = reinterpret_cast<const memory_map *>(m_image + md.offset);
+            if (md.size - sizeof(memory_map) != map->end_address - map->start_address) {
+                std::cerr << "Error region size differs from entry " << md << " in file " << file_path << std::endl;
+                close();
+                return -1;
+            }
+            m_regions.push_back({map, {m_image + md.offset + sizeof(memory_map), md.size - sizeof(memory_map)},
+                                 nullptr, {}, false, aligned, {}});
+        } else if ((md.type == serializer::mdata_type::SPARSE_MAP || md.type == serializer::mdata_type::DELTA_MAP ||
+                    md.type == serializer::mdata_type::XOR_MAP) &&
+                   md.size >= sizeof(memory_map)) {
+            auto map = reinterpret_cast<const memory_map *>(m_image + md.offset);
+            size_t pages = (map->end_address - map->start_address) / m_page_size;
+            size_t words = serializer::page_bitmap_words(pages);
+            size_t header = sizeof(memory_map) + words * sizeof(uint64_t);
+            bool xor_map = md.type == serializer::mdata_type::XOR_MAP;
+            region r = {map, {}, reinterpret_cast<const uint64_t *>(m_image + md.offset + sizeof(memory_map)), {},
+                        md.type != serializer::mdata_type::SPARSE_MAP, aligned, {}};
+            size_t saved = 0;
+            if (md.size >= header) {
+                r.rank.resize(words);
+                for (size_t i = 0; i < words; i++) {
+                    r.rank[i] = saved;
+                    saved += __builtin_popcountl(r.bitmap[i]);
+                }
+            }
+            // Stored sizes of the pages, then their data
+            size_t data_size = saved * m_page_size;
+            if (xor_map && md.size >= header && md.size - header >= saved * sizeof(uint32_t)) {
+                auto sizes = m_image + md.offset + header;
+                header += saved * sizeof(uint32_t);
+                r.offsets.resize(saved + 1);
+                data_size = 0;
+                for (size_t i = 0; i < saved; i++) {
+                    uint32_t size;
+                    std::memcpy(&size, sizes + i * sizeof(size), sizeof(size));
+                    if (size > m_page_size) {
+                        std::cerr << "Error page larger than a page in entry " << md << " in file " << file_path
+                                  << std::endl;
+                        close();
+                        return -1;
+                    }
+                    r.offsets[i] = data_size;
+                    data_size += size;
+                }
+                r.offsets[saved] = data_size;
+            }
+            if (md.size < header || md.size - header != data_size) {
+                std::cerr << "Error sparse region size differs from entry " << md << " in file " << file_path
+                          << std::endl;
+                close();
+                return -1;
+            }
+            r.data = {m_image + md.offset + header, md.size - header};
+            m_regions.push_back(std::move(r));
+        } else if (md.type == serializer::mdata_type::HOT_PAGES) {
+            m_hot_pages = {reinterpret_cast<const unsigned long *>(m_image + md.offset),
+                           md.size / sizeof(unsigned long)};
+        } else if (md.type == serializer::mdata_type::PARENT) {
+            m_parent = {m_image + md.offset, md.size};
+        } else if (md.type == serializer::mdata_type::STRIPE_SET) {
+            m_striped = true;
+        }
+        m_mdata.push_back(md);
+        offset = md.offset + md.size;
+    }
+
+    std::sort(m_regions.begin(), m_regions.end(),
+              [](const region &a, const region &b) { return a.start() < b.start(); });
+
+    debug_msg("End");
+    return 0;
+}
+
+void image_reader::close() {
+    if (m_image) {
+        ::munmap(const_cast<char *>(m_image), m_size);
+    }
+    m_image = nullptr;
+    m_size = 0;
+    m_mdata.clear();
+    m_regs.clear();
+    m_fpregs.clear();
+    m_regions.clear();
+    m_hot_pages = {};
+    m_parent = {};
+    m_striped = false;
+}
+
+span<char> image_reader::payload(const serializer::mdata &md) const {
+    if (!m_image || md.offset > m_size || md.size > m_size - md.offset) {
+        return {};
+    }
+    return {m_image + md.offset, md.size};
+}
+
+const image_reader::region *image_reader::find(unsigned long address) const {
+    auto it = std::upper_bound(m_regions.begin(), m_regions.end(), address,
+                               [](unsigned long addr, const region &r) { return addr < r.start(); });
+    if (it == m_regions.begin()) {
+        return nullptr;
+    }
+    --it;
+    if (address >= it->end()) {
+        return nullptr;
+    }
+    return &(*it);
+}
+
+ssize_t image_reader::region::saved_index(size_t page) const {
+    if (!bitmap) return page;
+    uint64_t word = bitmap[page / 64];
+    uint64_t bit = 1UL << (page % 64);
+    if (!(word & bit)) return -1;
+    return rank[page / 64] + __builtin_popcountl(word & (bit - 1));
+}
+
+const char *image_reader::at(unsigned long address) const {
+    auto page = stored(address);
+    if (page.size() != m_page_size) {
+        return nullptr;
+    }
+    return page.data() + address % m_page_size;
+}
+
+span<char> image_reader::stored(unsigned long address) const {
+    auto r = find(address);
+    if (!r) {
+        return {};
+    }
+    auto index = r->saved_index((address - r->start()) / m_page_size);
+    if (index < 0) {
+        return {};
+    }
+    if (r->offsets.empty()) {
+        return {r->data.data() + index * m_page_size, m_page_size};
+    }
+    return {r->data.data() + r->offsets[index], r->offsets[index + 1] - r->offsets[index]};
+}
+
+std::vector<std::string> image_chain::resolve(const std::string_view &file_path) {
+    debug_msg("Begin");
+    std::vector<std::string> v_paths{std::string{file_path}};
+    while (true) {
+        image_reader reader;
+        if (reader.open(v_paths.back()) < 0) {
+            return {};
+        }
+        if (!reader.is_delta()) break;
+
+        std::string parent{reader.parent()};
+        if (parent[0] != '/') {
+            auto slash = v_paths.back().rfind('/');
+            if (slash != std::string::npos) parent = v_paths.back().substr(0, slash + 1) + parent;
+        }
+        if (std::find(v_paths.begin(), v_paths.end(), parent) != v_paths.end()) {
+            std::cerr << "Error loop in the parents of image " << file_path << std::endl;
+            return {};
+        }
+        v_paths.push_back(parent);
+    }
+    std::reverse(v_paths.begin(), v_paths.end());
+    debug_msg("End " << v_paths.size() << " images");
+    return v_paths;
+}
+
+int image_chain::open(const std::string_view &file_path) {
+    auto v_paths = resolve(file_path);
+    if (v_paths.empty()) {
+        return -1;
+    }
+    return open(v_paths);
+}
+
+int image_chain::open(const std::vector<std::string> &v_paths) {
+    debug_msg("Begin");
+    m_images.clear();
+    for (auto &path : v_paths) {
+        auto reader = std::make_unique<image_reader>();
+        if (reader->open(path) < 0) {
+            m_images.clear();
+            return -1;
+        }
+        if (reader->is_striped()) {
+            std::cerr << "Error image " << path << " is striped, its pages are not in the image" << std::endl;
+            m_images.clear();
+            return -1;
+        }
+        m_images.push_back(std::move(reader));
+    }
+    debug_msg("End");
+    return m_images.empty() ? -1 : 0;
+}
+
+const char *image_chain::page(unsigned long address, char *buffer) const {
+    if (m_images.empty()) {
+        return nullptr;
+    }
+    return page(m_images.size() - 1, address, buffer);
+}
+
+const char *image_chain::page(size_t level, unsigned long address, char *buffer) const {
+    for (size_t i = level + 1; i-- > 0;) {
+        auto &reader = *m_images[i];
+        auto r = reader.find(address);
+        if (!r) {
+            return nullptr;
+        }
+        auto stored = reader.stored(address);
+        if (stored.empty()) {
+            if (!r->delta) return nullptr;
+            continue;
+        }
+        size_t page_size = reader.page_size();
+        if (stored.size() == page_size) {
+            return stored.data();
+        }
+        // The base page is resolved into buffer first, older deltas decode on top of it
+        const char *base = i > 0 ? page(i - 1, address, buffer) : nullptr;
+        if (!base) {
+            std::memset(buffer, 0, page_size);
+        } else if (base != buffer) {
+            std::memcpy(buffer, base, page_size);
+        }
+        if (!page_codec::decode(stored.data(), stored.size(), buffer, page_size)) {
+            std::cerr << "Error corrupted XOR page 0x" << std::hex << address << std::dec << std::endl;
+            std::memset(buffer, 0, page_size);
+        }
+        return buffer;
+    }
+    return nullptr;
+}
+
+bool image_chain::saved(unsigned long address) const {
+    for (auto it = m_images.rbegin(); it != m_images.rend(); ++it) {
+        auto r = (*it)->find(address);
+        if (!r) {
+            return false;
+        }
+        if (!(*it)->stored(address).empty()) {
+            return true;
+        }
+        if (!r->delta) {
+            return false;
+        }
+    }
+    return false;
+}
+
+}  // namespace RECK
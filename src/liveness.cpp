@@ -0,0 +1,130 @@
+// #define DEBUG
+
+#include "liveness.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "debug.hpp"
+#include "filesystem.hpp"
+
+namespace RECK {
+
+// glibc malloc chunk layout on x86_64: prev_size, size with its flag bits, then fd, bk, fd_nextsize and
+// bk_nextsize while the chunk is free
+constexpr unsigned long chunk_prev_inuse = 0x1;
+constexpr unsigned long chunk_is_mmapped = 0x2;
+constexpr unsigned long chunk_flags = 0x7;
+constexpr unsigned long chunk_min_size = 32;
+constexpr unsigned long chunk_alignment = 16;
+constexpr unsigned long chunk_header = 2 * sizeof(unsigned long);
+constexpr unsigned long free_chunk_header = 6 * sizeof(unsigned long);
+constexpr size_t heap_window = 64 * 1024;
+
+// Whole pages of [start, end)
+static void add_dead(std::vector<exclusion_table::entry>& v_dead, unsigned long start, unsigned long end,
+                     unsigned long page) {
+    start = (start + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (start < end) v_dead.push_back({start, end, exclusion_table::DEAD});
+}
+
+std::vector<exclusion_table::entry> liveness::dead_stacks(const std::vector<memory_map>& maps,
+                                                          const std::vector<user_regs_struct>& v_regs) {
+    debug_msg("Begin");
+    std::vector<exclusion_table::entry> v_dead;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < maps.size(); i++) {
+        auto& map = maps[i];
+        bool stack = std::strstr(map.pathname, "[stack]") != nullptr;
+        bool guarded = map.pathname[0] == '\0' && map.inode == 0 && (map.flags & MAP_PRIVATE) &&
+                       map.prot == (PROT_READ | PROT_WRITE) && i > 0 && maps[i - 1].end_address == map.start_address &&
+                       maps[i - 1].prot == PROT_NONE;
+        if (!stack && !guarded) continue;
+
+        // Lowest stack pointer in the mapping, two threads never share a stack but nothing is trimmed above it
+        unsigned long lowest = 0;
+        for (auto& regs : v_regs) {
+            if (regs.rsp < map.start_address || regs.rsp >= map.end_address) continue;
+            if (lowest == 0 || regs.rsp < lowest) lowest = regs.rsp;
+        }
+        if (lowest < map.start_address + red_zone) continue;
+        add_dead(v_dead, map.start_address, lowest - red_zone, page);
+    }
+
+    debug_msg("End " << v_dead.size() << " stacks");
+    return v_dead;
+}
+
+std::vector<exclusion_table::entry> liveness::free_chunks(pid_t pid, const std::vector<memory_map>& maps) {
+    debug_msg("Begin");
+    std::vector<exclusion_table::entry> v_dead;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    auto heap = std::find_if(maps.begin(), maps.end(),
+                             [](const memory_map& map) { return std::strstr(map.pathname, "[heap]") != nullptr; });
+    if (heap == maps.end() || heap->prot != (PROT_READ | PROT_WRITE)) {
+        debug_msg("End no heap");
+        return v_dead;
+    }
+    unsigned long start = heap->start_address;
+    unsigned long end = heap->end_address;
+
+    // The headers are read through a window of the heap instead of a syscall per chunk
+    std::vector<char> window(heap_window);
+    unsigned long window_start = 0, window_end = 0;
+    auto read_size = [&](unsigned long chunk, unsigned long& size) {
+        unsigned long address = chunk + sizeof(unsigned long);
+        if (address < window_start || address + sizeof(size) > window_end) {
+            size_t len = std::min<size_t>(heap_window, end - address);
+            if (filesystem::remote_read(pid, reinterpret_cast<void*>(address), window.data(), len) !=
+                static_cast<ssize_t>(len)) {
+                return false;
+            }
+            window_start = address;
+            window_end = address + len;
+        }
+        std::memcpy(&size, window.data() + (address - window_start), sizeof(size));
+        return true;
+    };
+
+    std::vector<exclusion_table::entry> v_chunks;
+    unsigned long chunk = start;
+    unsigned long size = 0;
+    if (end - start < chunk_header || !read_size(chunk, size)) {
+        debug_msg("End heap too small");
+        return v_dead;
+    }
+    while (true) {
+        unsigned long chunk_size = size & ~chunk_flags;
+        if (chunk_size < chunk_min_size || chunk_size % chunk_alignment || chunk_size > end - chunk ||
+            (size & chunk_is_mmapped)) {
+            debug_msg("End not a glibc heap at " << std::hex << chunk << std::dec);
+            return v_dead;
+        }
+        unsigned long next = chunk + chunk_size;
+        if (next == end) {
+            // The top chunk, only its header is live
+            add_dead(v_chunks, chunk + chunk_header, end, page);
+            break;
+        }
+        unsigned long next_size = 0;
+        if (end - next < chunk_header || !read_size(next, next_size)) {
+            debug_msg("End truncated chunk at " << std::hex << next << std::dec);
+            return v_dead;
+        }
+        // A free chunk keeps its links and its size is repeated in the prev_size of the next one
+        if (!(next_size & chunk_prev_inuse)) add_dead(v_chunks, chunk + free_chunk_header, next, page);
+        chunk = next;
+        size = next_size;
+    }
+    v_dead = std::move(v_chunks);
+
+    debug_msg("End " << v_dead.size() << " free chunks");
+    return v_dead;
+}
+
+}  // namespace RECK
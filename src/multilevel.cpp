@@ -0,0 +1,205 @@
+// #define DEBUG
+
+#include "multilevel.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "durable_file.hpp"
+#include "filesystem.hpp"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+static std::string tier_path(const storage_tier& tier, const std::string_view& name) {
+    return tier.directory + "/" + std::string{name};
+}
+
+ssize_t multilevel::make_checkpoint(const std::vector<storage_tier>& tiers, const std::string_view& name) {
+    debug_msg("Begin");
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Error fork " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (pid) {
+        ptracer::allow_pid();
+    } else {
+        pid_t tracee = getppid();
+        int ret = multilevel::dump_serialized_file(tracee, tiers, name);
+        if (ret < 0) {
+            std::cerr << "Error dumping checkpoint " << name << std::endl;
+        }
+        exit(0);
+    }
+    debug_msg("End");
+    return 0;
+}
+
+ssize_t multilevel::dump_serialized_file(pid_t pid, const std::vector<storage_tier>& tiers,
+                                         const std::string_view& name) {
+    ssize_t ret = 0;
+    debug_msg("Begin");
+
+    if (tiers.empty()) {
+        std::cerr << "Error no storage tiers for checkpoint " << name << std::endl;
+        return -1;
+    }
+    for (auto& tier : tiers) {
+        std::error_code ec;
+        std::filesystem::create_directories(tier.directory, ec);
+        if (ec) {
+            std::cerr << "Error creating tier directory " << tier.directory << " " << ec.message() << std::endl;
+            return -1;
+        }
+    }
+
+    // The image is only visible with its name once it is complete, so a copy found by name is valid
+    std::string fast_path = tier_path(tiers[0], name);
+    dump_options options;
+    options.durable = true;
+    options.writeback_window = 0;
+    ret = serializer::dump_serialized_file(pid, fast_path, options);
+    if (ret < 0) {
+        return ret;
+    }
+    // From here the tracee is already running again
+    apply_retention(tiers[0], name);
+
+    for (size_t i = 1; i < tiers.size(); i++) {
+        std::string path = tier_path(tiers[i], name);
+        if (drain(fast_path, path) < 0) {
+            std::cerr << "Error draining " << fast_path << " to " << path << std::endl;
+            return -1;
+        }
+        apply_retention(tiers[i], name);
+    }
+
+    debug_msg("End");
+    return ret;
+}
+
+int multilevel::drain(const std::string& src_path, const std::string& dst_path) {
+    debug_msg("Begin " << src_path << " -> " << dst_path);
+    trace_scope(TIER_DRAIN);
+
+    int fd_in = ::open(src_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_in < 0) {
+        std::cerr << "Error opening file " << src_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(fd_in); });
+    struct stat st;
+    if (::fstat(fd_in, &st) < 0) {
+        std::cerr << "Error stat file " << src_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // Same commit as a durable dump, the copy only gets its name once it is on the disk
+    durable_file out{dst_path, true, 0};
+    if (out.open() < 0) {
+        return -1;
+    }
+    out.preallocate(st.st_size);
+    auto ret = filesystem::copy(fd_in, out.fd(), st.st_size);
+    if (ret != st.st_size) {
+        std::cerr << "Error copying " << src_path << " to " << dst_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (out.commit() < 0) {
+        return -1;
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+// Images of the same checkpoint series as name differ from it only in the digits at the end of the stem, like
+// app.0001.reck and app.0002.reck
+static bool same_series(const std::string& file_name, const std::string_view& name) {
+    auto dot = name.rfind('.');
+    std::string_view stem = name.substr(0, dot);
+    std::string_view extension = dot == std::string_view::npos ? std::string_view{} : name.substr(dot);
+    size_t prefix = stem.find_last_not_of("0123456789") + 1;
+    std::string_view file_sv = file_name;
+    if (file_sv.size() < prefix + extension.size() || file_sv.substr(0, prefix) != stem.substr(0, prefix) ||
+        file_sv.substr(file_sv.size() - extension.size()) != extension) {
+        return false;
+    }
+    auto digits = file_sv.substr(prefix, file_sv.size() - extension.size() - prefix);
+    return digits.find_first_not_of("0123456789") == std::string_view::npos;
+}
+
+int multilevel::apply_retention(const storage_tier& tier, const std::string_view& keep) {
+    debug_msg("Begin " << tier.directory);
+    if (tier.retention == 0) return 0;
+
+    // Only the images of this checkpoint, stripes, other images and any other file in the directory stay
+    namespace fs = std::filesystem;
+    std::vector<fs::directory_entry> v_images;
+    std::error_code ec;
+    for (const fs::directory_entry& dir_entry : fs::directory_iterator(tier.directory, ec)) {
+        if (!dir_entry.is_regular_file(ec)) continue;
+        if (!same_series(dir_entry.path().filename(), keep)) continue;
+        image_reader reader;
+        if (reader.open(dir_entry.path().string()) < 0 || reader.regs().empty()) continue;
+        v_images.emplace_back(dir_entry);
+    }
+    if (v_images.size() <= tier.retention) return 0;
+
+    // Newest first
+    std::sort(v_images.begin(), v_images.end(), [](const fs::directory_entry& a, const fs::directory_entry& b) {
+        std::error_code ec;
+        return a.last_write_time(ec) > b.last_write_time(ec);
+    });
+    size_t kept = 1;  // the image just written
+    for (auto& image : v_images) {
+        if (image.path().filename() == keep) continue;
+        if (kept < tier.retention) {
+            kept++;
+            continue;
+        }
+        debug_msg("Removing " << image.path());
+        fs::remove(image.path(), ec);
+    }
+
+    debug_msg("End");
+    return 0;
+}
+
+std::string multilevel::find_checkpoint(const std::vector<storage_tier>& tiers, const std::string_view& name) {
+    debug_msg("Begin");
+    for (auto& tier : tiers) {
+        std::string path = tier_path(tier, name);
+        if (::access(path.c_str(), R_OK) < 0) continue;
+        image_reader reader;
+        if (reader.open(path) < 0 || reader.regs().empty() || reader.regions().empty()) {
+            std::cerr << "Warning: skipping invalid copy " << path << std::endl;
+            continue;
+        }
+        debug_msg("Found " << path);
+        return path;
+    }
+    debug_msg("End");
+    return {};
+}
+
+ssize_t multilevel::restore_serialized_file(const std::vector<storage_tier>& tiers, const std::string_view& name) {
+    auto path = find_checkpoint(tiers, name);
+    if (path.empty()) {
+        std::cerr << "Error no valid copy of checkpoint " << name << " in any tier" << std::endl;
+        return -1;
+    }
+    return serializer::restore_serialized_file(path);
+}
+
+}  // namespace RECK
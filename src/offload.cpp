@@ -0,0 +1,650 @@
+// #define DEBUG
+
+#include "offload.hpp"
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
+#include "hotness.hpp"
+#include "maps_parser.hpp"
+#include "ptracer.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+// Regions whose pages can be dropped and faulted in again with userfaultfd
+static bool can_offload(const memory_map& map) {
+    return (map.flags & MAP_PRIVATE) && map.inode == 0 && (map.prot & PROT_READ) && (map.prot & PROT_WRITE) &&
+           serializer::is_saved(map) && !std::strstr(map.pathname, "[stack");
+}
+
+// Dropped pages of a backing as the guardian sees them
+struct guard_entry {
+    uint64_t id;
+    unsigned long start;
+    size_t len;
+    unsigned long image;
+};
+
+// Event read from the userfaultfd of a backing, child is the id given to the backing of a fork
+struct journal_entry {
+    uint64_t id;
+    uint64_t child;
+    uffd_msg msg;
+};
+
+// Two copies of the dropped pages, publish fills the one of the next version and then switches to it, so the
+// guardian always finds a complete one. The events read since the version journal_base are kept in the journal,
+// right after the read, and the guardian replays them on that version. The entries of both copies follow the state
+// in the shared mapping
+struct cold_offload::guard_state {
+    static constexpr size_t capacity = 1024 * 1024;
+    static constexpr size_t journal_capacity = 1024;
+    static constexpr uint64_t disarmed = UINT64_MAX;
+    static constexpr uint64_t image = UINT64_MAX - 1;
+
+    // The image as drop mapped it, the guardian does not recall from an image written again since
+    off_t image_size = 0;
+    timespec image_mtime = {};
+    std::atomic<uint64_t> version = 0;
+    size_t count[2] = {};
+    std::atomic<uint64_t> journal_base = 0;
+    std::atomic<size_t> journal_count = 0;
+    journal_entry journal[journal_capacity] = {};
+
+    static size_t mapping_size() { return sizeof(guard_state) + 2 * capacity * sizeof(guard_entry); }
+    guard_entry* entries(uint64_t version) {
+        return reinterpret_cast<guard_entry*>(this + 1) + (version % 2) * capacity;
+    }
+};
+
+cold_offload::cold_offload(pid_t pid) : m_pid(pid) {}
+
+cold_offload::~cold_offload() {
+    recall();
+    if (m_pidfd >= 0) ::close(m_pidfd);
+}
+
+int cold_offload::guard() {
+    debug_msg("Begin");
+    if (m_state || !m_backings.empty()) {
+        std::cerr << "Error the guardian of pid " << m_pid << " has to be forked once, before drop" << std::endl;
+        return -1;
+    }
+    void* addr = ::mmap(nullptr, guard_state::mapping_size(), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mmap of the guardian state " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        std::cerr << "Error socketpair " << strerror(errno) << std::endl;
+        ::munmap(addr, guard_state::mapping_size());
+        return -1;
+    }
+    m_state = new (addr) guard_state{};
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        std::cerr << "Error fork of the guardian " << strerror(errno) << std::endl;
+        ::close(sv[0]);
+        ::close(sv[1]);
+        ::munmap(m_state, guard_state::mapping_size());
+        m_state = nullptr;
+        return -1;
+    }
+    if (pid == 0) {
+        ::close(sv[0]);
+        run_guardian(sv[1]);
+    }
+    ::close(sv[1]);
+    m_guard_fd = sv[0];
+    m_guardian = pid;
+    debug_msg("End guardian " << pid);
+    return 0;
+}
+
+void cold_offload::run_guardian(int sock) {
+    // Out of the session of the offload, a signal for its terminal does not end the guardian with it
+    ::setsid();
+    std::map<uint64_t, int> fds;
+    int image_fd = -1;
+    for (;;) {
+        uint64_t id;
+        iovec iov = {&id, sizeof(id)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        // The offload is gone without disarm
+        if (n <= 0) break;
+        if (id == guard_state::disarmed) ::_exit(0);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && id == guard_state::image) {
+            // Mapped now, the path may name another image later
+            std::memcpy(&image_fd, CMSG_DATA(c), sizeof(int));
+            if (m_reader.open("/proc/self/fd/" + std::to_string(image_fd)) < 0) ::_exit(1);
+        } else if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fds[id], CMSG_DATA(c), sizeof(int));
+        } else if (auto it = fds.find(id); it != fds.end()) {
+            ::close(it->second);
+            fds.erase(it);
+        }
+    }
+
+    uint64_t version = m_state->version.load(std::memory_order_acquire);
+    std::map<uint64_t, backing*> v_backings;
+    for (size_t i = 0; i < m_state->count[version % 2]; i++) {
+        auto& e = m_state->entries(version)[i];
+        auto fd = fds.find(e.id);
+        if (fd == fds.end()) continue;
+        auto& b = v_backings[e.id];
+        if (!b) b = &m_backings.emplace_back(backing{fd->second, e.id, {}});
+        b->extents[e.start] = {e.len, e.image};
+    }
+    // The events the offload read after that version, a journal of an older version is already in it
+    size_t events = m_state->journal_count.load(std::memory_order_acquire);
+    if (m_state->journal_base.load(std::memory_order_acquire) != version) events = 0;
+    for (size_t i = 0; i < events; i++) {
+        auto& j = m_state->journal[i];
+        auto b = v_backings.find(j.id);
+        if (b == v_backings.end()) continue;
+        auto fd = fds.find(j.child);
+        if (j.msg.event == UFFD_EVENT_FORK && fd != fds.end()) {
+            v_backings[j.child] = &m_backings.emplace_back(backing{fd->second, j.child, b->second->extents});
+        } else if (j.msg.event != UFFD_EVENT_FORK) {
+            follow(*b->second, j.msg);
+        }
+    }
+    for (auto [id, fd] : fds) {
+        if (!v_backings.count(id)) ::close(fd);
+    }
+    std::cerr << "Warning: the offload of pid " << m_pid << " died, its guardian recalls " << v_backings.size()
+              << " userfaultfds" << std::endl;
+
+    struct stat st;
+    if (!m_backings.empty() &&
+        (image_fd < 0 || ::fstat(image_fd, &st) < 0 || st.st_size != m_state->image_size ||
+         st.st_mtim.tv_sec != m_state->image_mtime.tv_sec || st.st_mtim.tv_nsec != m_state->image_mtime.tv_nsec)) {
+        // The pages of another image would be worse than zero pages
+        std::cerr << "Error the image of pid " << m_pid << " changed since the drop, the dropped pages are lost"
+                  << std::endl;
+        ::_exit(1);
+    }
+    int ret = m_backings.empty() ? 0 : recall();
+    ::_exit(ret < 0 ? 1 : 0);
+}
+
+void cold_offload::tell_guardian(uint64_t id, int fd) {
+    if (m_guard_fd < 0) return;
+    iovec iov = {&id, sizeof(id)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+    }
+    if (::sendmsg(m_guard_fd, &msg, MSG_NOSIGNAL) < 0) {
+        std::cerr << "Warning: the guardian of pid " << m_pid << " is gone " << strerror(errno) << std::endl;
+        ::close(m_guard_fd);
+        m_guard_fd = -1;
+    }
+}
+
+void cold_offload::publish() {
+    if (!m_state) return;
+    uint64_t version = m_state->version.load(std::memory_order_relaxed) + 1;
+    guard_entry* entries = m_state->entries(version);
+    size_t n = 0;
+    for (auto& b : m_backings) {
+        for (auto& [start, e] : b.extents) {
+            if (n == guard_state::capacity) break;
+            entries[n++] = {b.id, start, e.len, e.image};
+        }
+    }
+    if (n == guard_state::capacity) {
+        std::cerr << "Warning: the guardian of pid " << m_pid << " only keeps " << n << " dropped runs" << std::endl;
+    }
+    m_state->count[version % 2] = n;
+    m_state->version.store(version, std::memory_order_release);
+    m_state->journal_count.store(0, std::memory_order_relaxed);
+    m_state->journal_base.store(version, std::memory_order_release);
+}
+
+void cold_offload::journal(const backing& b, const uffd_msg* msgs, size_t count, uint64_t* child_ids) {
+    for (size_t i = 0; i < count; i++) child_ids[i] = msgs[i].event == UFFD_EVENT_FORK ? m_next_id++ : 0;
+    if (!m_state) return;
+    size_t n = m_state->journal_count.load(std::memory_order_relaxed);
+    if (n + count > guard_state::journal_capacity) {
+        // Everything read before is applied, a new version takes it
+        publish();
+        n = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (msgs[i].event != UFFD_EVENT_PAGEFAULT) m_state->journal[n++] = {b.id, child_ids[i], msgs[i]};
+    }
+    m_state->journal_count.store(n, std::memory_order_release);
+}
+
+void cold_offload::follow(backing& b, const uffd_msg& msg) {
+    if (msg.event == UFFD_EVENT_REMAP) {
+        auto remap = msg.arg.remap;
+        for (auto& [start, e] : erase(b, remap.from, remap.len)) b.extents[start - remap.from + remap.to] = e;
+    } else if (msg.event == UFFD_EVENT_REMOVE || msg.event == UFFD_EVENT_UNMAP) {
+        erase(b, msg.arg.remove.start, msg.arg.remove.end - msg.arg.remove.start);
+    }
+}
+
+void cold_offload::disarm() {
+    if (m_guardian < 0) return;
+    tell_guardian(guard_state::disarmed, -1);
+    if (m_guard_fd >= 0) ::close(m_guard_fd);
+    ::waitpid(m_guardian, nullptr, 0);
+    ::munmap(m_state, guard_state::mapping_size());
+    m_guard_fd = -1;
+    m_guardian = -1;
+    m_state = nullptr;
+}
+
+int cold_offload::drop(const std::string& image_path, const std::vector<unsigned long>& hot, bool accept_loss) {
+    debug_msg("Begin");
+    trace_scope(OFFLOAD, m_pid);
+    if (!accept_loss && !m_state) {
+        std::cerr << "Error the dropped pages of pid " << m_pid << " read as zero if the offload dies before recall, "
+                  << "drop needs a guardian or accept_loss" << std::endl;
+        return -1;
+    }
+    if (!m_backings.empty()) {
+        std::cerr << "Error pid " << m_pid << " is already offloaded" << std::endl;
+        return -1;
+    }
+    // The guardian maps the same file, whatever the path names later
+    int image_fd = ::open(image_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (image_fd < 0) {
+        std::cerr << "Error opening file " << image_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(image_fd); });
+    struct stat st;
+    if (::fstat(image_fd, &st) < 0 || m_reader.open("/proc/self/fd/" + std::to_string(image_fd)) < 0) {
+        std::cerr << "Error opening image " << image_path << std::endl;
+        return -1;
+    }
+    if (m_reader.is_delta() || m_reader.is_striped()) {
+        std::cerr << "Error offloading to " << image_path << " needs a full image with its data" << std::endl;
+        return -1;
+    }
+    if (m_state) {
+        m_state->image_size = st.st_size;
+        m_state->image_mtime = st.st_mtim;
+        tell_guardian(guard_state::image, image_fd);
+    }
+    std::vector<unsigned long> v_hot = hot;
+    if (v_hot.empty()) v_hot.assign(m_reader.hot_pages().begin(), m_reader.hot_pages().end());
+    size_t page = m_reader.page_size();
+
+    m_pidfd = ::syscall(SYS_pidfd_open, m_pid, 0);
+    if (m_pidfd < 0) {
+        std::cerr << "Error pidfd_open " << m_pid << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    ptracer p{m_pid};
+    if (p.init() < 0 || p.infect(false) < 0) {
+        std::cerr << "Error stopping pid " << m_pid << std::endl;
+        return -1;
+    }
+
+    // The userfaultfd belongs to the memory of the tracee, the tracer only takes its fd. It works before any
+    // page is dropped
+    long remote_fd = p.remote_syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (remote_fd < 0) {
+        std::cerr << "Error remote userfaultfd " << strerror(-remote_fd) << std::endl;
+        return -1;
+    }
+    int fd = ::syscall(SYS_pidfd_getfd, m_pidfd, remote_fd, 0);
+    p.remote_syscall(SYS_close, remote_fd);
+    if (fd < 0) {
+        std::cerr << "Error pidfd_getfd " << strerror(errno) << std::endl;
+        return -1;
+    }
+    auto& b = m_backings.emplace_back(backing{fd, m_next_id++, {}});
+    tell_guardian(b.id, fd);
+    uffdio_api api = {.api = UFFD_API,
+                      .features = UFFD_FEATURE_EVENT_FORK | UFFD_FEATURE_EVENT_REMAP | UFFD_FEATURE_EVENT_REMOVE |
+                                  UFFD_FEATURE_EVENT_UNMAP,
+                      .ioctls = 0};
+    if (::ioctl(fd, UFFDIO_API, &api) < 0) {
+        std::cerr << "Error UFFDIO_API " << strerror(errno) << std::endl;
+        close_backing(b);
+        m_backings.clear();
+        return -1;
+    }
+
+    // Only a page that reads the same as in the image is dropped, the tracee cannot change it meanwhile
+    std::vector<char> current;
+    std::vector<char> zero(page, 0);
+    std::vector<memory_map> v_registered;
+    bool failed = false;
+    for (auto& map : maps_parser::get_maps(m_pid)) {
+        if (!can_offload(map)) continue;
+        // Anonymous regions merge and split as the process maps memory, the parts that were in the image count
+        std::vector<std::pair<unsigned long, size_t>> v_cold;
+        for (auto& r : m_reader.regions()) {
+            unsigned long start = std::max(r.start(), map.start_address);
+            unsigned long end = std::min(r.end(), map.end_address);
+            if (start >= end || !can_offload(*r.map)) continue;
+            hotness::split_runs(v_hot.data(), v_hot.size(), start, end - start, page,
+                                [&](unsigned long address, size_t len, bool is_hot) {
+                                    if (!is_hot) v_cold.push_back({address, len});
+                                });
+        }
+        size_t dropped = m_stats.dropped;
+        auto drop_run = [&](unsigned long start, unsigned long end) {
+            if (start == end || failed) return;
+            long ret = p.remote_syscall(SYS_madvise, start, end - start, MADV_DONTNEED);
+            if (ret < 0) {
+                std::cerr << "Error remote madvise " << strerror(-ret) << std::endl;
+                failed = true;
+                return;
+            }
+            b.extents[start] = {end - start, start};
+            m_stats.dropped += (end - start) / page;
+        };
+        for (auto [address, len] : v_cold) {
+            m_stats.cold += len / page;
+            current.resize(len);
+            ssize_t n = filesystem::remote_read(m_pid, reinterpret_cast<void*>(address), current.data(), len);
+            size_t read = n > 0 ? n : 0;
+            unsigned long run = address;
+            for (size_t off = 0; off < len; off += page) {
+                // A page of a sparse region that is not saved is zero in the image
+                auto saved = m_reader.stored(address + off);
+                const char* image = saved.size() == page ? saved.data() : saved.empty() ? zero.data() : nullptr;
+                if (off + page <= read && image && !std::memcmp(current.data() + off, image, page)) continue;
+                m_stats.changed++;
+                drop_run(run, address + off);
+                run = address + off + page;
+            }
+            drop_run(run, address + len);
+        }
+        if (failed) break;
+        if (m_stats.dropped > dropped) v_registered.push_back(map);
+    }
+
+    // Registered before the tracee runs again, the dropped pages go back into it if that fails
+    bool registered = !failed;
+    for (size_t i = 0; i < v_registered.size() && registered; i++) {
+        auto& map = v_registered[i];
+        uffdio_register reg = {.range = {.start = map.start_address, .len = map.size()},
+                               .mode = UFFDIO_REGISTER_MODE_MISSING,
+                               .ioctls = 0};
+        if (::ioctl(fd, UFFDIO_REGISTER, &reg) < 0) {
+            std::cerr << "Error UFFDIO_REGISTER " << map << " " << strerror(errno) << std::endl;
+            registered = false;
+        }
+    }
+    if (!registered) {
+        for (auto& [start, e] : b.extents) {
+            for (size_t off = 0; off < e.len; off += page) {
+                const char* image = m_reader.at(e.image + off);
+                filesystem::remote_write(m_pid, reinterpret_cast<void*>(start + off), image ? image : zero.data(),
+                                         page);
+            }
+        }
+        close_backing(b);
+        m_backings.clear();
+        return -1;
+    }
+    close_empty();
+    // Before the tracee runs again, the guardian knows every page from the start
+    publish();
+
+    debug_msg("End " << m_stats.dropped << " pages dropped of " << m_stats.cold << " cold");
+    return 0;
+}
+
+std::vector<std::pair<unsigned long, cold_offload::extent>> cold_offload::erase(backing& b, unsigned long start,
+                                                                               size_t len) {
+    std::vector<std::pair<unsigned long, extent>> v_removed;
+    unsigned long end = start + len;
+    auto it = b.extents.upper_bound(start);
+    if (it != b.extents.begin()) it--;
+    while (it != b.extents.end() && it->first < end) {
+        unsigned long s = it->first;
+        unsigned long e = s + it->second.len;
+        unsigned long image = it->second.image;
+        if (e <= start) {
+            it++;
+            continue;
+        }
+        it = b.extents.erase(it);
+        if (s < start) b.extents[s] = {start - s, image};
+        if (e > end) b.extents[end] = {e - end, image + (end - s)};
+        unsigned long from = std::max(s, start);
+        v_removed.push_back({from, {std::min(e, end) - from, image + (from - s)}});
+    }
+    return v_removed;
+}
+
+int cold_offload::fill(backing& b, unsigned long address, size_t len) {
+    size_t page = m_reader.page_size();
+    // Image data of a page, nullptr when it is zero filled. dropped tells whether the page is in the image
+    auto source = [&](unsigned long a, bool& dropped) -> const char* {
+        auto it = b.extents.upper_bound(a);
+        dropped = it != b.extents.begin() && a < std::prev(it)->first + std::prev(it)->second.len;
+        if (!dropped) return nullptr;
+        it--;
+        return m_reader.at(it->second.image + (a - it->first));
+    };
+
+    unsigned long end = address + len;
+    while (address < end) {
+        bool dropped;
+        const char* src = source(address, dropped);
+        // One ioctl for the pages that follow each other in the image too
+        size_t n = page;
+        for (bool next_dropped; address + n < end; n += page) {
+            const char* next = source(address + n, next_dropped);
+            if (next_dropped != dropped || next != (src ? src + n : nullptr)) break;
+        }
+
+        long done;
+        int ret;
+        if (src) {
+            uffdio_copy copy = {.dst = address, .src = reinterpret_cast<unsigned long>(src), .len = n, .mode = 0,
+                                .copy = 0};
+            ret = ::ioctl(b.fd, UFFDIO_COPY, &copy);
+            done = copy.copy;
+        } else {
+            uffdio_zeropage zeropage = {.range = {.start = address, .len = n}, .mode = 0, .zeropage = 0};
+            ret = ::ioctl(b.fd, UFFDIO_ZEROPAGE, &zeropage);
+            done = zeropage.zeropage;
+        }
+        done = ret < 0 ? std::max(done, 0L) : n;
+        if (dropped) m_filled += done / page;
+        if (ret < 0 && errno == EAGAIN) {
+            erase(b, address, done);
+            return 1;
+        }
+        if (ret < 0 && errno == EEXIST) {
+            // Mapped meanwhile, a thread waiting for it is woken up
+            done += page;
+            uffdio_range range = {.start = address, .len = static_cast<unsigned long>(done)};
+            ::ioctl(b.fd, UFFDIO_WAKE, &range);
+        } else if (ret < 0 && (errno == ENOENT || errno == ESRCH)) {
+            // Unmapped or the process is gone, nothing there needs the image anymore
+            erase(b, address, end - address);
+            return 0;
+        } else if (ret < 0) {
+            std::cerr << "Error filling " << n << " bytes at 0x" << std::hex << address << std::dec << " "
+                      << strerror(errno) << std::endl;
+            return -1;
+        }
+        erase(b, address, done);
+        address += done;
+    }
+    return 0;
+}
+
+ssize_t cold_offload::handle(backing& b) {
+    size_t page = m_reader.page_size();
+    ssize_t served = 0;
+    // Faults tried while the process was changing its mappings, tried again once its events are read
+    std::vector<unsigned long> v_again;
+    for (;;) {
+        uffd_msg msgs[32];
+        ssize_t n = ::read(b.fd, msgs, sizeof(msgs));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EAGAIN) {
+            std::cerr << "Error reading userfaultfd " << strerror(errno) << std::endl;
+            return -1;
+        }
+        // In the journal first, the guardian replays what this process read if it dies before it publishes
+        size_t count = n > 0 ? n / sizeof(uffd_msg) : 0;
+        uint64_t child_ids[32];
+        journal(b, msgs, count, child_ids);
+        for (size_t i = 0; i < count; i++) {
+            auto& msg = msgs[i];
+            if (msg.event == UFFD_EVENT_PAGEFAULT) {
+                unsigned long address = msg.arg.pagefault.address & ~(page - 1);
+                trace_mark(FAULT, address);
+                bool dropped = false;
+                auto it = b.extents.upper_bound(address);
+                if (it != b.extents.begin()) dropped = address < std::prev(it)->first + std::prev(it)->second.len;
+                (dropped ? m_stats.faults : m_stats.zero_fills)++;
+                served++;
+                v_again.push_back(address);
+            } else if (msg.event == UFFD_EVENT_FORK) {
+                // The child has the same pages dropped, with its own userfaultfd
+                auto& child = m_backings.emplace_back(backing{static_cast<int>(msg.arg.fork.ufd), child_ids[i],
+                                                              b.extents});
+                tell_guardian(child.id, child.fd);
+            } else {
+                follow(b, msg);
+            }
+        }
+
+        std::vector<unsigned long> v_pending;
+        for (auto address : v_again) {
+            int ret = fill(b, address, page);
+            if (ret < 0) return -1;
+            if (ret > 0) v_pending.push_back(address);
+        }
+        v_again.swap(v_pending);
+        if (n < 0 && v_again.empty()) break;
+        // The event that makes the fill fail is still coming
+        if (n < 0) {
+            pollfd pfd = {b.fd, POLLIN, 0};
+            ::poll(&pfd, 1, 1);
+        }
+    }
+    return served;
+}
+
+void cold_offload::close_empty() {
+    for (auto it = m_backings.begin(); it != m_backings.end();) {
+        if (!it->extents.empty()) {
+            it++;
+            continue;
+        }
+        close_backing(*it);
+        it = m_backings.erase(it);
+    }
+}
+
+void cold_offload::close_backing(const backing& b) {
+    ::close(b.fd);
+    // The copy of the guardian would keep the regions registered
+    tell_guardian(b.id, -1);
+}
+
+ssize_t cold_offload::serve(std::chrono::milliseconds timeout) {
+    std::vector<pollfd> v_pfds = {{m_pidfd, POLLIN, 0}};
+    for (auto& b : m_backings) v_pfds.push_back({b.fd, POLLIN, 0});
+    if (::poll(v_pfds.data(), v_pfds.size(), timeout.count() < 0 ? -1 : timeout.count()) < 0) {
+        if (errno == EINTR) return 0;
+        std::cerr << "Error poll " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (v_pfds[0].revents) m_exited = true;
+
+    // Only the backings polled, a fork adds one at the end
+    ssize_t served = 0;
+    bool handled = false;
+    auto it = m_backings.begin();
+    for (size_t i = 1; i < v_pfds.size(); i++, it++) {
+        if (!v_pfds[i].revents) continue;
+        ssize_t ret = handle(*it);
+        if (ret < 0) {
+            return -1;
+        }
+        served += ret;
+        handled = true;
+    }
+    close_empty();
+    if (handled) publish();
+    return served;
+}
+
+int cold_offload::recall() {
+    debug_msg("Begin");
+    int ret = 0;
+    for (auto& b : m_backings) {
+        while (!b.extents.empty()) {
+            // Events first, the pages may have moved
+            if (handle(b) < 0) {
+                ret = -1;
+                break;
+            }
+            if (b.extents.empty()) break;
+            auto [start, e] = *b.extents.begin();
+            size_t before = m_filled;
+            int filled = fill(b, start, e.len);
+            m_stats.recalled += m_filled - before;
+            if (filled < 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    close_empty();
+    // What is left could not be put back, it is lost with the userfaultfd
+    for (auto& b : m_backings) {
+        std::cerr << "Error " << b.extents.size() << " dropped runs of pid " << m_pid << " not recalled" << std::endl;
+        close_backing(b);
+    }
+    m_backings.clear();
+    disarm();
+    debug_msg("End");
+    return ret;
+}
+
+}  // namespace RECK
@@ -0,0 +1,76 @@
+// #define DEBUG
+
+#include "page_codec.hpp"
+
+#include <cstring>
+
+namespace RECK {
+
+ssize_t page_codec::encode(const char* data, const char* base, size_t page, char* out) {
+    if (page > max_page_size || page % sizeof(uint64_t) != 0) return -1;
+
+    // Word at a time so the compiler vectorizes it
+    alignas(64) uint64_t x[max_page_size / sizeof(uint64_t)];
+    size_t words = page / sizeof(uint64_t);
+    std::memcpy(x, data, page);
+    if (base) {
+        alignas(64) uint64_t b[max_page_size / sizeof(uint64_t)];
+        std::memcpy(b, base, page);
+        for (size_t i = 0; i < words; i++) x[i] ^= b[i];
+    }
+
+    auto bytes = reinterpret_cast<const unsigned char*>(x);
+    size_t pos = 0;
+    size_t n = 0;
+    while (pos < page) {
+        size_t start = pos;
+        while (pos < page && !bytes[pos]) {
+            if (pos % sizeof(uint64_t) == 0 && x[pos / sizeof(uint64_t)] == 0) {
+                pos += sizeof(uint64_t);
+            } else {
+                pos++;
+            }
+        }
+        if (pos == page) break;
+
+        // A literal goes on over zero gaps that are cheaper than the header of a new run
+        size_t literal = pos;
+        while (pos < page) {
+            if (bytes[pos]) {
+                pos++;
+                continue;
+            }
+            size_t zeros = pos;
+            while (zeros < page && !bytes[zeros] && zeros - pos <= sizeof(run)) zeros++;
+            if (zeros == page || zeros - pos > sizeof(run)) break;
+            pos = zeros;
+        }
+
+        size_t len = pos - literal;
+        if (n + sizeof(run) + len >= page) return -1;
+        run r = {static_cast<uint16_t>(literal - start), static_cast<uint16_t>(len)};
+        std::memcpy(out + n, &r, sizeof(r));
+        std::memcpy(out + n + sizeof(r), bytes + literal, len);
+        n += sizeof(r) + len;
+    }
+    return n;
+}
+
+bool page_codec::decode(const char* in, size_t len, char* page_data, size_t page) {
+    size_t pos = 0;
+    size_t n = 0;
+    while (n < len) {
+        run r;
+        if (len - n < sizeof(r)) return false;
+        std::memcpy(&r, in + n, sizeof(r));
+        n += sizeof(r);
+        pos += r.skip;
+        if (r.len > len - n || pos + r.len > page) return false;
+        for (size_t i = 0; i < r.len; i++) page_data[pos + i] ^= in[n + i];
+        pos += r.len;
+        n += r.len;
+    }
+    return true;
+}
+
+}  // namespace RECK
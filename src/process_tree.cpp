@@ -0,0 +1,354 @@
+// #define DEBUG
+
+#include "process_tree.hpp"
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <tuple>
+
+#include "debug.hpp"
+#include "durable_file.hpp"
+#include "filesystem.hpp"
+#include "image_reader.hpp"
+#include "pipeline.hpp"
+#include "ptracer.hpp"
+#include "qos.hpp"
+
+namespace RECK {
+
+// Children of every thread of pid, sorted
+static std::vector<pid_t> children_of(pid_t pid) {
+    std::vector<pid_t> v_children;
+    std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+    DIR* d = ::opendir(task_dir.c_str());
+    if (!d) return v_children;
+    while (auto de = ::readdir(d)) {
+        if (de->d_name[0] == '.') continue;
+        std::ifstream children(task_dir + "/" + de->d_name + "/children");
+        pid_t child;
+        while (children >> child) v_children.push_back(child);
+    }
+    ::closedir(d);
+    std::sort(v_children.begin(), v_children.end());
+    return v_children;
+}
+
+std::vector<process_tree::process> process_tree::collect(pid_t pid) {
+    std::vector<process> v_procs = {{pid, 0}};
+    for (size_t i = 0; i < v_procs.size(); i++) {
+        for (auto child : children_of(v_procs[i].pid)) {
+            if (child != getpid()) v_procs.push_back({child, v_procs[i].pid});
+        }
+    }
+    return v_procs;
+}
+
+std::string process_tree::process_path(const std::string_view& file_path, pid_t pid, uint64_t generation) {
+    if (generation == 0) return std::string{file_path} + "." + std::to_string(pid);
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016lx", static_cast<unsigned long>(generation));
+    return std::string{file_path} + "." + hex + "." + std::to_string(pid);
+}
+
+// Process images of earlier trees of file_path, with or without a generation, other than the ones in keep
+static std::vector<std::string> stale_process_images(const std::string& file_path,
+                                                     const std::vector<std::string>& keep) {
+    std::vector<std::string> v_stale;
+    std::filesystem::path path{file_path};
+    auto dir = path.has_parent_path() ? path.parent_path() : std::filesystem::path{"."};
+    std::string prefix = path.filename().string() + ".";
+    auto is_number = [](const std::string& s) {
+        return !s.empty() && s.find_first_not_of("0123456789") == std::string::npos;
+    };
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        std::string file = entry.path().filename();
+        if (file.size() <= prefix.size() || file.compare(0, prefix.size(), prefix)) continue;
+        std::string rest = file.substr(prefix.size());
+        bool generation = rest.size() > 17 && rest[16] == '.' &&
+                          rest.find_first_not_of("0123456789abcdef") == 16 && is_number(rest.substr(17));
+        if (!generation && !is_number(rest)) continue;
+        if (std::none_of(keep.begin(), keep.end(), [&file](const std::string& k) {
+                return std::filesystem::path(k).filename() == file;
+            })) {
+            v_stale.push_back(entry.path());
+        }
+    }
+    return v_stale;
+}
+
+ssize_t process_tree::dump(pid_t pid, const std::string_view& file_path, const dump_options& options) {
+    debug_msg("Begin");
+    auto v_procs = collect(pid);
+    std::vector<std::unique_ptr<ptracer>> v_tracers;
+    for (auto& proc : v_procs) {
+        auto& tracer = v_tracers.emplace_back(std::make_unique<ptracer>(proc.pid, options.stop));
+        if (tracer->init() < 0) {
+            std::cerr << "Error initiating ptracer for pid " << proc.pid << std::endl;
+            return -1;
+        }
+    }
+    // A fork while the tree was being stopped would be missed
+    auto v_stopped = collect(pid);
+    if (!std::equal(v_procs.begin(), v_procs.end(), v_stopped.begin(), v_stopped.end(),
+                    [](const process& a, const process& b) { return a.pid == b.pid && a.ppid == b.ppid; })) {
+        std::cerr << "Error the tree of pid " << pid << " changed while it was stopped" << std::endl;
+        return -1;
+    }
+
+    // Shared mappings of the same object are one segment, whatever process maps them
+    struct shared_map {
+        pid_t pid;
+        memory_map map;
+    };
+    struct shared_segment {
+        segment seg;
+        std::vector<shared_map> v_maps;
+    };
+    using key = std::tuple<unsigned, unsigned, unsigned long>;
+    std::map<key, uint64_t> ids;
+    std::vector<shared_segment> v_segments;
+    for (auto& proc : v_procs) {
+        for (auto& map : maps_parser::get_maps(proc.pid)) {
+            if (!(map.flags & MAP_SHARED) || !serializer::is_saved(map)) continue;
+            auto [it, added] = ids.emplace(key{map.device_mayor, map.device_minor, map.inode}, v_segments.size());
+            if (added) v_segments.push_back({{it->second, 0}, {}});
+            auto& segment = v_segments[it->second];
+            segment.seg.size = std::max(segment.seg.size, map.offset + map.size());
+            segment.v_maps.push_back({proc.pid, map});
+        }
+    }
+    auto segment_of = [&ids](const memory_map& map) -> long {
+        if (!(map.flags & MAP_SHARED)) return -1;
+        auto it = ids.find(key{map.device_mayor, map.device_minor, map.inode});
+        return it == ids.end() ? -1 : static_cast<long>(it->second);
+    };
+
+    std::string file_path_str{file_path};
+    // Staged like the images of the processes, the tree is only throttled once it runs again
+    durable_file file{file_path_str, options.durable, options.writeback_window};
+    if (options.qos.limits()) file.stage(options.qos);
+    int fd = file.open();
+    if (fd < 0) {
+        return -1;
+    }
+    serializer::header h;
+    if (filesystem::write(fd, &h, sizeof(h)) != sizeof(h)) {
+        std::cerr << "Error writing header to file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // The process images of the previous tree stay in place until this tree image replaces it
+    uint64_t generation = 0;
+    if (options.durable) {
+        generation = std::chrono::system_clock::now().time_since_epoch().count();
+        serializer::mdata md_generation = {.type = serializer::TREE_GENERATION,
+                                           .offset = sizeof(h) + sizeof(serializer::mdata),
+                                           .size = sizeof(generation)};
+        if (filesystem::write(fd, &md_generation, sizeof(md_generation)) != sizeof(md_generation) ||
+            filesystem::write(fd, &generation, sizeof(generation)) != sizeof(generation)) {
+            std::cerr << "Error writing generation to file " << file_path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    for (auto& proc : v_procs) {
+        auto offset = ::lseek(fd, 0, SEEK_CUR);
+        serializer::mdata md_proc = {
+            .type = serializer::TREE_PROCESS, .offset = offset + sizeof(serializer::mdata), .size = sizeof(proc)};
+        if (filesystem::write(fd, &md_proc, sizeof(md_proc)) != sizeof(md_proc) ||
+            filesystem::write(fd, &proc, sizeof(proc)) != sizeof(proc)) {
+            std::cerr << "Error writing process " << proc.pid << " to file " << file_path << " " << strerror(errno)
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    qos_throttle throttle{options.qos.limits() ? qos_policy{} : options.qos};
+    std::vector<char> buffer;
+    for (auto& segment : v_segments) {
+        size_t pages = segment.seg.size / page;
+        std::vector<uint64_t> bitmap(serializer::page_bitmap_words(pages), 0);
+        size_t saved = 0;
+        for (auto& m : segment.v_maps) {
+            for (size_t p = m.map.offset / page; p < (m.map.offset + m.map.size()) / page; p++) {
+                if (bitmap[p / 64] & (1UL << (p % 64))) continue;
+                bitmap[p / 64] |= 1UL << (p % 64);
+                saved++;
+            }
+        }
+        size_t bitmap_size = bitmap.size() * sizeof(uint64_t);
+        auto offset = ::lseek(fd, 0, SEEK_CUR);
+        serializer::mdata md_segment = {.type = serializer::SHARED_SEGMENT,
+                                        .offset = offset + sizeof(serializer::mdata),
+                                        .size = sizeof(segment.seg) + bitmap_size + saved * page};
+        debug_msg(md_segment);
+        if (filesystem::write(fd, &md_segment, sizeof(md_segment)) != sizeof(md_segment) ||
+            filesystem::write(fd, &segment.seg, sizeof(segment.seg)) != sizeof(segment.seg) ||
+            filesystem::write(fd, bitmap.data(), bitmap_size) != static_cast<ssize_t>(bitmap_size)) {
+            std::cerr << "Error writing segment " << segment.seg.id << " to file " << file_path << " "
+                      << strerror(errno) << std::endl;
+            return -1;
+        }
+
+        // Every page is read once, from a readable map of it when there is one
+        bool failed = false;
+        auto sink = make_pipeline(throttled_sink{fd, throttle});
+        serializer::for_each_page_run(bitmap.data(), pages, [&](size_t first, size_t count) {
+            for (size_t p = first; p < first + count && !failed;) {
+                const shared_map* from = nullptr;
+                for (auto& m : segment.v_maps) {
+                    if (p < m.map.offset / page || p >= (m.map.offset + m.map.size()) / page) continue;
+                    if (!from || (!(from->map.prot & PROT_READ) && (m.map.prot & PROT_READ))) from = &m;
+                }
+                size_t n = std::min(first + count, (from->map.offset + from->map.size()) / page) - p;
+                unsigned long address = from->map.start_address + p * page - from->map.offset;
+                ssize_t ret = (from->map.prot & PROT_READ)
+                                  ? remote_source{from->pid, buffer}.pump(address, n * page, sink)
+                                  : zero_source{buffer}.pump(address, n * page, sink);
+                failed = ret < 0;
+                p += n;
+            }
+        });
+        if (failed || file.paced() < 0) {
+            std::cerr << "Error dumping segment " << segment.seg.id << " to file " << file_path << std::endl;
+            return -1;
+        }
+    }
+
+    dump_options process_options = options;
+    process_options.hot_window = std::chrono::milliseconds{0};
+    process_options.parent.clear();
+    process_options.stripe_dirs.clear();
+    std::vector<std::unique_ptr<durable_file>> v_staged(v_procs.size());
+    std::vector<std::string> v_paths;
+    for (size_t i = 0; i < v_procs.size(); i++) {
+        auto& path = v_paths.emplace_back(process_path(file_path, v_procs[i].pid, generation));
+        if (serializer::dump_process(v_procs[i].pid, path, process_options, v_tracers[i].get(), segment_of,
+                                     &v_staged[i]) < 0) {
+            std::cerr << "Error dumping pid " << v_procs[i].pid << " to file " << path << std::endl;
+            return -1;
+        }
+    }
+    // The tree runs again, the tree image is published last so it never names a missing process image
+    v_tracers.clear();
+    if (options.durable) {
+        for (auto& stale : stale_process_images(file_path_str, v_paths)) file.remove_on_commit(stale);
+    }
+    for (size_t i = 0; i < v_staged.size(); i++) {
+        if (v_staged[i] && v_staged[i]->commit() < 0) {
+            std::cerr << "Error committing the image of pid " << v_procs[i].pid << std::endl;
+            return -1;
+        }
+    }
+    if (file.commit() < 0) {
+        std::cerr << "Error committing file " << file_path << std::endl;
+        return -1;
+    }
+
+    debug_msg("End " << v_procs.size() << " processes, " << v_segments.size() << " segments");
+    return v_procs.size();
+}
+
+ssize_t process_tree::restore(const std::string_view& file_path) {
+    debug_msg("Begin");
+    std::vector<process> v_procs;
+    uint64_t generation = 0;
+    std::map<uint64_t, int> segments;
+    auto fail = [&segments]() {
+        for (auto& [id, fd] : segments) ::close(fd);
+        return -1;
+    };
+
+    image_reader reader;
+    if (reader.open(file_path) < 0) {
+        return -1;
+    }
+    size_t page = reader.page_size();
+    for (auto& md : reader.mdata()) {
+        auto payload = reader.payload(md);
+        if (md.type == serializer::TREE_PROCESS && payload.size() == sizeof(process)) {
+            std::memcpy(&v_procs.emplace_back(), payload.data(), sizeof(process));
+        } else if (md.type == serializer::TREE_GENERATION && payload.size() == sizeof(generation)) {
+            std::memcpy(&generation, payload.data(), sizeof(generation));
+        } else if (md.type == serializer::SHARED_SEGMENT && payload.size() >= sizeof(segment)) {
+            segment seg;
+            std::memcpy(&seg, payload.data(), sizeof(seg));
+            size_t pages = seg.size / page;
+            size_t header = sizeof(seg) + serializer::page_bitmap_words(pages) * sizeof(uint64_t);
+            if (payload.size() < header) {
+                std::cerr << "Error corrupted segment " << seg.id << " in file " << file_path << std::endl;
+                return fail();
+            }
+            int fd = ::memfd_create("reck_segment", MFD_CLOEXEC);
+            if (fd < 0 || ::ftruncate(fd, seg.size) < 0) {
+                std::cerr << "Error creating segment " << seg.id << " " << strerror(errno) << std::endl;
+                if (fd >= 0) ::close(fd);
+                return fail();
+            }
+            segments[seg.id] = fd;
+            auto bitmap = reinterpret_cast<const uint64_t*>(payload.data() + sizeof(seg));
+            const char* data = payload.data() + header;
+            bool failed = false;
+            serializer::for_each_page_run(bitmap, pages, [&](size_t first, size_t count) {
+                size_t len = count * page;
+                failed = failed || data + len > payload.end() ||
+                         filesystem::pwrite(fd, data, len, first * page) != static_cast<ssize_t>(len);
+                data += len;
+            });
+            if (failed) {
+                std::cerr << "Error loading segment " << seg.id << " of file " << file_path << std::endl;
+                return fail();
+            }
+        }
+    }
+    // The tree image is not needed anymore, its mapping could be in the way of the restored regions
+    reader.close();
+    if (v_procs.empty()) {
+        std::cerr << "Error file " << file_path << " has no processes" << std::endl;
+        return fail();
+    }
+
+    restore_subtree(file_path, generation, v_procs, 0, segments);
+    return fail();
+}
+
+ssize_t process_tree::restore_subtree(const std::string_view& file_path, uint64_t generation,
+                                      const std::vector<process>& v_procs, size_t i,
+                                      const std::map<uint64_t, int>& segments) {
+    std::vector<pid_t> v_children;
+    bool forked = true;
+    for (size_t c = i + 1; c < v_procs.size() && forked; c++) {
+        if (v_procs[c].ppid != v_procs[i].pid) continue;
+        pid_t child = fork();
+        if (child < 0) {
+            std::cerr << "Error fork " << strerror(errno) << std::endl;
+            forked = false;
+            continue;
+        }
+        if (child == 0) {
+            restore_subtree(file_path, generation, v_procs, c, segments);
+            std::cerr << "Error restoring pid " << v_procs[c].pid << " of file " << file_path << std::endl;
+            _exit(1);
+        }
+        v_children.push_back(child);
+    }
+    if (forked) {
+        serializer::restore_process(process_path(file_path, v_procs[i].pid, generation), {}, segments);
+    }
+    // Only reached on error, the children would run without their parent
+    for (auto child : v_children) ::kill(child, SIGKILL);
+    return -1;
+}
+
+}  // namespace RECK
@@ -2,18 +2,27 @@
 #include "ptracer.hpp"
 
 #include <linux/prctl.h> /* Definition of PR_* constants */
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <wait.h>
 
 #include <algorithm>
 #include <filesystem>
+#include <string>
 
+#include "cgroup_freezer.hpp"
 #include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
 #include "maps_parser.hpp"
+#include "trace.hpp"
 
 namespace RECK {
 
-ptracer::ptracer(pid_t pid) : m_pid(pid) {
+ptracer::ptracer(pid_t pid, stop_method method) : m_pid(pid), m_method(method) {
     debug_msg("Begin");
     debug_msg("End");
 }
@@ -21,6 +30,9 @@ ptracer::ptracer(pid_t pid) : m_pid(pid) {
 ptracer::~ptracer() {
     debug_msg("Begin");
 
+    if (m_infected) {
+        cure();
+    }
     if (m_init) {
         detach();
     }
@@ -32,6 +44,17 @@ int ptracer::init() {
     int ret = 0;
     debug_msg("Begin");
 
+    if (m_method == STOP_FREEZE) {
+        if (seize_frozen() == 0) {
+            m_init = true;
+            debug_msg("End frozen " << m_tasks.size() << " tasks");
+            return 0;
+        }
+        std::cerr << "Warning: cannot freeze the cgroup of pid " << m_pid << ", attaching thread by thread"
+                  << std::endl;
+        m_method = STOP_PTRACE;
+    }
+
     std::vector<pid_t> v_ptraced;
     auto all_in = [](const std::vector<pid_t>& v1, const std::vector<pid_t>& v2) -> bool {
         for (auto& pid : v1) {
@@ -53,6 +76,11 @@ int ptracer::init() {
         for (auto& pid : m_tasks) {
             if (std::find(v_ptraced.begin(), v_ptraced.end(), pid) != v_ptraced.end()) continue;
             ret = attach(pid);
+            // The thread exited since the scan, the next scan does not list it
+            if (ret == -ESRCH && pid != m_pid) {
+                ret = 0;
+                continue;
+            }
             if (ret < 0) {
                 std::cerr << "Error ptracer attach" << std::endl;
                 return -1;
@@ -73,7 +101,8 @@ int ptracer::attach(pid_t pid) {
 
     ret = ::ptrace(PTRACE_ATTACH, pid);
     if (ret < 0) {
-        std::cerr << "Error PTRACE_ATTACH " << std::strerror(errno) << std::endl;
+        ret = -errno;
+        if (ret != -ESRCH) std::cerr << "Error PTRACE_ATTACH " << std::strerror(-ret) << std::endl;
         return ret;
     }
     int status = 0;
@@ -95,6 +124,55 @@ int ptracer::attach(pid_t pid) {
     return 0;
 }
 
+int ptracer::seize_frozen() {
+    debug_msg("Begin");
+    cgroup_freezer freezer{m_pid};
+    if (freezer.freeze() < 0) {
+        return -1;
+    }
+
+    // Nothing runs in a frozen process, one scan of the task list finds every thread
+    m_tasks = get_tasks();
+    if (m_tasks.size() == 0) {
+        std::cerr << "Error ptracer get tasks" << std::endl;
+        return -1;
+    }
+    size_t seized = 0;
+    for (; seized < m_tasks.size(); seized++) {
+        auto pid = m_tasks[seized];
+        if (::ptrace(PTRACE_SEIZE, pid, nullptr, nullptr) < 0) {
+            std::cerr << "Error PTRACE_SEIZE " << pid << " " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (::ptrace(PTRACE_INTERRUPT, pid, nullptr, nullptr) < 0) {
+            std::cerr << "Error PTRACE_INTERRUPT " << pid << " " << std::strerror(errno) << std::endl;
+            seized++;
+            break;
+        }
+    }
+
+    // A frozen thread enters the ptrace stop right away and stays there once the cgroup is thawed
+    bool stopped = seized == m_tasks.size();
+    for (size_t i = 0; i < seized; i++) {
+        int status = 0;
+        if (::waitpid(m_tasks[i], &status, __WALL) != m_tasks[i] || !WIFSTOPPED(status)) {
+            std::cerr << "Error waitpid " << m_tasks[i] << " not stopped " << std::strerror(errno) << std::endl;
+            stopped = false;
+        }
+    }
+    if (!stopped) {
+        for (size_t i = 0; i < seized; i++) ::ptrace(PTRACE_DETACH, m_tasks[i], nullptr, nullptr);
+        m_tasks.clear();
+        return -1;
+    }
+
+    if (freezer.thaw() < 0) {
+        std::cerr << "Warning: cgroup of pid " << m_pid << " not restored after the freeze" << std::endl;
+    }
+    debug_msg("End");
+    return 0;
+}
+
 std::vector<pid_t> ptracer::get_tasks() {
     debug_msg("Begin");
     std::vector<pid_t> v_pid;
@@ -199,9 +277,14 @@ int ptracer::detach() {
     ssize_t ret = 0;
     debug_msg("Begin");
 
-    ret = ::ptrace(PTRACE_DETACH, m_pid, 0, 0);
+    // Every thread, a thread left traced stays stopped until the tracer exits
+    for (auto& pid : m_tasks) {
+        if (::ptrace(PTRACE_DETACH, pid, 0, 0) < 0) {
+            std::cerr << "Error PTRACE_DETACH " << pid << " " << std::strerror(errno) << std::endl;
+            ret = -1;
+        }
+    }
     if (ret < 0) {
-        std::cerr << "Error PTRACE_DETACH " << std::strerror(errno) << std::endl;
         return ret;
     }
 
@@ -211,6 +294,217 @@ int ptracer::detach() {
     return ret;
 }
 
+int ptracer::infect(bool with_drain) {
+    debug_msg("Begin");
+    if (!m_init || m_infected) {
+        std::cerr << "Error infect needs an attached and not infected tracee" << std::endl;
+        return -1;
+    }
+
+    if (::ptrace(PTRACE_GETREGS, m_pid, nullptr, &m_saved_regs) < 0) {
+        std::cerr << "Error PTRACE_GETREGS " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // syscall; int3 at the start of the page of the current instruction, it is surely mapped and executable
+    m_syscall_ip = m_saved_regs.rip & ~0xfffUL;
+    errno = 0;
+    m_saved_code = ::ptrace(PTRACE_PEEKTEXT, m_pid, m_syscall_ip, nullptr);
+    if (errno != 0) {
+        std::cerr << "Error PTRACE_PEEKTEXT " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    long code = (m_saved_code & ~0xffffffL) | 0xcc050fL;
+    if (::ptrace(PTRACE_POKETEXT, m_pid, m_syscall_ip, code) < 0) {
+        std::cerr << "Error PTRACE_POKETEXT " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    m_infected = true;
+    if (!with_drain) {
+        debug_msg("End without drain");
+        return 0;
+    }
+
+    long page = remote_syscall(SYS_mmap, 0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page < 0 && page > -4096) {
+        std::cerr << "Error remote mmap " << std::strerror(-page) << std::endl;
+        cure();
+        return -1;
+    }
+    m_remote_page = page;
+
+    if (::pipe2(m_pipe, O_CLOEXEC) < 0) {
+        std::cerr << "Error pipe " << std::strerror(errno) << std::endl;
+        cure();
+        return -1;
+    }
+    // As big as allowed, every vmsplice has to fit in the pipe or the tracee blocks
+    int pipe_size = ::fcntl(m_pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+    if (pipe_size < 0) pipe_size = ::fcntl(m_pipe[1], F_GETPIPE_SZ);
+    m_pipe_size = pipe_size;
+
+    // The tracee opens the write end of the pipe through the fd link of the tracer
+    std::string path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(m_pipe[1]);
+    auto remote_path = m_remote_page + sizeof(iovec);
+    if (filesystem::remote_write(m_pid, reinterpret_cast<void*>(remote_path), path.c_str(), path.size() + 1) !=
+        static_cast<ssize_t>(path.size() + 1)) {
+        std::cerr << "Error writing remote path " << std::strerror(errno) << std::endl;
+        cure();
+        return -1;
+    }
+    long remote_fd = remote_syscall(SYS_openat, AT_FDCWD, remote_path, O_WRONLY | O_CLOEXEC);
+    if (remote_fd < 0) {
+        std::cerr << "Error remote open of " << path << " " << std::strerror(-remote_fd) << std::endl;
+        cure();
+        return -1;
+    }
+    m_remote_pipe = remote_fd;
+
+    debug_msg("End pipe of " << m_pipe_size << " bytes");
+    return 0;
+}
+
+int ptracer::cure() {
+    int ret = 0;
+    debug_msg("Begin");
+    if (!m_infected) return 0;
+
+    if (m_remote_pipe >= 0) remote_syscall(SYS_close, m_remote_pipe);
+    if (m_remote_page) remote_syscall(SYS_munmap, m_remote_page, sysconf(_SC_PAGESIZE));
+    m_remote_pipe = -1;
+    m_remote_page = 0;
+    for (auto& fd : m_pipe) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    if (::ptrace(PTRACE_POKETEXT, m_pid, m_syscall_ip, m_saved_code) < 0) {
+        std::cerr << "Error PTRACE_POKETEXT " << std::strerror(errno) << std::endl;
+        ret = -1;
+    }
+    if (::ptrace(PTRACE_SETREGS, m_pid, nullptr, &m_saved_regs) < 0) {
+        std::cerr << "Error PTRACE_SETREGS " << std::strerror(errno) << std::endl;
+        ret = -1;
+    }
+    m_infected = false;
+
+    // Delivered once the tracee is detached
+    for (auto sig : m_pending_signals) {
+        ::syscall(SYS_tgkill, m_pid, m_pid, sig);
+    }
+    m_pending_signals.clear();
+
+    debug_msg("End");
+    return ret;
+}
+
+long ptracer::remote_syscall(long nr, long a1, long a2, long a3, long a4, long a5, long a6) {
+    debug_msg("Begin (" << nr << ")");
+    if (!m_infected) return -EINVAL;
+    trace_scope(REMOTE_SYSCALL, nr);
+
+    user_regs_struct regs = m_saved_regs;
+    regs.rax = nr;
+    regs.rdi = a1;
+    regs.rsi = a2;
+    regs.rdx = a3;
+    regs.r10 = a4;
+    regs.r8 = a5;
+    regs.r9 = a6;
+    regs.rip = m_syscall_ip;
+    // Not inside a syscall anymore, otherwise the kernel could restart the interrupted one
+    regs.orig_rax = -1;
+    if (::ptrace(PTRACE_SETREGS, m_pid, nullptr, &regs) < 0) {
+        std::cerr << "Error PTRACE_SETREGS " << std::strerror(errno) << std::endl;
+        return -errno;
+    }
+
+    int status = 0;
+    while (true) {
+        if (::ptrace(PTRACE_CONT, m_pid, nullptr, nullptr) < 0) {
+            std::cerr << "Error PTRACE_CONT " << std::strerror(errno) << std::endl;
+            return -errno;
+        }
+        if (::waitpid(m_pid, &status, __WALL) != m_pid) {
+            std::cerr << "Error waitpid " << std::strerror(errno) << std::endl;
+            return -errno;
+        }
+        if (!WIFSTOPPED(status)) {
+            std::cerr << "Error tracee " << m_pid << " exited running a remote syscall" << std::endl;
+            m_infected = false;
+            return -ESRCH;
+        }
+        if (WSTOPSIG(status) == SIGTRAP) break;
+        m_pending_signals.push_back(WSTOPSIG(status));
+    }
+
+    if (::ptrace(PTRACE_GETREGS, m_pid, nullptr, &regs) < 0) {
+        std::cerr << "Error PTRACE_GETREGS " << std::strerror(errno) << std::endl;
+        return -errno;
+    }
+
+    debug_msg("End (" << nr << ")= " << static_cast<long>(regs.rax));
+    return regs.rax;
+}
+
+ssize_t ptracer::drain(unsigned long address, size_t len, int fd) {
+    ssize_t ret = 0;
+    debug_msg("Begin (" << address << ", " << len << ")");
+    if (!m_infected) return 0;
+    trace_scope(DRAIN, address, len);
+
+    off_t start = ::lseek(fd, 0, SEEK_CUR);
+    defer({
+        // The injected code went to the file with the rest of its page
+        if (start >= 0 && m_syscall_ip >= address && m_syscall_ip < address + ret) {
+            char code[sizeof(m_saved_code)];
+            size_t n = std::min(sizeof(code), address + ret - m_syscall_ip);
+            hide_parasite(m_syscall_ip, code, n);
+            if (::pwrite(fd, code, n, start + (m_syscall_ip - address)) != static_cast<ssize_t>(n)) {
+                std::cerr << "Error writing original code " << std::strerror(errno) << std::endl;
+            }
+        }
+    });
+
+    while (static_cast<size_t>(ret) < len) {
+        iovec iov = {reinterpret_cast<void*>(address + ret), std::min(len - ret, m_pipe_size)};
+        if (filesystem::remote_write(m_pid, reinterpret_cast<void*>(m_remote_page), &iov, sizeof(iov)) !=
+            sizeof(iov)) {
+            break;
+        }
+        long n = remote_syscall(SYS_vmsplice, m_remote_pipe, m_remote_page, 1, 0);
+        if (n <= 0) {
+            debug_msg("vmsplice " << std::strerror(-n));
+            break;
+        }
+        for (long left = n; left > 0;) {
+            auto r = ::splice(m_pipe[0], nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+            if (r <= 0) {
+                // The pipe keeps data that is not in the file, it cannot be used anymore
+                std::cerr << "Error splice " << std::strerror(errno) << std::endl;
+                cure();
+                return ret;
+            }
+            left -= r;
+            ret += r;
+        }
+    }
+
+    debug_msg("End (" << address << ", " << len << ")= " << ret);
+    return ret;
+}
+
+void ptracer::hide_parasite(unsigned long address, char* data, size_t len) const {
+    if (!m_syscall_ip) return;
+    auto code = reinterpret_cast<const char*>(&m_saved_code);
+    for (size_t i = 0; i < sizeof(m_saved_code); i++) {
+        if (m_syscall_ip + i >= address && m_syscall_ip + i < address + len) {
+            data[m_syscall_ip + i - address] = code[i];
+        }
+    }
+}
+
 int ptracer::allow_pid(pid_t pid) { return prctl(PR_SET_PTRACER, pid); }
 
 }  // namespace RECK
\ No newline at end of file
@@ -0,0 +1,126 @@
+// #define DEBUG
+
+#include "qos.hpp"
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "debug.hpp"
+#include "filesystem.hpp"
+
+namespace RECK {
+
+constexpr size_t qos_max_chunk = 1024 * 1024;
+constexpr int ioprio_class_shift = 13;
+constexpr int ioprio_who_process = 1;
+
+qos_throttle::qos_throttle(const qos_policy& policy)
+    : m_policy(policy), m_rate(policy.bandwidth), m_tokens(policy.burst), m_last(std::chrono::steady_clock::now()) {}
+
+int qos_throttle::apply(const qos_policy& policy) {
+    debug_msg("Begin");
+    int ret = 0;
+    if (policy.io != qos_policy::IO_NONE) {
+        int prio = (policy.io << ioprio_class_shift) | std::clamp(policy.io_level, 0, 7);
+        if (::syscall(SYS_ioprio_set, ioprio_who_process, 0, prio) < 0) {
+            std::cerr << "Error ioprio_set " << prio << " " << strerror(errno) << std::endl;
+            ret = -1;
+        }
+    }
+    if (!policy.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : policy.cpus) CPU_SET(cpu, &set);
+        if (::sched_setaffinity(0, sizeof(set), &set) < 0) {
+            std::cerr << "Error sched_setaffinity " << strerror(errno) << std::endl;
+            ret = -1;
+        }
+    }
+    // PRIO_PROCESS with 0 is the calling thread on Linux
+    if (policy.nice != 0 && ::setpriority(PRIO_PROCESS, 0, policy.nice) < 0) {
+        std::cerr << "Error setpriority " << policy.nice << " " << strerror(errno) << std::endl;
+        ret = -1;
+    }
+    debug_msg("End");
+    return ret;
+}
+
+size_t qos_throttle::chunk(size_t len) const {
+    if (!enabled()) return len;
+    return std::min({len, std::max<size_t>(m_policy.burst, 4096), qos_max_chunk});
+}
+
+void qos_throttle::acquire(size_t len) {
+    if (m_policy.admit) m_policy.admit(len);
+    if (!enabled()) return;
+    std::chrono::duration<double> wait{0};
+    {
+        std::unique_lock lock(m_mutex);
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> idle = now - m_last;
+        m_last = now;
+        m_tokens = std::min(m_tokens + idle.count() * m_rate, static_cast<double>(m_policy.burst));
+        // The bytes are taken now, a writer that finds them spent waits for its share after the ones before it
+        m_tokens -= len;
+        if (m_tokens < 0) wait = std::chrono::duration<double>(-m_tokens / m_rate);
+    }
+    if (wait.count() > 0) std::this_thread::sleep_for(wait);
+}
+
+void qos_throttle::completed(size_t len, std::chrono::nanoseconds elapsed) {
+    if (!enabled() || m_policy.target_latency.count() == 0 || len == 0) return;
+    std::unique_lock lock(m_mutex);
+    double floor = m_policy.bandwidth / 64;
+    if (elapsed > m_policy.target_latency) {
+        m_rate = std::max(m_rate / 2, floor);
+    } else {
+        m_rate = std::min(m_rate + m_policy.bandwidth / 16, m_policy.bandwidth);
+    }
+    debug_msg("Write of " << len << " bytes in " << elapsed.count() << " ns, rate " << m_rate);
+}
+
+double qos_throttle::rate() const {
+    std::unique_lock lock(m_mutex);
+    return m_rate;
+}
+
+ssize_t qos_throttle::write(int fd, const void* data, size_t len) {
+    auto buffer = static_cast<const char*>(data);
+    size_t done = 0;
+    while (done < len) {
+        size_t n = chunk(len - done);
+        acquire(n);
+        auto start = std::chrono::steady_clock::now();
+        ssize_t ret = filesystem::write(fd, buffer + done, n);
+        completed(n, std::chrono::steady_clock::now() - start);
+        if (ret < 0) return done > 0 ? static_cast<ssize_t>(done) : ret;
+        done += ret;
+        if (static_cast<size_t>(ret) != n) break;
+    }
+    return done;
+}
+
+ssize_t qos_throttle::pwrite(int fd, const void* data, size_t len, off_t offset) {
+    auto buffer = static_cast<const char*>(data);
+    size_t done = 0;
+    while (done < len) {
+        size_t n = chunk(len - done);
+        acquire(n);
+        auto start = std::chrono::steady_clock::now();
+        ssize_t ret = filesystem::pwrite(fd, buffer + done, n, offset + done);
+        completed(n, std::chrono::steady_clock::now() - start);
+        if (ret < 0) return done > 0 ? static_cast<ssize_t>(done) : ret;
+        done += ret;
+        if (static_cast<size_t>(ret) != n) break;
+    }
+    return done;
+}
+
+}  // namespace RECK
@@ -3,20 +3,46 @@
 #include "serializer.hpp"
 
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include <algorithm>
+#include <atomic>
 #include <charconv>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "debug.hpp"
 #include "defer.hpp"
+#include "exclusion.hpp"
+#include "fd_table.hpp"
 #include "filesystem.hpp"
+#include "hotness.hpp"
+#include "image_reader.hpp"
+#include "liveness.hpp"
+#include "page_codec.hpp"
+#include "pipeline.hpp"
+#include "qos.hpp"
+#include "trace.hpp"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 namespace RECK {
 
@@ -29,6 +55,19 @@ std::ostream& operator<<(std::ostream& os, const serializer::mdata& md) {
         CASE_TYPE(REGS);
         CASE_TYPE(FPREGS);
         CASE_TYPE(MEMORY_MAP);
+        CASE_TYPE(SPARSE_MAP);
+        CASE_TYPE(HOT_PAGES);
+        CASE_TYPE(PARENT);
+        CASE_TYPE(DELTA_MAP);
+        CASE_TYPE(STRIPE_SET);
+        CASE_TYPE(STRIPED_MAP);
+        CASE_TYPE(PADDING);
+        CASE_TYPE(XOR_MAP);
+        CASE_TYPE(FILE_DESC);
+        CASE_TYPE(SHARED_MAP);
+        CASE_TYPE(SHARED_SEGMENT);
+        CASE_TYPE(TREE_PROCESS);
+        CASE_TYPE(TREE_GENERATION);
         default:
             os << "Unknown type (" << static_cast<int>(md.type) << ")";
             break;
@@ -38,9 +77,388 @@ std::ostream& operator<<(std::ostream& os, const serializer::mdata& md) {
     return os;
 }
 
-ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
+static int map_region(const memory_map& map) {
+    void* addr = MAP_FAILED;
+    if (std::strstr(map.pathname, "[stack]")) {
+        addr = mmap(reinterpret_cast<void*>(map.start_address), map.size(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN | MAP_STACK, -1, 0);
+    } else {
+        addr = mmap(reinterpret_cast<void*>(map.start_address), map.size(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mapping memory_map " << map << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static bool is_stack(const memory_map& map) { return std::strstr(map.pathname, "[stack]") != nullptr; }
+
+// Sorted regions, neighbours that can_coalesce are mapped with a single mmap
+static int map_regions(const std::vector<memory_map>& v_maps) {
+    size_t i = 0;
+    while (i < v_maps.size()) {
+        memory_map merged = v_maps[i++];
+        while (i < v_maps.size() && serializer::can_coalesce(merged, v_maps[i])) {
+            merged.end_address = v_maps[i++].end_address;
+        }
+        if (map_region(merged) < 0) {
+            return -1;
+        }
+        trace_mark(RESTORE_MAP, merged.start_address, merged.size());
+    }
+    return 0;
+}
+
+// Regions are mapped read write to be filled, only the other protections need a call and adjacent ones share it
+static int protect_regions(const std::vector<memory_map>& v_maps) {
+    size_t i = 0;
+    while (i < v_maps.size()) {
+        memory_map merged = v_maps[i++];
+        while (i < v_maps.size() && v_maps[i].start_address == merged.end_address && v_maps[i].prot == merged.prot) {
+            merged.end_address = v_maps[i++].end_address;
+        }
+        if (merged.prot == (PROT_READ | PROT_WRITE)) continue;
+        if (mprotect(reinterpret_cast<void*>(merged.start_address), merged.size(), merged.prot) < 0) {
+            std::cerr << "Error mprotect data " << merged << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Pages of the map to save, empty when all of them are saved
+static std::vector<uint64_t> saved_pages(const memory_map& map, const std::vector<exclusion_table::entry>& v_excl) {
+    std::vector<uint64_t> bitmap;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    size_t pages = map.size() / page;
+    for (auto& excl : v_excl) {
+        if (excl.end_address <= map.start_address || excl.start_address >= map.end_address) continue;
+        if (bitmap.empty()) {
+            bitmap.assign(serializer::page_bitmap_words(pages), 0);
+            for (size_t i = 0; i < pages; i++) bitmap[i / 64] |= 1UL << (i % 64);
+        }
+        size_t first = (std::max(excl.start_address, map.start_address) - map.start_address) / page;
+        size_t last = (std::min(excl.end_address, map.end_address) - map.start_address) / page;
+        for (size_t i = first; i < last; i++) bitmap[i / 64] &= ~(1UL << (i % 64));
+    }
+    return bitmap;
+}
+
+// Copy len bytes at address of pid to the current offset of fd
+static ssize_t dump_range(pid_t pid, int fd, const memory_map& map, unsigned long address, size_t len,
+                          std::vector<char>& buffer, qos_throttle& throttle, ptracer* parasite = nullptr,
+                          durable_file* file = nullptr) {
+    ssize_t ret = 0;
+    if (parasite && parasite->infected() && (map.prot & PROT_READ)) {
+        // Whatever cannot be spliced is copied as usual
+        size_t drained = 0;
+        while (drained < len) {
+            size_t n = throttle.chunk(len - drained);
+            throttle.acquire(n);
+            auto start = std::chrono::steady_clock::now();
+            ssize_t moved = parasite->drain(address + drained, n, fd);
+            throttle.completed(std::max<ssize_t>(moved, 0), std::chrono::steady_clock::now() - start);
+            if (moved > 0) drained += moved;
+            if (file && file->paced() < 0) return -1;
+            if (moved != static_cast<ssize_t>(n)) break;
+        }
+        if (drained == len) {
+            return drained;
+        }
+        address += drained;
+        len -= drained;
+    }
+    // The parasite code goes back into the copy before it is written
+    auto hide = [parasite](chunk& c) {
+        if (parasite) parasite->hide_parasite(c.address, c.data, c.len);
+    };
+    // Every chunk written lets the writeback of the image go on
+    auto pace = [file](const chunk&) { return file ? file->paced() : 0; };
+    auto sink = make_pipeline(transform_stage{hide}, after_stage{pace}, throttled_sink{fd, throttle});
+    if (map.prot & PROT_READ) {
+        ret = remote_source{pid, buffer}.pump(address, len, sink);
+    } else {
+        ret = zero_source{buffer}.pump(address, len, sink);
+    }
+    return ret < 0 ? -1 : ret;
+}
+
+static ssize_t write_map_entry(int fd, serializer::mdata_type type, const memory_map& map, size_t size) {
+    auto offset = ::lseek(fd, 0, SEEK_CUR);
+    serializer::mdata md_map = {.type = type, .offset = offset + sizeof(serializer::mdata), .size = size};
+    debug_msg(md_map);
+
+    auto ret = filesystem::write(fd, &md_map, sizeof(md_map));
+    if (ret != sizeof(md_map)) {
+        std::cerr << "Error writing md_map " << strerror(errno) << std::endl;
+        return -1;
+    }
+    ret = filesystem::write(fd, &map, sizeof(map));
+    if (ret != sizeof(map)) {
+        std::cerr << "Error writing map " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return ret;
+}
+
+// PADDING entry before a region entry with header_size bytes before its data, so the data starts at an offset
+// congruent to the address of the map modulo align. The padding is left as a hole
+static ssize_t write_padding(int fd, const memory_map& map, size_t header_size, size_t align) {
+    auto offset = ::lseek(fd, 0, SEEK_CUR);
+    size_t data_offset = offset + 2 * sizeof(serializer::mdata) + header_size;
+    size_t pad = (map.start_address - data_offset) & (align - 1);
+    serializer::mdata md_pad = {.type = serializer::mdata_type::PADDING, .offset = offset + sizeof(serializer::mdata),
+                                .size = pad};
+    debug_msg(md_pad);
+
+    auto ret = filesystem::write(fd, &md_pad, sizeof(md_pad));
+    if (ret != sizeof(md_pad)) {
+        std::cerr << "Error writing md_pad " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (::lseek(fd, pad, SEEK_CUR) < 0) {
+        std::cerr << "Error lseek over padding " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return pad;
+}
+
+// Only the pages that differ from the parent chain, excluded pages are compared as zero pages. A first pass finds
+// them, and their stored size when they are XOR encoded, a second one reads them again and streams them to fd, so
+// only the bitmap and the sizes are kept in memory. The tracee is stopped, the pages read the same both times
+static ssize_t dump_delta_map(pid_t pid, int fd, const memory_map& map, const std::vector<exclusion_table::entry>& v_excl,
+                              const image_chain& chain, bool xor_pages, std::vector<char>& buffer,
+                              qos_throttle& throttle, durable_file* file) {
+    ssize_t ret = 0;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    size_t pages = map.size() / page;
+
+    auto excluded = saved_pages(map, v_excl);
+    std::vector<uint64_t> bitmap(serializer::page_bitmap_words(pages), 0);
+    std::vector<char> zero(page, 0), parent_page(page), encoded(page);
+    // Stored size of every changed page when they are XOR encoded
+    std::vector<uint32_t> v_sizes;
+    size_t changed = 0, n_encoded = 0;
+    auto zero_excluded = [&](chunk& c) {
+        if (excluded.empty()) return;
+        for (size_t offset = 0; offset < c.len; offset += page) {
+            size_t i = (c.address + offset - map.start_address) / page;
+            if (!(excluded[i / 64] & (1UL << (i % 64)))) std::memset(c.data + offset, 0, page);
+        }
+    };
+    // A changed page is stored encoded against its parent page when that is smaller, as it is otherwise
+    auto encode = [&](const char* data, const char* parent, const char*& stored) {
+        ssize_t n = page_codec::encode(data, parent, page, encoded.data());
+        stored = n < 0 ? data : encoded.data();
+        return n;
+    };
+    auto is_changed = [&](unsigned long address, const char* data) {
+        size_t i = (address - map.start_address) / page;
+        const char* parent = chain.page(address, parent_page.data());
+        if (std::memcmp(data, parent ? parent : zero.data(), page) == 0) return false;
+        bitmap[i / 64] |= 1UL << (i % 64);
+        changed++;
+        if (!xor_pages) return true;
+        const char* stored;
+        ssize_t n = encode(data, parent, stored);
+        v_sizes.push_back(n < 0 ? page : n);
+        if (n >= 0) n_encoded++;
+        return true;
+    };
+    auto find = make_pipeline(transform_stage{zero_excluded}, page_filter_stage{page, is_changed}, null_sink{});
+    if (map.prot & PROT_READ) {
+        ret = remote_source{pid, buffer}.pump(map.start_address, map.size(), find);
+    } else {
+        ret = zero_source{buffer}.pump(map.start_address, map.size(), find);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    size_t bitmap_size = bitmap.size() * sizeof(uint64_t);
+    if (n_encoded > 0) {
+        size_t sizes_size = v_sizes.size() * sizeof(uint32_t);
+        size_t data_size = 0;
+        for (auto size : v_sizes) data_size += size;
+        if (write_map_entry(fd, serializer::mdata_type::XOR_MAP, map,
+                            sizeof(map) + bitmap_size + sizes_size + data_size) < 0) {
+            return -1;
+        }
+        if (filesystem::write(fd, bitmap.data(), bitmap_size) != static_cast<ssize_t>(bitmap_size) ||
+            filesystem::write(fd, v_sizes.data(), sizes_size) != static_cast<ssize_t>(sizes_size)) {
+            std::cerr << "Error writing XOR pages " << strerror(errno) << std::endl;
+            return -1;
+        }
+    } else if (changed == pages) {
+        if (write_map_entry(fd, serializer::mdata_type::MEMORY_MAP, map, sizeof(map) + map.size()) < 0) {
+            return -1;
+        }
+    } else {
+        if (write_map_entry(fd, serializer::mdata_type::DELTA_MAP, map, sizeof(map) + bitmap_size + changed * page) <
+            0) {
+            return -1;
+        }
+        if (filesystem::write(fd, bitmap.data(), bitmap_size) != static_cast<ssize_t>(bitmap_size)) {
+            std::cerr << "Error writing page bitmap " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+
+    // The layout is written, every changed page now goes to fd as it is read again
+    size_t next_size = 0;
+    auto store = [&](const chunk& c, auto& next) -> ssize_t {
+        if (n_encoded == 0) return next(c) < 0 ? -1 : c.len;
+        for (size_t offset = 0; offset < c.len; offset += page) {
+            const char* stored;
+            ssize_t n = encode(c.data + offset, chain.page(c.address + offset, parent_page.data()), stored);
+            size_t len = n < 0 ? page : n;
+            if (len != v_sizes[next_size++]) {
+                std::cerr << "Error page at 0x" << std::hex << c.address + offset << std::dec
+                          << " changed during the dump" << std::endl;
+                return -1;
+            }
+            if (next(chunk{c.address + offset, const_cast<char*>(stored), len}) < 0) return -1;
+        }
+        return c.len;
+    };
+    auto pace = [file](const chunk&) { return file ? file->paced() : 0; };
+    auto sink = make_pipeline(transform_stage{zero_excluded}, store, after_stage{pace}, throttled_sink{fd, throttle});
+    for (size_t i = 0; i < pages;) {
+        if (!(bitmap[i / 64] & (1UL << (i % 64)))) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        while (i < pages && (bitmap[i / 64] & (1UL << (i % 64)))) i++;
+        unsigned long address = map.start_address + first * page;
+        size_t len = (i - first) * page;
+        ret = (map.prot & PROT_READ) ? remote_source{pid, buffer}.pump(address, len, sink)
+                                     : zero_source{buffer}.pump(address, len, sink);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return changed * page;
+}
+
+// Open files of a STRIPE_SET
+struct stripe_files {
+    size_t unit = 0;
+    std::vector<int> fds;
+
+    stripe_files() = default;
+    stripe_files(const stripe_files&) = delete;
+    stripe_files& operator=(const stripe_files&) = delete;
+    ~stripe_files() {
+        for (auto fd : fds) ::close(fd);
+    }
+
+    bool empty() const { return fds.empty(); }
+
+    // Calls fn(stripe, file_offset, done, len) for the pieces of [stream_offset, stream_offset + len)
+    template <typename F>
+    void for_each_piece(size_t stream_offset, size_t len, F&& fn) const {
+        size_t done = 0;
+        while (done < len) {
+            size_t k = (stream_offset + done) / unit;
+            size_t within = (stream_offset + done) % unit;
+            size_t n = std::min(len - done, unit - within);
+            fn(k % fds.size(), (k / fds.size()) * unit + within, done, n);
+            done += n;
+        }
+    }
+};
+
+// Saved pages of a region placed in the stripes
+struct stripe_extent {
+    size_t stream_offset;
+    unsigned long address;
+    size_t len;
+    bool readable;
+};
+
+// Stripe i of the image name in dir. A durable dump gives every image its own stripes, the previous image keeps
+// reading its stripes until the new image replaces it
+static std::string stripe_path(const std::string& dir, const std::string& name, const std::string& generation,
+                               size_t i) {
+    return dir + "/" + name + (generation.empty() ? "" : "." + generation) + ".stripe" + std::to_string(i);
+}
+
+// Stripes i of earlier images of name in dir, other than keep
+static std::vector<std::string> stale_stripes(const std::string& dir, const std::string& name, size_t i,
+                                              const std::string& keep) {
+    std::vector<std::string> v_stale = {stripe_path(dir, name, "", i)};
+    std::string prefix = name + ".";
+    std::string suffix = ".stripe" + std::to_string(i);
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        std::string file = entry.path().filename();
+        if (file.size() <= prefix.size() + suffix.size() || file.compare(0, prefix.size(), prefix) ||
+            file.compare(file.size() - suffix.size(), suffix.size(), suffix)) {
+            continue;
+        }
+        std::string generation = file.substr(prefix.size(), file.size() - prefix.size() - suffix.size());
+        if (generation.size() == 16 && generation.find_first_not_of("0123456789abcdef") == std::string::npos &&
+            entry.path().filename() != std::filesystem::path(keep).filename()) {
+            v_stale.push_back(entry.path());
+        }
+    }
+    return v_stale;
+}
+
+// One thread per stripe file reads its units from the tracee and writes them, so every device works at once
+static ssize_t write_stripes(pid_t pid, const stripe_files& stripes, const std::vector<stripe_extent>& v_extents,
+                             size_t stream_size, qos_throttle& throttle) {
+    debug_msg("Begin " << stream_size << " bytes");
+    std::atomic<bool> failed = false;
+    std::vector<std::thread> v_threads;
+    for (size_t i = 0; i < stripes.fds.size(); i++) {
+        v_threads.emplace_back([&, i]() {
+            std::vector<char> buffer;
+            for (size_t k = i; k * stripes.unit < stream_size && !failed; k += stripes.fds.size()) {
+                size_t unit_start = k * stripes.unit;
+                size_t unit_len = std::min(stripes.unit, stream_size - unit_start);
+                size_t file_offset = (k / stripes.fds.size()) * stripes.unit;
+                auto it = std::upper_bound(
+                    v_extents.begin(), v_extents.end(), unit_start,
+                    [](size_t offset, const stripe_extent& e) { return offset < e.stream_offset; });
+                if (it != v_extents.begin()) --it;
+                // The extents are back to back in the stream, every piece of the unit goes to its place in the file
+                for (; it != v_extents.end() && it->stream_offset < unit_start + unit_len && !failed; ++it) {
+                    size_t from = std::max(unit_start, it->stream_offset);
+                    size_t to = std::min(unit_start + unit_len, it->stream_offset + it->len);
+                    if (from >= to) continue;
+                    unsigned long address = it->address + (from - it->stream_offset);
+                    off_t offset = file_offset + (from - unit_start);
+                    auto sink = make_pipeline(throttled_pwrite_sink{stripes.fds[i], address, offset, throttle});
+                    ssize_t ret = it->readable ? remote_source{pid, buffer, stripes.unit}.pump(address, to - from, sink)
+                                               : zero_source{buffer, stripes.unit}.pump(address, to - from, sink);
+                    if (ret < 0) {
+                        std::cerr << "Error writing stripe " << i << std::endl;
+                        failed = true;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : v_threads) t.join();
+
+    debug_msg("End");
+    return failed ? -1 : static_cast<ssize_t>(stream_size);
+}
+
+ssize_t serializer::restore_serialized_file(const std::string_view& file_path,
+                                           const std::function<int(pid_t pid)>& fixup) {
+    return restore_process(file_path, fixup, {});
+}
+
+ssize_t serializer::restore_process(const std::string_view& file_path, const std::function<int(pid_t pid)>& fixup,
+                                    const std::map<uint64_t, int>& segments, int* helper_fd) {
     ssize_t ret = 0;
     debug_msg("Begin");
+    trace::emit(trace::RESTORE, trace::BEGIN);
 
     auto v_mdata = read_serialized_mdata(file_path);
     if (v_mdata.size() == 0) {
@@ -62,9 +480,30 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
 
     std::vector<user_regs_struct> v_regs;
     std::vector<user_fpregs_struct> v_fpregs;
+    // Saved data of the regions, read after every region is mapped
+    struct data_run {
+        unsigned long address;
+        size_t len;
+        // Offset in the stripes for a STRIPED_MAP
+        size_t file_offset;
+        bool striped;
+        // Mapped from the image instead of read, its region was dumped with dump_options::align
+        bool mapped;
+    };
+    stripe_files stripes;
+    std::vector<memory_map> v_maps;
+    std::vector<data_run> v_runs;
+    std::vector<unsigned long> v_hot;
+    std::vector<fd_table::file> v_files;
+    // Maps of a process of a tree, mapped from their segment
+    std::vector<std::pair<memory_map, uint64_t>> v_shared;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    // The previous entry was a PADDING, the data of this region is aligned in the image
+    bool padded = false;
 
     for (auto& md : v_mdata) {
         debug_msg(md);
+        bool aligned = std::exchange(padded, md.type == mdata_type::PADDING);
         auto ret = ::lseek(fd, md.offset, SEEK_SET);
         if (ret < 0) {
             std::cerr << "Error lseek to data of file " << file_path << " " << strerror(errno) << std::endl;
@@ -84,6 +523,16 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
                 std::cerr << "Error reading memory data of file " << file_path << " " << strerror(errno) << std::endl;
                 return -1;
             }
+        } else if (md.type == mdata_type::HOT_PAGES) {
+            v_hot.resize(md.size / sizeof(unsigned long));
+            ret = filesystem::read(fd, v_hot.data(), v_hot.size() * sizeof(unsigned long));
+            if (ret != static_cast<ssize_t>(v_hot.size() * sizeof(unsigned long))) {
+                std::cerr << "Error reading hot pages of file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+        } else if (md.type == mdata_type::PARENT || md.type == mdata_type::DELTA_MAP || md.type == mdata_type::XOR_MAP) {
+            std::cerr << "Error file " << file_path << " is a delta, compact it with its parents first" << std::endl;
+            return -1;
         } else if (md.type == mdata_type::MEMORY_MAP) {
             memory_map map;
             ret = filesystem::read(fd, &map, sizeof(map));
@@ -94,28 +543,117 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
             }
             debug_msg(map);
 
-            void* addr = MAP_FAILED;
-            if (std::strstr(map.pathname, "[stack]")) {
-                addr = mmap(reinterpret_cast<void*>(map.start_address), map.size(), PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN | MAP_STACK, -1, 0);
-            } else {
-                addr = mmap(reinterpret_cast<void*>(map.start_address), map.size(), PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            v_maps.push_back(map);
+            v_runs.push_back({map.start_address, map.size(), md.offset + sizeof(map), false, aligned && !is_stack(map)});
+        } else if (md.type == mdata_type::SPARSE_MAP) {
+            memory_map map;
+            ret = filesystem::read(fd, &map, sizeof(map));
+            if (ret != sizeof(map)) {
+                std::cerr << "Error reading memory_map data of file " << file_path << " " << strerror(errno)
+                          << std::endl;
+                return -1;
+            }
+            debug_msg(map);
+
+            size_t pages = map.size() / page;
+            std::vector<uint64_t> bitmap(page_bitmap_words(pages));
+            ret = filesystem::read(fd, bitmap.data(), bitmap.size() * sizeof(uint64_t));
+            if (ret != static_cast<ssize_t>(bitmap.size() * sizeof(uint64_t))) {
+                std::cerr << "Error reading page bitmap of " << map << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            v_maps.push_back(map);
+
+            // Pages without their bit are left as the zero pages of the new mapping
+            size_t data_offset = md.offset + sizeof(map) + bitmap.size() * sizeof(uint64_t);
+            size_t saved = 0;
+            for_each_page_run(bitmap.data(), pages, [&](size_t first, size_t count) {
+                v_runs.push_back({map.start_address + first * page, count * page, data_offset + saved * page, false,
+                                  aligned && !is_stack(map)});
+                saved += count;
+            });
+        } else if (md.type == mdata_type::STRIPE_SET) {
+            stripe_set set;
+            ret = filesystem::read(fd, &set, sizeof(set));
+            if (ret != sizeof(set) || set.unit == 0 || md.size != sizeof(set) + set.count * PATH_MAX) {
+                std::cerr << "Error reading stripe set of file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            stripes.unit = set.unit;
+            for (uint64_t i = 0; i < set.count; i++) {
+                char path[PATH_MAX];
+                ret = filesystem::read(fd, path, sizeof(path));
+                path[PATH_MAX - 1] = '\0';
+                int stripe_fd = ret == sizeof(path) ? ::open(path, O_RDONLY | O_CLOEXEC) : -1;
+                if (stripe_fd < 0) {
+                    std::cerr << "Error opening stripe " << path << " " << strerror(errno) << std::endl;
+                    return -1;
+                }
+                stripes.fds.push_back(stripe_fd);
+            }
+        } else if (md.type == mdata_type::STRIPED_MAP) {
+            memory_map map;
+            uint64_t stream_offset;
+            ret = filesystem::read(fd, &map, sizeof(map));
+            if (ret != sizeof(map) || filesystem::read(fd, &stream_offset, sizeof(stream_offset)) !=
+                                          sizeof(stream_offset)) {
+                std::cerr << "Error reading memory_map data of file " << file_path << " " << strerror(errno)
+                          << std::endl;
+                return -1;
             }
-            if (addr == MAP_FAILED) {
-                std::cerr << "Error mapping memory_map " << map << " " << strerror(errno) << std::endl;
+            debug_msg(map);
+            if (stripes.empty()) {
+                std::cerr << "Error striped region " << map << " before the stripe set" << std::endl;
                 return -1;
             }
 
-            ret = filesystem::read(fd, reinterpret_cast<void*>(map.start_address), map.size());
-            if (ret != static_cast<ssize_t>(map.size())) {
-                std::cerr << "Error reading data to memory " << map << " " << strerror(errno) << std::endl;
+            size_t pages = map.size() / page;
+            std::vector<uint64_t> bitmap(page_bitmap_words(pages));
+            ret = filesystem::read(fd, bitmap.data(), bitmap.size() * sizeof(uint64_t));
+            if (ret != static_cast<ssize_t>(bitmap.size() * sizeof(uint64_t))) {
+                std::cerr << "Error reading page bitmap of " << map << " " << strerror(errno) << std::endl;
                 return -1;
             }
 
-            ret = mprotect(reinterpret_cast<void*>(map.start_address), map.size(), map.prot);
-            if (ret < 0) {
-                std::cerr << "Error mprotect data " << map << " " << strerror(errno) << std::endl;
+            v_maps.push_back(map);
+
+            size_t saved = 0;
+            for_each_page_run(bitmap.data(), pages, [&](size_t first, size_t count) {
+                v_runs.push_back(
+                    {map.start_address + first * page, count * page, stream_offset + saved * page, true, false});
+                saved += count;
+            });
+        } else if (md.type == mdata_type::PADDING) {
+            // Nothing to restore, it only marks the next region as aligned
+        } else if (md.type == mdata_type::SHARED_MAP) {
+            memory_map map;
+            uint64_t id;
+            if (filesystem::read(fd, &map, sizeof(map)) != sizeof(map) ||
+                filesystem::read(fd, &id, sizeof(id)) != sizeof(id)) {
+                std::cerr << "Error reading shared map of file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            debug_msg(map);
+            if (!segments.count(id)) {
+                std::cerr << "Error file " << file_path << " is part of a tree, restore it with process_tree"
+                          << std::endl;
+                return -1;
+            }
+            v_maps.push_back(map);
+            v_shared.emplace_back(map, id);
+        } else if (md.type == mdata_type::FILE_DESC) {
+            auto& f = v_files.emplace_back();
+            ret = filesystem::read(fd, &f.e, sizeof(f.e));
+            if (ret != sizeof(f.e) || md.size != sizeof(f.e) + f.e.path_size + f.e.data_size) {
+                std::cerr << "Error reading open file of file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            f.path.resize(f.e.path_size);
+            f.data.resize(f.e.data_size);
+            if (filesystem::read(fd, f.path.data(), f.path.size()) != static_cast<ssize_t>(f.path.size()) ||
+                filesystem::read(fd, f.data.data(), f.data.size()) != static_cast<ssize_t>(f.data.size())) {
+                std::cerr << "Error reading open file of file " << file_path << " " << strerror(errno) << std::endl;
                 return -1;
             }
         } else {
@@ -124,6 +662,132 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
         }
     }
 
+    // Mapping plan in address order, then the pages that are going to be filled are faulted in with one call per
+    // run instead of one fault per page. Older kernels without MADV_POPULATE_WRITE just fault them while loading
+    std::sort(v_maps.begin(), v_maps.end(),
+              [](const memory_map& a, const memory_map& b) { return a.start_address < b.start_address; });
+    std::sort(v_runs.begin(), v_runs.end(), [](const data_run& a, const data_run& b) { return a.address < b.address; });
+    if (map_regions(v_maps) < 0) {
+        return -1;
+    }
+    // Shared maps take their part back from the segment, with the data the other processes of the tree see
+    for (auto& [map, id] : v_shared) {
+        void* addr = ::mmap(reinterpret_cast<void*>(map.start_address), map.size(), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, segments.at(id), map.offset);
+        if (addr == MAP_FAILED) {
+            std::cerr << "Error mapping segment " << id << " to " << map << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        trace_mark(RESTORE_MAP, map.start_address, map.size());
+    }
+    for (auto& [id, segment_fd] : segments) ::close(segment_fd);
+    // Aligned runs replace their part of the anonymous mapping with a private mapping of the image, their pages
+    // are shared with the page cache until written and faulted in on demand
+    for (auto& run : v_runs) {
+        if (!run.mapped) continue;
+        void* addr = ::mmap(reinterpret_cast<void*>(run.address), run.len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_FIXED, fd, run.file_offset);
+        if (addr == MAP_FAILED) {
+            std::cerr << "Error mapping image data to 0x" << std::hex << run.address << std::dec << " "
+                      << strerror(errno) << std::endl;
+            return -1;
+        }
+        trace_mark(RESTORE_MAP, run.address, run.len);
+    }
+    for (size_t i = 0; i < v_runs.size();) {
+        if (v_runs[i].mapped) {
+            i++;
+            continue;
+        }
+        unsigned long start = v_runs[i].address;
+        unsigned long end = start + v_runs[i++].len;
+        while (i < v_runs.size() && !v_runs[i].mapped && v_runs[i].address == end) end += v_runs[i++].len;
+        ::madvise(reinterpret_cast<void*>(start), end - start, MADV_POPULATE_WRITE);
+    }
+
+    // The hot working set is loaded first so it is in memory before the cold pages, which are read in file order.
+    // Cold striped pages are read with one thread per stripe file. Mapped runs only fault in their hot pages
+    auto load = [&](const data_run& run, unsigned long address, size_t len, long only_stripe) {
+        trace_scope(RESTORE_LOAD, address, len);
+        size_t file_offset = run.file_offset + (address - run.address);
+        if (run.mapped) {
+            ::madvise(reinterpret_cast<void*>(address), len, MADV_POPULATE_READ);
+            return true;
+        }
+        if (!run.striped) {
+            return ::pread(fd, reinterpret_cast<void*>(address), len, file_offset) == static_cast<ssize_t>(len);
+        }
+        bool ok = true;
+        stripes.for_each_piece(file_offset, len, [&](size_t stripe, size_t offset, size_t done, size_t n) {
+            if (!ok || (only_stripe >= 0 && static_cast<long>(stripe) != only_stripe)) return;
+            ok = ::pread(stripes.fds[stripe], reinterpret_cast<void*>(address + done), n, offset) ==
+                 static_cast<ssize_t>(n);
+        });
+        return ok;
+    };
+    auto load_pass = [&](bool hot_pass, bool striped, long only_stripe) {
+        for (auto& run : v_runs) {
+            if (run.striped != striped || (run.mapped && !hot_pass)) continue;
+            bool failed = false;
+            hotness::split_runs(v_hot.data(), v_hot.size(), run.address, run.len, page,
+                                [&](unsigned long address, size_t len, bool is_hot) {
+                                    if (failed || is_hot != hot_pass) return;
+                                    failed = !load(run, address, len, only_stripe);
+                                });
+            if (failed) {
+                std::cerr << "Error reading data to memory 0x" << std::hex << run.address << std::dec << " "
+                          << strerror(errno) << std::endl;
+                return false;
+            }
+        }
+        return true;
+    };
+    if (!v_hot.empty() && (!load_pass(true, false, -1) || !load_pass(true, true, -1))) {
+        return -1;
+    }
+    if (!load_pass(false, false, -1)) {
+        return -1;
+    }
+    if (!stripes.empty()) {
+        std::atomic<bool> failed = false;
+        std::vector<std::thread> v_threads;
+        for (size_t i = 0; i < stripes.fds.size(); i++) {
+            v_threads.emplace_back([&, i]() {
+                if (!load_pass(false, true, i)) failed = true;
+            });
+        }
+        for (auto& t : v_threads) t.join();
+        if (failed) {
+            return -1;
+        }
+    }
+
+    trace::emit(trace::RESTORE_PROTECT, trace::BEGIN, v_maps.size());
+    if (protect_regions(v_maps) < 0) {
+        return -1;
+    }
+    trace::emit(trace::RESTORE_PROTECT, trace::END, v_maps.size());
+    // Above every restored number, fd_table::restore must not replace it
+    if (helper_fd && *helper_fd >= 0) {
+        int high = 0;
+        for (auto& f : v_files) high = std::max(high, f.e.fd + 1);
+        int moved = ::fcntl(*helper_fd, F_DUPFD_CLOEXEC, std::max(high, *helper_fd));
+        if (moved < 0) {
+            std::cerr << "Error moving fd " << *helper_fd << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if (moved != *helper_fd) ::close(*helper_fd);
+        *helper_fd = moved;
+    }
+    // The image and the stripes are not read anymore, a restored file can take their numbers
+    if (fd_table::restore(v_files) < 0) {
+        std::cerr << "Error restoring the open files of file " << file_path << std::endl;
+        return -1;
+    }
+    trace::emit(trace::RESTORE, trace::END);
+    // The process becomes the restored one and never reaches exit
+    trace::flush();
+
     // TODO: restore threads
 
     // Now change the registers with a child
@@ -135,7 +799,8 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
     int status;
     if (pid) {
         ptracer::allow_pid();
-        if (pid != wait(&status)) {
+        // The children of a restored tree are already running
+        if (pid != waitpid(pid, &status, 0)) {
             std::cerr << "Error wait " << strerror(errno) << std::endl;
             return -1;
         }
@@ -147,6 +812,19 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
         p.init();
         p.set_fpregs(v_fpregs);
         p.set_regs(v_regs);
+        // The restored process does not keep the fd of the helper, the helper still has its own copy
+        if (helper_fd && *helper_fd >= 0) {
+            if (p.infect(false) < 0 || p.remote_syscall(SYS_close, *helper_fd) < 0 || p.cure() < 0) {
+                std::cerr << "Error closing fd " << *helper_fd << " of restored pid " << ppid << std::endl;
+                ::kill(ppid, SIGKILL);
+                exit(1);
+            }
+        }
+        if (fixup && fixup(ppid) < 0) {
+            std::cerr << "Error fixup of restored pid " << ppid << std::endl;
+            ::kill(ppid, SIGKILL);
+            exit(1);
+        }
         // p.detach();
         exit(0);
     }
@@ -155,6 +833,78 @@ ssize_t serializer::restore_serialized_file(const std::string_view& file_path) {
     return ret;
 }
 
+std::vector<pid_t> serializer::spawn_clones(const std::string_view& file_path, size_t n, const clone_fixup& fixup) {
+    debug_msg("Begin " << n << " clones");
+    // Every clone writes its index once it is restored and fixed up. A clone that exits without it failed
+    int ready[2];
+    if (::pipe2(ready, O_CLOEXEC | O_NONBLOCK) < 0) {
+        std::cerr << "Error pipe " << strerror(errno) << std::endl;
+        return {};
+    }
+
+    std::vector<pid_t> v_pids;
+    bool failed = false;
+    for (size_t i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Error fork " << strerror(errno) << std::endl;
+            failed = true;
+            break;
+        }
+        if (pid == 0) {
+            ::close(ready[0]);
+            // Only the helper of the clone keeps the write end, see restore_process
+            restore_process(
+                file_path,
+                [&](pid_t clone) {
+                    if (fixup && fixup(clone, i) < 0) return -1;
+                    uint32_t index = i;
+                    return ::write(ready[1], &index, sizeof(index)) == sizeof(index) ? 0 : -1;
+                },
+                {}, &ready[1]);
+            // Only reached when the restore failed
+            std::cerr << "Error restoring clone " << i << " from " << file_path << std::endl;
+            _exit(1);
+        }
+        v_pids.push_back(pid);
+    }
+    ::close(ready[1]);
+    defer({ ::close(ready[0]); });
+
+    std::vector<bool> v_ready(v_pids.size(), false);
+    size_t n_ready = 0;
+    auto drain = [&]() {
+        uint32_t index;
+        while (::read(ready[0], &index, sizeof(index)) == sizeof(index)) {
+            if (index < v_ready.size() && !v_ready[index]) {
+                v_ready[index] = true;
+                n_ready++;
+            }
+        }
+    };
+    while (!failed && n_ready < v_pids.size()) {
+        pollfd pfd = {ready[0], POLLIN, 0};
+        ::poll(&pfd, 1, 10);
+        drain();
+        // Not reaped, the exit status of a clone belongs to the caller
+        for (size_t i = 0; i < v_pids.size() && !failed; i++) {
+            if (v_ready[i]) continue;
+            siginfo_t info = {};
+            if (::waitid(P_PID, v_pids[i], &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) continue;
+            drain();
+            failed = !v_ready[i];
+        }
+    }
+
+    if (failed) {
+        for (auto pid : v_pids) ::kill(pid, SIGKILL);
+        for (auto pid : v_pids) ::waitpid(pid, nullptr, 0);
+        return {};
+    }
+    debug_msg("End");
+    return v_pids;
+}
+
 std::vector<serializer::mdata> serializer::read_serialized_mdata(const std::string_view& file_path) {
     ssize_t ret = 0;
     std::vector<mdata> v_md;
@@ -197,7 +947,7 @@ std::vector<serializer::mdata> serializer::read_serialized_mdata(const std::stri
     return v_md;
 }
 
-ssize_t serializer::make_checkpoint(const std::string_view& file_path) {
+ssize_t serializer::make_checkpoint(const std::string_view& file_path, const dump_options& options) {
     debug_msg("Begin");
     pid_t pid = fork();
     if (pid < 0) {
@@ -208,7 +958,7 @@ ssize_t serializer::make_checkpoint(const std::string_view& file_path) {
         ptracer::allow_pid();
     } else {
         pid_t tracee = getppid();
-        int ret = serializer::dump_serialized_file(tracee, file_path);
+        int ret = serializer::dump_serialized_file(tracee, file_path, options);
         if (ret < 0) {
             std::cerr << "Error dumping file " << file_path << std::endl;
         }
@@ -218,19 +968,54 @@ ssize_t serializer::make_checkpoint(const std::string_view& file_path) {
     return 0;
 }
 
-ssize_t serializer::dump_serialized_file(pid_t pid, const std::string_view& file_path) {
+ssize_t serializer::dump_serialized_file(pid_t pid, const std::string_view& file_path, const dump_options& options) {
+    return dump_process(pid, file_path, options, nullptr, {});
+}
+
+ssize_t serializer::dump_process(pid_t pid, const std::string_view& file_path, const dump_options& options,
+                                 ptracer* stopped, const shared_segment_fn& shared_segment,
+                                 std::unique_ptr<durable_file>* staged) {
     ssize_t ret = 0;
     debug_msg("Begin");
+    trace_scope(DUMP, pid);
 
-    std::string file_path_str{file_path};
+    // With QoS limits the image is staged and only throttled once the tracee runs again, see durable_file::stage.
+    // The policy applies to the threads that copy it, never to this one
+    qos_throttle throttle{options.qos.limits() ? qos_policy{} : options.qos};
 
-    int fd = ::open(file_path_str.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    defer({
-        if (fd >= 0) ::close(fd);
-    });
+    // Sampled before stopping the tracee, it has to keep running during the window
+    std::vector<unsigned long> v_hot;
+    if (options.hot_window.count() > 0 && !stopped) {
+        v_hot = hotness::sample(pid, options.hot_window);
+    }
 
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    size_t align = options.align ? std::max<size_t>(options.align, page) : 0;
+    if (align & (align - 1)) {
+        std::cerr << "Error alignment " << options.align << " is not a power of two" << std::endl;
+        return -1;
+    }
+
+    // Opened before stopping the tracee, a delta is compared page by page with it
+    image_chain chain;
+    if (!options.parent.empty()) {
+        std::string parent_path = options.parent;
+        auto slash = file_path.rfind('/');
+        if (parent_path[0] != '/' && slash != std::string_view::npos) {
+            parent_path = std::string{file_path.substr(0, slash + 1)} + parent_path;
+        }
+        if (chain.open(parent_path) < 0) {
+            std::cerr << "Error opening parent image " << parent_path << std::endl;
+            return -1;
+        }
+    }
+
+    std::string file_path_str{file_path};
+
+    auto file = std::make_unique<durable_file>(file_path_str, options.durable, options.writeback_window);
+    if (options.qos.limits()) file->stage(options.qos);
+    int fd = file->open();
     if (fd < 0) {
-        std::cerr << "Error opening file " << file_path << " " << strerror(errno) << std::endl;
         return fd;
     }
 
@@ -241,13 +1026,87 @@ ssize_t serializer::dump_serialized_file(pid_t pid, const std::string_view& file
         return ret;
     }
 
-    ptracer p{pid};
-    ret = p.init();
-    if (ret < 0) {
-        std::cerr << "Error initiating ptracer for pid " << pid << std::endl;
-        return ret;
+    if (!options.parent.empty()) {
+        auto offset = ::lseek(fd, 0, SEEK_CUR);
+        mdata md_parent = {.type = mdata_type::PARENT, .offset = offset + sizeof(mdata), .size = options.parent.size()};
+        debug_msg(md_parent);
+
+        ret = filesystem::write(fd, &md_parent, sizeof(md_parent));
+        if (ret != sizeof(md_parent)) {
+            std::cerr << "Error writing md_parent to file " << file_path << " " << strerror(errno) << std::endl;
+            return ret;
+        }
+        ret = filesystem::write(fd, options.parent.data(), options.parent.size());
+        if (ret != static_cast<ssize_t>(options.parent.size())) {
+            std::cerr << "Error writing parent to file " << file_path << " " << strerror(errno) << std::endl;
+            return ret;
+        }
+    }
+
+    stripe_files stripes;
+    if (!options.stripe_dirs.empty()) {
+        if (chain.size() > 0) {
+            std::cerr << "Error a delta cannot be striped" << std::endl;
+            return -1;
+        }
+        auto slash = file_path.rfind('/');
+        std::string name{slash == std::string_view::npos ? file_path : file_path.substr(slash + 1)};
+
+        stripes.unit = (options.stripe_unit + page - 1) / page * page;
+        std::string generation;
+        if (options.durable) {
+            char hex[17];
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            std::snprintf(hex, sizeof(hex), "%016lx", static_cast<unsigned long>(now.count()));
+            generation = hex;
+        }
+        std::vector<char> paths(options.stripe_dirs.size() * PATH_MAX, '\0');
+        for (size_t i = 0; i < options.stripe_dirs.size(); i++) {
+            std::string path = stripe_path(options.stripe_dirs[i], name, generation, i);
+            if (path.size() >= PATH_MAX) {
+                std::cerr << "Error stripe path too long " << path << std::endl;
+                return -1;
+            }
+            // Synced with the image, staged with it too
+            int stripe_fd = file->open_extra(path);
+            if (stripe_fd < 0) {
+                std::cerr << "Error opening stripe " << path << std::endl;
+                return -1;
+            }
+            stripes.fds.push_back(stripe_fd);
+            if (options.durable) {
+                for (auto& stale : stale_stripes(options.stripe_dirs[i], name, i, path)) file->remove_on_commit(stale);
+            }
+            std::memcpy(&paths[i * PATH_MAX], path.c_str(), path.size());
+        }
+
+        stripe_set set = {stripes.unit, stripes.fds.size()};
+        auto offset = ::lseek(fd, 0, SEEK_CUR);
+        mdata md_set = {
+            .type = mdata_type::STRIPE_SET, .offset = offset + sizeof(mdata), .size = sizeof(set) + paths.size()};
+        debug_msg(md_set);
+
+        if (filesystem::write(fd, &md_set, sizeof(md_set)) != sizeof(md_set) ||
+            filesystem::write(fd, &set, sizeof(set)) != sizeof(set) ||
+            filesystem::write(fd, paths.data(), paths.size()) != static_cast<ssize_t>(paths.size())) {
+            std::cerr << "Error writing stripe set to file " << file_path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
     }
 
+    std::optional<ptracer> own;
+    if (!stopped) {
+        trace::emit(trace::ATTACH, trace::BEGIN, pid);
+        ret = own.emplace(pid, options.stop).init();
+        trace::emit(trace::ATTACH, trace::END, pid);
+        if (ret < 0) {
+            std::cerr << "Error initiating ptracer for pid " << pid << std::endl;
+            return ret;
+        }
+    }
+    ptracer& p = stopped ? *stopped : *own;
+
+    trace::emit(trace::DUMP_REGS, trace::BEGIN);
     auto v_regs = p.get_regs();
     if (v_regs.size() == 0) {
         std::cerr << "Error getting regs for pid " << pid << std::endl;
@@ -294,14 +1153,173 @@ ssize_t serializer::dump_serialized_file(pid_t pid, const std::string_view& file
         }
     }
 
+    trace::emit(trace::DUMP_REGS, trace::END, v_regs.size());
+
+    if (!v_hot.empty()) {
+        auto offset = ::lseek(fd, 0, SEEK_CUR);
+        size_t hot_size = v_hot.size() * sizeof(unsigned long);
+        mdata md_hot = {.type = mdata_type::HOT_PAGES, .offset = offset + sizeof(mdata), .size = hot_size};
+        debug_msg(md_hot);
+
+        ret = filesystem::write(fd, &md_hot, sizeof(md_hot));
+        if (ret != sizeof(md_hot)) {
+            std::cerr << "Error writing md_hot to file " << file_path << " " << strerror(errno) << std::endl;
+            return ret;
+        }
+        ret = filesystem::write(fd, v_hot.data(), hot_size);
+        if (ret != static_cast<ssize_t>(hot_size)) {
+            std::cerr << "Error writing hot pages to file " << file_path << " " << strerror(errno) << std::endl;
+            return ret;
+        }
+    }
+
+    if (options.files) {
+        std::vector<fd_table::file> v_files;
+        if (fd_table::read_remote(pid, v_files) < 0) {
+            std::cerr << "Error reading the open files of pid " << pid << std::endl;
+            return -1;
+        }
+        for (auto& f : v_files) {
+            auto offset = ::lseek(fd, 0, SEEK_CUR);
+            mdata md_file = {.type = mdata_type::FILE_DESC,
+                             .offset = offset + sizeof(mdata),
+                             .size = sizeof(f.e) + f.path.size() + f.data.size()};
+            debug_msg(md_file);
+
+            if (filesystem::write(fd, &md_file, sizeof(md_file)) != sizeof(md_file) ||
+                filesystem::write(fd, &f.e, sizeof(f.e)) != sizeof(f.e) ||
+                filesystem::write(fd, f.path.data(), f.path.size()) != static_cast<ssize_t>(f.path.size()) ||
+                filesystem::write(fd, f.data.data(), f.data.size()) != static_cast<ssize_t>(f.data.size())) {
+                std::cerr << "Error writing fd " << f.e.fd << " to file " << file_path << " " << strerror(errno)
+                          << std::endl;
+                return -1;
+            }
+        }
+    }
+
     auto v_maps = maps_parser::get_maps(pid);
+    auto v_exclusions = exclusion_table::read_remote(pid, v_maps);
+    if (options.trim_stacks || options.trim_free) {
+        auto v_stacks = options.trim_stacks ? liveness::dead_stacks(v_maps, v_regs) : decltype(v_exclusions){};
+        auto v_free = options.trim_free ? liveness::free_chunks(pid, v_maps) : decltype(v_exclusions){};
+        v_exclusions.insert(v_exclusions.end(), v_stacks.begin(), v_stacks.end());
+        v_exclusions.insert(v_exclusions.end(), v_free.begin(), v_free.end());
+        std::sort(v_exclusions.begin(), v_exclusions.end(),
+                  [](const auto& a, const auto& b) { return a.start_address < b.start_address; });
+    }
+
+    // After reading the maps, the parasite maps a page of its own. Cured when p is destroyed
+    if (options.parasite && chain.size() == 0 && stripes.empty() && p.infect() < 0) {
+        std::cerr << "Warning: parasite not available for pid " << pid << ", copying the memory" << std::endl;
+    }
+
+    // The deltas and the stripes leave most of the memory out of the image, the estimate would be far off
+    if (chain.size() == 0 && stripes.empty()) {
+        size_t expected = 0;
+        for (auto& map : v_maps) {
+            if (is_saved(map)) expected += sizeof(mdata) + sizeof(map) + map.size();
+        }
+        file->preallocate(expected);
+    }
 
     std::vector<char> buffer;
+    std::vector<stripe_extent> v_extents;
+    size_t stream_size = 0;
     for (auto& map : v_maps) {
         debug_msg(map);
-        if (std::strstr(map.pathname, "[vdso]")) continue;
-        if (std::strstr(map.pathname, "[vvar]")) continue;
+        if (!is_saved(map)) continue;
+        trace_scope(DUMP_MAP, map.start_address, map.size());
+
+        long segment = shared_segment ? shared_segment(map) : -1;
+        if (segment >= 0) {
+            uint64_t id = segment;
+            if (write_map_entry(fd, mdata_type::SHARED_MAP, map, sizeof(map) + sizeof(id)) < 0 ||
+                filesystem::write(fd, &id, sizeof(id)) != sizeof(id)) {
+                std::cerr << "Error writing " << map << " to file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
+        if (!stripes.empty()) {
+            size_t pages = map.size() / page;
+            auto bitmap = saved_pages(map, v_exclusions);
+            if (bitmap.empty()) {
+                bitmap.assign(page_bitmap_words(pages), 0);
+                for (size_t i = 0; i < pages; i++) bitmap[i / 64] |= 1UL << (i % 64);
+            }
+            size_t bitmap_size = bitmap.size() * sizeof(uint64_t);
+            uint64_t stream_offset = stream_size;
+            size_t entry_size = sizeof(map) + sizeof(stream_offset) + bitmap_size;
+            if (write_map_entry(fd, mdata_type::STRIPED_MAP, map, entry_size) < 0 ||
+                filesystem::write(fd, &stream_offset, sizeof(stream_offset)) != sizeof(stream_offset) ||
+                filesystem::write(fd, bitmap.data(), bitmap_size) != static_cast<ssize_t>(bitmap_size)) {
+                std::cerr << "Error writing " << map << " to file " << file_path << " " << strerror(errno) << std::endl;
+                return -1;
+            }
+            for_each_page_run(bitmap.data(), pages, [&](size_t first, size_t count) {
+                v_extents.push_back({stream_size, map.start_address + first * page, count * page,
+                                     (map.prot & PROT_READ) != 0});
+                stream_size += count * page;
+            });
+            continue;
+        }
+
+        if (chain.size() > 0) {
+            ret = dump_delta_map(pid, fd, map, v_exclusions, chain, options.xor_pages, buffer, throttle, file.get());
+            if (ret < 0) {
+                std::cerr << "Error dumping " << map << " to file " << file_path << std::endl;
+                return ret;
+            }
+            if (file->paced() < 0) return -1;
+            continue;
+        }
+
+        auto bitmap = saved_pages(map, v_exclusions);
+        if (align && write_padding(fd, map, sizeof(map) + bitmap.size() * sizeof(uint64_t), align) < 0) {
+            std::cerr << "Error writing padding of " << map << " to file " << file_path << std::endl;
+            return -1;
+        }
         auto offset = ::lseek(fd, 0, SEEK_CUR);
+
+        if (!bitmap.empty()) {
+            size_t pages = map.size() / page;
+            size_t saved = 0;
+            for_each_page_run(bitmap.data(), pages, [&](size_t, size_t count) { saved += count * page; });
+            size_t bitmap_size = bitmap.size() * sizeof(uint64_t);
+            mdata md_map = {.type = mdata_type::SPARSE_MAP,
+                            .offset = offset + sizeof(mdata),
+                            .size = sizeof(map) + bitmap_size + saved};
+            debug_msg(md_map);
+
+            ret = filesystem::write(fd, &md_map, sizeof(md_map));
+            if (ret != sizeof(md_map)) {
+                std::cerr << "Error writing md_map to file " << file_path << " " << strerror(errno) << std::endl;
+                return ret;
+            }
+            ret = filesystem::write(fd, &map, sizeof(map));
+            if (ret != sizeof(map)) {
+                std::cerr << "Error writing map to file " << file_path << " " << strerror(errno) << std::endl;
+                return ret;
+            }
+            ret = filesystem::write(fd, bitmap.data(), bitmap_size);
+            if (ret != static_cast<ssize_t>(bitmap_size)) {
+                std::cerr << "Error writing page bitmap to file " << file_path << " " << strerror(errno) << std::endl;
+                return ret;
+            }
+            bool failed = false;
+            for_each_page_run(bitmap.data(), pages, [&](size_t first, size_t count) {
+                if (failed) return;
+                failed = dump_range(pid, fd, map, map.start_address + first * page, count * page, buffer, throttle,
+                                    &p, file.get()) < 0;
+            });
+            if (failed) {
+                std::cerr << "Error dumping " << map << " to file " << file_path << std::endl;
+                return -1;
+            }
+            continue;
+        }
+
         mdata md_map = {
             .type = mdata_type::MEMORY_MAP, .offset = offset + sizeof(mdata), .size = sizeof(map) + map.size()};
         debug_msg(md_map);
@@ -317,24 +1335,204 @@ ssize_t serializer::dump_serialized_file(pid_t pid, const std::string_view& file
             return ret;
         }
 
-        buffer.resize(map.size());
-        if (map.prot & PROT_READ) {
-            ret = filesystem::remote_read(pid, reinterpret_cast<void*>(map.start_address), buffer.data(), map.size());
-            if (ret != static_cast<ssize_t>(map.size())) {
-                std::cerr << "Error reading remote data " << ret << " " << strerror(errno) << std::endl;
-                return ret;
-            }
+        ret = dump_range(pid, fd, map, map.start_address, map.size(), buffer, throttle, &p, file.get());
+        if (ret < 0) {
+            std::cerr << "Error dumping " << map << " to file " << file_path << std::endl;
+            return ret;
         }
+    }
 
-        ret = filesystem::write(fd, buffer.data(), buffer.size());
-        if (ret != static_cast<ssize_t>(buffer.size())) {
-            std::cerr << "Error writing remote data to file " << file_path << " " << strerror(errno) << std::endl;
+    if (!stripes.empty()) {
+        ret = write_stripes(pid, stripes, v_extents, stream_size, throttle);
+        if (ret < 0) {
+            std::cerr << "Error writing the stripes of file " << file_path << std::endl;
             return ret;
         }
     }
 
+    // Still stopped, no write can be missed
+    if (options.clear_soft_dirty && hotness::soft_dirty_supported() && hotness::clear_soft_dirty(pid) < 0) {
+        std::cerr << "Error clearing soft-dirty bits of " << pid << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    // The image is complete, the tracee does not wait for the disk nor for the copy of a staged image
+    if ((options.durable || file->staged()) && !stopped && ((p.infected() && p.cure() < 0) || p.detach() < 0)) {
+        std::cerr << "Error releasing pid " << pid << std::endl;
+        return -1;
+    }
+    // The caller commits once it released the tracee, a spilled image too
+    if (stopped && staged && (file->staged() || file->stats().spilled > 0)) {
+        *staged = std::move(file);
+        debug_msg("End staged");
+        return ret;
+    }
+    if (file->commit() < 0) {
+        std::cerr << "Error committing file " << file_path << std::endl;
+        return -1;
+    }
+    if (options.stats) *options.stats = file->stats();
+
     debug_msg("End");
     return ret;
 }
 
-}  // namespace RECK
\ No newline at end of file
+ssize_t serializer::compact_images(const std::vector<std::string>& chain, const std::string_view& file_path,
+                                   unsigned threads) {
+    debug_msg("Begin");
+    trace_scope(COMPACT, chain.size());
+    constexpr size_t io_size = 1024 * 1024;
+
+    image_chain images;
+    if (images.open(chain) < 0) {
+        std::cerr << "Error opening chain of " << chain.size() << " images" << std::endl;
+        return -1;
+    }
+    auto& newest = images.newest();
+    size_t page = newest.page_size();
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+
+    // Pages of the newest regions saved somewhere in the chain, found in parallel through the region index of each
+    // image. They are resolved, and XOR pages decoded, by the workers that write them
+    auto& v_regions = newest.regions();
+    std::vector<std::vector<bool>> v_sources(v_regions.size());
+    std::atomic<size_t> next = 0;
+    auto run_workers = [&](auto&& work) {
+        std::vector<std::thread> v_threads;
+        for (unsigned i = 0; i < threads; i++) v_threads.emplace_back(work);
+        for (auto& t : v_threads) t.join();
+    };
+    run_workers([&]() {
+        for (size_t i = next++; i < v_regions.size(); i = next++) {
+            auto& region = v_regions[i];
+            auto& sources = v_sources[i];
+            for (unsigned long address = region.start(); address < region.end(); address += page) {
+                sources.push_back(images.saved(address));
+            }
+        }
+    });
+
+    // The workers write at their own offsets, there is no writeback window to pace
+    std::string file_path_str{file_path};
+    durable_file file{file_path_str, true, 0};
+    int fd = file.open();
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Everything but the data of the regions is written here, the data offsets are laid out for the workers
+    size_t offset = 0;
+    auto put = [&](const void* data, size_t len) {
+        if (filesystem::pwrite(fd, data, len, offset) != static_cast<ssize_t>(len)) return false;
+        offset += len;
+        return true;
+    };
+    header h;
+    if (!put(&h, sizeof(h))) {
+        std::cerr << "Error writing header to file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    for (auto& md : newest.mdata()) {
+        if (md.type == MEMORY_MAP || md.type == SPARSE_MAP || md.type == DELTA_MAP || md.type == XOR_MAP ||
+            md.type == PARENT || md.type == PADDING) {
+            continue;
+        }
+        auto payload = newest.payload(md);
+        mdata md_out = {.type = md.type, .offset = offset + sizeof(mdata), .size = md.size};
+        if (!put(&md_out, sizeof(md_out)) || !put(payload.data(), payload.size())) {
+            std::cerr << "Error writing " << md << " to file " << file_path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+
+    struct chunk {
+        size_t region;
+        size_t first;   // first source page of the region
+        size_t count;   // saved pages in the chunk
+        size_t offset;  // in the output file
+    };
+    std::vector<chunk> v_chunks;
+    size_t pages_per_chunk = io_size / page;
+    for (size_t i = 0; i < v_regions.size(); i++) {
+        auto& map = *v_regions[i].map;
+        auto& sources = v_sources[i];
+        size_t pages = sources.size();
+        std::vector<uint64_t> bitmap(page_bitmap_words(pages), 0);
+        size_t saved = 0;
+        for (size_t p = 0; p < pages; p++) {
+            if (sources[p]) {
+                bitmap[p / 64] |= 1UL << (p % 64);
+                saved++;
+            }
+        }
+
+        // Zero filled pages only need a bitmap when there are some
+        bool sparse = saved != pages;
+        size_t bitmap_size = sparse ? bitmap.size() * sizeof(uint64_t) : 0;
+        mdata md_map = {.type = sparse ? SPARSE_MAP : MEMORY_MAP,
+                        .offset = offset + sizeof(mdata),
+                        .size = sizeof(map) + bitmap_size + saved * page};
+        debug_msg(md_map);
+        if (!put(&md_map, sizeof(md_map)) || !put(&map, sizeof(map)) || !put(bitmap.data(), bitmap_size)) {
+            std::cerr << "Error writing " << map << " to file " << file_path << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+
+        size_t p = 0;
+        while (p < pages) {
+            chunk c = {i, p, 0, offset};
+            while (p < pages && c.count < pages_per_chunk) {
+                if (sources[p]) c.count++;
+                p++;
+            }
+            if (c.count > 0) v_chunks.push_back(c);
+            offset += c.count * page;
+        }
+    }
+
+    file.preallocate(offset);
+
+    // Workers fill an aligned buffer per chunk and write it with a single pwrite
+    std::atomic<bool> failed = false;
+    next = 0;
+    run_workers([&]() {
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, page, io_size) != 0) {
+            std::cerr << "Error allocating buffer of " << io_size << " bytes" << std::endl;
+            failed = true;
+            return;
+        }
+        defer({ free(buffer); });
+        for (size_t i = next++; i < v_chunks.size() && !failed; i = next++) {
+            auto& c = v_chunks[i];
+            auto& sources = v_sources[c.region];
+            char* dst = static_cast<char*>(buffer);
+            for (size_t p = c.first, copied = 0; copied < c.count; p++) {
+                if (!sources[p]) continue;
+                char* out = dst + copied * page;
+                const char* src = images.page(v_regions[c.region].start() + p * page, out);
+                if (src != out) std::memcpy(out, src, page);
+                copied++;
+            }
+            size_t len = c.count * page;
+            if (filesystem::pwrite(fd, buffer, len, c.offset) != static_cast<ssize_t>(len)) {
+                std::cerr << "Error writing pages to file " << file_path << " " << strerror(errno) << std::endl;
+                failed = true;
+            }
+        }
+    });
+    if (failed) {
+        return -1;
+    }
+
+    // pwrite leaves the file offset alone, commit takes the size of the image from it
+    if (::lseek(fd, offset, SEEK_SET) < 0 || file.commit() < 0) {
+        std::cerr << "Error committing file " << file_path << std::endl;
+        return -1;
+    }
+
+    debug_msg("End");
+    return offset;
+}
+
+}  // namespace RECK
@@ -0,0 +1,421 @@
+// #define DEBUG
+
+#include "snapshot.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <wait.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "exclusion.hpp"
+#include "hotness.hpp"
+#include "image_reader.hpp"
+#include "maps_parser.hpp"
+
+namespace RECK {
+
+constexpr uint64_t pagemap_present = 1UL << 63;
+constexpr uint64_t pagemap_swapped = 1UL << 62;
+constexpr uint64_t pagemap_soft_dirty = 1UL << 55;
+// Pages of a region compared or looked up in the pagemap at once
+constexpr size_t rollback_chunk = 1024 * 1024;
+
+static size_t control_size(size_t capacity, size_t header, size_t slot) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (header + capacity * slot + page - 1) & ~(page - 1);
+}
+
+static bool overlaps(const memory_map& a, const memory_map& b) {
+    return a.start_address < b.end_address && b.start_address < a.end_address;
+}
+
+// Calls fn(start, end) for the parts of [start, end) outside of the sorted maps
+template <typename F>
+static void for_each_gap(unsigned long start, unsigned long end, const std::vector<memory_map>& v_maps, F&& fn) {
+    unsigned long address = start;
+    for (auto& map : v_maps) {
+        if (map.end_address <= address) continue;
+        if (map.start_address >= end) break;
+        if (map.start_address > address) fn(address, map.start_address);
+        address = map.end_address;
+    }
+    if (address < end) fn(address, end);
+}
+
+static const memory_map* find_heap(const std::vector<memory_map>& v_maps) {
+    for (auto& map : v_maps) {
+        if (std::strstr(map.pathname, "[heap]")) return &map;
+    }
+    return nullptr;
+}
+
+snapshot_ring::snapshot_ring(size_t capacity, const dump_options& options) : m_options(options) {
+    debug_msg("Begin");
+    size_t size = control_size(capacity, sizeof(control), sizeof(slot));
+    // Shared so the helpers see it too, and excluded so neither a snapshot nor a rollback touches it
+    void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Error mapping snapshot ring " << strerror(errno) << std::endl;
+        return;
+    }
+    if (exclude(addr, size) < 0) {
+        std::cerr << "Error excluding snapshot ring from the snapshots" << std::endl;
+        ::munmap(addr, size);
+        return;
+    }
+    m_control = static_cast<control*>(addr);
+    m_control->capacity = capacity;
+    m_control->next_seq = 1;
+    m_control->restored = 0;
+    m_control->helper = 0;
+    m_control->soft_dirty_base = 0;
+    for (size_t i = 0; i < capacity; i++) m_control->slots[i] = {0, -1};
+    debug_msg("End");
+}
+
+snapshot_ring::~snapshot_ring() {
+    if (!m_control) return;
+    for (size_t i = 0; i < m_control->capacity; i++) {
+        if (m_control->slots[i].fd >= 0) ::close(m_control->slots[i].fd);
+    }
+    unexclude(m_control);
+    ::munmap(m_control, control_size(m_control->capacity, sizeof(control), sizeof(slot)));
+}
+
+snapshot_ring::slot* snapshot_ring::find(long seq) const {
+    if (!m_control || seq <= 0) return nullptr;
+    for (size_t i = 0; i < m_control->capacity; i++) {
+        if (m_control->slots[i].seq == seq) return &m_control->slots[i];
+    }
+    return nullptr;
+}
+
+long snapshot_ring::restored() const { return m_control ? m_control->restored : 0; }
+
+long snapshot_ring::latest() const {
+    long seq = 0;
+    for (size_t i = 0; m_control && i < m_control->capacity; i++) seq = std::max(seq, m_control->slots[i].seq);
+    return seq;
+}
+
+size_t snapshot_ring::size() const {
+    size_t n = 0;
+    for (size_t i = 0; m_control && i < m_control->capacity; i++) n += m_control->slots[i].seq > 0;
+    return n;
+}
+
+size_t snapshot_ring::capacity() const { return m_control ? m_control->capacity : 0; }
+
+long snapshot_ring::capture() {
+    debug_msg("Begin");
+    if (!m_control || m_control->capacity == 0) {
+        std::cerr << "Error snapshot ring without slots" << std::endl;
+        return -1;
+    }
+    if (!m_options.parent.empty() || !m_options.stripe_dirs.empty()) {
+        std::cerr << "Error snapshots are full images in memory, without parent or stripes" << std::endl;
+        return -1;
+    }
+
+    // A free slot or the oldest snapshot
+    slot* s = &m_control->slots[0];
+    for (size_t i = 0; i < m_control->capacity; i++) {
+        auto& candidate = m_control->slots[i];
+        if (candidate.seq < s->seq) s = &candidate;
+    }
+    s->seq = 0;
+    if (s->fd < 0) {
+        s->fd = ::memfd_create("reck-snapshot", MFD_CLOEXEC);
+        if (s->fd < 0) {
+            std::cerr << "Error memfd_create " << strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    long seq = m_control->next_seq++;
+    std::string path = "/proc/self/fd/" + std::to_string(s->fd);
+
+    ptracer::allow_pid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Error fork " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (pid == 0) {
+        dump_options options = m_options;
+        options.clear_soft_dirty = true;
+        exit(serializer::dump_serialized_file(getppid(), path, options) < 0 ? 1 : 0);
+    }
+
+    // The snapshot is taken in this wait. A rollback comes back to it and the kernel restarts it, for a helper
+    // that was reaped long ago
+    int status = 0;
+    pid_t ret;
+    while ((ret = ::waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+    }
+    if (ret < 0 && errno == ECHILD) {
+        if (m_control->helper > 0) ::waitpid(std::exchange(m_control->helper, 0), nullptr, 0);
+        // The rollback cleared the bits once the process was back at the snapshot
+        m_control->soft_dirty_base = m_control->restored;
+        debug_msg("End rolled back to " << m_control->restored);
+        return 0;
+    }
+    // The dump may have cleared the bits before it failed
+    m_control->soft_dirty_base = 0;
+    if (ret < 0) {
+        std::cerr << "Error waitpid " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "Error taking snapshot " << seq << std::endl;
+        return -1;
+    }
+    s->seq = seq;
+    m_control->soft_dirty_base = seq;
+
+    debug_msg("End " << seq);
+    return seq;
+}
+
+int snapshot_ring::rollback(long seq) {
+    debug_msg("Begin " << seq);
+    auto s = find(seq);
+    if (!s) {
+        std::cerr << "Error snapshot " << seq << " is not in the ring" << std::endl;
+        return -1;
+    }
+    int fd = s->fd;
+    bool use_soft_dirty = m_control->soft_dirty_base == seq;
+    long restored = std::exchange(m_control->restored, seq);
+
+    ptracer::allow_pid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Error fork " << strerror(errno) << std::endl;
+        m_control->restored = restored;
+        return -1;
+    }
+    if (pid == 0) {
+        exit(restore_snapshot(getppid(), fd, m_options, use_soft_dirty) < 0 ? 1 : 0);
+    }
+    m_control->helper = pid;
+
+    // Only returns if the helper failed, otherwise this process continues in capture
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    // The helper may have cleared the bits before it failed
+    m_control->soft_dirty_base = 0;
+    m_control->helper = 0;
+    m_control->restored = restored;
+    std::cerr << "Error rolling back to snapshot " << seq << std::endl;
+    return -1;
+}
+
+int snapshot_ring::restore_snapshot(pid_t pid, int fd, const dump_options& options, bool use_soft_dirty) {
+    debug_msg("Begin");
+    image_reader reader;
+    if (reader.open("/proc/self/fd/" + std::to_string(fd)) < 0) {
+        return -1;
+    }
+    unsigned long page = reader.page_size();
+    std::vector<memory_map> v_snapshot;
+    for (auto& r : reader.regions()) v_snapshot.push_back(*r.map);
+
+    ptracer p{pid, options.stop};
+    if (p.init() < 0) {
+        std::cerr << "Error stopping " << pid << " for the rollback" << std::endl;
+        return -1;
+    }
+    if (p.get_regs().size() != reader.regs().size()) {
+        std::cerr << "Error the snapshot has " << reader.regs().size() << " threads and the process "
+                  << p.get_regs().size() << std::endl;
+        return -1;
+    }
+
+    // Nothing was changed until here. Past this point a failure would leave the process half rolled back
+    auto fail = [pid](const char* what) {
+        std::cerr << "Error " << what << " " << strerror(errno) << ", killing " << pid << std::endl;
+        ::kill(pid, SIGKILL);
+        return -1;
+    };
+
+    // Layout first, through syscalls run by the process itself
+    auto v_maps = maps_parser::get_maps(pid);
+    auto snapshot_heap = find_heap(v_snapshot);
+    auto heap = find_heap(v_maps);
+    // The stack only grows, the part below the snapshot is left to it
+    auto for_each_new = [&](auto&& fn) {
+        for (auto& map : v_maps) {
+            if (!serializer::is_saved(map) || std::strstr(map.pathname, "[stack]")) continue;
+            for_each_gap(map.start_address, map.end_address, v_snapshot, fn);
+        }
+    };
+    auto for_each_missing = [&](auto&& fn) {
+        for (auto& want : v_snapshot) {
+            for_each_gap(want.start_address, want.end_address, v_maps,
+                         [&](unsigned long start, unsigned long end) { fn(want, start, end); });
+        }
+    };
+    std::vector<std::pair<unsigned long, unsigned long>> v_remapped;
+    bool layout_changed = snapshot_heap && (!heap || heap->end_address != snapshot_heap->end_address);
+    for_each_new([&](unsigned long, unsigned long) { layout_changed = true; });
+    for_each_missing([&](const memory_map&, unsigned long, unsigned long) { layout_changed = true; });
+    if (layout_changed) {
+        if (p.infect(false) < 0) {
+            return fail("infecting for the layout");
+        }
+        if (snapshot_heap) {
+            long brk = p.remote_syscall(SYS_brk, snapshot_heap->end_address);
+            if (static_cast<unsigned long>(brk) != snapshot_heap->end_address) {
+                return fail("moving the brk");
+            }
+            v_maps = maps_parser::get_maps(pid);
+        }
+        bool failed = false;
+        // Mapped after the snapshot
+        for_each_new([&](unsigned long start, unsigned long end) {
+            failed = failed || p.remote_syscall(SYS_munmap, start, end - start) < 0;
+        });
+        if (failed) {
+            return fail("unmapping a new region");
+        }
+        // Unmapped after the snapshot, all the saved data is written below
+        for_each_missing([&](const memory_map& want, unsigned long start, unsigned long end) {
+            if (failed) return;
+            long ret = p.remote_syscall(SYS_mmap, start, end - start, want.prot,
+                                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            failed = static_cast<unsigned long>(ret) != start;
+            v_remapped.push_back({start, end});
+        });
+        if (failed) {
+            return fail("mapping a missing region");
+        }
+        p.cure();
+        v_maps = maps_parser::get_maps(pid);
+    }
+    bool protect = false;
+    for (auto& want : v_snapshot) {
+        for (auto& map : v_maps) protect = protect || (overlaps(map, want) && map.prot != want.prot);
+    }
+    if (protect) {
+        if (p.infect(false) < 0) {
+            return fail("infecting for the protections");
+        }
+        for (auto& want : v_snapshot) {
+            if (p.remote_syscall(SYS_mprotect, want.start_address, want.size(), want.prot) < 0) {
+                return fail("protecting a region");
+            }
+        }
+        p.cure();
+    }
+
+    // Then the pages that differ from the snapshot, soft-dirty or compared. /proc/<pid>/mem writes read only
+    // pages too. The bits were cleared by every capture and rollback since, for an older snapshot they miss the
+    // pages written in between
+    std::string mem_path = "/proc/" + std::to_string(pid) + "/mem";
+    int mem = ::open(mem_path.c_str(), O_RDWR | O_CLOEXEC);
+    defer({
+        if (mem >= 0) ::close(mem);
+    });
+    bool can_clear = hotness::soft_dirty_supported();
+    bool soft_dirty = can_clear && use_soft_dirty;
+    std::string pagemap_path = "/proc/" + std::to_string(pid) + "/pagemap";
+    int pagemap = soft_dirty ? ::open(pagemap_path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    defer({
+        if (pagemap >= 0) ::close(pagemap);
+    });
+    if (mem < 0 || (soft_dirty && pagemap < 0)) {
+        return fail("opening the memory of the process");
+    }
+
+    std::vector<char> current(rollback_chunk);
+    std::vector<uint64_t> entries(rollback_chunk / page);
+    std::vector<char> zero(page, 0);
+    size_t written = 0;
+    unsigned long run_address = 0;
+    const char* run_data = nullptr;
+    size_t run_len = 0;
+    auto flush = [&]() {
+        if (run_len && ::pwrite(mem, run_data, run_len, run_address) != static_cast<ssize_t>(run_len)) {
+            return false;
+        }
+        written += run_len;
+        run_len = 0;
+        return true;
+    };
+    for (auto& r : reader.regions()) {
+        bool anonymous = r.map->inode == 0;
+        bool remapped = std::any_of(v_remapped.begin(), v_remapped.end(),
+                                    [&](auto& range) { return range.first < r.end() && r.start() < range.second; });
+        // Without soft-dirty bits only the writable regions are compared, a read only one can only change if the
+        // process made it writable for a while
+        if (!soft_dirty && !remapped && !(r.map->prot & PROT_WRITE)) continue;
+        for (unsigned long start = r.start(); start < r.end(); start += rollback_chunk) {
+            size_t len = std::min(rollback_chunk, r.end() - start);
+            size_t n = len / page;
+            if (soft_dirty) {
+                if (::pread(pagemap, entries.data(), n * sizeof(uint64_t), start / page * sizeof(uint64_t)) !=
+                    static_cast<ssize_t>(n * sizeof(uint64_t))) {
+                    return fail("reading the pagemap");
+                }
+            } else if (::pread(mem, current.data(), len, start) != static_cast<ssize_t>(len)) {
+                return fail("reading the memory");
+            }
+            for (size_t i = 0; i < n; i++) {
+                unsigned long address = start + i * page;
+                // Excluded pages are not in the snapshot and are left alone
+                const char* saved = reader.at(address);
+                if (!saved) continue;
+                auto is_changed = [&]() {
+                    if (remapped && std::any_of(v_remapped.begin(), v_remapped.end(), [&](auto& range) {
+                            return range.first <= address && address < range.second;
+                        })) {
+                        return true;
+                    }
+                    if (!soft_dirty) return std::memcmp(current.data() + i * page, saved, page) != 0;
+                    if (entries[i] & pagemap_soft_dirty) return true;
+                    // Dropped since with MADV_DONTNEED, it reads as zero now
+                    return anonymous && !(entries[i] & (pagemap_present | pagemap_swapped)) &&
+                           std::memcmp(saved, zero.data(), page) != 0;
+                };
+                if (!is_changed()) continue;
+                if (run_len && (run_address + run_len != address || run_data + run_len != saved) && !flush()) {
+                    return fail("writing the memory");
+                }
+                if (!run_len) {
+                    run_address = address;
+                    run_data = saved;
+                }
+                run_len += page;
+            }
+        }
+    }
+    if (!flush()) {
+        return fail("writing the memory");
+    }
+    if (can_clear && hotness::clear_soft_dirty(pid) < 0) {
+        return fail("clearing the soft-dirty bits");
+    }
+
+    std::vector<user_regs_struct> v_regs;
+    std::vector<user_fpregs_struct> v_fpregs;
+    for (auto regs : reader.regs()) v_regs.push_back(*regs);
+    for (auto fpregs : reader.fpregs()) v_fpregs.push_back(*fpregs);
+    if (p.set_fpregs(v_fpregs) < 0 || p.set_regs(v_regs) < 0) {
+        return fail("setting the registers");
+    }
+
+    debug_msg("End " << written << " bytes written back");
+    return 0;
+}
+
+}  // namespace RECK
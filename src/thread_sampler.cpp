@@ -0,0 +1,321 @@
+// #define DEBUG
+
+#include "thread_sampler.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "debug.hpp"
+#include "defer.hpp"
+#include "filesystem.hpp"
+#include "trace.hpp"
+
+namespace RECK {
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static bool is_group_stop(int status) {
+    if (status >> 16 != PTRACE_EVENT_STOP) return false;
+    int sig = WSTOPSIG(status);
+    return sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU;
+}
+
+// Lets an interrupted thread go. A signal that stopped it first is delivered, then the interrupt still pending
+// stops it again and is let go too
+static void resume(pid_t tid, int status) {
+    while (status >> 16 != PTRACE_EVENT_STOP) {
+        if (::ptrace(PTRACE_CONT, tid, nullptr, WSTOPSIG(status)) < 0) return;
+        if (::waitpid(tid, &status, __WALL) != tid || !WIFSTOPPED(status)) return;
+    }
+    // A thread in a group stop stays in it, PTRACE_LISTEN lets SIGCONT wake it up
+    ::ptrace(is_group_stop(status) ? PTRACE_LISTEN : PTRACE_CONT, tid, nullptr, nullptr);
+}
+
+thread_sampler::thread_sampler(pid_t pid, size_t stack_window, std::chrono::microseconds stop_timeout)
+    : m_pid(pid), m_stack_window(stack_window), m_stop_timeout(stop_timeout) {}
+
+thread_sampler::~thread_sampler() {
+    debug_msg("Begin");
+    // Only a stopped thread can be detached, the others are detached when the tracer exits
+    std::vector<int> v_status, v_stop;
+    stop_threads(v_status, v_stop);
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        if (v_stop[i] > 0) {
+            int sig = v_status[i] >> 16 == PTRACE_EVENT_STOP ? 0 : WSTOPSIG(v_status[i]);
+            ::ptrace(PTRACE_DETACH, m_threads[i].tid, nullptr, sig);
+        }
+        ::close(m_threads[i].stat_fd);
+    }
+    debug_msg("End");
+}
+
+void thread_sampler::stop_threads(std::vector<int>& v_status, std::vector<int>& v_stop) {
+    size_t n = m_threads.size();
+    v_status.assign(n, 0);
+    v_stop.assign(n, 0);
+    // A stop sends SIGCHLD, it is waited for with sigtimedwait. Blocked before the interrupts so none is missed
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    ::pthread_sigmask(SIG_BLOCK, &chld, &old);
+    defer({ ::pthread_sigmask(SIG_SETMASK, &old, nullptr); });
+
+    // All the interrupts go out before any wait, the threads stop in parallel
+    size_t pending = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (::ptrace(PTRACE_INTERRUPT, m_threads[i].tid, nullptr, nullptr) < 0) {
+            v_stop[i] = -1;
+        } else {
+            pending++;
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + m_stop_timeout;
+    while (pending > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (v_stop[i] != 0) continue;
+            pid_t ret = ::waitpid(m_threads[i].tid, &v_status[i], __WALL | WNOHANG);
+            if (ret == 0) continue;
+            v_stop[i] = ret == m_threads[i].tid && WIFSTOPPED(v_status[i]) ? 1 : -1;
+            pending--;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (pending == 0 || now >= deadline) break;
+        auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+        timespec timeout = {left / 1000000000, left % 1000000000};
+        ::sigtimedwait(&chld, nullptr, &timeout);
+    }
+}
+
+int thread_sampler::seize_new_threads() {
+    std::string task_dir = "/proc/" + std::to_string(m_pid) + "/task";
+    DIR* d = ::opendir(task_dir.c_str());
+    if (!d) return -1;
+    defer({ ::closedir(d); });
+    while (auto de = ::readdir(d)) {
+        if (de->d_name[0] == '.') continue;
+        pid_t tid = std::atoi(de->d_name);
+        if (std::any_of(m_threads.begin(), m_threads.end(), [tid](const thread& t) { return t.tid == tid; })) {
+            continue;
+        }
+        // No options: the sampler never sees clones, execs or syscalls, only its own interrupts and signals
+        if (::ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) < 0) {
+            if (errno == ESRCH) continue;
+            std::cerr << "Error PTRACE_SEIZE " << tid << " " << strerror(errno) << std::endl;
+            return -1;
+        }
+        std::string stat_path = task_dir + "/" + de->d_name + "/stat";
+        m_threads.push_back({tid, ::open(stat_path.c_str(), O_RDONLY | O_CLOEXEC)});
+    }
+    return 0;
+}
+
+void thread_sampler::drop_thread(size_t i) {
+    // An exited thread stays a zombie until its tracer reaps it
+    int status;
+    ::waitpid(m_threads[i].tid, &status, __WALL | WNOHANG);
+    if (m_threads[i].stat_fd >= 0) ::close(m_threads[i].stat_fd);
+    m_threads.erase(m_threads.begin() + i);
+}
+
+int thread_sampler::init(int fd) {
+    debug_msg("Begin");
+    m_fd = fd;
+    if (seize_new_threads() < 0 || m_threads.empty()) {
+        std::cerr << "Error seizing the threads of pid " << m_pid << std::endl;
+        return -1;
+    }
+    file_header h = {};
+    std::memcpy(h.magic, file_magic, sizeof(h.magic));
+    h.version = file_version;
+    h.pid = m_pid;
+    h.stack_window = m_stack_window;
+    h.ns_start = now_ns();
+    if (filesystem::write(m_fd, &h, sizeof(h)) != sizeof(h)) {
+        std::cerr << "Error writing sample header " << strerror(errno) << std::endl;
+        return -1;
+    }
+    debug_msg("End " << m_threads.size() << " threads");
+    return 0;
+}
+
+ssize_t thread_sampler::take_sample() {
+    if (seize_new_threads() < 0) {
+        // The process is gone once its task directory is
+        if (errno != ENOENT && errno != ESRCH) return -1;
+        while (!m_threads.empty()) drop_thread(0);
+        return 0;
+    }
+    size_t n = m_threads.size();
+    if (n == 0) return 0;
+
+    // The scheduler state before the stop, every thread reads as traced afterwards
+    std::vector<char> v_states(n, '?');
+    for (size_t i = 0; i < n; i++) {
+        char stat[512];
+        ssize_t len = ::pread(m_threads[i].stat_fd, stat, sizeof(stat) - 1, 0);
+        if (len <= 0) continue;
+        stat[len] = '\0';
+        // The name in parentheses may have any character, the state follows the last parenthesis
+        char* end = std::strrchr(stat, ')');
+        if (end && end[1] == ' ' && end[2]) v_states[i] = end[2];
+    }
+
+    m_buffer.resize(sizeof(sample_header));
+    std::vector<int> v_status, v_stop;
+    sample_header sh = {};
+    {
+        trace_scope(SAMPLE, n);
+        sh.ns = now_ns();
+        stop_threads(v_status, v_stop);
+
+        for (size_t i = 0; i < n; i++) {
+            if (v_stop[i] < 0) continue;
+            record r = {};
+            r.tid = m_threads[i].tid;
+            r.state = v_states[i];
+            // Its interrupt stays pending, forward_signals or the next sample lets it go once it stops
+            if (v_stop[i] == 0) {
+                r.flags = record_no_regs;
+                m_buffer.insert(m_buffer.end(), reinterpret_cast<char*>(&r), reinterpret_cast<char*>(&r + 1));
+                sh.n_records++;
+                continue;
+            }
+            if (::ptrace(PTRACE_GETREGS, r.tid, nullptr, &r.regs) < 0) {
+                v_stop[i] = -1;
+                continue;
+            }
+            size_t offset = m_buffer.size();
+            m_buffer.resize(offset + sizeof(r) + m_stack_window);
+            // Up to the end of the stack mapping, the stack is only read while the thread is stopped
+            ssize_t len = filesystem::remote_read(r.tid, reinterpret_cast<void*>(r.regs.rsp),
+                                                  m_buffer.data() + offset + sizeof(r), m_stack_window);
+            r.stack_size = len > 0 ? len : 0;
+            std::memcpy(m_buffer.data() + offset, &r, sizeof(r));
+            m_buffer.resize(offset + sizeof(r) + r.stack_size);
+            sh.n_records++;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (v_stop[i] > 0) resume(m_threads[i].tid, v_status[i]);
+        }
+        sh.stop_ns = now_ns() - sh.ns;
+    }
+    m_max_stop = std::max(m_max_stop, std::chrono::nanoseconds{sh.stop_ns});
+
+    for (size_t i = n; i-- > 0;) {
+        if (v_stop[i] < 0) drop_thread(i);
+    }
+    if (sh.n_records == 0) return 0;
+    std::memcpy(m_buffer.data(), &sh, sizeof(sh));
+    if (filesystem::write(m_fd, m_buffer.data(), m_buffer.size()) != static_cast<ssize_t>(m_buffer.size())) {
+        std::cerr << "Error writing sample " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return sh.n_records;
+}
+
+void thread_sampler::forward_signals() {
+    for (size_t i = m_threads.size(); i-- > 0;) {
+        int status;
+        pid_t ret = ::waitpid(m_threads[i].tid, &status, __WALL | WNOHANG);
+        if (ret == 0) continue;
+        if (ret < 0 || !WIFSTOPPED(status)) {
+            drop_thread(i);
+        } else if (status >> 16 == PTRACE_EVENT_STOP) {
+            ::ptrace(is_group_stop(status) ? PTRACE_LISTEN : PTRACE_CONT, m_threads[i].tid, nullptr, nullptr);
+        } else {
+            ::ptrace(PTRACE_CONT, m_threads[i].tid, nullptr, WSTOPSIG(status));
+        }
+    }
+}
+
+ssize_t thread_sampler::run(unsigned hz, std::chrono::milliseconds duration) {
+    debug_msg("Begin " << hz << " Hz");
+    // A ptrace stop of a thread sends SIGCHLD to the tracer, it is waited for with sigtimedwait
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    ::pthread_sigmask(SIG_BLOCK, &chld, &old);
+    defer({ ::pthread_sigmask(SIG_SETMASK, &old, nullptr); });
+
+    auto period = std::chrono::nanoseconds{1000000000UL / std::max(hz, 1U)};
+    auto start = std::chrono::steady_clock::now();
+    auto next = start;
+    ssize_t samples = 0;
+    while (std::chrono::steady_clock::now() - start < duration) {
+        ssize_t ret = take_sample();
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) break;
+        samples++;
+        // Samples missed by a slow one are skipped, not taken in a burst
+        next += period;
+        auto now = std::chrono::steady_clock::now();
+        if (next < now) next = now;
+        for (forward_signals(); now < next; forward_signals()) {
+            auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(next - now).count();
+            timespec timeout = {left / 1000000000, left % 1000000000};
+            ::sigtimedwait(&chld, nullptr, &timeout);
+            now = std::chrono::steady_clock::now();
+        }
+    }
+    debug_msg("End " << samples << " samples");
+    return samples;
+}
+
+ssize_t thread_sampler::record_file(pid_t pid, const std::string& file_path, unsigned hz,
+                                    std::chrono::milliseconds duration, size_t stack_window) {
+    debug_msg("Begin");
+    int fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << file_path << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    defer({ ::close(fd); });
+    thread_sampler sampler{pid, stack_window};
+    if (sampler.init(fd) < 0) {
+        return -1;
+    }
+    ssize_t ret = sampler.run(hz, duration);
+    debug_msg("End");
+    return ret;
+}
+
+int thread_sampler::read_file(const std::string& file_path, file_header& h, std::vector<sample>& v_samples) {
+    std::ifstream in(file_path, std::ios::binary);
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || std::memcmp(h.magic, file_magic, sizeof(h.magic)) ||
+        h.version == 0 || h.version > file_version) {
+        std::cerr << "Error " << file_path << " is not a reck sample file" << std::endl;
+        return -1;
+    }
+    sample s;
+    while (in.read(reinterpret_cast<char*>(&s.h), sizeof(s.h))) {
+        s.v_threads.resize(s.h.n_records);
+        for (auto& t : s.v_threads) {
+            if (!in.read(reinterpret_cast<char*>(&t.r), sizeof(t.r)) || t.r.stack_size > h.stack_window) {
+                return 0;
+            }
+            t.stack.resize(t.r.stack_size);
+            if (!in.read(t.stack.data(), t.stack.size())) return 0;
+        }
+        v_samples.push_back(std::move(s));
+    }
+    return 0;
+}
+
+}  // namespace RECK
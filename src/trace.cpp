@@ -0,0 +1,164 @@
+// #define DEBUG
+
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+namespace RECK {
+
+thread_local trace::ring* trace::t_ring = nullptr;
+
+namespace {
+
+std::atomic<trace::ring*> g_rings{nullptr};
+uint64_t g_tsc_start = 0;
+uint64_t g_ns_start = 0;
+char g_trace_path[256] = {};
+// Its destructor gives the ring back when the thread exits
+pthread_key_t g_ring_key;
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Only async-signal-safe calls from here, it can run in a signal handler
+size_t append(char* dst, size_t pos, size_t cap, const char* src) {
+    while (*src && pos + 1 < cap) dst[pos++] = *src++;
+    dst[pos] = '\0';
+    return pos;
+}
+
+size_t append_number(char* dst, size_t pos, size_t cap, unsigned long value) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n > 0 && pos + 1 < cap) dst[pos++] = digits[--n];
+    dst[pos] = '\0';
+    return pos;
+}
+
+bool write_all(int fd, const void* data, size_t len) {
+    auto buffer = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t r = ::write(fd, buffer, len);
+        if (r <= 0) return false;
+        buffer += r;
+        len -= r;
+    }
+    return true;
+}
+
+void dump_at_exit() { trace::flush(); }
+
+[[maybe_unused]] int g_init = []() {
+    g_tsc_start = __rdtsc();
+    g_ns_start = monotonic_ns();
+    ::pthread_key_create(&g_ring_key, trace::release_ring);
+    if (const char* prefix = std::getenv("RECK_TRACE"); prefix && *prefix) {
+        append(g_trace_path, 0, sizeof(g_trace_path), prefix);
+        std::atexit(dump_at_exit);
+    }
+    return 0;
+}();
+
+}  // namespace
+
+trace::ring* trace::create_ring() {
+    pid_t tid = ::syscall(SYS_gettid);
+    ring* r = nullptr;
+    // The ring of an exited thread first, a thread that only lives for one checkpoint does not leave one behind
+    for (ring* free_ring = g_rings.load(std::memory_order_acquire); free_ring && !r; free_ring = free_ring->next) {
+        bool in_use = false;
+        if (free_ring->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) r = free_ring;
+    }
+    if (r) {
+        r->tid = tid;
+        r->head.store(0, std::memory_order_release);
+    } else {
+        // mmap instead of new, the first event of a thread can come from a signal handler
+        void* addr = ::mmap(nullptr, sizeof(ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) return nullptr;
+        r = static_cast<ring*>(addr);
+        r->tid = tid;
+        r->in_use.store(true, std::memory_order_relaxed);
+        r->head.store(0, std::memory_order_relaxed);
+        r->next = g_rings.load(std::memory_order_relaxed);
+        while (!g_rings.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+    // The key is below PTHREAD_KEY_2NDLEVEL_SIZE, setting it only stores the pointer in the thread
+    ::pthread_setspecific(g_ring_key, r);
+    t_ring = r;
+    return r;
+}
+
+void trace::release_ring(void* r) {
+    // An event recorded by a later destructor of the thread takes a ring again
+    t_ring = nullptr;
+    static_cast<ring*>(r)->in_use.store(false, std::memory_order_release);
+}
+
+int trace::dump(const char* path) {
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) return -1;
+
+    file_header h = {};
+    std::memcpy(h.magic, file_magic, sizeof(h.magic));
+    h.version = file_version;
+    h.pid = getpid();
+    h.tsc_start = g_tsc_start;
+    h.ns_start = g_ns_start;
+    h.tsc_end = __rdtsc();
+    h.ns_end = monotonic_ns();
+    // Rings created meanwhile are pushed in front of this one and left out
+    ring* first_ring = g_rings.load(std::memory_order_acquire);
+    for (ring* r = first_ring; r; r = r->next) h.n_rings++;
+
+    bool ok = write_all(fd, &h, sizeof(h));
+    for (ring* r = first_ring; r && ok; r = r->next) {
+        file_ring fr = {r->tid, 0, r->head.load(std::memory_order_acquire)};
+        ok = write_all(fd, &fr, sizeof(fr));
+        // Oldest entry first. One written during the dump can be torn, the decoder drops it by its timestamp
+        uint64_t count = fr.head < ring_entries ? fr.head : ring_entries;
+        uint64_t first = (fr.head - count) & (ring_entries - 1);
+        uint64_t tail = count < ring_entries - first ? count : ring_entries - first;
+        if (ok) ok = write_all(fd, &r->entries[first], tail * sizeof(entry));
+        if (ok) ok = write_all(fd, &r->entries[0], (count - tail) * sizeof(entry));
+    }
+    ::close(fd);
+    return ok ? 0 : -1;
+}
+
+int trace::flush() {
+    if (!g_trace_path[0]) return 0;
+    char path[sizeof(g_trace_path) + 24];
+    size_t pos = append(path, 0, sizeof(path), g_trace_path);
+    pos = append(path, pos, sizeof(path), ".");
+    append_number(path, pos, sizeof(path), getpid());
+    return dump(path);
+}
+
+const char* trace::event_name(uint16_t e) {
+    static const char* const names[EVENT_COUNT] = {
+        "DUMP",         "ATTACH",       "DUMP_REGS",       "DUMP_MAP", "REMOTE_READ",
+        "WRITE",        "DRAIN",        "REMOTE_SYSCALL",  "HOT_SAMPLE", "RESTORE",
+        "RESTORE_MAP",  "RESTORE_LOAD", "RESTORE_PROTECT", "COMPACT",  "TIER_DRAIN",
+        "WRITEBACK",    "COMMIT",       "SAMPLE",          "OFFLOAD",  "FAULT",
+    };
+    return e < EVENT_COUNT ? names[e] : "UNKNOWN";
+}
+
+}  // namespace RECK
@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "assert.h"
+#include "offload.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+constexpr size_t page = 4096;
+constexpr size_t pages = 8192;
+constexpr size_t hot_pages = 16;
+
+static void fill_page(char *p, size_t i) {
+    for (size_t off = 0; off < page; off += sizeof(i)) std::memcpy(p + off, &i, sizeof(i));
+}
+
+static bool page_is(const char *p, size_t i) {
+    for (size_t off = 0; off < page; off += sizeof(i)) {
+        if (std::memcmp(p + off, &i, sizeof(i))) return false;
+    }
+    return true;
+}
+
+static size_t resident(const char *data, size_t len) {
+    std::vector<unsigned char> v_pages(len / page);
+    assert(0 == mincore(const_cast<char *>(data), len, v_pages.data()));
+    size_t n = 0;
+    for (auto p : v_pages) n += p & 1;
+    return n;
+}
+
+// The buffer after the process changed it, pages 1000 to 1064 are at moved
+static void check_pages(const char *data, const char *moved) {
+    for (size_t i = 0; i < pages; i++) {
+        if (i >= 1000 && i < 1064) continue;
+        if (i >= 300 && i < 304) {
+            static const char zero[page] = {};
+            assert(0 == std::memcmp(data + i * page, zero, page));
+        } else {
+            assert(page_is(data + i * page, i >= 100 && i < 108 ? i + pages : i));
+        }
+    }
+    for (size_t i = 0; i < 64; i++) assert(page_is(moved + i * page, 1000 + i));
+}
+
+// The offloading child: dumps its parent, waits for it to change some pages, drops the cold ones and serves the
+// faults until the parent is done or kills it
+static int offloader(const std::string &file_path, unsigned long hot, int to_child, int to_parent) {
+    pid_t pid = getppid();
+    char c;
+    if (serializer::dump_serialized_file(pid, file_path) < 0 || ::write(to_parent, "d", 1) != 1 ||
+        ::read(to_child, &c, 1) != 1) {
+        return 1;
+    }
+    std::vector<unsigned long> v_hot;
+    for (size_t i = 0; i < hot_pages; i++) v_hot.push_back(hot + i * page);
+
+    cold_offload offload{pid};
+    // Refused without a guardian unless the loss of the pages is accepted
+    if (offload.drop(file_path, v_hot) == 0) return 1;
+    int ret = offload.guard() < 0 ? -1 : offload.drop(file_path, v_hot);
+    auto &stats = offload.get_stats();
+    if (::write(to_parent, &ret, sizeof(ret)) != sizeof(ret) ||
+        ::write(to_parent, &stats, sizeof(stats)) != sizeof(stats) || ret < 0) {
+        return 1;
+    }
+    pollfd pfd = {to_child, POLLIN, 0};
+    while (::poll(&pfd, 1, 0) == 0) {
+        if (offload.serve(std::chrono::milliseconds{10}) < 0) return 1;
+    }
+    ret = offload.recall();
+    return ::write(to_parent, &stats, sizeof(stats)) == sizeof(stats) && ret == 0 ? 0 : 1;
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_offload.reck";
+    size_t len = pages * page;
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(data != MAP_FAILED);
+    for (size_t i = 0; i < pages; i++) fill_page(data + i * page, i);
+
+    int to_child[2], to_parent[2];
+    assert(0 == ::pipe(to_child) && 0 == ::pipe(to_parent));
+    auto spawn_offloader = [&]() {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            exit(offloader(file_path, reinterpret_cast<unsigned long>(data), to_child[0], to_parent[1]));
+        }
+        return pid;
+    };
+    pid_t child = spawn_offloader();
+    ptracer::allow_pid();
+
+    char c;
+    assert(1 == ::read(to_parent[0], &c, 1));
+    // Changed after the image, these pages stay
+    for (size_t i = 100; i < 108; i++) fill_page(data + i * page, i + pages);
+    assert(1 == ::write(to_child[1], "g", 1));
+    int ret;
+    cold_offload::stats stats;
+    assert(sizeof(ret) == ::read(to_parent[0], &ret, sizeof(ret)) && ret == 0);
+    assert(sizeof(stats) == ::read(to_parent[0], &stats, sizeof(stats)));
+    std::cout << "Dropped " << stats.dropped << " of " << stats.cold << " cold pages, " << stats.changed
+              << " changed" << std::endl;
+    assert(stats.dropped >= pages - hot_pages - 8);
+    assert(stats.changed >= 8);
+
+    // Only the hot and the changed pages of the buffer are resident
+    size_t kept = resident(data, len);
+    std::cout << kept << " pages of " << pages << " resident" << std::endl;
+    assert(kept <= hot_pages + 8);
+
+    // Dropped by the process itself, they read as zero and not as the image
+    assert(0 == madvise(data + 300 * page, 4 * page, MADV_DONTNEED));
+    // Moved by the process, the pages come from the image at their old address
+    char *moved = static_cast<char *>(mmap(nullptr, 64 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(moved != MAP_FAILED);
+    assert(moved == mremap(data + 1000 * page, 64 * page, 64 * page, MREMAP_MAYMOVE | MREMAP_FIXED, moved));
+    for (size_t i = 0; i < 64; i++) assert(page_is(moved + i * page, 1000 + i));
+    // A child has the same pages
+    pid_t grandchild = fork();
+    assert(grandchild != -1);
+    if (grandchild == 0) {
+        bool ok = page_is(data + 2000 * page, 2000) && page_is(data + 8000 * page, 8000);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    assert(grandchild == waitpid(grandchild, &status, 0));
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    check_pages(data, moved);
+
+    assert(1 == ::write(to_child[1], "q", 1));
+    assert(sizeof(stats) == ::read(to_parent[0], &stats, sizeof(stats)));
+    assert(child == waitpid(child, &status, 0));
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    std::cout << stats.faults << " faults served from the image, " << stats.zero_fills << " zero filled, "
+              << stats.recalled << " pages recalled" << std::endl;
+    assert(stats.faults >= pages - hot_pages - 8 - 64 - 4);
+    std::cout << "Offloaded pages served back" << std::endl;
+
+    // Offloaded again and the offloader killed while it serves, its guardian recalls the pages
+    child = spawn_offloader();
+    assert(1 == ::read(to_parent[0], &c, 1));
+    assert(1 == ::write(to_child[1], "g", 1));
+    assert(sizeof(ret) == ::read(to_parent[0], &ret, sizeof(ret)) && ret == 0);
+    assert(sizeof(stats) == ::read(to_parent[0], &stats, sizeof(stats)));
+    assert(stats.dropped >= pages - hot_pages);
+    // The guardian keeps the image drop mapped, not what the path names later
+    assert(0 == ::rename(file_path.c_str(), (file_path + ".old").c_str()));
+    int junk = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(junk >= 0 && 0 == ::ftruncate(junk, len) && 0 == ::close(junk));
+    assert(0 == kill(child, SIGKILL));
+    assert(child == waitpid(child, &status, 0));
+    check_pages(data, moved);
+    std::cout << "Pages of a killed offload recalled by its guardian" << std::endl;
+    ::unlink((file_path + ".old").c_str());
+    return 0;
+}
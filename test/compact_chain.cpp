@@ -0,0 +1,84 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static void dump(const std::string &file_path, const dump_options &options) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+}
+
+int main(void) {
+    std::string base_path = "/tmp/dump_data_base.reck";
+    std::string delta_path = "/tmp/dump_data_delta.reck";
+    std::string delta2_path = "/tmp/dump_data_delta2.reck";
+    std::string compact_path = "/tmp/dump_data_compact.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 512 * page;
+
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(data != MAP_FAILED);
+    std::memset(data, 0x11, len);
+    dump(base_path, {});
+
+    // Each delta changes a few pages on top of the previous image, the second one is relative to its directory
+    std::memset(data, 0x22, page);
+    std::memset(data + 10 * page, 0x22, 2 * page);
+    dump_options options;
+    options.parent = base_path;
+    dump(delta_path, options);
+    std::memset(data + 11 * page, 0x33, page);
+    std::memset(data + 20 * page, 0, page);
+    options.parent = "dump_data_delta.reck";
+    dump(delta2_path, options);
+
+    image_reader delta;
+    assert(0 == delta.open(delta2_path));
+    assert(delta.is_delta());
+    auto region = delta.find(reinterpret_cast<unsigned long>(data));
+    assert(region != nullptr && region->delta);
+    assert(region->data.size() == 2 * page);
+
+    auto chain = image_chain::resolve(delta2_path);
+    assert(chain.size() == 3);
+    assert(chain[0] == base_path);
+    assert(serializer::compact_images(chain, compact_path, 4) > 0);
+
+    image_reader compact;
+    assert(0 == compact.open(compact_path));
+    assert(!compact.is_delta());
+    assert(compact.regs().size() == delta.regs().size());
+    for (size_t i = 0; i < len; i += page) {
+        auto saved = compact.at(reinterpret_cast<unsigned long>(data + i));
+        assert(saved != nullptr);
+        char expected = 0x11;
+        if (i == 20 * page) expected = 0;
+        if (i == 0 || i == 10 * page) expected = 0x22;
+        if (i == 11 * page) expected = 0x33;
+        assert(saved[0] == expected && saved[page - 1] == expected);
+    }
+
+    std::cout << "Compacted " << chain.size() << " images into " << compact_path << std::endl;
+    return 0;
+}
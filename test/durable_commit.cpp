@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "assert.h"
+#include "defer.hpp"
+#include "image_reader.hpp"
+#include "process_tree.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static int dump(const std::string &file_path, const dump_options &options) {
+    pid_t child = fork();
+    assert(child != -1);
+    int status;
+    if (child) {
+        ptracer::allow_pid();
+        assert(child == waitpid(child, &status, 0));
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    exit(serializer::dump_serialized_file(getppid(), file_path, options) < 0 ? 1 : 0);
+}
+
+static int dump_tree(const std::string &file_path, const dump_options &options) {
+    pid_t child = fork();
+    assert(child != -1);
+    int status;
+    if (child) {
+        ptracer::allow_pid();
+        assert(child == waitpid(child, &status, 0));
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    exit(process_tree::dump(getppid(), file_path, options) == 1 ? 0 : 1);
+}
+
+static bool exists(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0;
+}
+
+// Files of the image name in dir ending with suffix
+static std::vector<std::string> files_of(const std::string &dir, const std::string &name, const std::string &suffix) {
+    std::vector<std::string> v_paths;
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+        std::string file = entry.path().filename();
+        if (file.rfind(name + ".", 0) == 0 && file.size() > name.size() + suffix.size() &&
+            file.substr(file.size() - suffix.size()) == suffix) {
+            v_paths.push_back(entry.path());
+        }
+    }
+    return v_paths;
+}
+
+// Stripe 0 files of the image name in dir
+static std::vector<std::string> stripes_of(const std::string &dir, const std::string &name) {
+    return files_of(dir, name, ".stripe0");
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_durable.reck";
+    std::string tmp_path = file_path + ".tmp";
+    constexpr char old_image[] = "previous image";
+
+    int fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(::write(fd, old_image, sizeof(old_image)) == sizeof(old_image));
+    ::close(fd);
+
+    // A dump that fails leaves the previous image alone and no temporary file
+    dump_options options;
+    options.durable = true;
+    options.stripe_dirs = {"/nonexistent"};
+    assert(dump(file_path, options) != 0);
+    options.stripe_dirs.clear();
+    assert(!exists(tmp_path));
+    char read_back[sizeof(old_image)] = {};
+    fd = ::open(file_path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    defer({ ::close(fd); });
+    assert(::read(fd, read_back, sizeof(read_back)) == sizeof(read_back));
+    assert(std::memcmp(read_back, old_image, sizeof(old_image)) == 0);
+
+    // The stats are written by the dumper, in memory shared with it
+    auto stats = static_cast<commit_stats *>(
+        ::mmap(nullptr, sizeof(commit_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    assert(stats != MAP_FAILED);
+    new (stats) commit_stats{};
+
+    size_t len = 48 * 1024 * 1024;
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(data != MAP_FAILED);
+    std::memset(data, 0x3C, len);
+
+    options.writeback_window = 4 * 1024 * 1024;
+    options.stats = stats;
+    assert(dump(file_path, options) == 0);
+    std::cout << "Committed " << stats->bytes << " bytes, " << stats->preallocated << " preallocated, "
+              << stats->windows << " windows. Writeback waits " << stats->writeback.count() << " us, fdatasync "
+              << stats->sync.count() << " us, rename " << stats->publish.count() << " us" << std::endl;
+
+    assert(!exists(tmp_path));
+    struct stat st;
+    assert(0 == ::stat(file_path.c_str(), &st));
+    assert(stats->bytes == static_cast<size_t>(st.st_size));
+    assert(stats->windows >= len / options.writeback_window);
+    // The new image took the name, the previous one is still there for whoever had it open
+    assert(::pread(fd, read_back, sizeof(read_back), 0) == sizeof(read_back));
+    assert(std::memcmp(read_back, old_image, sizeof(old_image)) == 0);
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    for (size_t i = 0; i < len; i += 4096) {
+        auto saved = reader.at(reinterpret_cast<unsigned long>(data + i));
+        assert(saved != nullptr && saved[0] == 0x3C);
+    }
+
+    // Every durable striped image writes stripes of its own, the previous ones go once the new image is committed
+    std::string striped_path = "/tmp/dump_data_durable_striped.reck";
+    for (auto &stale : stripes_of("/tmp", "dump_data_durable_striped.reck")) ::unlink(stale.c_str());
+    options.stats = nullptr;
+    options.stripe_dirs = {"/tmp"};
+    assert(dump(striped_path, options) == 0);
+    auto v_first = stripes_of("/tmp", "dump_data_durable_striped.reck");
+    assert(v_first.size() == 1);
+    int first_fd = ::open(v_first[0].c_str(), O_RDONLY);
+    assert(first_fd >= 0);
+    defer({ ::close(first_fd); });
+    struct stat first_st;
+    assert(0 == ::fstat(first_fd, &first_st) && first_st.st_size >= static_cast<off_t>(len));
+    assert(dump(striped_path, options) == 0);
+    auto v_second = stripes_of("/tmp", "dump_data_durable_striped.reck");
+    assert(v_second.size() == 1 && v_second[0] != v_first[0]);
+    // The previous stripe was never truncated, only removed
+    assert(0 == ::fstat(first_fd, &st) && st.st_size == first_st.st_size);
+    ::unlink(v_second[0].c_str());
+
+    // A durable tree names its process images after its generation, the ones of the previous tree, and a legacy
+    // one, go once the new tree image is committed
+    std::string tree_path = "/tmp/dump_data_durable_tree.reck";
+    std::string pid_suffix = "." + std::to_string(getpid());
+    for (auto &stale : files_of("/tmp", "dump_data_durable_tree.reck", pid_suffix)) ::unlink(stale.c_str());
+    std::string legacy = process_tree::process_path(tree_path, getpid());
+    fd = ::open(legacy.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    ::close(fd);
+    options.stripe_dirs.clear();
+    assert(dump_tree(tree_path, options) == 0);
+    auto v_tree_first = files_of("/tmp", "dump_data_durable_tree.reck", pid_suffix);
+    assert(v_tree_first.size() == 1 && v_tree_first[0] != legacy);
+    assert(dump_tree(tree_path, options) == 0);
+    auto v_tree_second = files_of("/tmp", "dump_data_durable_tree.reck", pid_suffix);
+    assert(v_tree_second.size() == 1 && v_tree_second[0] != v_tree_first[0]);
+    ::unlink(v_tree_second[0].c_str());
+
+    std::cout << "Image committed" << std::endl;
+    return 0;
+}
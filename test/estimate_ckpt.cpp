@@ -0,0 +1,75 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "estimator.hpp"
+#include "exclusion.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_estimate.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 8192 * page;
+
+    // Half of it touched, a quarter of the untouched half excluded. The guard pages keep the mappings the
+    // estimator itself allocates from merging with it
+    char *guard = static_cast<char *>(
+        mmap(nullptr, len + 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(guard != MAP_FAILED);
+    assert(0 == mprotect(guard, page, PROT_NONE));
+    assert(0 == mprotect(guard + page + len, page, PROT_NONE));
+    char *data = guard + page;
+    std::memset(data, 0x5A, len / 2);
+    assert(0 == exclude(data + len / 2, len / 4));
+
+    // Nothing is written to the directory unless the probe is asked for
+    auto dry = estimator::estimate(getpid(), "/tmp");
+    assert(dry.write_bandwidth == 0 && dry.copy_bandwidth > 0);
+    auto estimate = estimator::estimate(getpid(), "/tmp", {}, true);
+    std::cout << estimate << std::endl;
+
+    auto it = std::find_if(estimate.regions.begin(), estimate.regions.end(), [&](const region_estimate &r) {
+        return r.map.start_address == reinterpret_cast<unsigned long>(data);
+    });
+    assert(it != estimate.regions.end());
+    assert(it->resident == len / 2);
+    assert(it->dirty == len / 2);
+    assert(it->zero == len / 2);
+    assert(it->excluded == len / 4);
+    assert(it->file_backed == 0);
+    assert(estimate.threads == 1);
+    assert(estimate.write_bandwidth > 0 && estimate.copy_bandwidth > 0);
+    assert(estimate.pause.count() > 0);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+
+    // The maps can change a little between the estimate and the dump
+    struct stat st;
+    assert(0 == stat(file_path.c_str(), &st));
+    double ratio = static_cast<double>(st.st_size) / estimate.image_size;
+    std::cout << "Estimated " << estimate.image_size << " bytes, dumped " << st.st_size << std::endl;
+    assert(ratio > 0.95 && ratio < 1.05);
+    return 0;
+}
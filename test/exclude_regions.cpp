@@ -0,0 +1,73 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "exclusion.hpp"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_exclude.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 256 * page;
+
+    char *cache = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(cache != MAP_FAILED);
+    std::memset(cache, 0xAB, len);
+
+    // Whole region excluded, half of the other one marked as scratch and a range without whole pages
+    char *scratch = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(scratch != MAP_FAILED);
+    std::memset(scratch, 0xCD, len);
+
+    assert(0 == exclude(cache, len));
+    assert(0 == mark_scratch(scratch + len / 2, len / 2));
+    assert(0 == exclude(scratch + 1, page));
+    assert(0 == exclude(scratch, page));
+    assert(0 == unexclude(scratch));
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+
+    auto cache_region = reader.find(reinterpret_cast<unsigned long>(cache));
+    assert(cache_region != nullptr);
+    assert(cache_region->bitmap != nullptr);
+    assert(nullptr == reader.at(reinterpret_cast<unsigned long>(cache)));
+    assert(nullptr == reader.at(reinterpret_cast<unsigned long>(cache + len - 1)));
+
+    auto scratch_region = reader.find(reinterpret_cast<unsigned long>(scratch));
+    assert(scratch_region != nullptr);
+    for (size_t i = 0; i < len / 2; i += page) {
+        auto data = reader.at(reinterpret_cast<unsigned long>(scratch + i));
+        assert(data != nullptr);
+        assert(data[0] == static_cast<char>(0xCD));
+    }
+    for (size_t i = len / 2; i < len; i += page) {
+        assert(nullptr == reader.at(reinterpret_cast<unsigned long>(scratch + i)));
+    }
+
+    std::cout << "Excluded regions skipped in " << file_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "assert.h"
+#include "cgroup_freezer.hpp"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+const std::string file_path = "/tmp/dump_data_freeze.reck";
+const size_t n_threads = 512;
+
+static size_t count_tasks(pid_t pid) {
+    size_t n = 0;
+    for ([[maybe_unused]] auto &task : std::filesystem::directory_iterator("/proc/" + std::to_string(pid) + "/task")) {
+        n++;
+    }
+    return n;
+}
+
+static std::chrono::microseconds time_stop(pid_t pid, ptracer::stop_method method, ptracer::stop_method &used) {
+    auto start = std::chrono::steady_clock::now();
+    ptracer p{pid, method};
+    assert(0 == p.init());
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    // Every thread is stopped, none was created after the scan
+    assert(p.get_regs().size() == count_tasks(pid));
+    assert(p.get_fpregs().size() == count_tasks(pid));
+    used = p.method();
+    return elapsed;
+}
+
+int main(void) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::atomic<bool> churn{true};
+
+    std::vector<std::thread> v_threads;
+    for (size_t i = 0; i < n_threads; i++) {
+        v_threads.emplace_back([&]() {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&] { return done; });
+        });
+    }
+    // Threads keep coming and going while the process is stopped
+    v_threads.emplace_back([&]() {
+        while (churn) std::thread([] {}).join();
+    });
+
+    auto cgroup = cgroup_freezer::cgroup_of(getpid());
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid) {
+        ptracer::allow_pid();
+        int status;
+        assert(pid == wait(&status));
+        assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    } else {
+        pid_t tracee = getppid();
+        ptracer::stop_method used;
+        auto freeze_time = time_stop(tracee, ptracer::STOP_FREEZE, used);
+        if (used != ptracer::STOP_FREEZE) std::cout << "cgroup v2 freezer not available, ptrace was used" << std::endl;
+        auto ptrace_time = time_stop(tracee, ptracer::STOP_PTRACE, used);
+        std::cout << "Stopped " << count_tasks(tracee) << " threads in " << freeze_time.count()
+                  << " us with the freezer and " << ptrace_time.count() << " us with ptrace" << std::endl;
+
+        dump_options options;
+        options.stop = ptracer::STOP_FREEZE;
+        if (serializer::dump_serialized_file(tracee, file_path, options) < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+
+    // The process is back in its cgroup
+    assert(cgroup == cgroup_freezer::cgroup_of(getpid()));
+
+    churn = false;
+    {
+        std::lock_guard lock(mutex);
+        done = true;
+    }
+    cv.notify_all();
+    for (auto &t : v_threads) t.join();
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    std::cout << reader.regs().size() << " threads in " << file_path << std::endl;
+    assert(reader.regs().size() >= n_threads + 1);
+    assert(reader.regs().size() == reader.fpregs().size());
+    return 0;
+}
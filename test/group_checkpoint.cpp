@@ -0,0 +1,71 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "assert.h"
+#include "group.hpp"
+#include "image_reader.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+constexpr char socket_path[] = "/tmp/reck_group.sock";
+constexpr size_t members = 4;
+
+// A rank of the job: dumps itself through the coordinator and checks its own image
+static int rank(size_t i) {
+    size_t len = (2UL << i) * 1024 * 1024;
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (data == MAP_FAILED) return 1;
+    std::memset(data, 0x40 + i, len);
+
+    std::string name = "dump_data_group_" + std::to_string(i) + ".reck";
+    pid_t dumper = group_checkpoint::make_checkpoint(socket_path, name);
+    int status;
+    if (dumper < 0 || waitpid(dumper, &status, 0) != dumper || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return 1;
+    }
+
+    image_reader reader;
+    if (reader.open("/tmp/" + name) < 0) return 1;
+    for (size_t off = 0; off < len; off += 4096) {
+        auto saved = reader.at(reinterpret_cast<unsigned long>(data + off));
+        if (!saved || saved[0] != static_cast<char>(0x40 + i)) return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    group_coordinator coordinator{socket_path, {"/tmp"}};
+    assert(0 == coordinator.listen());
+
+    pid_t ranks[members];
+    for (size_t i = 0; i < members; i++) {
+        ranks[i] = fork();
+        assert(ranks[i] != -1);
+        if (ranks[i] == 0) exit(rank(i));
+    }
+
+    assert(0 == coordinator.serve(members));
+    for (size_t i = 0; i < members; i++) {
+        int status;
+        assert(ranks[i] == waitpid(ranks[i], &status, 0));
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // One device, every grant goes to the image with the fewest bytes left and the largest one is released last
+    auto &stats = coordinator.stats();
+    assert(stats.size() == members);
+    long total = 0;
+    for (size_t i = 0; i < members; i++) {
+        std::cout << stats[i].name << " " << stats[i].bytes << " bytes, paused " << stats[i].pause.count() << " ms"
+                  << std::endl;
+        total += stats[i].pause.count();
+    }
+    assert(stats.back().name == "dump_data_group_3.reck");
+    std::cout << "Aggregate pause " << total << " ms" << std::endl;
+    return 0;
+}
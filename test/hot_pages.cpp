@@ -0,0 +1,90 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "hotness.hpp"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_hot.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 64 * page;
+
+    char *hot = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(hot != MAP_FAILED);
+    char *cold = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(cold != MAP_FAILED);
+    std::memset(hot, 0x11, len);
+    std::memset(cold, 0x22, len);
+
+    // Keeps writing every hot page while the dumper samples
+    std::atomic<bool> done = false;
+    std::thread writer([&]() {
+        char value = 0;
+        while (!done) {
+            value++;
+            for (size_t i = 0; i < len; i += page) hot[i] = value;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        dump_options options;
+        options.hot_window = std::chrono::milliseconds(200);
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+    done = true;
+    writer.join();
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+
+    auto v_hot = reader.hot_pages();
+    assert(!v_hot.empty());
+    for (size_t i = 0; i < len; i += page) {
+        auto address = reinterpret_cast<unsigned long>(hot + i);
+        assert(std::binary_search(v_hot.begin(), v_hot.end(), address));
+        address = reinterpret_cast<unsigned long>(cold + i);
+        assert(!std::binary_search(v_hot.begin(), v_hot.end(), address));
+    }
+
+    // Runs of a range split by the hot pages
+    unsigned long hot_pages[] = {0x1000, 0x2000, 0x5000};
+    std::vector<std::pair<unsigned long, bool>> v_runs;
+    hotness::split_runs(hot_pages, 3, 0x0, 0x7000, 0x1000, [&](unsigned long address, size_t run_len, bool is_hot) {
+        v_runs.push_back({address, is_hot});
+        assert(run_len > 0);
+    });
+    assert(v_runs.size() == 5);
+    assert(v_runs[0] == std::make_pair(0x0UL, false));
+    assert(v_runs[1] == std::make_pair(0x1000UL, true));
+    assert(v_runs[2] == std::make_pair(0x3000UL, false));
+    assert(v_runs[3] == std::make_pair(0x5000UL, true));
+    assert(v_runs[4] == std::make_pair(0x6000UL, false));
+
+    std::cout << v_hot.size() << " hot pages with " << hotness::best_method() << " in " << file_path << std::endl;
+    return 0;
+}
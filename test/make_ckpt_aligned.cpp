@@ -0,0 +1,44 @@
+#include <unistd.h>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "assert.h"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_aligned.reck";
+    dump_options options;
+    options.align = 2 * 1024 * 1024;
+
+    // Large enough for its own mapping, checked again after the restore
+    std::vector<unsigned> data(4 * 1024 * 1024);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i * 2654435761U;
+
+    for (size_t i = 0; i < 5; i++) {
+        if (i == 2) {
+            int ret = serializer::make_checkpoint(file_path, options);
+            if (ret < 0) {
+                std::cerr << "Error make_checkpoint to file " << file_path << std::endl;
+                return 1;
+            }
+            // The image has to be complete before the restore test maps it. The restored process has no child
+            wait(nullptr);
+            std::cout << "After make_checkpoint" << std::endl;
+        }
+        for (size_t j = 0; j < data.size(); j++) {
+            if (data[j] != static_cast<unsigned>(j * 2654435761U)) {
+                std::cerr << "Error data differs at " << j << std::endl;
+                return 1;
+            }
+        }
+        std::cout << i << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "assert.h"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+// Set by the fixup of every clone, 0 in the original process
+volatile unsigned g_clone = 0;
+
+// The ready pipe of spawn_clones is closed in the clones, only the standard streams can be pipes
+static bool has_stray_pipe() {
+    for (auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        int fd = std::stoi(entry.path().filename());
+        std::error_code ec;
+        auto target = std::filesystem::read_symlink(entry.path(), ec);
+        if (fd > 2 && !ec && target.string().rfind("pipe:", 0) == 0) {
+            std::cerr << "Error fd " << fd << " is " << target << std::endl;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_clones.reck";
+    dump_options options;
+    options.align = 2 * 1024 * 1024;
+
+    // Warm state shared by the clones, checked by each of them
+    std::vector<unsigned> data(4 * 1024 * 1024);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i * 2654435761U;
+
+    // The fixup of restore_clones writes here
+    std::ofstream(file_path + ".addr") << reinterpret_cast<unsigned long>(&g_clone) << std::endl;
+
+    for (size_t i = 0; i < 5; i++) {
+        if (i == 2) {
+            int ret = serializer::make_checkpoint(file_path, options);
+            if (ret < 0) {
+                std::cerr << "Error make_checkpoint to file " << file_path << std::endl;
+                return 1;
+            }
+            // The image has to be complete before it is cloned. The clones have no child
+            wait(nullptr);
+            std::cout << "After make_checkpoint clone " << g_clone << std::endl;
+            if (g_clone && has_stray_pipe()) return 101;
+        }
+        for (size_t j = 0; j < data.size(); j++) {
+            if (data[j] != static_cast<unsigned>(j * 2654435761U)) {
+                std::cerr << "Error data differs at " << j << std::endl;
+                return 100;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return g_clone;
+}
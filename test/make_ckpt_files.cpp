@@ -0,0 +1,76 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static bool check_read(int fd, const char* expected) {
+    char buffer[64] = {};
+    size_t len = std::strlen(expected);
+    if (::read(fd, buffer, len) != static_cast<ssize_t>(len) || std::memcmp(buffer, expected, len) != 0) {
+        std::cerr << "Error fd " << fd << " reads " << buffer << " instead of " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_files.reck";
+    std::string data_path = "/tmp/dump_data_files.txt";
+
+    int out = ::open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(out >= 0);
+    assert(::write(out, "0123456789", 10) == 10);
+    ::close(out);
+
+    // A file read up to the middle and a dup sharing its offset
+    int file = ::open(data_path.c_str(), O_RDONLY | O_CLOEXEC);
+    assert(file >= 0);
+    assert(check_read(file, "0123"));
+    int file_dup = ::dup(file);
+    assert(file_dup >= 0);
+    // The same file opened again has its own offset
+    int file_again = ::open(data_path.c_str(), O_RDONLY);
+    assert(file_again >= 0);
+
+    int memfd = ::memfd_create("reck_files", 0);
+    assert(memfd >= 0);
+    assert(::write(memfd, "memfd contents", 14) == 14);
+
+    int pipe_fds[2];
+    assert(0 == ::pipe2(pipe_fds, O_NONBLOCK));
+    assert(::write(pipe_fds[1], "queued", 6) == 6);
+
+    dump_options options;
+    options.files = true;
+    int ret = serializer::make_checkpoint(file_path, options);
+    if (ret < 0) {
+        std::cerr << "Error make_checkpoint to file " << file_path << std::endl;
+        return 1;
+    }
+    // The restored process has no child and returns at once
+    wait(nullptr);
+    std::cout << "After make_checkpoint" << std::endl;
+
+    if (!check_read(file, "45") || !check_read(file_dup, "67") || !check_read(file_again, "012")) return 1;
+    if (!(::fcntl(file, F_GETFD) & FD_CLOEXEC) || (::fcntl(file_dup, F_GETFD) & FD_CLOEXEC)) {
+        std::cerr << "Error close on exec flags differ" << std::endl;
+        return 1;
+    }
+    if (::lseek(memfd, 0, SEEK_CUR) != 14 || ::lseek(memfd, 0, SEEK_SET) != 0 || !check_read(memfd, "memfd")) {
+        return 1;
+    }
+    if (!check_read(pipe_fds[0], "queued") || !(::fcntl(pipe_fds[0], F_GETFL) & O_NONBLOCK)) return 1;
+    assert(::write(pipe_fds[1], "more", 4) == 4);
+    if (!check_read(pipe_fds[0], "more")) return 1;
+
+    std::cout << "Files checked" << std::endl;
+    return 0;
+}
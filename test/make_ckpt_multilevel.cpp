@@ -0,0 +1,36 @@
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "multilevel.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::vector<storage_tier> tiers = {{"/dev/shm/reck_tier_fast", 1}, {"/tmp/reck_tier_durable", 2}};
+    std::string name = "dump_data_multilevel.reck";
+    // restore_multilevel waits for a fresh durable copy. The retention must leave other files alone
+    std::filesystem::create_directories(tiers[1].directory);
+    std::filesystem::remove(tiers[1].directory + "/" + name);
+    std::ofstream(tiers[1].directory + "/notes.txt") << "not an image" << std::endl;
+
+    for (size_t i = 0; i < 5; i++) {
+        if (i == 2) {
+            int ret = multilevel::make_checkpoint(tiers, name);
+            if (ret < 0) {
+                std::cerr << "Error make_checkpoint to " << name << std::endl;
+                return 1;
+            }
+            std::cout << "After make_checkpoint" << std::endl;
+        }
+        std::cout << i << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "assert.h"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_striped.reck";
+    dump_options options;
+    options.stripe_dirs = {"/tmp/reck_stripe0", "/dev/shm/reck_stripe1", "/tmp/reck_stripe2"};
+    options.stripe_unit = 64 * 1024;
+    for (auto& dir : options.stripe_dirs) mkdir(dir.c_str(), 0700);
+
+    // Spans many stripe units, checked again after the restore
+    std::vector<unsigned> data(4 * 1024 * 1024);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i * 2654435761U;
+
+    for (size_t i = 0; i < 5; i++) {
+        if (i == 2) {
+            int ret = serializer::make_checkpoint(file_path, options);
+            if (ret < 0) {
+                std::cerr << "Error make_checkpoint to file " << file_path << std::endl;
+                return 1;
+            }
+            std::cout << "After make_checkpoint" << std::endl;
+        }
+        for (size_t j = 0; j < data.size(); j++) {
+            if (data[j] != static_cast<unsigned>(j * 2654435761U)) {
+                std::cerr << "Error data differs at " << j << std::endl;
+                return 1;
+            }
+        }
+        std::cout << i << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return 0;
+}
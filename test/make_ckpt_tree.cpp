@@ -0,0 +1,101 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "process_tree.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+constexpr int n_workers = 3;
+constexpr size_t arena_size = 32 * 1024 * 1024;
+constexpr size_t memfd_size = 1024 * 1024;
+
+// At the start of the shared arena
+struct control {
+    std::atomic<int> ready;
+    std::atomic<int> phase;
+    std::atomic<int> done;
+    int slots[n_workers];
+};
+
+static size_t file_size(const std::string& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Runs in every worker, before and after the restore
+static void worker(control* c, char* arena, char* shared_file, int index) {
+    ptracer::allow_pid();
+    c->ready++;
+    while (c->phase == 0) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    bool ok = arena[arena_size - 1] == 'A' && shared_file[memfd_size - 1] == 'M';
+    c->slots[index] = ok ? index + 1 : -1;
+    shared_file[index] = 'a' + index;
+    c->done++;
+    exit(ok ? 0 : 1);
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_tree.reck";
+
+    char* arena = static_cast<char*>(
+        ::mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    assert(arena != MAP_FAILED);
+    std::memset(arena + sizeof(control), 'A', arena_size - sizeof(control));
+    auto c = new (arena) control{};
+
+    int memfd = ::memfd_create("reck_tree", MFD_CLOEXEC);
+    assert(memfd >= 0);
+    assert(0 == ::ftruncate(memfd, memfd_size));
+    char* shared_file =
+        static_cast<char*>(::mmap(nullptr, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0));
+    assert(shared_file != MAP_FAILED);
+    ::close(memfd);
+    std::memset(shared_file, 'M', memfd_size);
+
+    for (int i = 0; i < n_workers; i++) {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) worker(c, arena, shared_file, i);
+    }
+    while (c->ready < n_workers) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    pid_t dumper = fork();
+    assert(dumper != -1);
+    if (dumper == 0) {
+        exit(process_tree::dump(getppid(), file_path) == n_workers + 1 ? 0 : 1);
+    }
+    ptracer::allow_pid();
+    // The restored process has no such child and returns at once
+    int status = 0;
+    if (waitpid(dumper, &status, 0) == dumper) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    std::cout << "After dump of the tree" << std::endl;
+
+    // The arena and the memfd are only in the tree image
+    size_t tree_size = file_size(file_path);
+    std::cout << "Tree image " << tree_size << " bytes" << std::endl;
+    assert(tree_size > arena_size + memfd_size);
+    assert(file_size(process_tree::process_path(file_path, getpid())) < arena_size);
+
+    // The workers see the same memory as the root
+    c->phase = 1;
+    for (int i = 0; i < 1000 && c->done < n_workers; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(c->done == n_workers);
+    for (int i = 0; i < n_workers; i++) {
+        assert(c->slots[i] == i + 1);
+        assert(shared_file[i] == 'a' + i);
+    }
+    // The workers and the helper of a restore
+    while (wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    std::cout << "Tree checked" << std::endl;
+    return 0;
+}
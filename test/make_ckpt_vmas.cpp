@@ -0,0 +1,82 @@
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "maps_parser.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+constexpr size_t n_vmas = 256;
+
+// Every page of the area is its own mapping, read only and read write alternate
+static bool check_area(const unsigned* area, size_t page) {
+    for (size_t i = 0; i < n_vmas * page / sizeof(unsigned); i++) {
+        if (area[i] != static_cast<unsigned>(i * 2654435761U)) {
+            std::cerr << "Error data differs at " << i << std::endl;
+            return false;
+        }
+    }
+    unsigned long start = reinterpret_cast<unsigned long>(area);
+    size_t found = 0;
+    for (auto& map : maps_parser::get_maps(getpid())) {
+        // The kernel can merge the ends of the area with its neighbours
+        unsigned long first = std::max(map.start_address, start);
+        unsigned long last = std::min(map.end_address, start + n_vmas * page);
+        for (unsigned long address = first; address < last; address += page) {
+            unsigned expected = (address - start) / page % 2 ? PROT_READ : PROT_READ | PROT_WRITE;
+            if (map.prot != expected) {
+                std::cerr << "Error protection differs at " << std::hex << address << std::dec << std::endl;
+                return false;
+            }
+            found++;
+        }
+    }
+    if (found != n_vmas) {
+        std::cerr << "Error " << found << " pages of the area are mapped" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_vmas.reck";
+    // The restore cannot move the kernel brk without CAP_SYS_RESOURCE, so the restored malloc must not move it
+    // either. The heap keeps enough room for the output after the checkpoint and is never trimmed
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_TOP_PAD, 4 * 1024 * 1024);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    void* addr = mmap(nullptr, n_vmas * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+    auto area = static_cast<unsigned*>(addr);
+    for (size_t i = 0; i < n_vmas * page / sizeof(unsigned); i++) area[i] = i * 2654435761U;
+    for (size_t i = 1; i < n_vmas; i += 2) {
+        assert(0 == mprotect(static_cast<char*>(addr) + i * page, page, PROT_READ));
+    }
+
+    for (size_t i = 0; i < 5; i++) {
+        if (i == 2) {
+            int ret = serializer::make_checkpoint(file_path);
+            if (ret < 0) {
+                std::cerr << "Error make_checkpoint to file " << file_path << std::endl;
+                return 1;
+            }
+            // The dumper is a child, waiting for it keeps the stop out of the maps reads of check_area. The restored
+            // process has no child and returns at once
+            wait(nullptr);
+            std::cout << "After make_checkpoint" << std::endl;
+        }
+        if (!check_area(area, page)) return 1;
+        std::cout << i << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return 0;
+}
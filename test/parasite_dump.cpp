@@ -0,0 +1,76 @@
+#include <dirent.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static size_t count_fds() {
+    size_t count = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    assert(dir != nullptr);
+    while (readdir(dir)) count++;
+    closedir(dir);
+    return count;
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_parasite.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 1024 * page;
+
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(data != MAP_FAILED);
+    for (size_t i = 0; i < len; i++) data[i] = static_cast<char>(i * 7 + i / page);
+    // Never touched, spliced as zero pages
+    char *untouched = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(untouched != MAP_FAILED);
+    size_t fds = count_fds();
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        dump_options options;
+        options.parasite = true;
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+
+    // Cured: the pipe of the parasite is closed and the interrupted wait returned the child
+    assert(fds == count_fds());
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    auto region = reader.find(reinterpret_cast<unsigned long>(data));
+    assert(region != nullptr);
+    assert(0 == std::memcmp(reader.at(reinterpret_cast<unsigned long>(data)), data, len));
+    for (size_t i = 0; i < len; i += page) {
+        auto saved = reader.at(reinterpret_cast<unsigned long>(untouched + i));
+        assert(saved != nullptr && saved[0] == 0 && saved[page - 1] == 0);
+    }
+
+    // The injected code is not in the image
+    for (auto &r : reader.regions()) {
+        if ((r.map->prot & (PROT_READ | PROT_EXEC)) != (PROT_READ | PROT_EXEC) || r.map->pathname[0] != '/') continue;
+        assert(0 == std::memcmp(r.data.data(), reinterpret_cast<const void *>(r.start()), r.data.size()));
+    }
+
+    std::cout << "Dumped with the parasite to " << file_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "assert.h"
+#include "defer.hpp"
+#include "pipeline.hpp"
+
+using namespace RECK;
+
+// Keeps everything until the end, like a compressor would
+class batch_stage {
+   public:
+    template <class Next>
+    ssize_t operator()(const chunk& c, Next&) {
+        if (m_data.empty()) m_address = c.address;
+        m_data.insert(m_data.end(), c.data, c.data + c.len);
+        return c.len;
+    }
+
+    template <class Next>
+    ssize_t flush(Next& next) {
+        m_flushes++;
+        return next(chunk{m_address, m_data.data(), m_data.size()});
+    }
+
+    size_t flushes() const { return m_flushes; }
+
+   private:
+    unsigned long m_address = 0;
+    std::vector<char> m_data;
+    size_t m_flushes = 0;
+};
+
+int main(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = 16;
+    std::vector<char> data(pages * page, 0);
+    // Every third page is zero
+    for (size_t i = 0; i < pages; i++) {
+        if (i % 3) std::memset(data.data() + i * page, static_cast<int>(i), page);
+    }
+    auto address = reinterpret_cast<unsigned long>(data.data());
+
+    // Copy with a checksum
+    {
+        std::vector<char> copy(data), out;
+        auto p = make_pipeline(checksum_stage{}, buffer_sink{out});
+        assert(local_source{copy.data()}.pump(address, copy.size(), p) == static_cast<ssize_t>(copy.size()));
+        assert(out == data);
+        assert(p.get<0>().value() == checksum_stage::hash(data.data(), data.size()));
+        assert(p.get<0>().bytes() == data.size());
+    }
+
+    // Zero pages dropped, the others kept in runs
+    {
+        std::vector<char> copy(data), out;
+        size_t runs = 0;
+        auto nonzero = [page](unsigned long, const char* p) {
+            for (size_t i = 0; i < page; i++) {
+                if (p[i]) return true;
+            }
+            return false;
+        };
+        auto count = [&runs](chunk&) { runs++; };
+        auto p = make_pipeline(page_filter_stage{page, nonzero}, transform_stage{count}, buffer_sink{out});
+        assert(local_source{copy.data()}.pump(address, copy.size(), p) == static_cast<ssize_t>(copy.size()));
+        size_t zero_pages = (pages + 2) / 3;
+        assert(p.get<0>().dropped() == zero_pages * page);
+        assert(out.size() == (pages - zero_pages) * page);
+        // Pages 0 and 15 are zero, the kept pages come in pairs between zero pages
+        assert(runs == zero_pages - 1);
+        for (size_t i = 0, j = 0; i < pages; i++) {
+            if (i % 3 == 0) continue;
+            assert(std::memcmp(out.data() + j++ * page, data.data() + i * page, page) == 0);
+        }
+    }
+
+    // Read from a process in chunks, changed in place and written to a file
+    {
+        char path[] = "/tmp/pipeline_stages.XXXXXX";
+        int fd = ::mkstemp(path);
+        assert(fd >= 0);
+        ::unlink(path);
+        defer({ ::close(fd); });
+
+        std::vector<char> buffer;
+        auto invert = [](chunk& c) {
+            for (size_t i = 0; i < c.len; i++) c.data[i] = ~c.data[i];
+        };
+        auto p = make_pipeline(transform_stage{invert}, checksum_stage{}, fd_sink{fd});
+        remote_source source{getpid(), buffer, 3 * page};
+        assert(source.pump(address, data.size(), p) == static_cast<ssize_t>(data.size()));
+        assert(buffer.size() == 3 * page);
+
+        std::vector<char> expected(data), read_back(data.size());
+        for (auto& c : expected) c = ~c;
+        assert(::pread(fd, read_back.data(), read_back.size(), 0) == static_cast<ssize_t>(read_back.size()));
+        assert(read_back == expected);
+        assert(p.get<1>().value() == checksum_stage::hash(expected.data(), expected.size()));
+
+        // An unmapped range fails
+        assert(source.pump(0, page, p) < 0);
+    }
+
+    // Zeros for unreadable memory, and a stage that only writes on flush
+    {
+        std::vector<char> buffer, out;
+        auto p = make_pipeline(batch_stage{}, checksum_stage{}, buffer_sink{out});
+        zero_source source{buffer, page};
+        assert(source.pump(address, 5 * page, p) == static_cast<ssize_t>(5 * page));
+        assert(p.get<0>().flushes() == 1);
+        assert(out == std::vector<char>(5 * page, 0));
+        assert(p.get<1>().bytes() == 5 * page);
+    }
+
+    // Chunks written at their place in a file, the second half of the data first
+    {
+        char path[] = "/tmp/pipeline_stages.XXXXXX";
+        int fd = ::mkstemp(path);
+        assert(fd >= 0);
+        ::unlink(path);
+        defer({ ::close(fd); });
+
+        std::vector<char> buffer;
+        qos_throttle throttle{qos_policy{}};
+        size_t half = data.size() / 2;
+        off_t offset = page, second_offset = page + half;
+        auto second = make_pipeline(throttled_pwrite_sink{fd, address + half, second_offset, throttle});
+        auto first = make_pipeline(throttled_pwrite_sink{fd, address, offset, throttle});
+        remote_source source{getpid(), buffer, 3 * page};
+        assert(source.pump(address + half, data.size() - half, second) == static_cast<ssize_t>(data.size() - half));
+        assert(source.pump(address, half, first) == static_cast<ssize_t>(half));
+
+        std::vector<char> read_back(data.size());
+        assert(::pread(fd, read_back.data(), read_back.size(), page) == static_cast<ssize_t>(read_back.size()));
+        assert(read_back == data);
+    }
+
+    {
+        std::vector<char> copy(data);
+        auto p = make_pipeline(checksum_stage{}, null_sink{});
+        assert(local_source{copy.data()}.pump(address, copy.size(), p) == static_cast<ssize_t>(copy.size()));
+        assert(p.get<0>().value() != checksum_stage::seed);
+    }
+
+    std::cout << "Pipeline stages checked" << std::endl;
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "qos.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static double dump(const std::string &file_path, const dump_options &options) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        cpu_set_t cpus;
+        assert(0 == sched_getaffinity(0, sizeof(cpus), &cpus));
+        int nice = getpriority(PRIO_PROCESS, 0);
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        // The policy only applies to the threads that copy the image
+        cpu_set_t after;
+        assert(0 == sched_getaffinity(0, sizeof(after), &after));
+        if (!CPU_EQUAL(&cpus, &after) || getpriority(PRIO_PROCESS, 0) != nice) {
+            std::cerr << "Error the dumper kept the QoS policy" << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_qos.reck";
+    constexpr double bandwidth = 16 * 1024 * 1024;
+
+    // The bucket lets the burst through and then the writes follow the rate
+    qos_policy policy;
+    policy.bandwidth = bandwidth;
+    policy.burst = 1024 * 1024;
+    {
+        qos_throttle throttle{policy};
+        int fd = ::open("/dev/null", O_WRONLY);
+        assert(fd >= 0);
+        std::vector<char> data(5 * 1024 * 1024, 1);
+        auto start = std::chrono::steady_clock::now();
+        assert(throttle.write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ::close(fd);
+        std::cout << "5 MiB at 16 MiB/s in " << elapsed.count() << " s" << std::endl;
+        assert(elapsed.count() > 0.2);
+    }
+
+    // Slow writes halve the rate down to its floor, fast ones bring it back
+    policy.target_latency = std::chrono::microseconds(1000);
+    {
+        qos_throttle throttle{policy};
+        throttle.completed(4096, std::chrono::milliseconds(5));
+        assert(throttle.rate() == bandwidth / 2);
+        for (int i = 0; i < 20; i++) throttle.completed(4096, std::chrono::milliseconds(5));
+        assert(throttle.rate() == bandwidth / 64);
+        for (int i = 0; i < 20; i++) throttle.completed(4096, std::chrono::microseconds(10));
+        assert(throttle.rate() == bandwidth);
+    }
+
+    // A throttled dump with the lowest I/O class and CPU priority still saves everything
+    size_t len = 8 * 1024 * 1024;
+    char *data = static_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(data != MAP_FAILED);
+    std::memset(data, 0x5A, len);
+
+    double full = dump(file_path, {});
+    dump_options options;
+    options.qos.bandwidth = bandwidth;
+    options.qos.io = qos_policy::IO_IDLE;
+    options.qos.nice = 10;
+    options.qos.cpus = {sched_getcpu()};
+
+    // The image is throttled once this process runs again, the longest time the ticker is stopped is the pause
+    std::atomic<bool> done = false;
+    std::atomic<long> longest_gap = 0;
+    std::thread ticker([&]() {
+        auto last = std::chrono::steady_clock::now();
+        while (!done) {
+            auto now = std::chrono::steady_clock::now();
+            long gap = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+            if (gap > longest_gap) longest_gap = gap;
+            last = now;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    double throttled = dump(file_path, options);
+    done = true;
+    ticker.join();
+    std::cout << "Dump in " << full << " s, throttled in " << throttled << " s, paused at most "
+              << longest_gap / 1000 << " ms" << std::endl;
+    assert(throttled > static_cast<double>(len) / options.qos.bandwidth / 2);
+    assert(longest_gap < static_cast<double>(len) / options.qos.bandwidth / 2 * 1e6);
+
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    for (size_t i = 0; i < len; i += 4096) {
+        auto saved = reader.at(reinterpret_cast<unsigned long>(data + i));
+        assert(saved != nullptr && saved[0] == 0x5A);
+    }
+
+    // Past its budget the staged image goes to the file during the stop, it is still complete
+    auto stats = static_cast<commit_stats *>(
+        ::mmap(nullptr, sizeof(commit_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    assert(stats != MAP_FAILED);
+    new (stats) commit_stats{};
+    options.qos.stage_budget = 1024 * 1024;
+    options.stats = stats;
+    dump(file_path, options);
+    std::cout << "Spilled " << stats->spilled << " bytes past a budget of " << options.qos.stage_budget << std::endl;
+    assert(stats->spilled > options.qos.stage_budget);
+    image_reader spilled;
+    assert(0 == spilled.open(file_path));
+    for (size_t i = 0; i < len; i += 4096) {
+        auto saved = spilled.at(reinterpret_cast<unsigned long>(data + i));
+        assert(saved != nullptr && saved[0] == 0x5A);
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_w_r_mdata.reck";
+
+    image_reader reader;
+    if (reader.open(file_path) < 0) {
+        std::cerr << "Error opening image " << file_path << std::endl;
+        return 1;
+    }
+
+    assert(0 != reader.regs().size());
+    assert(reader.regs().size() == reader.fpregs().size());
+    assert(0 != reader.regions().size());
+
+    for (const auto& region : reader.regions()) {
+        assert(region.data.size() == region.end() - region.start());
+        assert(reader.find(region.start()) == &region);
+        assert(reader.find(region.end() - 1) == &region);
+        assert(reader.at(region.start()) == region.data.data());
+    }
+    assert(nullptr == reader.find(0));
+
+    // The stack pointer of every thread has to be inside a saved region
+    for (const auto regs : reader.regs()) {
+        assert(nullptr != reader.find(regs->rsp));
+    }
+
+    std::cout << "Image " << file_path << " with " << reader.mdata().size() << " entries and "
+              << reader.regions().size() << " regions" << std::endl;
+    return 0;
+}
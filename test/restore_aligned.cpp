@@ -0,0 +1,38 @@
+#include <unistd.h>
+
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_aligned.reck";
+    size_t align = 2 * 1024 * 1024;
+
+    // Every region is after a PADDING and its data starts at the same offset as its address in a huge page
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    assert(!reader.regions().empty());
+    for (auto& region : reader.regions()) {
+        assert(region.aligned);
+        if (region.data.empty()) continue;
+        size_t offset = reader.file_offset(region.data.data());
+        if (!region.bitmap || region.saved_index(0) == 0) {
+            assert(offset % align == region.start() % align);
+        }
+        assert(offset % reader.page_size() == 0);
+    }
+    reader.close();
+
+    auto ret = serializer::restore_serialized_file(file_path);
+    if (ret < 0) {
+        std::cerr << "Error restoring dump file " << file_path << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include "assert.h"
+#include "filesystem.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_clones.reck";
+    constexpr size_t n = 4;
+
+    unsigned long clone_address = 0;
+    std::ifstream(file_path + ".addr") >> clone_address;
+    assert(clone_address != 0);
+
+    auto start = std::chrono::steady_clock::now();
+    auto v_pids = serializer::spawn_clones(file_path, n, [&](pid_t pid, size_t index) {
+        unsigned id = index + 1;
+        auto ret = filesystem::remote_write(pid, reinterpret_cast<void*>(clone_address), &id, sizeof(id));
+        return ret == sizeof(id) ? 0 : -1;
+    });
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << v_pids.size() << " clones in " << elapsed.count() << " ms" << std::endl;
+    assert(v_pids.size() == n);
+
+    // Every clone runs the checks of make_ckpt_clones and exits with its own id
+    for (size_t i = 0; i < n; i++) {
+        int status = 0;
+        assert(waitpid(v_pids[i], &status, 0) == v_pids[i]);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != static_cast<int>(i + 1)) {
+            std::cerr << "Error clone " << i << " status " << status << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "multilevel.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::vector<storage_tier> tiers = {{"/dev/shm/reck_tier_fast", 1}, {"/tmp/reck_tier_durable", 2}};
+    std::string name = "dump_data_multilevel.reck";
+
+    // The drain runs in the background after make_ckpt_multilevel exits, the durable copy appears once it is done
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (multilevel::find_checkpoint({tiers[1]}, name).empty() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // The durable copy has to be drained and the fast one has to be preferred
+    assert(multilevel::find_checkpoint({tiers[1]}, name) == tiers[1].directory + "/" + name);
+    assert(multilevel::find_checkpoint(tiers, name) == tiers[0].directory + "/" + name);
+    assert(std::filesystem::exists(tiers[1].directory + "/notes.txt"));
+
+    auto ret = multilevel::restore_serialized_file(tiers, name);
+    if (ret < 0) {
+        std::cerr << "Error restoring checkpoint " << name << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
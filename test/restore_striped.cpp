@@ -0,0 +1,29 @@
+#include <unistd.h>
+
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_striped.reck";
+
+    // Only the layout is in the image
+    image_reader reader;
+    assert(0 == reader.open(file_path));
+    assert(reader.is_striped());
+    assert(reader.regions().empty());
+    reader.close();
+
+    auto ret = serializer::restore_serialized_file(file_path);
+    if (ret < 0) {
+        std::cerr << "Error restoring dump file " << file_path << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
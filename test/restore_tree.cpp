@@ -0,0 +1,13 @@
+#include <iostream>
+
+#include "process_tree.hpp"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_tree.reck";
+
+    process_tree::restore(file_path);
+    std::cerr << "Error restoring tree file " << file_path << std::endl;
+    return 1;
+}
@@ -0,0 +1,124 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "assert.h"
+#include "exclusion.hpp"
+#include "snapshot.hpp"
+
+using namespace RECK;
+
+// Excluded, so it survives the rollbacks and tells where the test is
+struct progress {
+    int step;
+    long first;
+    long seqs[4];
+    unsigned long fresh;
+    std::chrono::steady_clock::time_point start;
+};
+
+static volatile int g_value = 0;
+
+static bool filled(const char* data, size_t len, char value) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != value) return false;
+    }
+    return true;
+}
+
+static bool mapped(unsigned long address, size_t len) {
+    return ::msync(reinterpret_cast<void*>(address), len, MS_ASYNC) == 0;
+}
+
+int main(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    void* addr = ::mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(addr != MAP_FAILED);
+    assert(0 == exclude(addr, page));
+    auto state = static_cast<progress*>(addr);
+
+    snapshot_ring ring{3};
+    size_t len = 64 * page;
+    char* heap = static_cast<char*>(std::malloc(len));
+    assert(heap);
+    std::memset(heap, 1, len);
+    char* gone = static_cast<char*>(::mmap(nullptr, 4 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1, 0));
+    assert(gone != MAP_FAILED);
+    std::memset(gone, 7, 4 * page);
+    volatile int local = 20;
+    g_value = 10;
+
+    auto start = std::chrono::steady_clock::now();
+    long seq = ring.capture();
+    assert(seq >= 0);
+    if (seq > 0) {
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        std::cout << "Snapshot " << seq << " taken in " << took.count() << " ms" << std::endl;
+        state->first = seq;
+        state->step = 1;
+
+        g_value = 11;
+        local = 21;
+        std::memset(heap, 2, len);
+        assert(0 == ::munmap(gone, 4 * page));
+        void* fresh = ::mmap(nullptr, 8 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(fresh != MAP_FAILED);
+        std::memset(fresh, 3, 8 * page);
+        state->fresh = reinterpret_cast<unsigned long>(fresh);
+
+        state->start = std::chrono::steady_clock::now();
+        ring.rollback(seq);
+        std::cerr << "Error rollback returned" << std::endl;
+        return 1;
+    }
+
+    if (state->step == 1) {
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - state->start;
+        std::cout << "Rolled back to snapshot " << ring.restored() << " in " << took.count() << " ms" << std::endl;
+        assert(ring.restored() == state->first);
+        assert(g_value == 10);
+        assert(local == 20);
+        assert(filled(heap, len, 1));
+        assert(mapped(reinterpret_cast<unsigned long>(gone), 4 * page));
+        assert(filled(gone, 4 * page, 7));
+        assert(!mapped(state->fresh, 8 * page));
+
+        // The oldest snapshots leave the ring. The heap changes between the second and the third snapshot only,
+        // so the rollback to the second one cannot rely on the soft-dirty bits of the last capture
+        for (int i = 0; i < 4; i++) {
+            g_value = 100 + i;
+            if (i == 2) std::memset(heap, 5, len);
+            long s = ring.capture();
+            assert(s >= 0);
+            if (s == 0) break;
+            state->seqs[i] = s;
+        }
+        if (state->step == 1) {
+            assert(ring.size() == 3);
+            assert(ring.latest() == state->seqs[3]);
+            assert(ring.rollback(state->first) < 0);
+            assert(ring.rollback(state->seqs[0]) < 0);
+            assert(ring.restored() == state->first);
+
+            state->step = 2;
+            g_value = 0;
+            ring.rollback(state->seqs[1]);
+            std::cerr << "Error rollback returned" << std::endl;
+            return 1;
+        }
+    }
+
+    assert(state->step == 2);
+    assert(ring.restored() == state->seqs[1]);
+    assert(g_value == 101);
+    assert(filled(heap, len, 1));
+
+    std::free(heap);
+    std::cout << "Snapshots rolled back" << std::endl;
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include "assert.h"
+#include "ptracer.hpp"
+#include "thread_sampler.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+constexpr uint64_t canary = 0x5a3b1c2d4e6f7081UL;
+static std::atomic<bool> stop = false;
+static std::atomic<uint64_t> spins = 0;
+static std::atomic<uint64_t> ticks = 0;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_samples.bin";
+
+    int p[2];
+    assert(0 == ::pipe(p));
+    // Waits in read, with a known value on its stack
+    std::thread reader([&]() {
+        volatile uint64_t marks[4] = {canary, canary, canary, canary};
+        char c;
+        while (::read(p[0], &c, 1) < 0 && errno == EINTR) {
+        }
+        assert(marks[0] == canary);
+    });
+    std::thread spinner([]() {
+        while (!stop) spins++;
+    });
+
+    // Signals arrive while the threads are stopped by the sampler, they are delivered and nothing is lost
+    struct sigaction sa = {};
+    sa.sa_handler = [](int) { ticks++; };
+    sa.sa_flags = SA_RESTART;
+    assert(0 == sigaction(SIGALRM, &sa, nullptr));
+    itimerval timer = {{0, 2000}, {0, 2000}};
+    assert(0 == setitimer(ITIMER_REAL, &timer, nullptr));
+
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        ssize_t samples = thread_sampler::record_file(getppid(), file_path, 200, std::chrono::milliseconds{500});
+        exit(samples > 0 ? 0 : 1);
+    }
+    ptracer::allow_pid();
+    int status;
+    while (waitpid(child, &status, 0) < 0) assert(errno == EINTR);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    timer = {};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+
+    // The process runs on after the sampler detached
+    uint64_t spins_before = spins;
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    assert(spins > spins_before);
+    stop = true;
+    assert(1 == ::write(p[1], "x", 1));
+    reader.join();
+    spinner.join();
+    assert(ticks > 0);
+
+    thread_sampler::file_header h;
+    std::vector<thread_sampler::sample> v_samples;
+    assert(0 == thread_sampler::read_file(file_path, h, v_samples));
+    assert(h.pid == getpid());
+    assert(v_samples.size() >= 20);
+
+    size_t reading = 0;
+    size_t running = 0;
+    size_t canaries = 0;
+    uint64_t total_stop = 0;
+    uint64_t max_stop = 0;
+    for (auto& s : v_samples) {
+        assert(s.h.n_records == 3 && s.v_threads.size() == 3);
+        total_stop += s.h.stop_ns;
+        max_stop = std::max<uint64_t>(max_stop, s.h.stop_ns);
+        for (auto& t : s.v_threads) {
+            assert(t.r.stack_size > 0 && t.r.stack_size <= h.stack_window);
+            if (t.r.state == 'R') running++;
+            if (static_cast<long>(t.r.regs.orig_rax) != SYS_read || t.r.state != 'S') continue;
+            reading++;
+            for (size_t off = 0; off + sizeof(canary) <= t.stack.size(); off += sizeof(canary)) {
+                if (std::memcmp(t.stack.data() + off, &canary, sizeof(canary)) == 0) {
+                    canaries++;
+                    break;
+                }
+            }
+        }
+    }
+    std::cout << v_samples.size() << " samples, stopped " << total_stop / v_samples.size() / 1000 << " us on average, "
+              << max_stop / 1000 << " us at most, " << ticks << " signals delivered" << std::endl;
+    // The reader waits in read in every sample, a signal handler may run in it now and then
+    assert(reading >= v_samples.size() / 2);
+    assert(canaries == reading);
+    assert(running > 0);
+    return 0;
+}
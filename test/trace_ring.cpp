@@ -0,0 +1,106 @@
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "assert.h"
+#include "serializer.hpp"
+#include "trace.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_trace.reck";
+    std::string trace_path = "/tmp/dump_data_trace.bin";
+
+    // One thread overflows its ring, the other one records a few scopes. They stay alive until the dumper has
+    // forked, the ring of an exited thread would be taken over by the dumper
+    std::promise<void> done;
+    std::shared_future<void> dumped = done.get_future().share();
+    std::promise<void> overflow_ready, scopes_ready;
+    std::thread overflow([&]() {
+        for (uint64_t i = 0; i < trace::ring_entries + 100; i++) trace_mark(WRITE, i);
+        overflow_ready.set_value();
+        dumped.wait();
+    });
+    std::thread scopes([&]() {
+        for (uint64_t i = 0; i < 10; i++) {
+            trace_scope(DUMP_MAP, i, i * 2);
+        }
+        scopes_ready.set_value();
+        dumped.wait();
+    });
+    overflow_ready.get_future().wait();
+    scopes_ready.get_future().wait();
+
+    // The dumper records its own events in its ring
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path);
+        if (ret < 0 || trace::dump(trace_path.c_str()) < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+
+    std::ifstream in(trace_path, std::ios::binary);
+    trace::file_header h;
+    assert(in.read(reinterpret_cast<char *>(&h), sizeof(h)));
+    assert(0 == std::memcmp(h.magic, trace::file_magic, sizeof(h.magic)));
+    assert(h.pid == pid);
+    assert(h.n_rings == 3);
+    assert(h.tsc_end > h.tsc_start && h.ns_end > h.ns_start);
+
+    size_t dumps = 0, overflowed = 0, scope_entries = 0;
+    for (uint32_t i = 0; i < h.n_rings; i++) {
+        trace::file_ring fr;
+        assert(in.read(reinterpret_cast<char *>(&fr), sizeof(fr)));
+        uint64_t count = std::min(fr.head, trace::ring_entries);
+        std::vector<trace::entry> v_entries(count);
+        assert(in.read(reinterpret_cast<char *>(v_entries.data()), count * sizeof(trace::entry)));
+        for (size_t j = 1; j < v_entries.size(); j++) assert(v_entries[j - 1].tsc <= v_entries[j].tsc);
+
+        if (fr.head == trace::ring_entries + 100) {
+            // The oldest 100 were overwritten
+            overflowed++;
+            assert(v_entries.front().arg0 == 100);
+            assert(v_entries.back().arg0 == trace::ring_entries + 99);
+        } else if (count == 20) {
+            scope_entries++;
+            assert(v_entries[0].kind == trace::BEGIN && v_entries[1].kind == trace::END);
+            assert(v_entries[19].event == trace::DUMP_MAP && v_entries[19].arg1 == 18);
+        } else {
+            for (auto &e : v_entries) dumps += e.event == trace::DUMP;
+        }
+    }
+    assert(overflowed == 1 && scope_entries == 1);
+    assert(dumps == 2);
+
+    // Threads that come and go take over the rings of the exited ones
+    done.set_value();
+    overflow.join();
+    scopes.join();
+    for (size_t i = 0; i < 100; i++) {
+        std::thread([]() { trace_mark(WRITE); }).join();
+    }
+    std::string reuse_path = trace_path + ".reuse";
+    assert(0 == trace::dump(reuse_path.c_str()));
+    std::ifstream reuse(reuse_path, std::ios::binary);
+    assert(reuse.read(reinterpret_cast<char *>(&h), sizeof(h)));
+    assert(h.n_rings <= 2);
+
+    std::cout << "Trace of the dumper in " << trace_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static volatile unsigned long g_deep = 0;
+
+// Leaves a marked frame far below the stack pointer of main
+__attribute__((noinline)) static void deep_frame() {
+    char frame[128 * 1024];
+    std::memset(frame, 0x5A, sizeof(frame));
+    g_deep = reinterpret_cast<unsigned long>(frame);
+    asm volatile("" : : "r"(frame) : "memory");
+}
+
+static void dump(const std::string& file_path, const dump_options& options) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+}
+
+int main(void) {
+    std::string file_path = "/tmp/dump_data_trim.reck";
+    std::string full_path = "/tmp/dump_data_trim_full.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 16 * page;
+
+    deep_frame();
+    char live_local = 0x11;
+
+    // Below the mmap threshold, so both come from the heap. The live one keeps the freed one off the top chunk
+    char* freed = static_cast<char*>(std::malloc(len));
+    char* live = static_cast<char*>(std::malloc(len));
+    assert(freed && live);
+    std::memset(freed, 0xEF, len);
+    std::memset(live, 0x77, len);
+    auto inside = (reinterpret_cast<unsigned long>(freed) + 2 * page) & ~(page - 1);
+    std::free(freed);
+
+    dump_options options;
+    options.trim_stacks = true;
+    options.trim_free = true;
+    dump(file_path, options);
+    dump(full_path, {});
+
+    image_reader reader, full;
+    assert(0 == reader.open(file_path));
+    assert(0 == full.open(full_path));
+    auto trimmed_size = std::filesystem::file_size(file_path);
+    auto full_size = std::filesystem::file_size(full_path);
+    std::cout << "Trimmed image " << trimmed_size << " bytes, full image " << full_size << " bytes" << std::endl;
+    assert(trimmed_size < full_size);
+
+    // Dead stack and the inside of the freed chunk are dropped
+    unsigned long deep = g_deep;
+    assert(full.at(deep) != nullptr);
+    assert(reader.at(deep) == nullptr);
+    assert(full.at(inside) != nullptr);
+    assert(reader.at(inside) == nullptr);
+
+    // Live frames and chunks are kept
+    auto local = reader.at(reinterpret_cast<unsigned long>(&live_local));
+    assert(local != nullptr && *local == 0x11);
+    for (size_t i = 0; i < len; i += page) {
+        auto data = reader.at(reinterpret_cast<unsigned long>(live + i));
+        assert(data != nullptr && *data == 0x77);
+    }
+
+    std::free(live);
+    std::cout << "Dead stack and free chunks skipped in " << file_path << std::endl;
+    return 0;
+}
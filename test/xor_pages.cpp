@@ -0,0 +1,105 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+#include "assert.h"
+#include "image_reader.hpp"
+#include "page_codec.hpp"
+#include "serializer.hpp"
+#include "wait.h"
+
+using namespace RECK;
+
+static void dump(const std::string &file_path, const dump_options &options) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    int status;
+    if (pid) {
+        ptracer::allow_pid();
+        assert(pid == wait(&status));
+        assert(0 == status);
+    } else {
+        int ret = serializer::dump_serialized_file(getppid(), file_path, options);
+        if (ret < 0) {
+            std::cerr << "Error dumping file " << file_path << std::endl;
+            exit(1);
+        }
+        exit(0);
+    }
+}
+
+static void round_trip(const char *data, const char *base, size_t page) {
+    std::vector<char> encoded(page), decoded(page, 0);
+    auto n = page_codec::encode(data, base, page, encoded.data());
+    if (n < 0) return;
+    if (base) std::memcpy(decoded.data(), base, page);
+    assert(page_codec::decode(encoded.data(), n, decoded.data(), page));
+    assert(0 == std::memcmp(decoded.data(), data, page));
+}
+
+int main(void) {
+    std::string base_path = "/tmp/dump_data_xor_base.reck";
+    std::string plain_path = "/tmp/dump_data_xor_plain.reck";
+    std::string xor_path = "/tmp/dump_data_xor.reck";
+    std::string compact_path = "/tmp/dump_data_xor_compact.reck";
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = 256 * page;
+
+    // Codec edge cases: sparse changes, changes at both ends, a page that does not shrink
+    std::mt19937 rng(7);
+    std::vector<char> a(page), b(page);
+    for (auto &c : a) c = rng();
+    b = a;
+    b[0] ^= 1;
+    b[page - 1] ^= 1;
+    for (size_t i = 0; i < page; i += 97) b[i] ^= 0x40;
+    round_trip(b.data(), a.data(), page);
+    round_trip(a.data(), nullptr, page);
+    for (auto &c : b) c = rng();
+    assert(page_codec::encode(b.data(), a.data(), page, std::vector<char>(page).data()) < 0);
+
+    // Values drift a little every step and one counter per page moves
+    auto values = static_cast<double *>(
+        mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    assert(values != MAP_FAILED);
+    size_t n = len / sizeof(double);
+    for (size_t i = 0; i < n; i++) values[i] = 1000.0 + i;
+    dump(base_path, {});
+
+    for (size_t i = 0; i < n; i += page / sizeof(double)) values[i] += 1;
+    for (size_t i = 0; i < n / 2; i++) values[i] *= 1.0 + 1e-13;
+    dump_options options;
+    options.parent = base_path;
+    dump(plain_path, options);
+    options.xor_pages = true;
+    dump(xor_path, options);
+
+    auto plain_size = std::filesystem::file_size(plain_path);
+    auto xor_size = std::filesystem::file_size(xor_path);
+    std::cout << "Delta " << plain_size << " bytes, XOR delta " << xor_size << " bytes" << std::endl;
+    assert(xor_size < plain_size / 2);
+
+    image_reader delta;
+    assert(0 == delta.open(xor_path));
+    auto region = delta.find(reinterpret_cast<unsigned long>(values));
+    assert(region != nullptr && region->delta && !region->offsets.empty());
+
+    // Pages decoded through the chain are the memory at the time of the dump
+    auto chain = image_chain::resolve(xor_path);
+    assert(chain.size() == 2);
+    assert(serializer::compact_images(chain, compact_path, 4) > 0);
+    image_reader compact;
+    assert(0 == compact.open(compact_path));
+    for (size_t i = 0; i < len; i += page) {
+        auto address = reinterpret_cast<unsigned long>(values) + i;
+        auto saved = compact.at(address);
+        assert(saved != nullptr);
+        assert(0 == std::memcmp(saved, reinterpret_cast<const char *>(address), page));
+    }
+
+    return 0;
+}
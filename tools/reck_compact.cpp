@@ -0,0 +1,46 @@
+// reck-compact: merges a chain of checkpoint images into one full image that restores without its parents.
+// With a single image its parents are followed, otherwise the images are given oldest first.
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "image_reader.hpp"
+#include "serializer.hpp"
+
+using namespace RECK;
+
+int main(int argc, char *argv[]) {
+    unsigned threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            threads = std::strtoul(optarg, nullptr, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - optind < 2) {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] <output.reck> <image.reck>..." << std::endl;
+        return 1;
+    }
+
+    std::string output = argv[optind];
+    std::vector<std::string> v_chain(argv + optind + 1, argv + argc);
+    if (v_chain.size() == 1) {
+        v_chain = image_chain::resolve(v_chain[0]);
+        if (v_chain.empty()) {
+            return 1;
+        }
+    }
+
+    if (serializer::compact_images(v_chain, output, threads) < 0) {
+        std::cerr << "Error compacting " << v_chain.size() << " images into " << output << std::endl;
+        return 1;
+    }
+    std::cout << "Compacted " << v_chain.size() << " images into " << output << std::endl;
+    return 0;
+}
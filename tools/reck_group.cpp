@@ -0,0 +1,38 @@
+// reck-group: node level coordinator of group checkpoints. Members started with group_checkpoint connect to
+// <socket>, every group of <members> is stopped together and its images are written to the directories, one
+// member at a time per device. Prints the pause of every member after each group.
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "group.hpp"
+
+using namespace RECK;
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || std::atoi(argv[2]) <= 0) {
+        std::cerr << "Usage: " << argv[0] << " <socket> <members> <directory>..." << std::endl;
+        return 1;
+    }
+    size_t members = std::atoi(argv[2]);
+    group_coordinator coordinator{argv[1], std::vector<std::string>(argv + 3, argv + argc)};
+    if (coordinator.listen() < 0) {
+        return 1;
+    }
+
+    for (unsigned long group = 0;; group++) {
+        if (coordinator.serve(members) < 0) {
+            std::cerr << "Warning: group " << group << " failed" << std::endl;
+            continue;
+        }
+        std::printf("group %lu\n", group);
+        for (auto &m : coordinator.stats()) {
+            std::printf("  %-32s %12lu bytes %8ld ms\n", m.name.c_str(), m.bytes,
+                        static_cast<long>(m.pause.count()));
+        }
+        std::fflush(stdout);
+    }
+}
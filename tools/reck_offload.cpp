@@ -0,0 +1,73 @@
+// reck-offload: checkpoints a running process and moves its cold memory out to the image. The hot pages are
+// sampled for a window before the dump, the other pages of the private anonymous regions are dropped from the
+// process and served from the image when it touches them again. Runs until the process exits or until SIGINT,
+// SIGTERM, SIGHUP or SIGQUIT, then puts the pages still dropped back into the process. A guardian recalls them
+// when reck-offload dies without that, see cold_offload::guard.
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "offload.hpp"
+#include "serializer.hpp"
+
+using namespace RECK;
+
+namespace {
+
+volatile sig_atomic_t stop = 0;
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    long window_ms = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        if (opt == 'w') {
+            window_ms = std::strtol(optarg, nullptr, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - optind != 2) {
+        std::cerr << "Usage: " << argv[0] << " [-w hot window ms] <pid> <image.reck>" << std::endl;
+        return 1;
+    }
+    pid_t pid = std::atoi(argv[optind]);
+    std::string image = argv[optind + 1];
+
+    dump_options options;
+    options.hot_window = std::chrono::milliseconds{window_ms};
+    if (serializer::dump_serialized_file(pid, image, options) < 0) {
+        std::cerr << "Error dumping pid " << pid << " to " << image << std::endl;
+        return 1;
+    }
+
+    // Without SA_RESTART, the signal ends the wait for faults
+    struct sigaction sa = {};
+    sa.sa_handler = [](int) { stop = 1; };
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT}) sigaction(sig, &sa, nullptr);
+
+    // The pages are only lost if the guardian dies too
+    cold_offload offload{pid};
+    if (offload.guard() < 0 || offload.drop(image) < 0) {
+        std::cerr << "Error offloading pid " << pid << std::endl;
+        return 1;
+    }
+    auto &stats = offload.get_stats();
+    std::cout << "Dropped " << stats.dropped << " of " << stats.cold << " cold pages, " << stats.changed
+              << " changed since the image" << std::endl;
+
+    while (!stop && !offload.exited()) {
+        if (offload.serve(std::chrono::milliseconds{-1}) < 0) {
+            break;
+        }
+    }
+    int ret = offload.recall();
+    std::cout << stats.faults << " faults served from the image, " << stats.zero_fills << " zero filled, "
+              << stats.recalled << " pages recalled" << std::endl;
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+// reck-restore: restores a checkpoint image replacing this whole process.
+// The image is planned here with the normal library, then the blob in restore_blob.cpp is moved to an address
+// free in both the current process and the image, everything else is unmapped and the image mapped with no
+// collisions. The blob ends with rt_sigreturn to the saved registers.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/rseq.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hotness.hpp"
+#include "image_reader.hpp"
+#include "restore_blob.hpp"
+#include "trace.hpp"
+
+using namespace RECK;
+
+namespace {
+
+constexpr unsigned long task_size = 0x7ffffffff000UL;
+constexpr unsigned long blob_low_address = 0x100000000UL;
+constexpr size_t blob_stack_size = 64 * 1024;
+constexpr size_t blob_scratch_size = 64 * 1024;
+constexpr int blob_tries_per_gap = 64;
+
+// Kernel internal restart codes, not exported to userspace
+constexpr long restart_sys = 512;
+constexpr long restart_nointr = 513;
+constexpr long restart_nohand = 514;
+constexpr long restart_restartblock = 516;
+
+unsigned long align_up(unsigned long value, unsigned long align) { return (value + align - 1) & ~(align - 1); }
+
+// The registers were captured with the thread stopped in a syscall, rt_sigreturn does not restart it
+void fixup_syscall_restart(user_regs_struct &regs) {
+    if (static_cast<long>(regs.orig_rax) < 0) return;
+    switch (static_cast<long>(regs.rax)) {
+        case -restart_sys:
+        case -restart_nointr:
+        case -restart_nohand:
+            regs.rax = regs.orig_rax;
+            regs.rip -= 2;
+            break;
+        case -restart_restartblock:
+            regs.rax = -EINTR;
+            break;
+        default:
+            break;
+    }
+}
+
+// Map len bytes outside the saved regions and outside the current mappings
+char *map_free_range(const image_reader &reader, size_t len) {
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    std::vector<std::pair<unsigned long, unsigned long>> gaps;
+    unsigned long prev_end = blob_low_address;
+    for (const auto &region : reader.regions()) {
+        if (region.start() > prev_end) gaps.emplace_back(prev_end, region.start());
+        prev_end = std::max(prev_end, region.end());
+    }
+    gaps.emplace_back(prev_end, task_size);
+
+    for (auto &[gap_start, gap_end] : gaps) {
+        // Keep a guard page at both sides
+        unsigned long candidate = align_up(gap_start, page) + page;
+        for (int i = 0; i < blob_tries_per_gap && candidate + len + page <= gap_end; i++, candidate += len) {
+            void *addr = ::mmap(reinterpret_cast<void *>(candidate), len, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+            if (addr == MAP_FAILED) {
+                if (errno == EEXIST) continue;
+                break;
+            }
+            if (reinterpret_cast<unsigned long>(addr) != candidate) {
+                // Old kernels ignore MAP_FIXED_NOREPLACE and use it as a hint
+                ::munmap(addr, len);
+                continue;
+            }
+            return static_cast<char *>(addr);
+        }
+    }
+    return nullptr;
+}
+
+// rseq stays registered by the kernel after the address space is replaced
+void unregister_rseq() {
+    if (__rseq_size == 0) return;
+    auto area = static_cast<char *>(__builtin_thread_pointer()) + __rseq_offset;
+    if (::syscall(SYS_rseq, area, 32, RSEQ_FLAG_UNREGISTER, RSEQ_SIG) == 0) return;
+    ::syscall(SYS_rseq, area, __rseq_size, RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+}
+
+class bump_allocator {
+   public:
+    bump_allocator(char *begin) : m_current(begin) {}
+
+    template <typename T>
+    T *alloc(size_t count = 1, size_t align = alignof(T)) {
+        m_current = reinterpret_cast<char *>(align_up(reinterpret_cast<unsigned long>(m_current), align));
+        T *ret = reinterpret_cast<T *>(m_current);
+        m_current += sizeof(T) * count;
+        return ret;
+    }
+
+   private:
+    char *m_current;
+};
+
+// With RECK_TRACE the rings of this process go to the trace file like at exit, and the blob gets a ring of its own
+// for its phases, see blob_trace. ring has room for a file_ring and blob_trace_stamps + 1 entries
+void prepare_blob_trace(blob_trace &trace, trace::file_header *header, char *ring, uint64_t restore_tsc,
+                        const restore_blob_args &args) {
+    trace.fd = -1;
+    const char *prefix = std::getenv("RECK_TRACE");
+    if (!prefix || !*prefix || trace::flush() < 0) return;
+    std::string trace_path = std::string{prefix} + "." + std::to_string(getpid());
+    int fd = ::open(trace_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (::pread(fd, header, sizeof(*header), 0) != sizeof(*header) || ::fstat(fd, &st) < 0) {
+        ::close(fd);
+        return;
+    }
+    header->n_rings++;
+
+    auto fr = reinterpret_cast<trace::file_ring *>(ring);
+    auto entries = reinterpret_cast<trace::entry *>(ring + sizeof(*fr));
+    const struct {
+        trace::event event;
+        trace::kind kind;
+        long arg0;
+    } phases[blob_trace_stamps + 1] = {
+        {trace::RESTORE, trace::BEGIN, 0},
+        {trace::RESTORE_MAP, trace::BEGIN, args.n_maps + args.n_files},
+        {trace::RESTORE_MAP, trace::END, args.n_maps + args.n_files},
+        {trace::RESTORE_LOAD, trace::BEGIN, args.n_batches},
+        {trace::RESTORE_LOAD, trace::END, args.n_batches},
+        {trace::RESTORE_PROTECT, trace::BEGIN, args.n_prots},
+        {trace::RESTORE_PROTECT, trace::END, args.n_prots},
+        {trace::RESTORE, trace::END, 0},
+    };
+    *fr = {static_cast<pid_t>(::syscall(SYS_gettid)), 0, blob_trace_stamps + 1};
+    for (long i = 0; i <= blob_trace_stamps; i++) {
+        entries[i] = {};
+        entries[i].tsc = i == 0 ? restore_tsc : 0;
+        entries[i].event = phases[i].event;
+        entries[i].kind = phases[i].kind;
+        entries[i].arg0 = phases[i].arg0;
+        if (i > 0) trace.stamps[i - 1] = &entries[i].tsc;
+    }
+
+    trace.fd = fd;
+    trace.header = header;
+    trace.header_len = sizeof(*header);
+    trace.tsc_end = &header->tsc_end;
+    trace.ns_end = &header->ns_end;
+    trace.ring = ring;
+    trace.ring_len = sizeof(*fr) + (blob_trace_stamps + 1) * sizeof(trace::entry);
+    trace.ring_offset = st.st_size;
+    trace.n_stamped = 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <image.reck>" << std::endl;
+        return 1;
+    }
+    std::string_view file_path = argv[1];
+    // The blob traces the restore up to the jump to the restored process, see prepare_blob_trace
+    uint64_t restore_tsc = __rdtsc();
+
+    image_reader reader;
+    if (reader.open(file_path) < 0) {
+        return 1;
+    }
+    if (reader.is_striped()) {
+        std::cerr << "Error image " << file_path << " is striped, restore it with the library" << std::endl;
+        return 1;
+    }
+    if (reader.regs().empty() || reader.fpregs().empty() || reader.regions().empty()) {
+        std::cerr << "Error image " << file_path << " has no registers or regions" << std::endl;
+        return 1;
+    }
+    if (reader.is_delta()) {
+        std::cerr << "Error image " << file_path << " is a delta, compact it with reck-compact first" << std::endl;
+        return 1;
+    }
+    if (reader.regs().size() > 1) {
+        std::cerr << "Warning: only the first of " << reader.regs().size() << " threads is restored" << std::endl;
+    }
+
+    struct planned_region {
+        unsigned long start;
+        unsigned long len;
+        int prot;
+        const memory_map *map;
+    };
+    // Saved data in file order for the batched reads
+    struct planned_piece {
+        unsigned long start;
+        unsigned long len;
+        unsigned long file_offset;
+        bool hot;
+    };
+    std::vector<planned_region> v_regions;
+    std::vector<planned_piece> v_pieces;
+    unsigned long start_brk = 0, brk = 0;
+    for (const auto &region : reader.regions()) {
+        v_regions.push_back(
+            {region.start(), region.end() - region.start(), static_cast<int>(region.map->prot), region.map});
+        if (std::strstr(region.map->pathname, "[heap]")) {
+            start_brk = region.start();
+            brk = region.end();
+        }
+    }
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    auto hot = reader.hot_pages();
+    // Aligned regions are mapped from the image, only their hot pages are faulted in. The stack keeps its
+    // anonymous mapping
+    std::vector<blob_file_map> v_files;
+    std::vector<blob_map> v_prefault;
+    for (const auto &region : reader.regions()) {
+        unsigned long data_offset = reader.file_offset(region.data.data());
+        bool mapped = region.aligned && !std::strstr(region.map->pathname, "[stack]");
+        auto add_piece = [&](unsigned long start, unsigned long len, unsigned long file_offset) {
+            if (mapped) v_files.push_back({start, len, file_offset});
+            hotness::split_runs(hot.data(), hot.size(), start, len, page,
+                                [&](unsigned long address, size_t run_len, bool is_hot) {
+                                    if (mapped) {
+                                        if (is_hot) v_prefault.push_back({address, run_len});
+                                        return;
+                                    }
+                                    v_pieces.push_back(
+                                        {address, run_len, file_offset + (address - start), is_hot});
+                                });
+        };
+        if (!region.bitmap) {
+            add_piece(region.start(), region.data.size(), data_offset);
+            continue;
+        }
+        size_t pages = (region.end() - region.start()) / page;
+        serializer::for_each_page_run(region.bitmap, pages, [&](size_t first, size_t count) {
+            add_piece(region.start() + first * page, count * page, data_offset + region.saved_index(first) * page);
+        });
+    }
+    // Hot pages are read first, then everything else in file order
+    std::sort(v_pieces.begin(), v_pieces.end(), [](const planned_piece &a, const planned_piece &b) {
+        if (a.hot != b.hot) return a.hot;
+        return a.file_offset < b.file_offset;
+    });
+
+    // Only neighbours with the same protection, flags and name share a mapping, see serializer::can_coalesce
+    std::vector<blob_map> v_maps;
+    std::vector<blob_prot> v_prots;
+    for (size_t i = 0; i < v_regions.size(); i++) {
+        auto &r = v_regions[i];
+        if (i > 0 && serializer::can_coalesce(*v_regions[i - 1].map, *r.map)) {
+            v_maps.back().len += r.len;
+        } else {
+            v_maps.push_back({r.start, r.len});
+        }
+        if (!v_prots.empty() && v_prots.back().start + v_prots.back().len == r.start && v_prots.back().prot == r.prot) {
+            v_prots.back().len += r.len;
+        } else {
+            v_prots.push_back({r.start, r.len, r.prot});
+        }
+    }
+    // Ranges are mapped read write, they need no mprotect
+    v_prots.erase(std::remove_if(v_prots.begin(), v_prots.end(),
+                                 [](const blob_prot &p) { return p.prot == (PROT_READ | PROT_WRITE); }),
+                  v_prots.end());
+
+    // Every saved page is populated with one madvise per run of adjacent pieces before the reads
+    std::vector<blob_map> v_populate;
+    for (auto &r : v_pieces) v_populate.push_back({r.start, r.len});
+    std::sort(v_populate.begin(), v_populate.end(),
+              [](const blob_map &a, const blob_map &b) { return a.start < b.start; });
+    size_t n_populate = 0;
+    for (auto &r : v_populate) {
+        if (n_populate > 0 && v_populate[n_populate - 1].start + v_populate[n_populate - 1].len == r.start) {
+            v_populate[n_populate - 1].len += r.len;
+        } else {
+            v_populate[n_populate++] = r;
+        }
+    }
+    v_populate.resize(n_populate);
+
+    // Worst case every piece needs a data iovec and a scratch one
+    size_t n_iov = v_pieces.size() * 2;
+    size_t code_size = __stop_reck_blob - __start_reck_blob;
+    size_t data_size = sizeof(restore_blob_args) + sizeof(blob_sigframe) + sizeof(user_fpregs_struct) + 64 +
+                       sizeof(blob_map) * (v_maps.size() + v_populate.size() + v_prefault.size()) +
+                       sizeof(blob_file_map) * v_files.size() + sizeof(blob_prot) * v_prots.size() +
+                       sizeof(blob_batch) * v_pieces.size() + sizeof(iovec) * n_iov + blob_scratch_size +
+                       sizeof(trace::file_header) + sizeof(trace::file_ring) +
+                       sizeof(trace::entry) * (blob_trace_stamps + 1) + 256;
+    size_t code_len = align_up(code_size, page);
+    size_t blob_len = code_len + align_up(data_size, page) + blob_stack_size;
+
+    char *blob = map_free_range(reader, blob_len);
+    if (!blob) {
+        std::cerr << "Error no free range of " << blob_len << " bytes for the restorer blob" << std::endl;
+        return 1;
+    }
+    std::memcpy(blob, __start_reck_blob, code_size);
+
+    bump_allocator alloc{blob + code_len};
+    auto args = alloc.alloc<restore_blob_args>();
+    auto frame = alloc.alloc<blob_sigframe>();
+    auto fpstate = alloc.alloc<user_fpregs_struct>(1, 64);
+    auto maps = alloc.alloc<blob_map>(v_maps.size());
+    auto files = alloc.alloc<blob_file_map>(v_files.size());
+    auto populate = alloc.alloc<blob_map>(v_populate.size());
+    auto prefault = alloc.alloc<blob_map>(v_prefault.size());
+    auto prots = alloc.alloc<blob_prot>(v_prots.size());
+    auto batches = alloc.alloc<blob_batch>(v_pieces.size());
+    auto iovs = alloc.alloc<iovec>(n_iov);
+    auto scratch = alloc.alloc<char>(blob_scratch_size);
+    auto trace_header = alloc.alloc<trace::file_header>();
+    auto trace_ring = alloc.alloc<char>(sizeof(trace::file_ring) + sizeof(trace::entry) * (blob_trace_stamps + 1), 8);
+
+    std::copy(v_maps.begin(), v_maps.end(), maps);
+    std::copy(v_files.begin(), v_files.end(), files);
+    std::copy(v_populate.begin(), v_populate.end(), populate);
+    std::copy(v_prefault.begin(), v_prefault.end(), prefault);
+    std::copy(v_prots.begin(), v_prots.end(), prots);
+
+    long n_batches = 0;
+    long used_iov = 0;
+    unsigned long pos = 0;
+    for (auto &r : v_pieces) {
+        unsigned long gap = r.file_offset - pos;
+        if (n_batches == 0 || r.file_offset < pos || gap > blob_scratch_size) {
+            batches[n_batches++] = {static_cast<long>(r.file_offset), &iovs[used_iov], 0};
+        } else if (gap > 0) {
+            iovs[used_iov++] = {scratch, gap};
+            batches[n_batches - 1].iov_count++;
+        }
+        iovs[used_iov++] = {reinterpret_cast<void *>(r.start), r.len};
+        batches[n_batches - 1].iov_count++;
+        pos = r.file_offset + r.len;
+    }
+
+    user_regs_struct regs;
+    std::memcpy(&regs, reader.regs()[0], sizeof(regs));
+    fixup_syscall_restart(regs);
+
+    std::memcpy(fpstate, reader.fpregs()[0], sizeof(*fpstate));
+    // Clear the software reserved bytes so the kernel takes it as a plain fxsave area
+    std::memset(fpstate->padding, 0, sizeof(fpstate->padding));
+
+    std::memset(frame, 0, sizeof(*frame));
+    frame->uc.ss_flags = SS_DISABLE;
+    auto &sc = frame->uc.uc_mcontext;
+    sc.r8 = regs.r8;
+    sc.r9 = regs.r9;
+    sc.r10 = regs.r10;
+    sc.r11 = regs.r11;
+    sc.r12 = regs.r12;
+    sc.r13 = regs.r13;
+    sc.r14 = regs.r14;
+    sc.r15 = regs.r15;
+    sc.rdi = regs.rdi;
+    sc.rsi = regs.rsi;
+    sc.rbp = regs.rbp;
+    sc.rbx = regs.rbx;
+    sc.rdx = regs.rdx;
+    sc.rax = regs.rax;
+    sc.rcx = regs.rcx;
+    sc.rsp = regs.rsp;
+    sc.rip = regs.rip;
+    sc.eflags = regs.eflags;
+    sc.cs = regs.cs;
+    sc.ss = regs.ss;
+    sc.fpstate = reinterpret_cast<unsigned long>(fpstate);
+
+    int fd = ::open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << file_path << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    *args = {};
+    args->blob_start = reinterpret_cast<unsigned long>(blob);
+    args->blob_end = reinterpret_cast<unsigned long>(blob) + blob_len;
+    args->task_size = task_size;
+    args->fd = fd;
+    args->maps = maps;
+    args->n_maps = v_maps.size();
+    args->files = files;
+    args->n_files = v_files.size();
+    args->populate = populate;
+    args->n_populate = v_populate.size();
+    args->prefault = prefault;
+    args->n_prefault = v_prefault.size();
+    args->batches = batches;
+    args->n_batches = n_batches;
+    args->prots = prots;
+    args->n_prots = v_prots.size();
+    args->start_brk = start_brk;
+    args->brk = brk;
+    args->fs_base = regs.fs_base;
+    args->gs_base = regs.gs_base;
+    args->frame = frame;
+    prepare_blob_trace(args->trace, trace_header, trace_ring, restore_tsc, *args);
+
+    if (::mprotect(blob, code_len, PROT_READ | PROT_EXEC) < 0) {
+        std::cerr << "Error mprotect restorer blob " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    auto entry = blob + (reinterpret_cast<char *>(&restore_blob_main) - __start_reck_blob);
+    auto stack_top = blob + blob_len;
+
+    std::cout.flush();
+    std::cerr.flush();
+    unregister_rseq();
+
+    asm volatile(
+        "mov %0, %%rsp\n\t"
+        "mov %1, %%rdi\n\t"
+        "call *%2\n\t"
+        "ud2\n\t"
+        :
+        : "r"(stack_top), "r"(args), "r"(entry)
+        : "memory");
+
+    return 1;
+}
@@ -0,0 +1,113 @@
+// reck-sample: samples the thread states of a running process into a file, or decodes such a file with -r.
+// Decoding prints every record, the thread, its scheduler state, the syscall it waits in and its instruction
+// pointer, then per thread the share of samples on a CPU and waiting, for wall-clock and off-CPU profiles.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "thread_sampler.hpp"
+
+using namespace RECK;
+
+namespace {
+
+struct thread_stats {
+    uint64_t samples = 0;
+    uint64_t running = 0;
+    // Samples waiting in every syscall
+    std::map<long, uint64_t> syscalls;
+};
+
+int decode(const std::string &file_path, bool summary_only) {
+    thread_sampler::file_header h;
+    std::vector<thread_sampler::sample> v_samples;
+    if (thread_sampler::read_file(file_path, h, v_samples) < 0) {
+        return 1;
+    }
+    std::printf("pid %d, %zu samples, %u stack bytes\n", h.pid, v_samples.size(), h.stack_window);
+
+    std::map<pid_t, thread_stats> threads;
+    uint64_t max_stop = 0;
+    for (auto &s : v_samples) {
+        max_stop = std::max<uint64_t>(max_stop, s.h.stop_ns);
+        for (auto &t : s.v_threads) {
+            auto &stats = threads[t.r.tid];
+            stats.samples++;
+            // A thread not running is in a syscall, or was about to enter one
+            if (t.r.state == 'R') {
+                stats.running++;
+            } else if (!(t.r.flags & thread_sampler::record_no_regs)) {
+                stats.syscalls[static_cast<long>(t.r.regs.orig_rax)]++;
+            }
+            if (summary_only) continue;
+            if (t.r.flags & thread_sampler::record_no_regs) {
+                std::printf("%14.3f ms %7d %c not stopped\n", (s.h.ns - h.ns_start) / 1e6, t.r.tid, t.r.state);
+                continue;
+            }
+            std::printf("%14.3f ms %7d %c syscall %4ld rip 0x%llx rsp 0x%llx %u stack bytes\n",
+                        (s.h.ns - h.ns_start) / 1e6, t.r.tid, t.r.state, static_cast<long>(t.r.regs.orig_rax),
+                        t.r.regs.rip, t.r.regs.rsp, t.r.stack_size);
+        }
+    }
+
+    std::printf("\nlongest stop %.3f us\n%7s %10s %10s %10s  %s\n", max_stop / 1e3, "tid", "samples", "on cpu %",
+                "off cpu %", "syscall:samples");
+    for (auto &[tid, stats] : threads) {
+        std::printf("%7d %10lu %10.1f %10.1f ", tid, stats.samples, 100.0 * stats.running / stats.samples,
+                    100.0 * (stats.samples - stats.running) / stats.samples);
+        for (auto &[nr, count] : stats.syscalls) std::printf(" %ld:%lu", nr, count);
+        std::printf("\n");
+    }
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    unsigned hz = 200;
+    long duration_ms = 1000;
+    size_t stack_window = 4096;
+    bool read = false;
+    bool summary_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:d:w:rs")) != -1) {
+        if (opt == 'f') {
+            hz = std::strtoul(optarg, nullptr, 10);
+        } else if (opt == 'd') {
+            duration_ms = std::strtol(optarg, nullptr, 10);
+        } else if (opt == 'w') {
+            stack_window = std::strtoul(optarg, nullptr, 10);
+        } else if (opt == 'r') {
+            read = true;
+        } else if (opt == 's') {
+            summary_only = true;
+        } else {
+            break;
+        }
+    }
+    if (read ? argc - optind != 1 : argc - optind != 2) {
+        std::cerr << "Usage: " << argv[0] << " [-f hz] [-d ms] [-w stack bytes] <pid> <file>" << std::endl
+                  << "       " << argv[0] << " -r [-s] <file>" << std::endl;
+        return 1;
+    }
+    if (read) {
+        return decode(argv[optind], summary_only);
+    }
+
+    pid_t pid = std::atoi(argv[optind]);
+    ssize_t samples = thread_sampler::record_file(pid, argv[optind + 1], hz, std::chrono::milliseconds{duration_ms},
+                                                  stack_window);
+    if (samples < 0) {
+        std::cerr << "Error sampling pid " << pid << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << samples << " samples of pid " << pid << " to " << argv[optind + 1] << std::endl;
+    return 0;
+}
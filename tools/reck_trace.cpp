@@ -0,0 +1,121 @@
+// reck-trace: decodes the binary trace rings written with RECK_TRACE=<prefix> into <prefix>.<pid>.
+// Prints every entry with its time since the start of the process and the duration of the BEGIN/END pairs,
+// then the time spent per event.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "trace.hpp"
+
+using namespace RECK;
+
+namespace {
+
+struct event_stats {
+    uint64_t count = 0;
+    double total_us = 0;
+    double max_us = 0;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    bool summary_only = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            summary_only = true;
+        } else {
+            break;
+        }
+    }
+    if (argc - optind != 1) {
+        std::cerr << "Usage: " << argv[0] << " [-s] <trace file>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[optind], std::ios::binary);
+    if (!in) {
+        std::cerr << "Error opening file " << argv[optind] << " " << strerror(errno) << std::endl;
+        return 1;
+    }
+    trace::file_header h;
+    if (!in.read(reinterpret_cast<char *>(&h), sizeof(h)) || std::memcmp(h.magic, trace::file_magic, sizeof(h.magic)) ||
+        h.version != trace::file_version) {
+        std::cerr << "Error " << argv[optind] << " is not a reck trace" << std::endl;
+        return 1;
+    }
+    double ns_per_tick = h.tsc_end > h.tsc_start
+                             ? static_cast<double>(h.ns_end - h.ns_start) / static_cast<double>(h.tsc_end - h.tsc_start)
+                             : 1.0;
+    auto to_us = [&](uint64_t ticks) { return ticks * ns_per_tick / 1000.0; };
+
+    std::printf("pid %d, %u threads, %.3f ms traced, %.3f ns per tick\n", h.pid, h.n_rings,
+                (h.ns_end - h.ns_start) / 1e6, ns_per_tick);
+
+    std::vector<event_stats> v_stats(trace::EVENT_COUNT);
+    for (uint32_t i = 0; i < h.n_rings; i++) {
+        trace::file_ring fr;
+        if (!in.read(reinterpret_cast<char *>(&fr), sizeof(fr))) {
+            std::cerr << "Error truncated trace file" << std::endl;
+            return 1;
+        }
+        uint64_t count = std::min(fr.head, trace::ring_entries);
+        std::vector<trace::entry> v_entries(count);
+        if (!in.read(reinterpret_cast<char *>(v_entries.data()), count * sizeof(trace::entry))) {
+            std::cerr << "Error truncated trace file" << std::endl;
+            return 1;
+        }
+
+        if (!summary_only) {
+            std::printf("\nthread %d, %lu entries%s\n", fr.tid, fr.head,
+                        fr.head > count ? " (oldest overwritten)" : "");
+        }
+        // Open BEGIN entries, matched with the last BEGIN of the same event
+        std::vector<const trace::entry *> v_open;
+        for (auto &e : v_entries) {
+            // Torn by a write during the dump
+            if (e.tsc < h.tsc_start || e.tsc > h.tsc_end || e.event >= trace::EVENT_COUNT) continue;
+
+            double duration = -1;
+            if (e.kind == trace::BEGIN) {
+                v_open.push_back(&e);
+            } else if (e.kind == trace::END) {
+                auto it = std::find_if(v_open.rbegin(), v_open.rend(),
+                                       [&](const trace::entry *b) { return b->event == e.event; });
+                if (it != v_open.rend()) {
+                    duration = to_us(e.tsc - (*it)->tsc);
+                    v_open.erase(std::next(it).base());
+                    auto &stats = v_stats[e.event];
+                    stats.count++;
+                    stats.total_us += duration;
+                    stats.max_us = std::max(stats.max_us, duration);
+                }
+            } else {
+                v_stats[e.event].count++;
+            }
+
+            if (summary_only) continue;
+            const char *kind = e.kind == trace::BEGIN ? "BEGIN" : e.kind == trace::END ? "END" : "MARK";
+            std::printf("%14.3f us %*s%-5s %-16s 0x%lx %lu", to_us(e.tsc - h.tsc_start),
+                        static_cast<int>(2 * v_open.size() - (e.kind == trace::BEGIN ? 2 : 0)), "", kind,
+                        trace::event_name(e.event), e.arg0, e.arg1);
+            if (duration >= 0) std::printf("  (%.3f us)", duration);
+            std::printf("\n");
+        }
+    }
+
+    std::printf("\n%-16s %10s %14s %14s\n", "event", "count", "total us", "max us");
+    for (uint16_t e = 0; e < trace::EVENT_COUNT; e++) {
+        auto &stats = v_stats[e];
+        if (!stats.count) continue;
+        std::printf("%-16s %10lu %14.3f %14.3f\n", trace::event_name(e), stats.count, stats.total_us, stats.max_us);
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+// Position independent restorer blob. reck-restore copies the reck_blob section to a free address and jumps into
+// it, so this file is compiled freestanding: no libc, no libstdc++, no data outside of the section and no calls
+// outside of it. Every helper has to be inlined into restore_blob_main.
+
+#include "restore_blob.hpp"
+
+#include <asm/prctl.h>
+#include <asm/unistd.h>
+#include <linux/prctl.h>
+#include <sys/mman.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+#define BLOB_ENTRY  extern "C" __attribute__((section("reck_blob"), used, noreturn, noinline))
+#define BLOB_INLINE static inline __attribute__((always_inline))
+
+namespace RECK {
+
+constexpr long blob_iov_max = 1024;
+
+BLOB_INLINE long blob_syscall(long nr, long a1 = 0, long a2 = 0, long a3 = 0, long a4 = 0, long a5 = 0,
+                              long a6 = 0) {
+    long ret;
+    register long r10 asm("r10") = a4;
+    register long r8 asm("r8") = a5;
+    register long r9 asm("r9") = a6;
+    asm volatile("syscall"
+                 : "=a"(ret)
+                 : "a"(nr), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8), "r"(r9)
+                 : "rcx", "r11", "memory");
+    return ret;
+}
+
+[[noreturn]] BLOB_INLINE void blob_exit(long code) {
+    for (;;) {
+        blob_syscall(__NR_exit_group, code);
+    }
+}
+
+// preadv until every iovec is full, iovecs are consumed in place
+BLOB_INLINE bool blob_read_iov(int fd, iovec *iov, long count, long offset) {
+    while (count > 0) {
+        long n = blob_syscall(__NR_preadv, fd, reinterpret_cast<long>(iov), count < blob_iov_max ? count : blob_iov_max,
+                              offset, 0);
+        if (n <= 0) {
+            return false;
+        }
+        offset += n;
+        while (count > 0 && static_cast<unsigned long>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0 && n > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+BLOB_INLINE unsigned long blob_rdtsc() {
+    unsigned int lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<unsigned long>(hi) << 32) | lo;
+}
+
+BLOB_INLINE void blob_stamp(blob_trace &trace) {
+    if (trace.fd < 0 || trace.n_stamped >= blob_trace_stamps) return;
+    *trace.stamps[trace.n_stamped++] = blob_rdtsc();
+}
+
+// Best effort, the restore goes on without its trace
+BLOB_INLINE void blob_write_trace(blob_trace &trace) {
+    if (trace.fd < 0) return;
+    struct {
+        long tv_sec;
+        long tv_nsec;
+    } ts;
+    *trace.tsc_end = blob_rdtsc();
+    if (blob_syscall(__NR_clock_gettime, CLOCK_MONOTONIC, reinterpret_cast<long>(&ts)) == 0) {
+        *trace.ns_end = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+    if (blob_syscall(__NR_pwrite64, trace.fd, reinterpret_cast<long>(trace.ring), trace.ring_len,
+                     trace.ring_offset) == trace.ring_len) {
+        blob_syscall(__NR_pwrite64, trace.fd, reinterpret_cast<long>(trace.header), trace.header_len, 0);
+    }
+    blob_syscall(__NR_close, trace.fd);
+}
+
+BLOB_ENTRY void restore_blob_main(restore_blob_args *args) {
+    blob_stamp(args->trace);
+    // Drop the whole address space of reck-restore except the blob, the saved image has the rest
+    if (args->blob_start > 0 && blob_syscall(__NR_munmap, 0, args->blob_start) < 0) {
+        blob_exit(10);
+    }
+    if (blob_syscall(__NR_munmap, args->blob_end, args->task_size - args->blob_end) < 0) {
+        blob_exit(11);
+    }
+
+    for (long i = 0; i < args->n_maps; i++) {
+        long addr = blob_syscall(__NR_mmap, args->maps[i].start, args->maps[i].len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (addr != static_cast<long>(args->maps[i].start)) {
+            blob_exit(12);
+        }
+    }
+    for (long i = 0; i < args->n_files; i++) {
+        long addr = blob_syscall(__NR_mmap, args->files[i].start, args->files[i].len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_FIXED, args->fd, args->files[i].offset);
+        if (addr != static_cast<long>(args->files[i].start)) {
+            blob_exit(17);
+        }
+    }
+    blob_stamp(args->trace);
+    blob_stamp(args->trace);
+
+    // Best effort, kernels before 5.14 fault the pages one by one while reading
+    for (long i = 0; i < args->n_populate; i++) {
+        blob_syscall(__NR_madvise, args->populate[i].start, args->populate[i].len, MADV_POPULATE_WRITE);
+    }
+    for (long i = 0; i < args->n_prefault; i++) {
+        blob_syscall(__NR_madvise, args->prefault[i].start, args->prefault[i].len, MADV_POPULATE_READ);
+    }
+
+    for (long i = 0; i < args->n_batches; i++) {
+        auto &batch = args->batches[i];
+        if (!blob_read_iov(args->fd, batch.iov, batch.iov_count, batch.offset)) {
+            blob_exit(13);
+        }
+    }
+    blob_syscall(__NR_close, args->fd);
+    blob_stamp(args->trace);
+
+    blob_stamp(args->trace);
+    for (long i = 0; i < args->n_prots; i++) {
+        if (blob_syscall(__NR_mprotect, args->prots[i].start, args->prots[i].len, args->prots[i].prot) < 0) {
+            blob_exit(14);
+        }
+    }
+    blob_stamp(args->trace);
+
+    // Best effort, needs CAP_SYS_RESOURCE. Without it malloc falls back to mmap when the heap has to grow
+    if (args->brk) {
+        if (blob_syscall(__NR_prctl, PR_SET_MM, PR_SET_MM_BRK, args->brk, 0, 0) < 0 ||
+            blob_syscall(__NR_prctl, PR_SET_MM, PR_SET_MM_START_BRK, args->start_brk, 0, 0) < 0) {
+            blob_syscall(__NR_prctl, PR_SET_MM, PR_SET_MM_START_BRK, args->start_brk, 0, 0);
+            blob_syscall(__NR_prctl, PR_SET_MM, PR_SET_MM_BRK, args->brk, 0, 0);
+        }
+    }
+
+    // rt_sigreturn does not restore the segment bases
+    if (blob_syscall(__NR_arch_prctl, ARCH_SET_FS, args->fs_base) < 0) {
+        blob_exit(15);
+    }
+    if (args->gs_base) {
+        blob_syscall(__NR_arch_prctl, ARCH_SET_GS, args->gs_base);
+    }
+
+    blob_stamp(args->trace);
+    blob_write_trace(args->trace);
+
+    // The kernel expects the stack pointer right after the pretcode of the frame
+    asm volatile(
+        "mov %0, %%rsp\n\t"
+        "mov %1, %%eax\n\t"
+        "syscall\n\t"
+        :
+        : "r"(&args->frame->uc), "i"(__NR_rt_sigreturn)
+        : "memory");
+    blob_exit(16);
+}
+
+}  // namespace RECK
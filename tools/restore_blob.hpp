@@ -0,0 +1,129 @@
+#pragma once
+
+// Shared between reck-restore and its position independent blob. The blob is built freestanding so this header
+// only uses plain structs from the system headers.
+
+#include <sys/uio.h>
+#include <sys/user.h>
+
+namespace RECK {
+
+// Kernel layout of the x86_64 rt_sigframe consumed by rt_sigreturn (arch/x86/include/asm/sigframe.h)
+struct blob_sigcontext {
+    unsigned long r8, r9, r10, r11, r12, r13, r14, r15;
+    unsigned long rdi, rsi, rbp, rbx, rdx, rax, rcx, rsp, rip, eflags;
+    unsigned short cs, gs, fs, ss;
+    unsigned long err, trapno, oldmask, cr2;
+    unsigned long fpstate;
+    unsigned long reserved1[8];
+};
+
+struct blob_ucontext {
+    unsigned long uc_flags;
+    unsigned long uc_link;
+    unsigned long ss_sp;
+    int ss_flags;
+    int ss_pad;
+    unsigned long ss_size;
+    blob_sigcontext uc_mcontext;
+    unsigned long uc_sigmask;
+};
+
+struct blob_sigframe {
+    unsigned long pretcode;
+    blob_ucontext uc;
+    char info[128];
+};
+
+static_assert(sizeof(blob_sigcontext) == 256, "sigcontext layout differs from the kernel one");
+static_assert(sizeof(blob_ucontext) == 304, "ucontext layout differs from the kernel one");
+
+// Anonymous range mapped read write before filling it
+struct blob_map {
+    unsigned long start;
+    unsigned long len;
+};
+
+// Range mapped private from the image over the anonymous one, its data was aligned by the dumper
+struct blob_file_map {
+    unsigned long start;
+    unsigned long len;
+    unsigned long offset;
+};
+
+// Final protection of a range
+struct blob_prot {
+    unsigned long start;
+    unsigned long len;
+    int prot;
+};
+
+// One preadv starting at offset, gaps between regions in the file land in a scratch buffer
+struct blob_batch {
+    long offset;
+    iovec *iov;
+    long iov_count;
+};
+
+// Phases the blob records when RECK_TRACE is set, see trace.hpp. reck-restore writes its own rings to the trace file
+// and prepares one more ring for the blob with every entry but the timestamps. The blob stamps them in order,
+// writes the ring at ring_offset and rewrites the header, that counts the ring and has the end time of the blob
+constexpr long blob_trace_stamps = 7;
+
+struct blob_trace {
+    // -1 without a trace
+    int fd;
+    void *header;
+    long header_len;
+    unsigned long *tsc_end;
+    unsigned long *ns_end;
+    void *ring;
+    long ring_len;
+    long ring_offset;
+    // Timestamp of each entry of the ring after the first one, the begin of the restore in reck-restore
+    unsigned long *stamps[blob_trace_stamps];
+    long n_stamped;
+};
+
+struct restore_blob_args {
+    // The blob mapping itself, everything else in the address space is unmapped
+    unsigned long blob_start;
+    unsigned long blob_end;
+    unsigned long task_size;
+
+    int fd;
+
+    blob_map *maps;
+    long n_maps;
+    blob_file_map *files;
+    long n_files;
+    // Hot ranges of the files faulted in with MADV_POPULATE_READ, they stay shared with the page cache
+    blob_map *prefault;
+    long n_prefault;
+    // Ranges faulted in with MADV_POPULATE_WRITE before they are read
+    blob_map *populate;
+    long n_populate;
+    blob_batch *batches;
+    long n_batches;
+    blob_prot *prots;
+    long n_prots;
+
+    unsigned long start_brk;
+    unsigned long brk;
+    unsigned long fs_base;
+    unsigned long gs_base;
+
+    blob_sigframe *frame;
+    blob_trace trace;
+};
+
+extern "C" {
+// Entry point of the blob, never returns
+void restore_blob_main(restore_blob_args *args);
+
+// Bounds of the blob code, defined by the linker for the reck_blob section
+extern char __start_reck_blob[];
+extern char __stop_reck_blob[];
+}
+
+}  // namespace RECK